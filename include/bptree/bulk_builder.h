@@ -0,0 +1,310 @@
+#ifndef _BPTREE_BULK_BUILDER_H_
+#define _BPTREE_BULK_BUILDER_H_
+
+#include "page.h"
+
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace bptree {
+
+/* builds a tree bottom-up from pairs sorted by key, for BTree::bulk_load()
+ * and BTree::rebuild(). it keeps the rightmost leaf and the rightmost inner
+ * node of each level (level 0 is the parent level of the leaves) with the
+ * first key below them, and takes pages from extents of fresh pages. nodes
+ * are filled to target and written as soon as they close. nodes closed on
+ * levels above max_level are collected in outputs instead */
+template <typename Tree> class BulkBuilder {
+    using K = typename Tree::KeyType;
+    using V = typename Tree::ValueType;
+    using NodeType = typename Tree::NodeType;
+    using InnerNodeType = typename Tree::InnerNodeType;
+    using LeafNodeType = typename Tree::LeafNodeType;
+    static constexpr unsigned int N = Tree::FANOUT;
+
+public:
+    static const size_t EXTENT_PAGES = 256;
+
+    BulkBuilder(Tree* tree, size_t target) : tree(tree), target(target) {}
+
+    /* the number of pairs or children per node for a fill factor */
+    static size_t fill_target(double fill_factor)
+    {
+        return std::min<size_t>(
+            N - 1, std::max<size_t>(1, (size_t)(fill_factor * (N - 1))));
+    }
+
+    /* see BTree::bulk_load() */
+    template <typename It>
+    static size_t load(Tree* tree, It first, It last, double fill_factor)
+    {
+        check_empty(tree);
+        if (first == last) return 0;
+
+        BulkBuilder builder(tree, fill_target(fill_factor));
+        size_t count = 0;
+        for (; first != last; ++first) {
+            builder.add_pair(first->first, first->second);
+            count++;
+        }
+
+        install_root(tree, builder.finish(), count);
+        return count;
+    }
+
+    /* see BTree::parallel_bulk_load() */
+    template <typename RandomIt>
+    static size_t parallel_load(Tree* tree, RandomIt first, RandomIt last,
+                                size_t num_threads, double fill_factor)
+    {
+        check_empty(tree);
+
+        size_t n = last - first;
+        if (num_threads == 0) num_threads = tree->executor->get_num_workers();
+        /* every range should fill a good number of parent nodes */
+        num_threads = std::min(num_threads, n / (16 * N * N) + 1);
+        if (num_threads <= 1) return load(tree, first, last, fill_factor);
+
+        /* equal keys must not be split across ranges */
+        std::vector<size_t> bounds{0};
+        for (size_t t = 1; t < num_threads; t++) {
+            size_t b = std::max(bounds.back(), n * t / num_threads);
+            while (b > 0 && b < n &&
+                   !tree->kcmp(first[b - 1].first, first[b].first)) {
+                b++;
+            }
+            bounds.push_back(b);
+        }
+        bounds.push_back(n);
+
+        size_t target = fill_target(fill_factor);
+        std::vector<BulkBuilder> parts;
+        parts.reserve(num_threads);
+        for (size_t t = 0; t < num_threads; t++) {
+            parts.emplace_back(tree, target);
+        }
+        std::vector<size_t> counts(num_threads, 0);
+
+        tree->executor->parallel_for(num_threads, [&](size_t t) {
+            auto& part = parts[t];
+            /* closed parents of leaves are handed to the stitching */
+            part.max_level = 0;
+            for (size_t i = bounds[t]; i < bounds[t + 1]; i++) {
+                part.add_pair(first[i].first, first[i].second);
+            }
+            counts[t] = bounds[t + 1] - bounds[t];
+            if (!part.leaf) return;
+
+            part.close_leaf();
+            auto node = std::move(part.nodes[0]);
+            tree->write_node_page(node.get());
+            part.outputs.emplace_back(part.first_keys[0], node->get_pid());
+            part.free_extent();
+        });
+
+        BulkBuilder top(tree, target);
+        size_t count = 0, num_outputs = 0;
+        PageID last_output = Page::INVALID_PAGE_ID;
+        for (size_t t = 0; t < num_threads; t++) {
+            count += counts[t];
+            for (auto&& out : parts[t].outputs) {
+                top.add_child(0, out.first, out.second);
+                last_output = out.second;
+                num_outputs++;
+            }
+        }
+
+        std::unique_ptr<NodeType> new_root;
+        if (num_outputs == 1) {
+            new_root = tree->read_node(nullptr, last_output);
+        } else {
+            new_root = top.finish_levels();
+        }
+
+        top.free_extent();
+        install_root(tree, std::move(new_root), count);
+        return count;
+    }
+
+    /* append a pair to the rightmost leaf, starting a new leaf once it holds
+     * target pairs */
+    void add_pair(const K& key, const V& value)
+    {
+        if (leaf) {
+            size_t size = leaf->get_size();
+            /* equal keys stay in one leaf as long as it has room */
+            if (size >= target &&
+                (size == N - 1 || tree->kcmp(leaf->keys[size - 1], key))) {
+                close_leaf();
+            }
+        }
+
+        if (!leaf) {
+            leaf = std::make_unique<LeafNodeType>(tree, nullptr, alloc_page());
+            leaf_first = key;
+        }
+
+        size_t size = leaf->get_size();
+        leaf->keys[size] = key;
+        leaf->values[size] = value;
+        leaf->set_size(size + 1);
+    }
+
+    /* close every level and return the root, an empty leaf if no pair was
+     * added. the unused rest of the extent is freed */
+    std::unique_ptr<NodeType> finish()
+    {
+        std::unique_ptr<NodeType> root;
+        if (!leaf && nodes.empty()) {
+            root = tree->template create_node<LeafNodeType>(nullptr);
+        } else if (nodes.empty()) {
+            /* a single leaf */
+            root = std::move(leaf);
+        } else {
+            close_leaf();
+            root = finish_levels();
+        }
+
+        free_extent();
+        return root;
+    }
+
+private:
+    Tree* tree;
+    size_t target;
+    std::unique_ptr<LeafNodeType> leaf;
+    K leaf_first;
+    std::vector<std::unique_ptr<InnerNodeType>> nodes;
+    std::vector<K> first_keys;
+    std::vector<size_t> closed;
+    size_t max_level = std::numeric_limits<size_t>::max();
+    std::vector<std::pair<K, PageID>> outputs;
+    PageID next_pid = Page::INVALID_PAGE_ID;
+    PageID extent_end = Page::INVALID_PAGE_ID;
+
+    static void check_empty(Tree* tree)
+    {
+        tree->check_writable();
+        if (tree->num_pairs.load() > 0 || !tree->root->is_leaf() ||
+            tree->root->get_size() > 0) {
+            throw std::runtime_error("bulk load needs an empty tree");
+        }
+    }
+
+    /* replace the empty root with the root of a bulk build */
+    static void install_root(Tree* tree, std::unique_ptr<NodeType> new_root,
+                             size_t count)
+    {
+        PageID old_pid = tree->root->get_pid();
+        {
+            std::lock_guard<std::mutex> guard(tree->alloc_mutex);
+            if (tree->shadow_paging && !tree->fresh_pages.erase(old_pid)) {
+                tree->pending_free.push_back(old_pid);
+            } else {
+                tree->free_pages.push_back(old_pid);
+            }
+            tree->dirty_nodes.erase(tree->root.get());
+        }
+
+        tree->root = std::move(new_root);
+        tree->num_pairs.store(count);
+        tree->write_node(tree->root.get());
+        tree->write_metadata();
+    }
+
+    PageID alloc_page()
+    {
+        if (next_pid == extent_end) {
+            next_pid = tree->page_cache->new_pages(EXTENT_PAGES);
+            extent_end = next_pid + EXTENT_PAGES;
+        }
+
+        PageID pid = next_pid++;
+        if (tree->shadow_paging) {
+            /* a rebuild runs next to commit() */
+            auto latch = tree->writer_latch();
+            std::lock_guard<std::mutex> guard(tree->alloc_mutex);
+            tree->fresh_pages.insert(pid);
+        }
+        return pid;
+    }
+
+    void free_extent()
+    {
+        auto latch = tree->writer_latch();
+        std::lock_guard<std::mutex> guard(tree->alloc_mutex);
+        for (PageID pid = next_pid; pid != extent_end; pid++) {
+            tree->free_pages.push_back(pid);
+        }
+        next_pid = extent_end;
+    }
+
+    void close_leaf()
+    {
+        auto closing = std::move(leaf);
+        tree->write_node_page(closing.get());
+        add_child(0, leaf_first, closing->get_pid());
+    }
+
+    /* close the rightmost node of each level and return the root, the only
+     * node of the first level that never closed one */
+    std::unique_ptr<NodeType> finish_levels()
+    {
+        for (size_t l = 0;; l++) {
+            auto node = std::move(nodes[l]);
+            if (l + 1 == nodes.size() && closed[l] == 0) {
+                return node;
+            }
+            tree->write_node_page(node.get());
+            K node_first = first_keys[l];
+            add_child(l + 1, node_first, node->get_pid());
+        }
+    }
+
+    /* append a child to the rightmost node of level l, closing the node and
+     * passing it up first if it is full */
+    void add_child(size_t l, const K& first_key, PageID pid)
+    {
+        if (l > max_level) {
+            outputs.emplace_back(first_key, pid);
+            return;
+        }
+
+        if (nodes.size() == l) {
+            nodes.emplace_back();
+            first_keys.emplace_back(first_key);
+            closed.push_back(0);
+        }
+
+        if (nodes[l] && nodes[l]->get_size() == target) {
+            /* the recursion may grow the vectors */
+            auto node = std::move(nodes[l]);
+            K node_first = first_keys[l];
+            tree->write_node_page(node.get());
+            closed[l]++;
+            add_child(l + 1, node_first, node->get_pid());
+        }
+
+        auto& node = nodes[l];
+        if (!node) {
+            node = std::make_unique<InnerNodeType>(tree, nullptr, alloc_page());
+            node->child_pages[0] = pid;
+            first_keys[l] = first_key;
+            return;
+        }
+
+        size_t size = node->get_size();
+        node->keys[size] = first_key;
+        node->child_pages[size + 1] = pid;
+        node->set_size(size + 1);
+    }
+};
+
+} // namespace bptree
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef _BPTREE_CATALOG_H_
+#define _BPTREE_CATALOG_H_
+
+#include "page_cache.h"
+
+#include <array>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace bptree {
+
+/* maps tree names to their meta pages so that several trees (with any
+ * template parameters) can share one heap file and one page cache. the
+ * catalog starts at page 1 of the file and continues in a chain of pages as
+ * it grows. a file that holds a single unnamed tree has its metadata at page 1
+ * and cannot have a catalog */
+class Catalog {
+public:
+    static constexpr size_t MAX_NAME_LEN = 55;
+    using MetaPages = std::array<PageID, 2>;
+
+    explicit Catalog(AbstractPageCache* page_cache);
+
+    bool find(const std::string& name, MetaPages& meta_pids);
+    /* register a tree after its metadata has been written. returns false if
+     * the name is taken */
+    bool add(const std::string& name, const MetaPages& meta_pids);
+    std::vector<std::string> list();
+
+private:
+    /* version 2 stores 64-bit page IDs. version 1 catalogs (32-bit page IDs)
+     * are read and keep their layout when entries are added */
+    static constexpr uint32_t CATALOG_MAGIC = 0x0CA7A107;
+    static constexpr uint32_t CATALOG_MAGIC_V1 = 0x0CA7A106;
+    static constexpr PageID CATALOG_PAGE_ID = 1;
+
+    struct CatalogHeader {
+        uint32_t magic;
+        uint32_t num_entries;
+        PageID next_pid;
+    };
+
+    struct CatalogEntry {
+        char name[MAX_NAME_LEN + 1];
+        MetaPages meta_pids;
+    };
+
+    struct CatalogHeaderV1 {
+        uint32_t magic;
+        uint32_t num_entries;
+        uint32_t next_pid;
+    };
+
+    struct CatalogEntryV1 {
+        char name[MAX_NAME_LEN + 1];
+        std::array<uint32_t, 2> meta_pids;
+    };
+
+    AbstractPageCache* page_cache;
+    std::mutex mutex;
+    std::map<std::string, MetaPages> entries;
+    /* catalog pages in chain order and the number of entries in the last */
+    std::vector<PageID> catalog_pages;
+    size_t last_page_entries;
+    uint32_t version;
+
+    uint32_t magic() const
+    {
+        return version == 1 ? CATALOG_MAGIC_V1 : CATALOG_MAGIC;
+    }
+    size_t header_size() const;
+    size_t entry_size() const;
+    size_t entries_per_page() const;
+    /* (de)serialize in the layout of the catalog's version */
+    CatalogHeader read_header(const uint8_t* buf) const;
+    void write_header(uint8_t* buf, const CatalogHeader& header) const;
+    CatalogEntry read_entry(const uint8_t* buf) const;
+    void write_entry(uint8_t* buf, const CatalogEntry& entry) const;
+
+    void load();
+    void init_page(PageID pid);
+};
+
+} // namespace bptree
+
+#endif
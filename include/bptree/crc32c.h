@@ -0,0 +1,18 @@
+#ifndef _BPTREE_CRC32C_H_
+#define _BPTREE_CRC32C_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace bptree {
+
+/* CRC-32C (Castagnoli) of buf, continuing from crc. uses the SSE4.2 crc32
+ * instruction when the CPU supports it and a table-driven implementation
+ * otherwise */
+uint32_t crc32c(uint32_t crc, const void* buf, size_t len);
+
+bool crc32c_hardware_supported();
+
+} // namespace bptree
+
+#endif
@@ -0,0 +1,253 @@
+#ifndef _BPTREE_DEFRAGMENTER_H_
+#define _BPTREE_DEFRAGMENTER_H_
+
+#include "page.h"
+#include "tree_node.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+namespace bptree {
+
+struct DefragOptions {
+    /* leaves are moved into extents of this many fresh pages */
+    size_t extent_pages = 256;
+    /* pause for pause_ms after every batch_leaves moved leaves */
+    size_t batch_leaves = 64;
+    uint32_t pause_ms = 1;
+    /* skip the pass if fewer leaves than this fraction do not directly
+     * follow their left neighbour in the file */
+    double min_fragmentation = 0.1;
+};
+
+/* rewrites the leaves of a tree in key order into extents of fresh pages,
+ * see BTree::defragment(), and runs such a pass in a background thread */
+template <typename Tree> class Defragmenter {
+    using K = typename Tree::KeyType;
+    using NodeType = typename Tree::NodeType;
+    using InnerNodeType = typename Tree::InnerNodeType;
+    using LeafNodeType = typename Tree::LeafNodeType;
+
+public:
+    explicit Defragmenter(Tree* tree) : tree(tree), stop_flag(false), moved(0)
+    {}
+
+    Defragmenter(const Defragmenter&) = delete;
+    Defragmenter& operator=(const Defragmenter&) = delete;
+
+    /* one pass, stopped early once *stop is set. returns the number of
+     * leaves moved */
+    size_t run(const DefragOptions& options, const std::atomic<bool>* stop)
+    {
+        size_t extent_pages = std::max<size_t>(1, options.extent_pages);
+        size_t batch_leaves = std::max<size_t>(1, options.batch_leaves);
+        std::vector<PageID> extent;
+        size_t extent_pos = 0;
+        PageID prev_pid = Page::INVALID_PAGE_ID;
+        std::optional<K> cursor;
+        size_t count = 0;
+
+        if (fragmentation() < options.min_fragmentation) return 0;
+
+        while (!stop || !*stop) {
+            if (extent_pos == extent.size()) {
+                extent = stripe_order(
+                    tree->page_cache->new_pages(extent_pages), extent_pages);
+                extent_pos = 0;
+            }
+
+            std::optional<K> upper;
+            bool relocated = false;
+            prev_pid = relocate_leaf(cursor ? &*cursor : nullptr, prev_pid,
+                                     extent[extent_pos], upper, relocated);
+
+            if (relocated) {
+                extent_pos++;
+                if (++count % batch_leaves == 0 && options.pause_ms) {
+                    std::this_thread::sleep_for(
+                        std::chrono::milliseconds(options.pause_ms));
+                }
+            }
+
+            if (!upper) break;
+            cursor = upper;
+        }
+
+        {
+            /* the unused rest of the last extent */
+            std::lock_guard<std::mutex> guard(tree->alloc_mutex);
+            tree->free_pages.insert(tree->free_pages.end(),
+                                    extent.begin() + extent_pos, extent.end());
+        }
+        tree->write_metadata();
+
+        return count;
+    }
+
+    void start(const DefragOptions& options)
+    {
+        stop();
+        stop_flag = false;
+        thread = std::thread(
+            [this, options] { moved += run(options, &stop_flag); });
+    }
+
+    void stop()
+    {
+        stop_flag = true;
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+
+    /* leaves moved by background passes */
+    size_t get_moved() const { return moved.load(); }
+
+    /* the fraction of leaves that are not stored right after their left
+     * neighbour in the same file */
+    double fragmentation()
+    {
+        std::optional<K> cursor;
+        PageID prev_pid = Page::INVALID_PAGE_ID;
+        size_t num_leaves = 0, breaks = 0;
+
+        while (true) {
+            PageID pid;
+            std::optional<K> upper;
+            tree->read_leaf(cursor ? &*cursor : nullptr,
+                            [&](LeafNodeType* leaf, const std::optional<K>& u) {
+                                pid = leaf->get_pid();
+                                upper = u;
+                            });
+
+            if (num_leaves++ > 0 &&
+                pid != tree->page_cache->next_in_stripe(prev_pid)) {
+                breaks++;
+            }
+            prev_pid = pid;
+
+            if (!upper) break;
+            cursor = upper;
+        }
+
+        return num_leaves > 1 ? (double)breaks / (num_leaves - 1) : 0.0;
+    }
+
+private:
+    Tree* tree;
+    std::thread thread;
+    std::atomic<bool> stop_flag;
+    std::atomic<size_t> moved;
+
+    /* the pages of an extent in the order that fills each file of a striped
+     * heap sequentially */
+    std::vector<PageID> stripe_order(PageID first, size_t count)
+    {
+        std::vector<PageID> order;
+        std::vector<bool> used(count, false);
+        order.reserve(count);
+
+        for (size_t i = 0; i < count; i++) {
+            PageID pid = first + i;
+            while (pid < first + count && !used[pid - first]) {
+                used[pid - first] = true;
+                order.push_back(pid);
+                pid = tree->page_cache->next_in_stripe(pid);
+            }
+        }
+        return order;
+    }
+
+    /* move the leaf that covers key (the leftmost leaf if key is null) to
+     * new_pid unless it is stored right after prev_pid. returns the page ID
+     * of the leaf after the call and sets upper to its upper fence */
+    PageID relocate_leaf(const K* key, PageID prev_pid, PageID new_pid,
+                         std::optional<K>& upper, bool& relocated)
+    {
+        auto latch = tree->writer_latch();
+        auto epoch = tree->epochs.enter();
+
+        while (true) {
+            try {
+                NodeType* parent;
+                uint64_t version, parent_version;
+                bool need_restart;
+
+                auto* leaf = tree->find_leaf(key, version, parent,
+                                             parent_version, upper);
+                if (leaf->get_pid() ==
+                    tree->page_cache->next_in_stripe(prev_pid)) {
+                    if (leaf->read_unlock_or_restart(version)) continue;
+                    relocated = false;
+                    return leaf->get_pid();
+                }
+
+                leaf->upgrade_to_write_lock_or_restart(version, need_restart);
+                if (need_restart) throw OLCRestart();
+                if (parent) {
+                    parent->upgrade_to_write_lock_or_restart(parent_version,
+                                                             need_restart);
+                    if (need_restart) {
+                        leaf->write_unlock();
+                        throw OLCRestart();
+                    }
+                }
+
+                PageID old_pid = leaf->get_pid();
+                leaf->set_pid(new_pid);
+
+                if (parent) {
+                    auto* inner = static_cast<InnerNodeType*>(parent);
+                    for (size_t i = 0; i <= inner->get_size(); i++) {
+                        if (inner->child_cache[i].get() == leaf) {
+                            inner->child_pages[i] = new_pid;
+                            break;
+                        }
+                    }
+                }
+
+                if (tree->shadow_paging) {
+                    std::lock_guard<std::mutex> guard(tree->alloc_mutex);
+                    /* the new page is not referenced by the committed tree */
+                    tree->fresh_pages.insert(new_pid);
+                    if (tree->fresh_pages.erase(old_pid)) {
+                        tree->free_pages.push_back(old_pid);
+                    } else {
+                        tree->pending_free.push_back(old_pid);
+                    }
+                    tree->dirty_nodes.insert(leaf);
+                    if (parent) tree->dirty_nodes.insert(parent);
+                } else {
+                    /* the leaf must be in place before the parent points to
+                     * it and the old page can only be reused after that */
+                    tree->write_node_page(leaf);
+                    if (parent) {
+                        tree->write_node_page(parent);
+                    } else {
+                        tree->write_metadata();
+                    }
+
+                    std::lock_guard<std::mutex> guard(tree->alloc_mutex);
+                    tree->free_pages.push_back(old_pid);
+                }
+
+                if (parent) parent->write_unlock();
+                leaf->write_unlock();
+
+                relocated = true;
+                return new_pid;
+            } catch (OLCRestart&) {
+                continue;
+            }
+        }
+    }
+};
+
+} // namespace bptree
+
+#endif
@@ -0,0 +1,163 @@
+#ifndef _BPTREE_EPOCH_H_
+#define _BPTREE_EPOCH_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace bptree {
+
+/* epoch-based reclamation of memory that optimistic readers may still look at
+ * after it was unlinked. threads enter() before they traverse shared nodes
+ * and keep the guard until they are done. retire() queues a callback that
+ * reclaim() runs once every thread that was inside when the callback was
+ * retired has left */
+class EpochManager {
+public:
+    class Guard {
+    public:
+        Guard(EpochManager* manager, size_t slot)
+            : manager(manager), slot(slot)
+        {}
+        Guard(Guard&& other) : manager(other.manager), slot(other.slot)
+        {
+            other.manager = nullptr;
+        }
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+
+        ~Guard()
+        {
+            if (manager) manager->leave(slot);
+        }
+
+    private:
+        EpochManager* manager;
+        size_t slot;
+    };
+
+    EpochManager() : global_epoch(1), num_waiting(0) {}
+
+    Guard enter()
+    {
+        static thread_local size_t hint =
+            std::hash<std::thread::id>{}(std::this_thread::get_id());
+
+        /* a slot holds the epoch its thread entered in (0 if free). nested
+         * guards simply take another slot */
+        for (size_t i = 0;; i++) {
+            size_t idx = (hint + i) % MAX_SLOTS;
+            auto& slot = slots[idx].epoch;
+            uint64_t expected = 0;
+
+            if (slot.load(std::memory_order_relaxed) == 0 &&
+                slot.compare_exchange_strong(expected, global_epoch.load())) {
+                return Guard(this, idx);
+            }
+            if ((i + 1) % MAX_SLOTS == 0) wait_for_slot();
+        }
+    }
+
+    void retire(std::function<void()> fn)
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        retired.emplace_back(global_epoch.fetch_add(1), std::move(fn));
+    }
+
+    /* run the callbacks that no thread can observe anymore. returns the
+     * number of callbacks run */
+    size_t reclaim()
+    {
+        uint64_t min_active = std::numeric_limits<uint64_t>::max();
+        for (auto&& slot : slots) {
+            uint64_t epoch = slot.epoch.load();
+            if (epoch != 0 && epoch < min_active) min_active = epoch;
+        }
+
+        std::vector<std::function<void()>> ready;
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            while (!retired.empty() && retired.front().first < min_active) {
+                ready.push_back(std::move(retired.front().second));
+                retired.pop_front();
+            }
+        }
+
+        for (auto&& fn : ready) {
+            fn();
+        }
+        return ready.size();
+    }
+
+    /* wait until every thread that was inside when this was called has left.
+     * must not be called from inside a guard */
+    void synchronize()
+    {
+        uint64_t epoch = global_epoch.fetch_add(1);
+        for (auto&& slot : slots) {
+            while (true) {
+                uint64_t e = slot.epoch.load();
+                if (e == 0 || e > epoch) break;
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    size_t num_retired()
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        return retired.size();
+    }
+
+private:
+    void leave(size_t slot)
+    {
+        slots[slot].epoch.store(0);
+        /* a waiter registers before it checks the slots, so either it sees
+         * this slot free or this sees the waiter */
+        if (num_waiting.load() > 0) {
+            std::lock_guard<std::mutex> guard(slot_mutex);
+            slot_cv.notify_all();
+        }
+    }
+
+    void wait_for_slot()
+    {
+        std::unique_lock<std::mutex> lock(slot_mutex);
+        num_waiting++;
+        slot_cv.wait(lock, [this] {
+            for (auto&& slot : slots) {
+                if (slot.epoch.load() == 0) return true;
+            }
+            return false;
+        });
+        num_waiting--;
+    }
+
+    static constexpr size_t MAX_SLOTS = 128;
+
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> epoch{0};
+    };
+
+    std::atomic<uint64_t> global_epoch;
+    Slot slots[MAX_SLOTS];
+    /* threads that found every slot taken sleep until a guard is released */
+    std::atomic<size_t> num_waiting;
+    std::mutex slot_mutex;
+    std::condition_variable slot_cv;
+    std::mutex mutex;
+    /* in retire order, so in epoch order */
+    std::deque<std::pair<uint64_t, std::function<void()>>> retired;
+};
+
+} // namespace bptree
+
+#endif
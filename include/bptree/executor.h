@@ -0,0 +1,124 @@
+#ifndef _BPTREE_EXECUTOR_H_
+#define _BPTREE_EXECUTOR_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace bptree {
+
+/* foreground tasks are taken before any maintenance task. a running task is
+ * not interrupted, long maintenance work is split into tasks or checks
+ * Executor::has_foreground_work() between steps */
+enum class TaskPriority { FOREGROUND = 0, MAINTENANCE = 1 };
+
+/* a fixed pool of worker threads with a deque of tasks per worker and
+ * priority. a worker runs the newest task of its own deque and steals the
+ * oldest task of another worker when it runs out. the parallel operations of
+ * the library run on one shared pool so that they do not oversubscribe the
+ * host */
+class Executor {
+public:
+    /* all hardware threads if num_workers is 0 */
+    explicit Executor(size_t num_workers = 0);
+    /* runs the queued tasks before the workers exit */
+    ~Executor();
+
+    Executor(const Executor&) = delete;
+    Executor& operator=(const Executor&) = delete;
+
+    /* the pool used when no executor is given */
+    static Executor& get_default();
+
+    size_t get_num_workers() const { return workers.size(); }
+
+    /* run fn on a worker. a task submitted from a worker goes to its own
+     * deque. exceptions thrown by fn are dropped, use a TaskGroup to get
+     * them */
+    void submit(std::function<void()> fn,
+                TaskPriority priority = TaskPriority::FOREGROUND);
+
+    bool has_foreground_work() const
+    {
+        return num_queued[(int)TaskPriority::FOREGROUND].load() > 0;
+    }
+
+    /* run fn(0), ..., fn(count - 1) as tasks and wait for them. the calling
+     * thread runs tasks as well, so calls from inside a task cannot
+     * deadlock. the first exception is rethrown */
+    void parallel_for(size_t count, const std::function<void(size_t)>& fn,
+                      TaskPriority priority = TaskPriority::FOREGROUND);
+
+private:
+    static const int NUM_PRIORITIES = 2;
+
+    struct Worker {
+        std::mutex mutex;
+        std::deque<std::function<void()>> queues[NUM_PRIORITIES];
+        std::thread thread;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<size_t> next_worker;
+    std::atomic<size_t> num_queued[NUM_PRIORITIES];
+
+    std::mutex sleep_mutex;
+    std::condition_variable sleep_cv;
+    bool stopping;
+
+    bool take_task(size_t self, std::function<void()>& task);
+    void worker_loop(size_t self);
+};
+
+/* tasks whose completion is waited for together. queued tasks of the group
+ * are also run by the thread that waits, and the group waits for its running
+ * tasks when it is destroyed, so tasks may refer to the caller's stack */
+class TaskGroup {
+public:
+    explicit TaskGroup(Executor& executor,
+                       TaskPriority priority = TaskPriority::FOREGROUND);
+    ~TaskGroup();
+
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator=(const TaskGroup&) = delete;
+
+    void run(std::function<void()> fn);
+
+    /* run one queued task of the group on the calling thread. returns false
+     * if none is queued */
+    bool run_one();
+
+    /* drop the tasks that have not started */
+    void cancel();
+
+    /* wait for all tasks, running queued ones on the calling thread. the
+     * tasks left are cancelled after the first exception, which is
+     * rethrown */
+    void wait();
+
+private:
+    struct State {
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::deque<std::function<void()>> tasks;
+        size_t running = 0;
+        std::exception_ptr error;
+    };
+
+    Executor& executor;
+    TaskPriority priority;
+    std::shared_ptr<State> state;
+
+    static bool run_next(State& state);
+};
+
+} // namespace bptree
+
+#endif
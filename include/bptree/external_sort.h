@@ -0,0 +1,523 @@
+#ifndef _BPTREE_EXTERNAL_SORT_H_
+#define _BPTREE_EXTERNAL_SORT_H_
+
+#include "executor.h"
+#include "heap_file.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstdlib>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unistd.h>
+#include <vector>
+
+namespace bptree {
+
+struct ExternalSortOptions {
+    /* bytes of pairs held in memory at a time, split between the threads */
+    size_t memory_budget = 256 << 20;
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    /* sorted runs that do not fit the budget are spilled here */
+    std::string temp_dir = "/tmp";
+    /* runs merged at once, each read through its own 1 MiB buffer. with
+     * more spilled runs, groups of them are first merged into longer runs
+     * until no more than this are left */
+    size_t max_merge_runs = 64;
+    /* input files are parsed on this executor, the shared default one if
+     * null */
+    Executor* executor = nullptr;
+};
+
+/* sorts more pairs than fit in memory to feed BTree::bulk_load(): pairs are
+ * collected and sorted in runs within the memory budget, runs are spilled
+ * one after another to an unlinked temporary file and merged k-way on the
+ * way into the tree, after intermediate merge passes if there are more than
+ * max_merge_runs of them. keys and values are spilled as raw bytes */
+template <typename K, typename V, typename KeyComparator = std::less<K>>
+class ExternalSorter {
+    static_assert(std::is_trivially_copyable<K>::value &&
+                      std::is_trivially_copyable<V>::value,
+                  "spilled pairs are copied as raw bytes");
+
+public:
+    using Pair = std::pair<K, V>;
+
+    explicit ExternalSorter(
+        const ExternalSortOptions& options = ExternalSortOptions{},
+        KeyComparator kcmp = KeyComparator{})
+        : options(options), kcmp(kcmp), memory_pairs(0), num_spilled(0),
+          num_merge_passes(0)
+    {
+        size_t threads = std::max<size_t>(1, options.threads);
+        budget_pairs = options.memory_budget / sizeof(Pair);
+        run_pairs = std::max(MIN_RUN_PAIRS, budget_pairs / threads);
+    }
+
+    /* add one pair from the calling thread */
+    void add(const K& key, const V& value)
+    {
+        buffer.emplace_back(key, value);
+        if (buffer.size() >= run_pairs) {
+            spill(buffer);
+        }
+    }
+
+    /* add the pairs of a text file with one "key value" pair per line. the
+     * file is split into one byte range per thread and the ranges are parsed
+     * and sorted as parallel tasks.
+     * returns the number of pairs read */
+    size_t add_text_file(const std::string& path)
+    {
+        std::ifstream in(path, std::ios::binary | std::ios::ate);
+        if (!in) throw IOException("cannot open input file");
+        size_t file_size = in.tellg();
+        in.close();
+
+        size_t threads = std::max<size_t>(1, options.threads);
+        std::vector<size_t> counts(threads, 0);
+        auto* executor =
+            options.executor ? options.executor : &Executor::get_default();
+
+        executor->parallel_for(threads, [&](size_t t) {
+            counts[t] = parse_range(path, file_size * t / threads,
+                                    file_size * (t + 1) / threads);
+        });
+
+        size_t count = 0;
+        for (auto c : counts) {
+            count += c;
+        }
+        return count;
+    }
+
+    /* merge all runs and the pairs still in memory into an empty tree */
+    template <typename Tree>
+    size_t load_into(Tree& tree, double fill_factor = 1.0)
+    {
+        sort_buffer(buffer);
+        if (!buffer.empty()) memory_runs.push_back(std::move(buffer));
+        buffer.clear();
+
+        merge_runs();
+        Merger merger(this, runs, memory_runs);
+        return tree.bulk_load(merger.begin(), merger.end(), fill_factor);
+    }
+
+    size_t get_num_spilled_runs() const { return num_spilled; }
+    size_t get_num_merge_passes() const { return num_merge_passes; }
+
+private:
+    static constexpr size_t READ_BUFFER_BYTES = 1 << 20;
+    static constexpr size_t MIN_RUN_PAIRS = 1024;
+
+    /* an unlinked temporary file that holds runs one after another. it is
+     * closed once no run in it is left */
+    struct RunFile {
+        int fd;
+        off_t size;
+
+        explicit RunFile(const std::string& dir) : size(0)
+        {
+            std::string name = dir + "/bptree-run-XXXXXX";
+            fd = mkstemp(&name[0]);
+            if (fd < 0) throw IOException("cannot create run file");
+            ::unlink(name.c_str());
+        }
+        ~RunFile() { ::close(fd); }
+    };
+
+    struct Run {
+        std::shared_ptr<RunFile> file;
+        off_t offset;
+        size_t size; /* in pairs */
+    };
+
+    ExternalSortOptions options;
+    KeyComparator kcmp;
+    size_t budget_pairs;
+    size_t run_pairs;
+
+    std::vector<Pair> buffer;
+    std::mutex mutex; /* guards the run lists and the spill file */
+    std::shared_ptr<RunFile> spill_file;
+    std::vector<Run> runs;
+    /* sorted runs kept in memory */
+    std::vector<std::vector<Pair>> memory_runs;
+    /* pairs in memory_runs plus the buffers reserved by parse tasks */
+    size_t memory_pairs;
+    size_t num_spilled;
+    size_t num_merge_passes;
+
+    void sort_buffer(std::vector<Pair>& pairs)
+    {
+        std::stable_sort(pairs.begin(), pairs.end(),
+                         [this](const Pair& a, const Pair& b) {
+                             return kcmp(a.first, b.first);
+                         });
+    }
+
+    /* sort the pairs and write them to a new run at the end of the spill
+     * file. the room is reserved first so that tasks write in parallel */
+    void spill(std::vector<Pair>& pairs)
+    {
+        sort_buffer(pairs);
+
+        Run run;
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            if (!spill_file) {
+                spill_file = std::make_shared<RunFile>(options.temp_dir);
+            }
+            run = reserve_run(spill_file, pairs.size());
+        }
+        write_pairs(run.file->fd, pairs.data(), pairs.size(), run.offset);
+
+        std::lock_guard<std::mutex> guard(mutex);
+        runs.push_back(std::move(run));
+        num_spilled++;
+        pairs.clear();
+    }
+
+    /* room for size pairs at the end of file */
+    static Run reserve_run(const std::shared_ptr<RunFile>& file, size_t size)
+    {
+        Run run{file, file->size, size};
+        file->size += size * sizeof(Pair);
+        return run;
+    }
+
+    static void write_pairs(int fd, const Pair* pairs, size_t count,
+                            off_t offset)
+    {
+        auto* buf = reinterpret_cast<const char*>(pairs);
+        size_t len = count * sizeof(Pair);
+        while (len > 0) {
+            ssize_t n = ::pwrite(fd, buf, len, offset);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) throw IOException("run write failed");
+            buf += n;
+            len -= n;
+            offset += n;
+        }
+    }
+
+    static void read_pairs(int fd, Pair* pairs, size_t count, off_t offset)
+    {
+        auto* buf = reinterpret_cast<char*>(pairs);
+        size_t len = count * sizeof(Pair);
+        while (len > 0) {
+            ssize_t n = ::pread(fd, buf, len, offset);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) throw IOException("run read failed");
+            buf += n;
+            len -= n;
+            offset += n;
+        }
+    }
+
+    /* merge consecutive groups of max_merge_runs spilled runs into one run
+     * each until no more than max_merge_runs are left. a merged run takes
+     * the place of its group, so pairs with equal keys keep their run order.
+     * each pass writes a new file, the previous one is closed with its last
+     * run */
+    void merge_runs()
+    {
+        size_t fan_in = std::max<size_t>(2, options.max_merge_runs);
+        std::vector<std::vector<Pair>> no_memory_runs;
+
+        while (runs.size() > fan_in) {
+            auto file = std::make_shared<RunFile>(options.temp_dir);
+            std::vector<Run> merged;
+            std::vector<Pair> out;
+            out.reserve(READ_BUFFER_BYTES / sizeof(Pair));
+
+            for (size_t first = 0; first < runs.size(); first += fan_in) {
+                size_t last = std::min(runs.size(), first + fan_in);
+                std::vector<Run> group(runs.begin() + first,
+                                       runs.begin() + last);
+                size_t size = 0;
+                for (auto&& run : group) {
+                    size += run.size;
+                }
+
+                Run run = reserve_run(file, size);
+                off_t offset = run.offset;
+                Merger merger(this, group, no_memory_runs);
+                for (auto it = merger.begin(); it != merger.end(); ++it) {
+                    out.push_back(*it);
+                    if (out.size() == out.capacity()) {
+                        write_pairs(file->fd, out.data(), out.size(), offset);
+                        offset += out.size() * sizeof(Pair);
+                        out.clear();
+                    }
+                }
+                write_pairs(file->fd, out.data(), out.size(), offset);
+                out.clear();
+
+                merged.push_back(std::move(run));
+            }
+
+            runs = std::move(merged);
+            num_merge_passes++;
+        }
+    }
+
+    template <typename T> static bool parse_token(std::string_view token, T& v)
+    {
+        if constexpr (std::is_integral<T>::value) {
+            auto res = std::from_chars(token.data(),
+                                       token.data() + token.size(), v);
+            return res.ec == std::errc() &&
+                   res.ptr == token.data() + token.size();
+        } else {
+            std::istringstream ss{std::string(token)};
+            return (bool)(ss >> v);
+        }
+    }
+
+    static std::string_view next_token(std::string_view& line)
+    {
+        size_t begin = line.find_first_not_of(" \t\r");
+        if (begin == std::string_view::npos) {
+            line = std::string_view();
+            return line;
+        }
+        size_t end = line.find_first_of(" \t\r", begin);
+        if (end == std::string_view::npos) end = line.size();
+
+        auto token = line.substr(begin, end - begin);
+        line.remove_prefix(end);
+        return token;
+    }
+
+    /* reserve room for the buffer of a parse task in the memory budget. a
+     * task gets up to run_pairs, less if the budget is mostly taken by the
+     * runs kept in memory. returns the number of pairs reserved */
+    size_t reserve_buffer()
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        size_t free = budget_pairs > memory_pairs ? budget_pairs - memory_pairs
+                                                  : 0;
+        size_t limit = std::max(MIN_RUN_PAIRS, std::min(run_pairs, free));
+        memory_pairs += limit;
+        return limit;
+    }
+
+    void release_buffer(size_t limit)
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        memory_pairs -= limit;
+    }
+
+    /* parse the lines that start in [begin, end) */
+    size_t parse_range(const std::string& path, size_t begin, size_t end)
+    {
+        std::vector<Pair> pairs;
+        size_t limit = reserve_buffer();
+        size_t count;
+        try {
+            count = parse_lines(path, begin, end, limit, pairs);
+        } catch (...) {
+            release_buffer(limit);
+            throw;
+        }
+
+        /* the rest is kept in memory while it fits the budget, e.g. over
+         * many small files. it takes over part of the reserved room */
+        bool keep;
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            memory_pairs -= limit;
+            keep = memory_pairs + pairs.size() <= budget_pairs;
+            if (keep) memory_pairs += pairs.size();
+        }
+
+        if (pairs.empty()) return count;
+        if (!keep) {
+            spill(pairs);
+            return count;
+        }
+
+        /* sorted here so that the runs are sorted in parallel */
+        sort_buffer(pairs);
+        std::lock_guard<std::mutex> guard(mutex);
+        memory_runs.push_back(std::move(pairs));
+        return count;
+    }
+
+    /* parse the lines that start in [begin, end) into pairs, which are
+     * spilled whenever they reach limit. returns the number of pairs read */
+    size_t parse_lines(const std::string& path, size_t begin, size_t end,
+                       size_t limit, std::vector<Pair>& pairs)
+    {
+        std::ifstream in(path, std::ios::binary);
+        if (!in) throw IOException("cannot open input file");
+
+        if (begin > 0) {
+            /* a line that starts before begin belongs to the previous range */
+            in.seekg(begin - 1);
+            if (in.get() != '\n') {
+                std::string skipped;
+                std::getline(in, skipped);
+            }
+        }
+
+        std::string line;
+        size_t count = 0;
+        while ((size_t)in.tellg() < end && std::getline(in, line)) {
+            std::string_view rest(line);
+            auto key_token = next_token(rest);
+            if (key_token.empty()) continue;
+            auto value_token = next_token(rest);
+
+            Pair p;
+            if (!parse_token(key_token, p.first) ||
+                !parse_token(value_token, p.second)) {
+                throw std::invalid_argument("bad input line: " + line);
+            }
+
+            pairs.push_back(p);
+            count++;
+            if (pairs.size() >= limit) {
+                spill(pairs);
+            }
+            if (in.peek() == EOF) break;
+        }
+        return count;
+    }
+
+    /* reads a run through a buffer of batch pairs at a time */
+    struct RunCursor {
+        int fd = -1;
+        off_t offset = 0;
+        size_t remaining = 0;
+        std::vector<Pair> pairs;
+        size_t pos = 0;
+        const std::vector<Pair>* memory = nullptr;
+
+        bool valid() const
+        {
+            return memory ? pos < memory->size() : pos < pairs.size();
+        }
+        const Pair& get() const { return memory ? (*memory)[pos] : pairs[pos]; }
+
+        void next(size_t batch)
+        {
+            pos++;
+            if (memory || pos < pairs.size() || remaining == 0) return;
+
+            pairs.resize(std::min(batch, remaining));
+            read_pairs(fd, pairs.data(), pairs.size(), offset);
+            offset += pairs.size() * sizeof(Pair);
+            remaining -= pairs.size();
+            pos = 0;
+        }
+    };
+
+    /* k-way merge of the given runs, as an input iterator range. every
+     * spilled run is read READ_BUFFER_BYTES at a time, so that the reads stay
+     * large whatever the number of runs. pairs with equal keys come out in
+     * run order, spilled runs first */
+    class Merger {
+    public:
+        class iterator {
+        public:
+            const Pair& operator*() const { return merger->current(); }
+            const Pair* operator->() const { return &merger->current(); }
+            iterator& operator++()
+            {
+                merger->advance();
+                return *this;
+            }
+            bool operator==(const iterator& rhs) const
+            {
+                return at_end() == rhs.at_end();
+            }
+            bool operator!=(const iterator& rhs) const
+            {
+                return !(*this == rhs);
+            }
+
+        private:
+            friend class Merger;
+            explicit iterator(Merger* merger) : merger(merger) {}
+            bool at_end() const { return !merger || merger->heap.empty(); }
+
+            Merger* merger;
+        };
+
+        Merger(ExternalSorter* sorter, const std::vector<Run>& runs,
+               const std::vector<std::vector<Pair>>& memory_runs)
+            : sorter(sorter), heap(HeapCompare{this})
+        {
+            batch = std::max<size_t>(1, READ_BUFFER_BYTES / sizeof(Pair));
+
+            cursors.resize(runs.size() + memory_runs.size());
+            size_t i = 0;
+            for (; i < runs.size(); i++) {
+                cursors[i].fd = runs[i].file->fd;
+                cursors[i].offset = runs[i].offset;
+                cursors[i].remaining = runs[i].size;
+                /* the first next() fills the buffer */
+                cursors[i].pos = (size_t)-1;
+                cursors[i].next(batch);
+            }
+            for (auto&& run : memory_runs) {
+                cursors[i++].memory = &run;
+            }
+
+            for (size_t c = 0; c < cursors.size(); c++) {
+                if (cursors[c].valid()) heap.push(c);
+            }
+        }
+
+        iterator begin() { return iterator(this); }
+        iterator end() { return iterator(nullptr); }
+
+    private:
+        struct HeapCompare {
+            Merger* merger;
+            /* a max-heap, so the order is reversed. ties go to the lower run
+             * index */
+            bool operator()(size_t a, size_t b) const
+            {
+                const K& ka = merger->cursors[a].get().first;
+                const K& kb = merger->cursors[b].get().first;
+                if (merger->sorter->kcmp(kb, ka)) return true;
+                if (merger->sorter->kcmp(ka, kb)) return false;
+                return a > b;
+            }
+        };
+
+        ExternalSorter* sorter;
+        std::vector<RunCursor> cursors;
+        std::priority_queue<size_t, std::vector<size_t>, HeapCompare> heap;
+        size_t batch;
+
+        const Pair& current() const { return cursors[heap.top()].get(); }
+
+        void advance()
+        {
+            size_t c = heap.top();
+            heap.pop();
+            cursors[c].next(batch);
+            if (cursors[c].valid()) heap.push(c);
+        }
+    };
+};
+
+} // namespace bptree
+
+#endif
@@ -3,9 +3,13 @@
 
 #include "page.h"
 
+#include <atomic>
+#include <condition_variable>
 #include <mutex>
 #include <stdexcept>
 #include <string>
+#include <sys/types.h>
+#include <vector>
 
 namespace bptree {
 
@@ -14,34 +18,165 @@ public:
     IOException(const char* message) : runtime_error(message) {}
 };
 
+/* a page read from the file does not match its checksum, e.g. because a write
+ * to it was torn */
+class CorruptPageException : public IOException {
+public:
+    CorruptPageException(const char* message) : IOException(message) {}
+};
+
+/* page checksums are enabled when a heap file is created with a mode other
+ * than NONE. EAGER verifies a page when it is read from the file, LAZY defers
+ * the check to the first fetch of the page from the cache and NONE skips
+ * verification */
+enum class ChecksumMode { NONE, EAGER, LAZY };
+
+/* how pages are spread across the files of a striped heap file:
+ * MODULO - page p is in file p % # files
+ * EXTENT - runs of extent_pages pages go to the files in turn */
+enum class StripeLayout { MODULO, EXTENT };
+
+/* READ_ONLY opens an existing heap file without ever writing to it, so that
+ * reader processes can open the file of a writer process. pages the writer
+ * appends later are found when they are first read */
+enum class OpenMode { READ_WRITE, READ_ONLY };
+
+struct StripeOptions {
+    StripeLayout layout = StripeLayout::MODULO;
+    size_t extent_pages = 256;
+};
+
 class HeapFile {
 public:
-    explicit HeapFile(std::string_view filename, bool create, size_t page_size);
+    explicit HeapFile(std::string_view filename, bool create, size_t page_size,
+                      ChecksumMode checksum_mode = ChecksumMode::NONE);
+    /* a heap file striped across several files, e.g. on different devices.
+     * the first file holds the header. the files must be given in the same
+     * order every time, the layout is taken from the header when opening.
+     * a READ_ONLY heap file is never created */
+    HeapFile(const std::vector<std::string>& filenames, bool create,
+             size_t page_size, ChecksumMode checksum_mode = ChecksumMode::NONE,
+             const StripeOptions& stripe_options = StripeOptions{},
+             OpenMode mode = OpenMode::READ_WRITE);
     ~HeapFile();
 
     bool is_open() const { return fd != -1; }
+    bool is_read_only() const { return mode == OpenMode::READ_ONLY; }
     size_t get_page_size() const { return page_size; }
 
+    bool has_checksums() const { return (flags & FLAG_PAGE_CHECKSUMS) != 0; }
+    /* bytes at the beginning of each page reserved for the page header */
+    size_t get_page_header_size() const
+    {
+        return has_checksums() ? PAGE_HEADER_SIZE : 0;
+    }
+
+    size_t get_num_stripes() const { return stripe_fds.size(); }
+    size_t get_stripe(PageID pid) const;
+    /* the page stored right after pid in the same file */
+    PageID next_in_stripe(PageID pid) const;
+
+    /* including the header page */
+    PageID get_num_pages();
+
     PageID new_page();
+    /* extend the file by count pages. returns the first new page ID */
+    PageID new_pages(size_t count);
+    /* shrink the file to its first num_pages pages */
+    void truncate(PageID num_pages);
     void initialize(size_t num_pages);
-    void read_page(Page* page, boost::upgrade_to_unique_lock<Page>& lock);
+    /* throws CorruptPageException if verify is set and the page does not
+     * match its checksum (EAGER mode) */
+    void read_page(Page* page, boost::upgrade_to_unique_lock<Page>& lock,
+                   bool verify = true);
+    /* ask the OS to start reading count pages that follow each other in one
+     * file (see next_in_stripe()), starting at pid. errors are ignored */
+    void read_ahead(PageID pid, size_t count = 1);
     void write_page(Page* page, boost::upgrade_lock<Page>& lock);
+    /* write a run of pages that follow each other in one file (see
+     * next_in_stripe()) with vectored I/O. the caller holds the lock of each
+     * page */
+    void write_pages(Page* const* pages, boost::upgrade_lock<Page>* locks,
+                     size_t count);
+    /* throws CorruptPageException if the page does not match its checksum */
+    void verify_page(Page* page, boost::upgrade_lock<Page>& lock);
+
+    /* make all writes that completed before the call durable. concurrent
+     * callers share fdatasync calls: a caller whose writes are covered by a
+     * sync already in flight only waits for it */
+    void sync();
+    uint64_t get_num_syncs() const { return num_syncs.load(); }
+
+    /* record in the header that all pages dirty before the checkpoint began
+     * have been written */
+    void mark_checkpoint();
+    uint64_t get_checkpoint_seq() const { return checkpoint_seq; }
+    uint64_t get_checkpoint_time() const { return checkpoint_time; }
+
+    uint32_t get_format_version() const { return format_version; }
 
 private:
+    /* header: | magic | format version | page size | # pages | checkpoint
+     * seq | checkpoint time | flags | # stripes | stripe layout | extent
+     * pages |. version 1 files have no version field
+     * and a 32-bit page count. they are kept in that format and cannot grow
+     * past 2^32 pages */
     static const uint32_t MAGIC = 0xDEADBEEF;
+    static const uint32_t MAGIC_V2 = 0xDEADBEF2;
+    static const uint32_t FORMAT_VERSION = 2;
+    static const uint32_t FLAG_PAGE_CHECKSUMS = 1;
+
+    /* page header: | checksum(4 bytes) | flags(4 bytes) |. the checksum covers
+     * the rest of the page and is seeded with the page ID so that misdirected
+     * writes are detected as well */
+    static const size_t PAGE_HEADER_SIZE = 8;
+    static const uint32_t PAGE_FLAG_WRITTEN = 1;
 
     int fd;
     size_t page_size;
-    uint32_t file_size_pages;
+    uint32_t format_version;
+    /* atomic because reload_num_pages() grows it in read-only mode */
+    std::atomic<uint64_t> file_size_pages;
+    uint64_t checkpoint_seq;
+    uint64_t checkpoint_time; /* ms since epoch */
+    uint32_t flags;
+    ChecksumMode checksum_mode;
+    OpenMode mode;
     std::string filename;
     std::mutex mutex;
 
+    /* one descriptor per stripe, the first one is fd */
+    std::vector<std::string> stripe_files;
+    std::vector<int> stripe_fds;
+    StripeOptions stripe_options;
+
+    /* write_seq counts completed writes. synced_seq is the write_seq value
+     * covered by the last completed fdatasync */
+    std::atomic<uint64_t> write_seq;
+    uint64_t synced_seq;
+    bool sync_in_progress;
+    std::atomic<uint64_t> num_syncs;
+    std::mutex sync_mutex;
+    std::condition_variable sync_cv;
+
     void create();
     void open(bool create);
     void close();
 
     void read_header();
     void write_header();
+
+    void check_page_id(PageID pid);
+    void check_writable() const;
+    /* read the page count from the header again (read-only mode) */
+    void reload_num_pages();
+    off64_t stripe_offset(PageID pid) const;
+    void open_stripes(int flags);
+    void check_frame(PageID pid, const uint8_t* frame) const;
+    static uint32_t checksum_seed(PageID pid)
+    {
+        return (uint32_t)(pid ^ (pid >> 32));
+    }
 };
 
 } // namespace bptree
@@ -1,35 +1,161 @@
 #ifndef _BPTREE_HEAP_PAGE_CACHE_H_
 #define _BPTREE_HEAP_PAGE_CACHE_H_
 
+#include "executor.h"
 #include "heap_file.h"
 #include "page_cache.h"
 
+#include <algorithm>
 #include <atomic>
+#include <condition_variable>
 #include <cstdint>
 #include <deque>
 #include <list>
 #include <memory>
 #include <mutex>
+#include <string>
+#include <thread>
 #include <unordered_map>
+#include <vector>
 
 namespace bptree {
 
+struct CheckpointOptions {
+    /* a checkpoint starts as soon as more pages than this are dirty. writers
+     * write their own pages while more than twice as many are dirty */
+    size_t max_dirty_pages = 1024;
+    /* ... or when this much time has passed since the last one */
+    uint32_t interval_ms = 1000;
+    /* dirty pages are written in batches of this size with a pause in
+     * between so that a checkpoint does not saturate the device. the pause
+     * is skipped while the dirty page budget is exceeded */
+    size_t batch_pages = 64;
+    uint32_t batch_pause_ms = 1;
+};
+
+struct ShutdownStats {
+    size_t pages_written = 0;
+    uint64_t write_calls = 0;
+    /* whether the written pages were synced before close returned */
+    bool synced = false;
+    double duration_ms = 0;
+};
+
+/* when written pages are made durable with fdatasync. sync() barriers (e.g.
+ * tree commits) always are, the modes differ in the other writes:
+ * NONE          - never, durability is left to the OS
+ * ON_CHECKPOINT - by checkpoints and on close
+ * INTERVAL      - additionally every sync_interval_ms from a background thread
+ * PER_FLUSH     - additionally before every flush_page()/flush_all_pages() and
+ *                 write-through unpin returns. concurrent writers share the
+ *                 fdatasync calls */
+enum class DurabilityMode { NONE, ON_CHECKPOINT, INTERVAL, PER_FLUSH };
+
 class HeapPageCache : public AbstractPageCache {
 public:
     HeapPageCache(std::string_view filename, bool create,
-                  size_t max_pages = 4096, size_t page_size = 4096);
+                  size_t max_pages = 4096, size_t page_size = 4096,
+                  ChecksumMode checksum_mode = ChecksumMode::NONE);
+    /* cache over a heap file striped across several files */
+    HeapPageCache(const std::vector<std::string>& filenames, bool create,
+                  size_t max_pages = 4096, size_t page_size = 4096,
+                  ChecksumMode checksum_mode = ChecksumMode::NONE,
+                  const StripeOptions& stripe_options = StripeOptions{});
+    /* open an existing heap file in the given mode. the page size is taken
+     * from the file. a read-only cache fails all writes */
+    HeapPageCache(std::string_view filename, OpenMode mode,
+                  size_t max_pages = 4096,
+                  ChecksumMode checksum_mode = ChecksumMode::NONE);
+    HeapPageCache(const std::vector<std::string>& filenames, OpenMode mode,
+                  size_t max_pages = 4096,
+                  ChecksumMode checksum_mode = ChecksumMode::NONE);
+    ~HeapPageCache();
 
     virtual Page* new_page(boost::upgrade_lock<Page>& lock);
+    /* throws CorruptPageException if the page does not match its
+     * checksum */
     virtual Page* fetch_page(PageID id, boost::upgrade_lock<Page>& lock);
+    virtual Page* fetch_page_for_overwrite(PageID id,
+                                           boost::upgrade_lock<Page>& lock);
+    virtual PageID new_pages(size_t count) { return heap_file->new_pages(count); }
+    virtual bool truncate(PageID num_pages);
+    virtual void read_ahead(const std::vector<PageID>& pids);
+    virtual PageID next_in_stripe(PageID pid) const
+    {
+        return heap_file->next_in_stripe(pid);
+    }
+    virtual void invalidate(const std::vector<PageID>& pids = {});
+    virtual void discard(const std::vector<PageID>& pids);
 
     virtual void pin_page(Page* page, boost::upgrade_lock<Page>& lock);
     virtual void unpin_page(Page* page, bool dirty, boost::upgrade_lock<Page>& lock);
 
     virtual void flush_page(Page* page, boost::upgrade_lock<Page>& lock);
     virtual void flush_all_pages();
+    virtual void sync();
 
     virtual size_t size() const { return pages.size(); }
     virtual size_t get_page_size() const { return page_size; }
+    virtual PageID get_num_pages() const { return heap_file->get_num_pages(); }
+
+    /* in write-back mode unpin_page() leaves dirty pages in the cache. they are
+     * written when evicted, by a checkpoint or by flush_all_pages() */
+    void set_write_back(bool enable) { write_back = enable; }
+    bool is_write_back() const { return write_back; }
+    size_t get_num_dirty() const { return num_dirty.load(); }
+
+    /* write all pages that are dirty when the checkpoint starts without
+     * blocking writers, then record the checkpoint in the heap file header */
+    void checkpoint();
+    uint64_t get_checkpoint_seq() const { return heap_file->get_checkpoint_seq(); }
+
+    /* run checkpoints from a background thread to bound the number of dirty
+     * pages (and so the work lost on a crash) */
+    void start_checkpointer(const CheckpointOptions& options = CheckpointOptions{});
+    void stop_checkpointer();
+
+    void set_durability(DurabilityMode mode, uint32_t sync_interval_ms = 100);
+    DurabilityMode get_durability() const { return durability; }
+    uint64_t get_num_syncs() const { return heap_file->get_num_syncs(); }
+    size_t get_num_stripes() const { return heap_file->get_num_stripes(); }
+    bool is_read_only() const { return heap_file->is_read_only(); }
+
+    /* flushes write dirty pages in page ID order and merge the pages that are
+     * contiguous in the file into a single vectored write of at most this many
+     * bytes */
+    void set_max_write_bytes(size_t bytes) { max_write_bytes = bytes; }
+    size_t get_max_write_bytes() const { return max_write_bytes; }
+    uint64_t get_num_write_calls() const { return num_write_calls.load(); }
+
+    /* flush_all_pages() and close() split the dirty pages into page ID ranges
+     * and write them from this many tasks */
+    void set_flush_threads(size_t threads) { flush_threads = std::max<size_t>(1, threads); }
+    size_t get_flush_threads() const { return flush_threads; }
+
+    /* parallel flushes and background prefetching run on this executor,
+     * the shared default one unless set */
+    void set_executor(Executor* executor) { this->executor = executor; }
+
+    /* stop the background threads and write all dirty pages. a fast close
+     * does not wait for the writes to be synced (except in PER_FLUSH mode):
+     * the pages are with the OS and survive a process restart. the destructor
+     * does a normal close if close() was not called */
+    ShutdownStats close(bool fast = false);
+    const ShutdownStats& get_shutdown_stats() const { return shutdown_stats; }
+
+    /* read the given pages into free frames of the cache. returns the number
+     * of pages read */
+    size_t prefetch_pages(std::vector<PageID> pids);
+
+    /* save the IDs of the resident pages, most recently used first, so that
+     * the next open can warm up the cache with load_hot_pages(). with a hot
+     * page file set, the list is saved by every checkpoint and on close */
+    void dump_hot_pages(const std::string& path);
+    void set_hot_page_file(const std::string& path) { hot_page_path = path; }
+    /* prefetch the pages saved by dump_hot_pages(), in the background unless
+     * told otherwise. returns false if there is no valid list */
+    bool load_hot_pages(const std::string& path, bool background = true);
+    size_t get_num_prefetched() const { return num_prefetched.load(); }
 
 private:
     std::unique_ptr<HeapFile> heap_file;
@@ -38,12 +164,67 @@ private:
     std::mutex mutex;
     std::mutex lru_mutex;
 
+    bool write_back;
+    std::atomic<size_t> num_dirty;
+
+    CheckpointOptions checkpoint_options;
+    std::thread checkpointer;
+    std::mutex checkpoint_mutex;
+    std::condition_variable checkpoint_cv;
+    std::atomic<bool> checkpointer_running;
+
+    DurabilityMode durability;
+    uint32_t sync_interval_ms;
+    std::thread syncer;
+    std::mutex syncer_mutex;
+    std::condition_variable syncer_cv;
+    bool syncer_running;
+
+    static constexpr size_t DEFAULT_MAX_WRITE_BYTES = 1 << 20;
+    size_t max_write_bytes;
+    std::atomic<uint64_t> num_write_calls;
+
+    static constexpr size_t DEFAULT_MAX_FLUSH_THREADS = 8;
+    size_t flush_threads;
+    bool closed;
+    ShutdownStats shutdown_stats;
+
+    static const uint32_t HOT_PAGE_MAGIC = 0x484F5451; /* 64-bit page IDs */
+    static const size_t PREFETCH_BATCH_PAGES = 64;
+    std::string hot_page_path;
+    std::atomic<size_t> num_prefetched;
+    /* a background prefetch runs as a chain of maintenance tasks, one batch
+     * per task */
+    std::mutex prefetch_mutex;
+    std::condition_variable prefetch_cv;
+    bool prefetch_active;
+    std::atomic<bool> prefetcher_running;
+
+    Executor* executor;
+
     std::list<std::unique_ptr<Page>> pages;
     std::unordered_map<PageID, Page*> page_map;
+    std::vector<Page*> free_frames; /* frames that hold no page */
     std::list<PageID> lru_list;
     std::unordered_map<PageID, std::list<PageID>::iterator> lru_map;
 
     Page* alloc_page(PageID new_id, boost::upgrade_lock<Page>& lock);
+    Page* fetch_page(PageID id, boost::upgrade_lock<Page>& lock, bool verify);
+
+    bool write_page(Page* page, boost::upgrade_lock<Page>& lock);
+    size_t flush_dirty_pages(bool paced);
+    size_t write_dirty_pages(
+        const std::vector<std::pair<PageID, Page*>>& dirty_pages, size_t begin,
+        size_t end, bool paced);
+    void checkpointer_loop();
+    void prefetch_hot_pages(const std::vector<PageID>& pids);
+    void prefetch_hot_batch(std::shared_ptr<const std::vector<PageID>> pids,
+                            size_t begin);
+    void stop_prefetcher();
+    void stop_syncer();
+    void syncer_loop();
+    /* sync() unless durability is left to the OS */
+    void sync_if_durable();
 
     void lru_insert(PageID id);
     void lru_erase(PageID id);
@@ -41,6 +41,7 @@ public:
 
     virtual size_t size() const { return page_map.size(); }
     virtual size_t get_page_size() const { return page_size; }
+    virtual PageID get_num_pages() const { return next_id.load(); }
 
 private:
     size_t page_size;
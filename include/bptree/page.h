@@ -11,23 +11,44 @@
 
 namespace bptree {
 
-typedef uint32_t PageID;
+typedef uint64_t PageID;
 
 class Page : public boost::upgrade_lockable_adapter<boost::shared_mutex> {
 public:
     static const PageID INVALID_PAGE_ID = 0;
 
-    explicit Page(PageID id, size_t size) : id(id), size(size), dirty(false), pin_count(0)
+    /* the first header_size bytes of the frame are reserved for the storage
+     * layer (e.g. page checksums). get_buffer() and get_size() only cover the
+     * bytes after the header */
+    explicit Page(PageID id, size_t size, size_t header_size = 0)
+        : id(id), size(size), header_size(header_size), dirty(false),
+          verified(true), pin_count(0)
     {
-        buffer = std::make_unique<uint8_t[]>(size);
+        owned_buffer = std::make_unique<uint8_t[]>(size);
+        buffer = owned_buffer.get();
     }
 
+    /* a page over a frame that someone else owns, e.g. a frame in shared
+     * memory. the frame must outlive the page */
+    Page(PageID id, uint8_t* frame, size_t size, size_t header_size = 0)
+        : id(id), buffer(frame), size(size), header_size(header_size),
+          dirty(false), verified(true), pin_count(0)
+    {}
+
     uint8_t* get_buffer(boost::upgrade_to_unique_lock<Page>&) {
-        return buffer.get();
+        return buffer + header_size;
     }
 
     const uint8_t* get_buffer(boost::upgrade_lock<Page>&) {
-        return buffer.get();
+        return buffer + header_size;
+    }
+
+    uint8_t* get_frame(boost::upgrade_to_unique_lock<Page>&) {
+        return buffer;
+    }
+
+    const uint8_t* get_frame(boost::upgrade_lock<Page>&) {
+        return buffer;
     }
 
     int32_t pin() { return pin_count.fetch_add(1); }
@@ -35,16 +56,27 @@ public:
 
     void set_id(PageID pid) { id = pid; }
     PageID get_id() const { return id; }
-    size_t get_size() const { return size; }
+    size_t get_size() const { return size - header_size; }
+    size_t get_frame_size() const { return size; }
+
+    bool is_dirty() const { return dirty.load(); }
+    void set_dirty(bool d) { dirty.store(d); }
+    /* returns true if the page was clean */
+    bool mark_dirty() { return !dirty.exchange(true); }
 
-    bool is_dirty() const { return dirty; }
-    void set_dirty(bool d) { dirty = d; }
+    /* false while the frame content has not been checked against its
+     * checksum */
+    bool is_verified() const { return verified.load(); }
+    void set_verified(bool v) { verified.store(v); }
 
 private:
     PageID id;
-    std::unique_ptr<uint8_t[]> buffer;
+    std::unique_ptr<uint8_t[]> owned_buffer;
+    uint8_t* buffer;
     size_t size;
-    bool dirty;
+    size_t header_size;
+    std::atomic<bool> dirty;
+    std::atomic<bool> verified;
     std::atomic<int32_t> pin_count;
     std::mutex mutex;
 };
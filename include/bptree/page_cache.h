@@ -3,21 +3,74 @@
 
 #include "page.h"
 
+#include <vector>
+
 namespace bptree {
 
 class AbstractPageCache {
 public:
     virtual Page* new_page(boost::upgrade_lock<Page>& lock) = 0;
+    /* returns nullptr if the page does not exist. a page that exists but is
+     * corrupt is an error, caches that check page checksums throw. so do
+     * caches with a frame limit when every frame is pinned */
     virtual Page* fetch_page(PageID id, boost::upgrade_lock<Page>& lock) = 0;
+    /* fetch a page that the caller overwrites completely. the stored copy is
+     * not checked, it may be torn, e.g. a recycled page after a crash */
+    virtual Page* fetch_page_for_overwrite(PageID id,
+                                           boost::upgrade_lock<Page>& lock)
+    {
+        return fetch_page(id, lock);
+    }
+    /* allocate count pages with consecutive IDs (an extent) without bringing
+     * them into the cache. returns the first page ID */
+    virtual PageID new_pages(size_t count)
+    {
+        PageID first = Page::INVALID_PAGE_ID;
+        for (size_t i = 0; i < count; i++) {
+            boost::upgrade_lock<Page> lock;
+            auto* page = new_page(lock);
+            if (i == 0) first = page->get_id();
+            unpin_page(page, false, lock);
+        }
+        return first;
+    }
+
+    /* drop the pages with IDs >= num_pages from the cache and the file. none
+     * of them may be in use. returns false if the cache cannot shrink its
+     * storage */
+    virtual bool truncate(PageID /* num_pages */) { return false; }
+
+    /* hint that the pages will be fetched soon. the cache may start reading
+     * them in the background */
+    virtual void read_ahead(const std::vector<PageID>& /* pids */) {}
+    /* the page stored right after pid in the same file */
+    virtual PageID next_in_stripe(PageID pid) const { return pid + 1; }
+
+    /* drop the cached copies of the given clean pages (all of them if pids is
+     * empty) so that the next fetch reads them from the storage again, e.g.
+     * after another process wrote them. pinned pages are kept */
+    virtual void invalidate(const std::vector<PageID>& /* pids */ = {}) {}
+    /* drop the given pages without writing them, even if they are dirty, e.g.
+     * the pages a shadow paging tree wrote after its last commit when it gives
+     * up those changes. pinned pages are kept */
+    virtual void discard(const std::vector<PageID>& /* pids */) {}
 
     virtual void pin_page(Page* page, boost::upgrade_lock<Page>&) = 0;
+    /* the caller's lock is still held on return, except for caches that drop
+     * their private copy of the page with the last pin (ShmPageCache) */
     virtual void unpin_page(Page* page, bool dirty, boost::upgrade_lock<Page>&) = 0;
 
     virtual void flush_page(Page* page, boost::upgrade_lock<Page>&) = 0;
     virtual void flush_all_pages() = 0;
+    /* barrier: pages written so far are durable before any later write.
+     * tree commits depend on it, so caches over a file honour it whatever
+     * their durability settings */
+    virtual void sync() {}
 
     virtual size_t size() const = 0;
     virtual size_t get_page_size() const = 0;
+    /* the page IDs in use are below this */
+    virtual PageID get_num_pages() const = 0;
 };
 
 } // namespace bptree
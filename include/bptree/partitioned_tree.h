@@ -0,0 +1,671 @@
+#ifndef _BPTREE_PARTITIONED_TREE_H_
+#define _BPTREE_PARTITIONED_TREE_H_
+
+#include "executor.h"
+#include "heap_page_cache.h"
+#include "tree.h"
+#include "write_batch.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <fcntl.h>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace bptree {
+
+struct PartitionOptions {
+    size_t num_shards = 8;
+    /* page cache of each shard */
+    size_t max_pages = 4096;
+    size_t page_size = 4096;
+    BTreeOptions tree_options;
+    /* a key range is rebalanced once it holds rebalance_ratio times the pairs
+     * of an even share and at least min_rebalance_pairs */
+    double rebalance_ratio = 2.0;
+    size_t min_rebalance_pairs = 1 << 16;
+    /* check the balance in the background after this many writes, never if
+     * 0 */
+    size_t rebalance_check_writes = 1 << 16;
+};
+
+/* a tree range-partitioned over independent shards, each a BTree with its
+ * own heap file and page cache, so that writers to different key ranges
+ * share no root and no cache. shard i lives in path.i and the layout (split
+ * keys and the shard of each range) in path.shards. split keys are taken from
+ * a sample with set_split_points(), and a range that grows past its share is
+ * moved in part to a neighbour, or split into a shard that holds no range
+ * yet, while the tree stays online. write batches are atomic per shard
+ * only */
+template <unsigned int N, typename K, typename V,
+          typename KeySerializer = CopySerializer<K>,
+          typename KeyComparator = std::less<K>,
+          typename KeyEq = std::equal_to<K>,
+          typename ValueSerializer = CopySerializer<V>>
+class PartitionedBTree {
+public:
+    using TreeType = BTree<N, K, V, KeySerializer, KeyComparator, KeyEq,
+                           ValueSerializer>;
+
+    PartitionedBTree(const std::string& path, bool create,
+                     const PartitionOptions& options = PartitionOptions{})
+        : path(path), options(options), writes(0), rebalance_pending(false),
+          closed(false), executor(options.tree_options.executor
+                                      ? options.tree_options.executor
+                                      : &Executor::get_default())
+    {
+        if (options.num_shards == 0) {
+            throw std::invalid_argument("a partitioned tree needs shards");
+        }
+
+        if (create) {
+            ranges.push_back(0);
+        } else {
+            read_layout();
+        }
+
+        for (size_t i = 0; i < options.num_shards; i++) {
+            auto shard = std::make_unique<Shard>();
+            shard->cache = std::make_unique<HeapPageCache>(
+                path + "." + std::to_string(i), create, options.max_pages,
+                options.page_size);
+            shard->tree = std::make_unique<TreeType>(shard->cache.get(),
+                                                     options.tree_options);
+            shards.push_back(std::move(shard));
+        }
+
+        if (create) write_layout();
+    }
+
+    ~PartitionedBTree() { close(); }
+
+    /* choose split keys at the quantiles of a sample of the keys to come.
+     * the tree must be empty */
+    void set_split_points(std::vector<K> sample)
+    {
+        std::lock_guard<std::mutex> guard(rebalance_mutex);
+        std::unique_lock<std::shared_mutex> latch(route_mutex);
+
+        if (size() > 0) {
+            throw std::runtime_error("split points need an empty tree");
+        }
+
+        std::sort(sample.begin(), sample.end(), kcmp);
+        splits.clear();
+        ranges.assign(1, 0);
+        for (size_t i = 1; i < options.num_shards && !sample.empty(); i++) {
+            const K& key = sample[sample.size() * i / options.num_shards];
+            if (splits.empty() || kcmp(splits.back(), key)) {
+                splits.push_back(key);
+                ranges.push_back(ranges.size());
+            }
+        }
+        write_layout();
+    }
+
+    void close()
+    {
+        if (closed.exchange(true)) return;
+
+        {
+            std::unique_lock<std::mutex> lock(rebalance_mutex);
+            rebalance_cv.wait(lock, [this] { return !rebalance_pending; });
+        }
+
+        for (auto&& shard : shards) {
+            shard->tree->close();
+            shard->cache->close();
+        }
+    }
+
+    void commit()
+    {
+        for (auto&& shard : shards) {
+            shard->tree->commit();
+        }
+    }
+
+    /* may count moved pairs twice while a rebalance is in progress */
+    size_t size() const
+    {
+        size_t count = 0;
+        for (auto&& shard : shards) {
+            count += shard->tree->size();
+        }
+        return count;
+    }
+
+    size_t get_num_shards() const { return shards.size(); }
+    TreeType& get_shard(size_t i) { return *shards[i]->tree; }
+
+    void get_value(const K& key, std::vector<V>& value_list)
+    {
+        std::shared_lock<std::shared_mutex> latch(route_mutex);
+        tree_of(find_range(key)).get_value(key, value_list);
+    }
+
+    void insert(const K& key, const V& value)
+    {
+        {
+            std::shared_lock<std::shared_mutex> latch;
+            size_t r = route_write(key, key, true, latch);
+            tree_of(r).insert(key, value);
+        }
+        count_writes(1);
+    }
+
+    size_t erase(const K& key)
+    {
+        size_t count;
+        {
+            std::shared_lock<std::shared_mutex> latch;
+            size_t r = route_write(key, key, true, latch);
+            count = tree_of(r).erase(key);
+        }
+        count_writes(1);
+        return count;
+    }
+
+    /* remove all pairs with keys in [lo, hi) */
+    void erase_range(const K& lo, const K& hi)
+    {
+        if (!kcmp(lo, hi)) return;
+
+        {
+            std::shared_lock<std::shared_mutex> latch;
+            size_t first = route_write(lo, hi, false, latch);
+            for (size_t r = first; r < ranges.size(); r++) {
+                auto rlo = range_lo(r);
+                auto rhi = range_hi(r);
+                if (rlo && !kcmp(*rlo, hi)) break;
+
+                const K& elo = rlo && kcmp(lo, *rlo) ? *rlo : lo;
+                const K& ehi = rhi && kcmp(*rhi, hi) ? *rhi : hi;
+                tree_of(r).erase_range(elo, ehi);
+            }
+        }
+        count_writes(1);
+    }
+
+    void clear()
+    {
+        std::lock_guard<std::mutex> guard(rebalance_mutex);
+        std::unique_lock<std::shared_mutex> latch(route_mutex);
+        for (auto&& shard : shards) {
+            shard->tree->clear();
+        }
+    }
+
+    /* the operations of each shard are applied as one batch */
+    void write(const WriteBatch<K, V>& batch)
+    {
+        if (batch.empty()) return;
+
+        K lo = batch.get_ops().front().key, hi = lo;
+        for (auto&& op : batch.get_ops()) {
+            if (kcmp(op.key, lo)) lo = op.key;
+            if (kcmp(hi, op.key)) hi = op.key;
+        }
+
+        {
+            std::shared_lock<std::shared_mutex> latch;
+            route_write(lo, hi, true, latch);
+
+            std::vector<WriteBatch<K, V>> parts(ranges.size());
+            for (auto&& op : batch.get_ops()) {
+                auto& part = parts[find_range(op.key)];
+                if (op.type == WriteBatch<K, V>::OpType::ERASE) {
+                    part.erase(op.key);
+                } else {
+                    part.put(op.key, op.value);
+                }
+            }
+            for (size_t r = 0; r < parts.size(); r++) {
+                if (!parts[r].empty()) tree_of(r).write(parts[r]);
+            }
+        }
+        count_writes(batch.size());
+    }
+
+    /* move pairs out of the largest range if it holds more than its share:
+     * into a shard that holds no range yet, or else to its smaller
+     * neighbour. readers and writers of other keys carry on, writers of the
+     * moved keys wait until the move is done. returns whether pairs were
+     * moved */
+    bool rebalance()
+    {
+        std::lock_guard<std::mutex> guard(rebalance_mutex);
+        if (closed) return false;
+
+        Move move;
+        if (!plan_move(move)) return false;
+
+        {
+            std::unique_lock<std::shared_mutex> latch(route_mutex);
+            std::lock_guard<std::mutex> move_guard(move_mutex);
+            moving = std::make_pair(move.lo, move.hi);
+        }
+
+        /* the moved pairs are copied while readers still find them in the
+         * source range */
+        auto& src = *shards[ranges[move.range]]->tree;
+        auto& dst = *shards[move.dst_shard]->tree;
+
+        /* a crash between an earlier copy and its layout leaves copies in the
+         * destination that lookups do not reach. drop them so that they are
+         * not merged a second time */
+        if (move.new_range) {
+            dst.clear();
+        } else {
+            dst.erase_range(*move.lo, *move.hi);
+        }
+
+        std::optional<K> first_moved, last_moved;
+        std::vector<std::pair<K, V>> batch;
+        auto it = move.lo ? src.begin(*move.lo) : src.begin();
+        for (; it != src.end(); ++it) {
+            if (move.hi && !kcmp(it->first, *move.hi)) break;
+            if (!first_moved) first_moved = it->first;
+            last_moved = it->first;
+            batch.push_back(*it);
+            if (batch.size() == MOVE_BATCH_PAIRS) {
+                dst.merge(batch.begin(), batch.end());
+                batch.clear();
+            }
+        }
+        dst.merge(batch.begin(), batch.end());
+        /* the moved pairs must be durable before the layout points to them */
+        dst.commit();
+
+        {
+            std::unique_lock<std::shared_mutex> latch(route_mutex);
+            if (move.new_range) {
+                /* a new range right above the split one */
+                splits.insert(splits.begin() + move.range, move.cut);
+                ranges.insert(ranges.begin() + move.range + 1, move.dst_shard);
+            } else if (move.dst_range > move.range) {
+                splits[move.range] = move.cut;
+            } else {
+                splits[move.range - 1] = move.cut;
+            }
+            write_layout();
+
+            std::lock_guard<std::mutex> move_guard(move_mutex);
+            moving.reset();
+        }
+        move_cv.notify_all();
+
+        /* the source keeps copies outside of its range until they are
+         * erased, lookups no longer reach them */
+        if (first_moved) {
+            src.erase_range(*first_moved, *last_moved);
+            src.erase(*last_moved);
+        }
+        return true;
+    }
+
+    /* iterates the ranges in key order. like BTree::iterator it is not
+     * atomic with respect to concurrent writes */
+    class iterator {
+        friend class PartitionedBTree;
+
+    public:
+        using value_type = std::pair<K, V>;
+        using reference = value_type&;
+        using pointer = value_type*;
+
+        iterator& operator++()
+        {
+            ++*it;
+            settle();
+            return *this;
+        }
+        reference operator*() { return kvp; }
+        pointer operator->() { return &kvp; }
+        bool is_end() const { return ended; }
+
+    private:
+        PartitionedBTree* owner;
+        std::optional<typename TreeType::iterator> it;
+        std::optional<K> hi;
+        value_type kvp;
+        bool ended;
+
+        iterator(PartitionedBTree* owner, const std::optional<K>& key)
+            : owner(owner), ended(false)
+        {
+            seek(key);
+            settle();
+        }
+
+        void seek(const std::optional<K>& key)
+        {
+            std::shared_lock<std::shared_mutex> latch(owner->route_mutex);
+            size_t r = key ? owner->find_range(*key) : 0;
+            auto& tree = owner->tree_of(r);
+            it.emplace(key ? tree.begin(*key) : tree.begin());
+            hi = owner->range_hi(r);
+        }
+
+        /* continue in the next range once this one is done */
+        void settle()
+        {
+            while (it->is_end() || (hi && !owner->kcmp((*it)->first, *hi))) {
+                if (!hi) {
+                    ended = true;
+                    return;
+                }
+                seek(std::optional<K>(*hi));
+            }
+            kvp = **it;
+        }
+    };
+
+    struct Sentinel {};
+    friend bool operator==(const iterator& it, Sentinel) { return it.is_end(); }
+    friend bool operator!=(const iterator& it, Sentinel) { return !it.is_end(); }
+
+    iterator begin() { return iterator(this, std::nullopt); }
+    iterator begin(const K& key) { return iterator(this, key); }
+    Sentinel end() const { return Sentinel{}; }
+
+private:
+    static const uint32_t LAYOUT_MAGIC = 0x50545231;
+    static const size_t MOVE_BATCH_PAIRS = 1 << 14;
+
+    struct Shard {
+        std::unique_ptr<HeapPageCache> cache;
+        std::unique_ptr<TreeType> tree;
+    };
+
+    struct Move {
+        size_t range;
+        size_t dst_range;
+        size_t dst_shard;
+        /* the destination shard holds no range yet */
+        bool new_range;
+        K cut;
+        /* the moved keys, [lo, hi) */
+        std::optional<K> lo, hi;
+    };
+
+    std::string path;
+    PartitionOptions options;
+    KeyComparator kcmp;
+    KeySerializer key_serializer;
+    std::vector<std::unique_ptr<Shard>> shards;
+
+    /* range r holds the keys in [splits[r - 1], splits[r]) and lives in
+     * shard ranges[r]. operations hold route_mutex shared, layout changes
+     * hold it exclusive */
+    std::shared_mutex route_mutex;
+    std::vector<K> splits;
+    std::vector<size_t> ranges;
+
+    /* keys being moved by a rebalance, writers to them wait on move_cv */
+    std::optional<std::pair<std::optional<K>, std::optional<K>>> moving;
+    std::mutex move_mutex;
+    std::condition_variable move_cv;
+
+    std::mutex rebalance_mutex;
+    std::condition_variable rebalance_cv;
+    std::atomic<size_t> writes;
+    bool rebalance_pending;
+    std::atomic<bool> closed;
+    Executor* executor;
+
+    size_t find_range(const K& key) const
+    {
+        return std::upper_bound(splits.begin(), splits.end(), key, kcmp) -
+               splits.begin();
+    }
+
+    TreeType& tree_of(size_t r) { return *shards[ranges[r]]->tree; }
+
+    std::optional<K> range_lo(size_t r) const
+    {
+        if (r == 0) return std::nullopt;
+        return splits[r - 1];
+    }
+
+    std::optional<K> range_hi(size_t r) const
+    {
+        if (r == splits.size()) return std::nullopt;
+        return splits[r];
+    }
+
+    /* whether [lo, hi] (or [lo, hi) if not inclusive) overlaps the keys
+     * being moved */
+    bool is_moving(const K& lo, const K& hi, bool inclusive) const
+    {
+        if (!moving) return false;
+        auto& m = *moving;
+        if (m.second && !kcmp(lo, *m.second)) return false;
+        if (m.first && (inclusive ? kcmp(hi, *m.first) : !kcmp(*m.first, hi)))
+            return false;
+        return true;
+    }
+
+    /* take the route latch shared for a write to the keys from lo to hi,
+     * waiting while any of them is being moved. returns the range of lo */
+    size_t route_write(const K& lo, const K& hi, bool inclusive,
+                       std::shared_lock<std::shared_mutex>& latch)
+    {
+        while (true) {
+            latch = std::shared_lock<std::shared_mutex>(route_mutex);
+            if (!is_moving(lo, hi, inclusive)) return find_range(lo);
+            latch.unlock();
+
+            std::unique_lock<std::mutex> lock(move_mutex);
+            move_cv.wait(lock, [&] { return !is_moving(lo, hi, inclusive); });
+        }
+    }
+
+    void count_writes(size_t count)
+    {
+        size_t check = options.rebalance_check_writes;
+        if (check == 0) return;
+
+        size_t before = writes.fetch_add(count);
+        if (before / check == (before + count) / check) return;
+
+        {
+            std::lock_guard<std::mutex> guard(rebalance_mutex);
+            if (rebalance_pending || closed) return;
+            rebalance_pending = true;
+        }
+        executor->submit(
+            [this] {
+                try {
+                    while (!closed && rebalance())
+                        ;
+                } catch (std::exception&) {
+                    /* retried after the next writes */
+                }
+                std::lock_guard<std::mutex> guard(rebalance_mutex);
+                rebalance_pending = false;
+                rebalance_cv.notify_all();
+            },
+            TaskPriority::MAINTENANCE);
+    }
+
+    /* pick the range to move pairs out of and where to. the caller holds
+     * rebalance_mutex, which keeps the layout stable */
+    bool plan_move(Move& move)
+    {
+        std::vector<size_t> sizes;
+        size_t total = 0;
+        for (size_t r = 0; r < ranges.size(); r++) {
+            sizes.push_back(tree_of(r).size());
+            total += sizes.back();
+        }
+
+        size_t r = std::max_element(sizes.begin(), sizes.end()) - sizes.begin();
+        double share = (double)total / options.num_shards;
+        if (sizes[r] < options.min_rebalance_pairs ||
+            sizes[r] < options.rebalance_ratio * share) {
+            return false;
+        }
+
+        /* how many pairs to move and whether from the top of the range */
+        size_t count;
+        bool up;
+        move.range = r;
+        if (ranges.size() < options.num_shards) {
+            std::vector<bool> used(options.num_shards, false);
+            for (auto s : ranges) {
+                used[s] = true;
+            }
+            move.dst_shard =
+                std::find(used.begin(), used.end(), false) - used.begin();
+            move.dst_range = r + 1;
+            move.new_range = true;
+            count = sizes[r] / 2;
+            up = true;
+        } else {
+            size_t left = r > 0 ? sizes[r - 1] : SIZE_MAX;
+            size_t right = r + 1 < ranges.size() ? sizes[r + 1] : SIZE_MAX;
+            up = right <= left;
+            move.dst_range = up ? r + 1 : r - 1;
+            move.new_range = false;
+            if (move.dst_range >= ranges.size()) return false;
+            move.dst_shard = ranges[move.dst_range];
+
+            size_t other = std::min(left, right);
+            if (other * options.rebalance_ratio > sizes[r]) return false;
+            count = (sizes[r] - other) / 2;
+        }
+
+        /* the cut is the first key of the upper part */
+        size_t pos = up ? sizes[r] - count : count;
+        auto lo = range_lo(r), hi = range_hi(r);
+        auto& tree = tree_of(r);
+        std::optional<K> first, cut;
+        size_t i = 0;
+        for (auto it = lo ? tree.begin(*lo) : tree.begin(); it != tree.end();
+             ++it, i++) {
+            if (hi && !kcmp(it->first, *hi)) break;
+            if (!first) first = it->first;
+            if (i >= pos) {
+                cut = it->first;
+                break;
+            }
+        }
+        /* a range of equal keys cannot be cut */
+        if (!cut || !kcmp(*first, *cut)) return false;
+
+        move.cut = *cut;
+        if (up) {
+            move.lo = cut;
+            move.hi = hi;
+        } else {
+            move.lo = lo;
+            move.hi = cut;
+        }
+        return true;
+    }
+
+    /* layout: | magic | # shards | # ranges | shard of each range | split
+     * keys |. the layout is written to a temporary file that is synced
+     * before it is renamed over the old one, and the directory is synced
+     * after the rename */
+    void write_layout()
+    {
+        std::vector<uint8_t> buf(
+            std::max(options.page_size, splits.size() * sizeof(K) * 2));
+        size_t key_bytes = splits.empty()
+                               ? 0
+                               : key_serializer.serialize(
+                                     buf.data(), buf.size(), splits.data(),
+                                     splits.data() + splits.size());
+
+        std::vector<uint8_t> layout;
+        auto append = [&layout](const void* data, size_t len) {
+            auto* p = static_cast<const uint8_t*>(data);
+            layout.insert(layout.end(), p, p + len);
+        };
+        uint32_t header[3] = {LAYOUT_MAGIC, (uint32_t)options.num_shards,
+                              (uint32_t)ranges.size()};
+        append(header, sizeof(header));
+        for (auto s : ranges) {
+            uint32_t shard = s;
+            append(&shard, sizeof(shard));
+        }
+        uint64_t len = key_bytes;
+        append(&len, sizeof(len));
+        append(buf.data(), key_bytes);
+
+        std::string tmp_path = path + ".shards.tmp";
+        int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                        S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        if (fd < 0) throw IOException("unable to write shard layout");
+        bool ok = ::write(fd, layout.data(), layout.size()) ==
+                      (ssize_t)layout.size() &&
+                  ::fsync(fd) == 0;
+        ok = ::close(fd) == 0 && ok;
+
+        if (!ok ||
+            ::rename(tmp_path.c_str(), (path + ".shards").c_str()) != 0) {
+            throw IOException("unable to write shard layout");
+        }
+
+        auto slash = path.rfind('/');
+        std::string dir = slash == std::string::npos ? "."
+                          : slash == 0               ? "/"
+                                                     : path.substr(0, slash);
+        int dir_fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+        if (dir_fd < 0) throw IOException("unable to sync shard layout");
+        ok = ::fsync(dir_fd) == 0;
+        ::close(dir_fd);
+        if (!ok) throw IOException("unable to sync shard layout");
+    }
+
+    void read_layout()
+    {
+        std::ifstream in(path + ".shards", std::ios::binary);
+        uint32_t header[3] = {0, 0, 0};
+        in.read(reinterpret_cast<char*>(header), sizeof(header));
+        if (!in || header[0] != LAYOUT_MAGIC ||
+            header[1] != options.num_shards || header[2] == 0 ||
+            header[2] > header[1]) {
+            throw std::runtime_error("bad shard layout");
+        }
+
+        ranges.resize(header[2]);
+        for (auto&& s : ranges) {
+            uint32_t shard = 0;
+            in.read(reinterpret_cast<char*>(&shard), sizeof(shard));
+            if (shard >= options.num_shards) {
+                throw std::runtime_error("bad shard layout");
+            }
+            s = shard;
+        }
+
+        uint64_t len = 0;
+        in.read(reinterpret_cast<char*>(&len), sizeof(len));
+        std::vector<uint8_t> buf(len);
+        in.read(reinterpret_cast<char*>(buf.data()), len);
+        if (!in) throw std::runtime_error("bad shard layout");
+
+        splits.resize(ranges.size() - 1);
+        if (!splits.empty()) {
+            key_serializer.deserialize(splits.data(),
+                                       splits.data() + splits.size(),
+                                       buf.data(), buf.size());
+        }
+    }
+};
+
+} // namespace bptree
+
+#endif
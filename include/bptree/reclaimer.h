@@ -0,0 +1,258 @@
+#ifndef _BPTREE_RECLAIMER_H_
+#define _BPTREE_RECLAIMER_H_
+
+#include "page.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace bptree {
+
+/* a subtree unlinked by erase_range() or clear(). node is null if the
+ * subtree root was never loaded. height counts the levels down to the leaves
+ * (1 for a leaf), 0 if it is not known yet */
+template <typename Node> struct DetachedSubtree {
+    PageID pid;
+    std::unique_ptr<Node> node;
+    size_t height;
+};
+
+template <typename Node> struct ReclaimTask {
+    std::vector<DetachedSubtree<Node>> subtrees;
+    /* subtract the pairs found in the subtrees from the pair count */
+    bool count_pairs;
+};
+
+/* nodes unlinked from a tree are freed once no reader can be inside them.
+ * their pages are collected and recycled by a background thread, which is
+ * started by the first task and finishes the queued work before it stops */
+template <typename Tree> class Reclaimer {
+    using NodeType = typename Tree::NodeType;
+    using InnerNodeType = typename Tree::InnerNodeType;
+    using Subtree = DetachedSubtree<NodeType>;
+    using Task = ReclaimTask<NodeType>;
+
+public:
+    explicit Reclaimer(Tree* tree) : tree(tree), stopping(false), busy(false)
+    {}
+
+    Reclaimer(const Reclaimer&) = delete;
+    Reclaimer& operator=(const Reclaimer&) = delete;
+
+    /* collect and recycle the pages of the subtrees in the background */
+    void push(Task task)
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        queue.push_back(std::move(task));
+        start();
+        cv.notify_all();
+    }
+
+    /* only free the memory of the subtrees, their pages are gone already */
+    void retire(std::vector<Subtree> subtrees)
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        auto holder =
+            std::make_shared<std::vector<Subtree>>(std::move(subtrees));
+        tree->epochs.retire([holder] { holder->clear(); });
+        start();
+        cv.notify_all();
+    }
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+
+        /* the thread finishes the queued work before it exits */
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+
+    /* wait until all unlinked subtrees have been reclaimed */
+    void drain()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!thread.joinable()) return;
+
+        cv.notify_all();
+        idle_cv.wait(lock, [this] {
+            return queue.empty() && !busy && tree->epochs.num_retired() == 0;
+        });
+    }
+
+    /* collect the pages of the subtree of the given height (0 if unknown)
+     * below node (read from pid if null), and count its pairs if count_pairs
+     * is set. leaves that are not in memory are only read to count their
+     * pairs, the bottom inner level already holds their page IDs */
+    void collect_subtree_pages(NodeType* node, PageID pid, size_t height,
+                               bool count_pairs, std::vector<PageID>& pids,
+                               size_t& pairs)
+    {
+        if (!node && height == 1 && !count_pairs) {
+            if (pid != Page::INVALID_PAGE_ID) pids.push_back(pid);
+            return;
+        }
+
+        /* nodes read here stay private, the unlinked nodes are not changed */
+        std::unique_ptr<NodeType> loaded;
+        if (!node) {
+            if (pid == Page::INVALID_PAGE_ID) return;
+            loaded = tree->read_node(nullptr, pid);
+            if (!loaded) return;
+            node = loaded.get();
+        }
+
+        pids.push_back(node->get_pid());
+        if (node->is_leaf()) {
+            pairs += node->get_size();
+            return;
+        }
+
+        auto* inner = static_cast<InnerNodeType*>(node);
+        for (size_t i = 0; i <= inner->get_size(); i++) {
+            collect_subtree_pages(inner->child_cache[i].get(),
+                                  inner->child_pages[i],
+                                  height ? height - 1 : 0, count_pairs, pids,
+                                  pairs);
+        }
+    }
+
+private:
+    Tree* tree;
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::condition_variable idle_cv;
+    std::deque<Task> queue;
+    bool stopping;
+    bool busy;
+
+    /* the caller holds mutex */
+    void start()
+    {
+        if (thread.joinable()) return;
+        stopping = false;
+        thread = std::thread([this] { loop(); });
+    }
+
+    /* collect the pages (and count the pairs) of unlinked subtrees, reading
+     * the nodes that were never loaded, then free the nodes and recycle the
+     * pages once no reader can be inside them */
+    void reclaim(Task& task)
+    {
+        std::vector<PageID> pids;
+        size_t pairs = 0;
+        bool complete = true;
+
+        try {
+            for (auto&& subtree : task.subtrees) {
+                size_t height = subtree.height;
+                if (!height) {
+                    height = subtree_height(subtree.node.get(), subtree.pid);
+                }
+                collect_subtree_pages(subtree.node.get(), subtree.pid, height,
+                                      task.count_pairs, pids, pairs);
+            }
+        } catch (std::runtime_error&) {
+            /* I/O errors: the pages that could not be visited are leaked and
+             * the pair count stays marked for a recount */
+            complete = false;
+        }
+
+        if (task.count_pairs) {
+            tree->num_pairs -= pairs;
+            if (complete) tree->uncounted_tasks--;
+            tree->write_metadata();
+        }
+
+        auto holder =
+            std::make_shared<std::vector<Subtree>>(std::move(task.subtrees));
+        Tree* t = tree;
+        tree->epochs.retire([t, holder, pids] {
+            holder->clear();
+
+            /* commit() moves pages between the lists under the commit latch */
+            auto latch = t->writer_latch();
+            std::lock_guard<std::mutex> guard(t->alloc_mutex);
+            for (auto pid : pids) {
+                if (t->shadow_paging && !t->fresh_pages.erase(pid)) {
+                    /* still referenced by the last committed tree */
+                    t->pending_free.push_back(pid);
+                } else {
+                    t->free_pages.push_back(pid);
+                }
+            }
+        });
+    }
+
+    /* the height of the subtree below node (read from pid if null), found
+     * along its leftmost path. reads at most one page per level */
+    size_t subtree_height(NodeType* node, PageID pid)
+    {
+        std::unique_ptr<NodeType> loaded;
+        size_t height = 1;
+        while (true) {
+            if (!node) {
+                if (pid == Page::INVALID_PAGE_ID) return 0;
+                loaded = tree->read_node(nullptr, pid);
+                if (!loaded) return 0;
+                node = loaded.get();
+            }
+            if (node->is_leaf()) return height;
+
+            auto* inner = static_cast<InnerNodeType*>(node);
+            pid = inner->child_pages[0];
+            node = inner->child_cache[0].get();
+            height++;
+        }
+    }
+
+    void loop()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while (true) {
+            if (!queue.empty()) {
+                auto task = std::move(queue.front());
+                queue.pop_front();
+                busy = true;
+                lock.unlock();
+                reclaim(task);
+                lock.lock();
+                busy = false;
+                continue;
+            }
+
+            if (tree->epochs.num_retired() > 0) {
+                lock.unlock();
+                tree->epochs.reclaim();
+                lock.lock();
+                if (tree->epochs.num_retired() > 0) {
+                    /* readers are still inside, try again shortly */
+                    cv.wait_for(lock, std::chrono::milliseconds(1));
+                }
+                continue;
+            }
+
+            idle_cv.notify_all();
+            if (stopping) break;
+            cv.wait(lock);
+        }
+    }
+};
+
+} // namespace bptree
+
+#endif
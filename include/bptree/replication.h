@@ -0,0 +1,218 @@
+#ifndef _BPTREE_REPLICATION_H_
+#define _BPTREE_REPLICATION_H_
+
+#include "page_cache.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace bptree {
+
+/* how far a follower got: the batches up to seq of the stream stream_id.
+ * a fresh follower has stream_id 0 */
+struct ReplicationPosition {
+    uint64_t stream_id = 0;
+    uint64_t seq = 0;
+};
+
+struct ReplicationOptions {
+    /* the batches kept for followers that fall behind. a follower that needs
+     * a batch that was dropped gets a full copy again */
+    size_t max_log_bytes = 64 << 20;
+    /* pages per message of a full copy */
+    size_t copy_batch_pages = 256;
+};
+
+/* page cache wrapper on the leader that turns the page writes into a stream
+ * of page deltas. the pages written between two sync() barriers form a batch
+ * that carries the latest content of each page, so a tree commit ends a
+ * batch. the batches are numbered and kept in a log in memory.
+ *
+ * each follower is served from its own thread over a pipe or a Unix socket.
+ * a follower whose position is still covered by the log is sent the batches
+ * after it (steady state). otherwise it first gets a full copy of the pages
+ * (catch-up), which does not stop the writers: the pages written during the
+ * copy are in the batches that follow it. the leader never waits for a
+ * follower. writing to a pipe whose reader is gone raises SIGPIPE, which the
+ * process must ignore */
+class ReplicationSource : public AbstractPageCache {
+public:
+    explicit ReplicationSource(AbstractPageCache* page_cache,
+                               const ReplicationOptions& options =
+                                   ReplicationOptions{});
+    /* disconnects the followers, the descriptors are closed */
+    ~ReplicationSource();
+
+    ReplicationSource(const ReplicationSource&) = delete;
+    ReplicationSource& operator=(const ReplicationSource&) = delete;
+
+    /* start sending to fd. the source owns fd from now on */
+    void add_follower(int fd,
+                      const ReplicationPosition& position = ReplicationPosition{});
+    /* the followers still connected. followers that are gone are joined and
+     * their descriptors closed here and in add_follower() */
+    size_t get_num_followers();
+
+    uint64_t get_stream_id() const { return stream_id; }
+    /* the number of the last batch */
+    uint64_t get_seq();
+
+    virtual Page* new_page(boost::upgrade_lock<Page>& lock)
+    {
+        return page_cache->new_page(lock);
+    }
+    virtual Page* fetch_page(PageID id, boost::upgrade_lock<Page>& lock)
+    {
+        return page_cache->fetch_page(id, lock);
+    }
+    virtual Page* fetch_page_for_overwrite(PageID id,
+                                           boost::upgrade_lock<Page>& lock)
+    {
+        return page_cache->fetch_page_for_overwrite(id, lock);
+    }
+    virtual PageID new_pages(size_t count)
+    {
+        return page_cache->new_pages(count);
+    }
+    virtual bool truncate(PageID num_pages);
+    virtual void read_ahead(const std::vector<PageID>& pids)
+    {
+        page_cache->read_ahead(pids);
+    }
+    virtual PageID next_in_stripe(PageID pid) const
+    {
+        return page_cache->next_in_stripe(pid);
+    }
+    virtual void invalidate(const std::vector<PageID>& pids = {})
+    {
+        page_cache->invalidate(pids);
+    }
+    virtual void discard(const std::vector<PageID>& pids)
+    {
+        page_cache->discard(pids);
+    }
+
+    virtual void pin_page(Page* page, boost::upgrade_lock<Page>& lock)
+    {
+        page_cache->pin_page(page, lock);
+    }
+    virtual void unpin_page(Page* page, bool dirty,
+                            boost::upgrade_lock<Page>& lock);
+
+    virtual void flush_page(Page* page, boost::upgrade_lock<Page>& lock)
+    {
+        page_cache->flush_page(page, lock);
+    }
+    virtual void flush_all_pages() { page_cache->flush_all_pages(); }
+    /* ends the current batch once the wrapped cache is synced */
+    virtual void sync();
+
+    virtual size_t size() const { return page_cache->size(); }
+    virtual size_t get_page_size() const { return page_cache->get_page_size(); }
+    virtual PageID get_num_pages() const
+    {
+        return page_cache->get_num_pages();
+    }
+
+private:
+    struct Follower {
+        int fd;
+        uint64_t next_seq; /* 0: needs a full copy */
+        std::thread thread;
+        std::atomic<bool> done;
+    };
+
+    AbstractPageCache* page_cache;
+    ReplicationOptions options;
+    uint64_t stream_id;
+
+    /* the batch being collected */
+    std::mutex pending_mutex;
+    std::map<PageID, std::string> pending_pages;
+    PageID pending_truncate;
+    /* changes since the source was created, tells whether a full copy raced
+     * with writers */
+    std::atomic<uint64_t> num_changes;
+
+    /* encoded batches, log.front() has number log_first_seq */
+    std::mutex log_mutex;
+    std::condition_variable log_cv;
+    std::deque<std::shared_ptr<const std::string>> log;
+    uint64_t log_first_seq;
+    size_t log_bytes;
+    bool stopping;
+
+    std::vector<std::unique_ptr<Follower>> followers;
+
+    void follower_loop(Follower* follower);
+    /* join and close the followers that are gone. the caller holds
+     * log_mutex */
+    void reap_followers();
+    /* send all pages and return the number of the last batch they cover */
+    uint64_t send_full_copy(int fd);
+};
+
+/* applies a replication stream to the follower's page cache. the batches
+ * that have arrived are applied together and made durable with one sync()
+ * of the cache, so a follower that is behind catches up in large batches.
+ * the pages of a batch are written in page ID order, a write-back cache lets
+ * it merge them into large writes. the follower's pages must have the same
+ * size as the leader's, with the same page checksum setting.
+ *
+ * a read-only tree on the follower's cache is refresh()ed after
+ * apply_available() to see the new commits. its readers validate their
+ * snapshots as on the leader's file (see BTree::validate_snapshot()) */
+class ReplicationSink {
+public:
+    /* fd is the stream from ReplicationSource::add_follower() and is closed
+     * by the sink. position is what the cache already holds */
+    ReplicationSink(AbstractPageCache* page_cache, int fd,
+                    const ReplicationPosition& position = ReplicationPosition{});
+    ~ReplicationSink();
+
+    ReplicationSink(const ReplicationSink&) = delete;
+    ReplicationSink& operator=(const ReplicationSink&) = delete;
+
+    /* wait for the next message, then apply it and every message that is
+     * already available, and sync. returns the number of messages applied,
+     * 0 at the end of the stream */
+    size_t apply_available();
+    /* apply until the end of the stream */
+    void run();
+
+    /* the durable position, to be given to the leader on reconnect */
+    ReplicationPosition get_position() const { return position; }
+    /* false from the start of a full copy that raced with writers until the
+     * batches with the writes made during the copy are applied, the pages
+     * may not form a consistent tree then */
+    bool is_consistent() const { return consistent; }
+
+private:
+    static const size_t MAX_MESSAGES_PER_SYNC = 64;
+
+    AbstractPageCache* page_cache;
+    int fd;
+    ReplicationPosition position;
+    ReplicationPosition applied;
+    bool consistent;
+    /* the batch that makes the pages of a racing full copy consistent */
+    uint64_t consistent_seq;
+    std::vector<uint8_t> buf;
+
+    /* returns false at the end of the stream */
+    bool apply_message();
+    bool read_fully(void* dst, size_t len);
+    void write_page(PageID pid, const uint8_t* data, size_t len);
+};
+
+} // namespace bptree
+
+#endif
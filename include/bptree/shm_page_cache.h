@@ -0,0 +1,166 @@
+#ifndef _BPTREE_SHM_PAGE_CACHE_H_
+#define _BPTREE_SHM_PAGE_CACHE_H_
+
+#include "heap_file.h"
+#include "page_cache.h"
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace bptree {
+
+/* page cache whose frames live in a POSIX shared memory segment, so that one
+ * writer process and any number of reader processes on a host share a single
+ * buffer pool over the heap file of a tree. the file is the storage: pages
+ * are loaded into free frames when they are first fetched and clean frames
+ * are evicted (clock) when the pool is full, by any process. the tree is not
+ * limited by the number of frames and survives the segment.
+ *
+ * readers fetch pages without copying them: their pages point into the
+ * shared frames, which stay pinned until unpinned. the writer works on
+ * private copies of the pages it has pinned and publishes a dirty copy into
+ * a new frame when it unpins or flushes it. the new frame replaces the old
+ * one, which is freed once no reader has it pinned, so a frame never changes
+ * while it is mapped and readers never block the writer. only the writer
+ * writes dirty frames to the file, when it evicts them or in
+ * flush_all_pages().
+ *
+ * the segment has a slot for each attached process (the writer has slot 0)
+ * holding its pid. the pins and the loads of a process that died are
+ * released by the next process that runs out of frames or attaches. readers
+ * throw IOException once the writer is gone, since a new writer creates a
+ * new segment.
+ *
+ * readers should open trees that the writer created with shadow paging and
+ * use BTree::validate_snapshot() and refresh() as with any read-only tree.
+ * a reader's tree parses the nodes it visits into private copies, set
+ * BTreeOptions::max_cached_nodes to bound them */
+class ShmPageCache : public AbstractPageCache {
+public:
+    /* the writer opens the heap file, creating it if create is set, and
+     * creates the segment with num_frames frames, replacing an existing
+     * segment of the same name. processes still attached to the old one keep
+     * it */
+    ShmPageCache(const std::string& name, std::string_view filename,
+                 bool create, size_t num_frames = 4096,
+                 size_t page_size = 4096);
+    /* READ_WRITE: the writer opens an existing heap file and creates the
+     * segment. READ_ONLY: a reader attaches to the segment of a writer and
+     * opens its heap file read-only. the geometry comes from the file and
+     * the segment */
+    ShmPageCache(const std::string& name, std::string_view filename,
+                 OpenMode mode, size_t num_frames = 4096);
+    ~ShmPageCache();
+
+    ShmPageCache(const ShmPageCache&) = delete;
+    ShmPageCache& operator=(const ShmPageCache&) = delete;
+
+    /* remove the segment name. attached processes keep their mapping */
+    static void remove(const std::string& name);
+
+    virtual Page* new_page(boost::upgrade_lock<Page>& lock);
+    virtual Page* fetch_page(PageID id, boost::upgrade_lock<Page>& lock);
+    virtual PageID new_pages(size_t count);
+
+    virtual void read_ahead(const std::vector<PageID>& pids);
+    virtual PageID next_in_stripe(PageID pid) const
+    {
+        return heap_file->next_in_stripe(pid);
+    }
+
+    /* readers: frames are never stale, only checks that the writer is still
+     * there */
+    virtual void invalidate(const std::vector<PageID>& pids = {});
+    /* writer: unmap the frames of the given pages without writing them */
+    virtual void discard(const std::vector<PageID>& pids);
+
+    virtual void pin_page(Page* page, boost::upgrade_lock<Page>& lock);
+    virtual void unpin_page(Page* page, bool dirty,
+                            boost::upgrade_lock<Page>& lock);
+
+    virtual void flush_page(Page* page, boost::upgrade_lock<Page>& lock);
+    /* writer: write every dirty frame to the file */
+    virtual void flush_all_pages();
+    virtual void sync();
+
+    /* writer: flush all pages and sync. both: detach from the segment */
+    void close();
+
+    /* frames holding a page */
+    virtual size_t size() const;
+    virtual size_t get_page_size() const { return page_size; }
+    virtual PageID get_num_pages() const
+    {
+        return heap_file->get_num_pages();
+    }
+
+    bool is_writer() const { return writer; }
+    size_t get_num_frames() const { return num_frames; }
+
+private:
+    struct Header;
+    struct Frame;
+    class SegmentLock;
+
+    static const size_t NO_FRAME = (size_t)-1;
+
+    /* the pages this process has pinned: private copies in the writer,
+     * pages over their frames in readers */
+    struct LocalPage {
+        std::unique_ptr<Page> page;
+        size_t pin_count;
+        size_t frame;
+    };
+
+    std::string name;
+    bool writer;
+    bool closed;
+    size_t page_size;
+    size_t num_frames;
+    std::unique_ptr<HeapFile> heap_file;
+
+    uint8_t* segment;
+    size_t segment_size;
+    Header* header;
+    Frame* frames;
+    uint32_t* table;
+    uint8_t* data;
+    size_t slot;
+
+    std::mutex mutex; /* guards local_pages, taken before the segment lock */
+    std::unordered_map<PageID, LocalPage> local_pages;
+    /* writer: orders the writes of dirty frames to the file */
+    std::mutex write_mutex;
+
+    void attach(bool create, size_t num_frames);
+
+    uint8_t* frame_data(size_t frame) const
+    {
+        return data + frame * page_size;
+    }
+
+    /* page table, guarded by the segment lock */
+    size_t lookup(PageID pid) const;
+    void map_frame(size_t frame);
+    void unmap_frame(size_t frame);
+    void release_frame(size_t frame);
+
+    size_t grab_frame(PageID pid, SegmentLock& lock);
+    void unpin_frame(size_t frame);
+    void write_frames(const size_t* frame_list, size_t count);
+    void reap();
+    void check_writer() const;
+
+    Page* pin_shared(PageID id);
+    Page* add_local(PageID id, size_t frame);
+    Page* pin_private(PageID id, bool fresh);
+    void publish(Page* page, boost::upgrade_lock<Page>& lock);
+};
+
+} // namespace bptree
+
+#endif
@@ -0,0 +1,243 @@
+#ifndef _BPTREE_SNAPSHOT_H_
+#define _BPTREE_SNAPSHOT_H_
+
+#include "page.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace bptree {
+
+/* shared by a snapshot and its iterators. the pages of a commit are never
+ * written again in shadow paging mode, so the inner nodes read by the
+ * snapshot are kept for its lifetime. the epoch is registered with the tree
+ * for as long as the state lives, so that commits hold back its pages */
+template <typename Tree> struct SnapshotState {
+    using NodeType = typename Tree::NodeType;
+
+    Tree* tree;
+    uint64_t epoch;
+    PageID root_pid;
+    size_t num_pairs;
+    std::mutex mutex;
+    std::unordered_map<PageID, std::shared_ptr<NodeType>> inner_nodes;
+
+    SnapshotState(Tree* tree, uint64_t epoch, PageID root_pid,
+                  size_t num_pairs)
+        : tree(tree), epoch(epoch), root_pid(root_pid), num_pairs(num_pairs)
+    {
+        std::lock_guard<std::mutex> guard(tree->snapshot_mutex);
+        tree->snapshot_epochs.insert(epoch);
+    }
+
+    ~SnapshotState()
+    {
+        std::lock_guard<std::mutex> guard(tree->snapshot_mutex);
+        tree->snapshot_epochs.erase(tree->snapshot_epochs.find(epoch));
+    }
+
+    std::shared_ptr<NodeType> load(PageID pid)
+    {
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            auto it = inner_nodes.find(pid);
+            if (it != inner_nodes.end()) return it->second;
+        }
+
+        std::shared_ptr<NodeType> node = tree->read_node(nullptr, pid);
+        if (!node) throw std::runtime_error("bad snapshot page");
+
+        if (!node->is_leaf()) {
+            std::lock_guard<std::mutex> guard(mutex);
+            inner_nodes.emplace(pid, node);
+        }
+        return node;
+    }
+};
+
+/* a point-in-time view of the tree as of the last commit, see
+ * BTree::snapshot(). it reads the pages of that commit and not the nodes in
+ * memory, so concurrent writers neither block it nor make it restart. the
+ * pages the later commits replace are only reused by the first commit after
+ * every snapshot that sees them is gone. needs shadow paging, and the tree
+ * must outlive its snapshots and their iterators */
+template <typename Tree> class TreeSnapshot {
+    friend Tree;
+
+    using K = typename Tree::KeyType;
+    using V = typename Tree::ValueType;
+    using KeyComparator = typename Tree::KeyComparatorType;
+    using KeyEq = typename Tree::KeyEqType;
+    using NodeType = typename Tree::NodeType;
+    using InnerNodeType = typename Tree::InnerNodeType;
+    using LeafNodeType = typename Tree::LeafNodeType;
+    using State = SnapshotState<Tree>;
+
+public:
+    class iterator {
+        friend class TreeSnapshot;
+
+    public:
+        using self_type = iterator;
+        using value_type = std::pair<K, V>;
+        using reference = value_type&;
+        using pointer = value_type*;
+        using iterator_category = std::forward_iterator_tag;
+        using difference_type = int;
+
+        self_type operator++()
+        {
+            self_type i = *this;
+            inc();
+            return i;
+        }
+        self_type operator++(int _unused)
+        {
+            inc();
+            return *this;
+        }
+        reference operator*() { return kvp; }
+        pointer operator->() { return &kvp; }
+        bool operator==(const self_type& rhs) const
+        {
+            return ended && rhs.ended;
+        }
+        bool operator!=(const self_type& rhs) const { return !(*this == rhs); }
+        bool is_end() const { return ended; }
+
+    private:
+        std::shared_ptr<State> state;
+        /* the inner nodes from the root down and the child taken in each */
+        std::vector<std::pair<std::shared_ptr<NodeType>, size_t>> path;
+        std::shared_ptr<NodeType> leaf;
+        size_t idx;
+        value_type kvp;
+        bool ended;
+        KeyComparator kcmp;
+
+        iterator() : idx(0), ended(true) {}
+
+        iterator(std::shared_ptr<State> state, const K* key)
+            : state(std::move(state)), idx(0), ended(false)
+        {
+            descend(this->state->root_pid, key);
+
+            auto* l = static_cast<LeafNodeType*>(leaf.get());
+            if (key) {
+                idx = std::lower_bound(l->keys.begin(),
+                                       l->keys.begin() + l->get_size(), *key,
+                                       kcmp) -
+                      l->keys.begin();
+            }
+            if (idx == l->get_size()) next_leaf();
+            if (!ended) load_pair();
+        }
+
+        /* follow the separators for key, or the leftmost children if key is
+         * null */
+        void descend(PageID pid, const K* key)
+        {
+            while (true) {
+                auto node = state->load(pid);
+                if (node->is_leaf()) {
+                    leaf = std::move(node);
+                    idx = 0;
+                    return;
+                }
+
+                auto* inner = static_cast<InnerNodeType*>(node.get());
+                size_t child_idx =
+                    key ? std::upper_bound(inner->keys.begin(),
+                                           inner->keys.begin() +
+                                               inner->get_size(),
+                                           *key, kcmp) -
+                              inner->keys.begin()
+                        : 0;
+                pid = inner->child_pages[child_idx];
+                path.emplace_back(std::move(node), child_idx);
+            }
+        }
+
+        void next_leaf()
+        {
+            /* leaves emptied by erases are skipped */
+            do {
+                while (!path.empty() &&
+                       path.back().second >= path.back().first->get_size()) {
+                    path.pop_back();
+                }
+                if (path.empty()) {
+                    ended = true;
+                    leaf.reset();
+                    return;
+                }
+
+                auto* inner =
+                    static_cast<InnerNodeType*>(path.back().first.get());
+                descend(inner->child_pages[++path.back().second], nullptr);
+            } while (leaf->get_size() == 0);
+        }
+
+        void load_pair()
+        {
+            auto* l = static_cast<LeafNodeType*>(leaf.get());
+            kvp = std::make_pair(l->keys[idx], l->values[idx]);
+        }
+
+        void inc()
+        {
+            if (ended) return;
+            if (++idx == leaf->get_size()) next_leaf();
+            if (!ended) load_pair();
+        }
+    };
+
+    uint64_t get_epoch() const { return state->epoch; }
+    size_t size() const { return state->num_pairs; }
+
+    void get_value(const K& key, std::vector<V>& value_list) const
+    {
+        KeyComparator kcmp;
+        KeyEq keq;
+
+        auto node = state->load(state->root_pid);
+        while (!node->is_leaf()) {
+            auto* inner = static_cast<InnerNodeType*>(node.get());
+            size_t child_idx =
+                std::upper_bound(inner->keys.begin(),
+                                 inner->keys.begin() + inner->get_size(), key,
+                                 kcmp) -
+                inner->keys.begin();
+            node = state->load(inner->child_pages[child_idx]);
+        }
+
+        auto* leaf = static_cast<LeafNodeType*>(node.get());
+        auto end = leaf->keys.begin() + leaf->get_size();
+        auto lower = std::lower_bound(leaf->keys.begin(), end, key, kcmp);
+        for (auto it = lower; it != end && keq(key, *it); it++) {
+            value_list.push_back(leaf->values[it - leaf->keys.begin()]);
+        }
+    }
+
+    iterator begin() const { return iterator(state, nullptr); }
+    iterator begin(const K& key) const { return iterator(state, &key); }
+    iterator end() const { return iterator(); }
+
+private:
+    std::shared_ptr<State> state;
+
+    explicit TreeSnapshot(std::shared_ptr<State> state)
+        : state(std::move(state))
+    {}
+};
+
+} // namespace bptree
+
+#endif
@@ -1,42 +1,347 @@
 #ifndef _BPTREE_TREE_H_
 #define _BPTREE_TREE_H_
 
+#include "bulk_builder.h"
+#include "catalog.h"
+#include "defragmenter.h"
+#include "epoch.h"
+#include "executor.h"
+#include "heap_file.h"
 #include "page_cache.h"
+#include "reclaimer.h"
+#include "snapshot.h"
 #include "tree_node.h"
+#include "write_batch.h"
 
+#include <algorithm>
 #include <cassert>
+#include <condition_variable>
+#include <deque>
+#include <exception>
 #include <iostream>
+#include <limits>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <stdexcept>
+#include <type_traits>
+#include <unordered_set>
+#include <utility>
 
 namespace bptree {
 
+struct BTreeOptions {
+    /* copy-on-write commits: modified nodes are written to fresh pages by
+     * commit() and become visible by flipping between two alternating meta
+     * pages. a commit is only crash-safe if the page cache makes sync() a
+     * real barrier, as HeapPageCache does in every durability mode. only
+     * takes effect when the tree is created */
+    bool shadow_paging = false;
+    /* when an existing tree is opened, load all inner nodes before the
+     * constructor returns so that the first lookups do not fault them in one
+     * by one. the inner levels are read breadth-first, each level split into
+     * up to preload_threads tasks */
+    bool preload_inner = false;
+    size_t preload_threads = 4;
+    /* store child pointers of inner nodes as 32-bit page IDs, which fits more
+     * children in a page but limits the tree to the first 2^32 pages of the
+     * file. only takes effect when the tree is created */
+    bool compact_child_pages = false;
+    /* parallel operations run on this executor, the shared default one if
+     * null */
+    Executor* executor = nullptr;
+    /* open an existing tree without ever writing to it, e.g. in a reader
+     * process next to the process that writes the heap file. the constructor
+     * throws if there is no tree. operations that modify a read-only tree
+     * throw std::runtime_error, see refresh() and validate_snapshot() */
+    bool read_only = false;
+    /* shadow paging: the pages a commit stops using are only reused after
+     * this many further commits, so that readers in other processes can
+     * finish with an older snapshot. only takes effect when the tree is
+     * created */
+    uint32_t free_page_delay = 0;
+    /* read-only trees: once more than this many nodes have been read from
+     * the page cache, drop all loaded nodes below the root so that they are
+     * read again when needed. bounds the private copies of a reader over a
+     * shared cache (ShmPageCache). 0 keeps every node */
+    size_t max_cached_nodes = 0;
+};
+
 template <unsigned int N, typename K, typename V,
           typename KeySerializer = CopySerializer<K>,
           typename KeyComparator = std::less<K>,
           typename KeyEq = std::equal_to<K>,
           typename ValueSerializer = CopySerializer<V>>
 class BTree {
+    using NodeType = BaseNode<K, V, KeyComparator, KeyEq>;
+    using InnerNodeType = InnerNode<N, K, V, KeySerializer, KeyComparator,
+                                    KeyEq, ValueSerializer>;
+    using LeafNodeType = LeafNode<N, K, V, KeySerializer, KeyComparator, KeyEq,
+                                  ValueSerializer>;
+    using DetachedSubtree = bptree::DetachedSubtree<NodeType>;
+    using ReclaimTask = bptree::ReclaimTask<NodeType>;
+
+    /* for the helper classes below */
+    using KeyType = K;
+    using ValueType = V;
+    using KeyComparatorType = KeyComparator;
+    using KeyEqType = KeyEq;
+    static constexpr unsigned int FANOUT = N;
+
+    friend class BulkBuilder<BTree>;
+    friend class Defragmenter<BTree>;
+    friend class Reclaimer<BTree>;
+    friend struct SnapshotState<BTree>;
+    friend class TreeSnapshot<BTree>;
+
 public:
-    BTree(AbstractPageCache* page_cache) : page_cache(page_cache)
+    using Snapshot = TreeSnapshot<BTree>;
+
+    BTree(AbstractPageCache* page_cache,
+          const BTreeOptions& options = BTreeOptions{})
+        : BTree(page_cache, nullptr, std::string(), options)
+    {}
+
+    /* open or create the tree registered as `name` in the catalog of a shared
+     * heap file */
+    BTree(AbstractPageCache* page_cache, Catalog* catalog,
+          const std::string& name,
+          const BTreeOptions& options = BTreeOptions{})
+        : page_cache(page_cache), batch_version(0),
+          shadow_paging(options.shadow_paging),
+          compact_child_pages(options.compact_child_pages),
+          read_only(options.read_only),
+          free_page_delay(options.free_page_delay),
+          max_cached_nodes(options.max_cached_nodes), num_loaded_nodes(0),
+          closed(false),
+          executor(options.executor ? options.executor
+                                    : &Executor::get_default()),
+          defragmenter(std::make_unique<Defragmenter<BTree>>(this)),
+          meta_epoch(0), committed_root_pid(Page::INVALID_PAGE_ID),
+          committed_pairs(0), meta_page_size(0),
+          meta_free_list_current(false),
+          reclaimer(std::make_unique<Reclaimer<BTree>>(this)),
+          uncounted_tasks(0),
+          rebuild_state(REBUILD_IDLE)
     {
-        bool create = !read_metadata();
+        bool create;
 
-        if (create) {
-            {
-                boost::upgrade_lock<Page> lock;
-                auto page = page_cache->new_page(lock);
-                assert(page->get_id() == META_PAGE_ID);
+        if (catalog) {
+            create = !catalog->find(name, meta_pids);
+            if (create && read_only) {
+                throw std::runtime_error("tree not found");
+            }
+
+            if (create) {
+                for (auto&& pid : meta_pids) {
+                    boost::upgrade_lock<Page> lock;
+                    auto page = page_cache->new_page(lock);
+                    pid = page->get_id();
+                    page_cache->unpin_page(page, false, lock);
+                }
+            } else if (!read_metadata()) {
+                throw std::runtime_error("bad tree metadata");
+            }
+        } else {
+            meta_pids = {META_PAGE_ID, META_PAGE_ID + 1};
+            create = !read_metadata();
+            if (create && read_only) {
+                throw std::runtime_error("tree not found");
+            }
+
+            if (create) {
+                size_t num_slots = shadow_paging ? 2 : 1;
+                for (size_t i = 0; i < num_slots; i++) {
+                    boost::upgrade_lock<Page> lock;
+                    auto page = page_cache->new_page(lock);
+                    assert(page->get_id() == meta_pids[i]);
+                    page_cache->unpin_page(page, false, lock);
+                }
             }
+        }
+
+        meta_page_size = read_meta_page_size();
+        check_node_size();
 
+        if (create) {
             root = create_node<LeafNode<N, K, V, KeySerializer, KeyComparator,
                                         KeyEq, ValueSerializer>>(nullptr);
             num_pairs.store(0);
-            write_metadata();
+            write_node(root.get());
+
+            if (shadow_paging) {
+                commit();
+            } else {
+                write_metadata();
+            }
+
+            /* the tree is only registered once its metadata is in place */
+            if (catalog && !catalog->add(name, meta_pids)) {
+                throw std::runtime_error("tree name already exists");
+            }
+        } else if (options.preload_inner) {
+            preload_inner_nodes(options.preload_threads);
         }
     }
 
-    ~BTree() { write_metadata(); }
+    ~BTree() { close(); }
+
+    /* persist the tree for the next open. a fast close of a shadow paging tree
+     * skips the final commit: recovery only needs the last commit, so the
+     * changes made since then are dropped, and the pages written for them
+     * are discarded from the cache instead of being written out. close the
+     * tree before closing its page cache */
+    void close(bool fast = false)
+    {
+        if (closed) return;
+        closed = true;
+        stop_defragmenter();
+        reclaimer->stop();
+
+        if (read_only) {
+            return;
+        } else if (shadow_paging) {
+            if (fast) {
+                discard_fresh_pages();
+            } else {
+                commit();
+            }
+        } else {
+            write_metadata(true);
+        }
+    }
 
     size_t size() const { return num_pairs.load(); }
+    bool is_shadow_paging() const { return shadow_paging; }
+    bool is_read_only() const { return read_only; }
+    /* the number of commits of a shadow paging tree. a read-only tree shows
+     * the state of this commit */
+    uint64_t get_epoch() const { return meta_epoch; }
+
+    /* read-only trees: move to the last commit in the heap file. all loaded
+     * nodes are dropped, must not run concurrently with other operations on
+     * the tree */
+    void refresh()
+    {
+        if (!read_only) {
+            throw std::runtime_error("only read-only trees can be refreshed");
+        }
+
+        page_cache->invalidate();
+        num_loaded_nodes.store(0);
+        if (!read_metadata()) {
+            throw std::runtime_error("tree not found");
+        }
+    }
+
+    /* read-only trees: whether everything read since the last refresh came
+     * from an intact snapshot. the writer reuses the pages of a commit only
+     * free_page_delay commits after the next one, so the snapshot is intact
+     * while the writer has not committed more often than that. call it after
+     * reading and refresh and retry if it fails. a tree without shadow paging
+     * is changed in place and is only safe to read while nobody writes it */
+    bool validate_snapshot()
+    {
+        if (!shadow_paging) return true;
+
+        page_cache->invalidate({meta_pids[0], meta_pids[1]});
+
+        MetaHeader header;
+        std::vector<PageID> free_list;
+        bool valid;
+        try {
+            if (!read_meta_header(header, free_list, valid) || !valid) {
+                return false;
+            }
+        } catch (std::runtime_error&) {
+            /* e.g. the writer is rewriting the meta page */
+            return false;
+        }
+
+        return header.epoch <= meta_epoch + free_page_delay;
+    }
+    bool has_compact_child_pages() const { return compact_child_pages; }
+
+    /* load every inner node that is not in memory yet, one level at a time.
+     * the pages of a level are handed to the page cache's read_ahead() in one
+     * batch before they are parsed. must not run concurrently with other
+     * operations on the tree. returns the number of nodes loaded */
+    size_t preload_inner_nodes(size_t num_threads = 4)
+    {
+        /* all leaves are at the same depth, find it along the leftmost path */
+        size_t height = 0;
+        for (NodeType* node = root.get(); node && !node->is_leaf(); height++) {
+            auto* inner = static_cast<InnerNodeType*>(node);
+            if (!inner->child_cache[0]) {
+                inner->child_cache[0] = read_node(inner, inner->child_pages[0]);
+            }
+            node = inner->child_cache[0].get();
+        }
+
+        std::vector<InnerNodeType*> level;
+        if (height > 1) {
+            level.push_back(static_cast<InnerNodeType*>(root.get()));
+        }
+
+        /* the level below `level` is an inner level while depth + 1 < height */
+        size_t loaded = 0;
+        for (size_t depth = 0; depth + 1 < height && !level.empty(); depth++) {
+            std::vector<std::pair<PageID, std::unique_ptr<NodeType>*>> slots;
+            std::vector<InnerNodeType*> parents;
+            for (auto* inner : level) {
+                for (size_t i = 0; i <= inner->get_size(); i++) {
+                    if (!inner->child_cache[i] &&
+                        inner->child_pages[i] != Page::INVALID_PAGE_ID) {
+                        slots.emplace_back(inner->child_pages[i],
+                                           &inner->child_cache[i]);
+                        parents.push_back(inner);
+                    }
+                }
+            }
+
+            /* read in page ID order, each thread takes a contiguous range */
+            std::vector<size_t> order(slots.size());
+            for (size_t i = 0; i < order.size(); i++) order[i] = i;
+            std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+                return slots[a].first < slots[b].first;
+            });
+
+            /* submit the whole level at once so that the storage sees large
+             * sequential requests instead of one page per read_node() */
+            std::vector<PageID> pids;
+            pids.reserve(order.size());
+            for (auto k : order) pids.push_back(slots[k].first);
+            page_cache->read_ahead(pids);
+
+            size_t threads =
+                std::max<size_t>(1, std::min(num_threads, slots.size() / 16));
+            auto load_range = [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; i++) {
+                    size_t k = order[i];
+                    *slots[k].second = read_node(parents[k], slots[k].first);
+                }
+            };
+
+            executor->parallel_for(threads, [&](size_t t) {
+                load_range(order.size() * t / threads,
+                           order.size() * (t + 1) / threads);
+            });
+            loaded += slots.size();
+
+            std::vector<InnerNodeType*> next_level;
+            for (auto* inner : level) {
+                for (size_t i = 0; i <= inner->get_size(); i++) {
+                    auto* child = inner->child_cache[i].get();
+                    if (child && !child->is_leaf()) {
+                        next_level.push_back(static_cast<InnerNodeType*>(child));
+                    }
+                }
+            }
+            level.swap(next_level);
+        }
+
+        return loaded;
+    }
 
     template <
         typename T,
@@ -44,6 +349,20 @@ public:
             BaseNode<K, V, KeyComparator, KeyEq>, T>::value>::type* = nullptr>
     std::unique_ptr<T> create_node(BaseNode<K, V, KeyComparator, KeyEq>* parent)
     {
+        if (shadow_paging) {
+            return std::make_unique<T>(this, parent, alloc_shadow_page());
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(alloc_mutex);
+            if (!free_pages.empty()) {
+                PageID pid = free_pages.back();
+                free_pages.pop_back();
+                meta_free_list_current = false;
+                return std::make_unique<T>(this, parent, pid);
+            }
+        }
+
         boost::upgrade_lock<Page> lock;
         auto page = page_cache->new_page(lock);
         auto node = std::make_unique<T>(this, parent, page->get_id());
@@ -52,15 +371,49 @@ public:
         return node;
     }
 
+    /* rewrite the leaves in key order into extents of fresh pages so that
+     * scans read the file sequentially again. leaves that already follow
+     * their left neighbour are left alone. runs next to other operations,
+     * each leaf is moved with it and its parent write-locked. the old pages
+     * are recycled for new nodes (after the next commit in shadow paging
+     * mode). returns the number of leaves moved */
+    size_t defragment(const DefragOptions& options = DefragOptions{})
+    {
+        check_writable();
+        return defragmenter->run(options, nullptr);
+    }
+
+    /* run defragment() in a background thread */
+    void start_defragmenter(const DefragOptions& options = DefragOptions{})
+    {
+        check_writable();
+        defragmenter->start(options);
+    }
+
+    void stop_defragmenter() { defragmenter->stop(); }
+
+    /* leaves moved by background defragmentation */
+    size_t get_defrag_moved() const { return defragmenter->get_moved(); }
+
+    /* the fraction of leaves that are not stored right after their left
+     * neighbour in the same file */
+    double fragmentation() { return defragmenter->fragmentation(); }
+
     void get_value(const K& key, std::vector<V>& value_list)
     {
+        trim_loaded_nodes();
+        auto epoch = epochs.enter();
+
         while (true) {
             try {
+                uint64_t bv = read_batch_version();
+
                 value_list.clear();
                 auto* root_node = root.get();
                 root_node->get_values(key, false, nullptr, nullptr, value_list,
                                       0);
                 if (root_node != root.get()) continue;
+                if (batch_version.load() != bv) continue;
                 break;
             } catch (OLCRestart&) {
                 continue;
@@ -71,14 +424,20 @@ public:
     void collect_values(const K& key, std::optional<K>* next_key,
                         std::vector<K>& key_list, std::vector<V>& value_list)
     {
+        trim_loaded_nodes();
+        auto epoch = epochs.enter();
+
         while (true) {
             try {
+                uint64_t bv = read_batch_version();
+
                 key_list.clear();
                 value_list.clear();
                 auto* root_node = root.get();
                 root_node->get_values(key, true, next_key, &key_list,
                                       value_list, 0);
                 if (root_node != root.get()) continue;
+                if (batch_version.load() != bv) continue;
                 break;
             } catch (OLCRestart&) {
                 continue;
@@ -88,47 +447,443 @@ public:
 
     void insert(const K& key, const V& value)
     {
-        while (true) {
-            try {
-                K split_key;
-                auto old_root = root.get();
-                if (!old_root)
-                    continue; /* old_root may be nullptr when another thread is
-                                 updating the root node pointer */
+        check_writable();
+        CaptureLatch capture;
+        auto epoch = enter_writer(capture, false);
+        auto latch = writer_latch();
+        insert_pair(key, value);
+        num_pairs++;
+        write_metadata();
 
-                auto root_sibling = old_root->insert(key, value, split_key, 0);
+        if (capture) capture_op(WriteOp{OpType::PUT, key, value});
+    }
 
-                if (root_sibling) {
-                    auto new_root =
-                        create_node<InnerNode<N, K, V, KeySerializer,
-                                              KeyComparator, KeyEq>>(nullptr);
+    /* remove all pairs with the given key. returns the number of pairs
+     * removed */
+    size_t erase(const K& key)
+    {
+        check_writable();
+        CaptureLatch capture;
+        auto epoch = enter_writer(capture, true);
+        auto latch = writer_latch();
+        size_t count = erase_pairs(key, root);
 
-                    root->set_parent(new_root.get());
-                    root_sibling->set_parent(new_root.get());
+        if (count > 0) {
+            num_pairs -= count;
+            write_metadata();
+        }
 
-                    new_root->set_size(1);
-                    new_root->keys[0] = split_key;
-                    new_root->child_pages[0] = root->get_pid();
-                    new_root->child_pages[1] = root_sibling->get_pid();
-                    new_root->child_cache[0] = std::move(root);
-                    new_root->child_cache[1] = std::move(root_sibling);
+        if (capture) capture_op(WriteOp{OpType::ERASE, key, V{}});
+        return count;
+    }
 
-                    root = std::move(new_root);
-                    write_node(root.get());
-                    write_metadata();
+    /* remove all pairs with keys in [lo, hi). children of inner nodes that
+     * lie entirely in the range are unlinked in one step, only the leaves at
+     * the ends of the range are rewritten. the pages of the unlinked subtrees
+     * are collected and recycled in the background, size() catches up once
+     * they have been counted */
+    void erase_range(const K& lo, const K& hi)
+    {
+        check_writable();
+        if (!kcmp(lo, hi)) return;
 
-                    /* release the lock on the old root */
-                    old_root->write_unlock();
-                    continue;
-                }
+        std::lock_guard<std::mutex> guard(structure_mutex);
+        auto latch = structure_latch();
+        auto epoch = epochs.enter();
 
-                num_pairs++;
-                write_metadata();
+        std::vector<DetachedSubtree> detached;
+        size_t erased = 0;
+        while (true) {
+            try {
+                auto* node = root.get();
+                if (!node) continue;
+
+                /* work done before a restart stays done */
+                erase_subrange(node, true, std::nullopt, std::nullopt, lo, hi,
+                               detached, erased);
                 break;
             } catch (OLCRestart&) {
                 continue;
             }
         }
+
+        num_pairs -= erased;
+        if (!detached.empty()) uncounted_tasks++;
+        write_metadata();
+
+        if (!detached.empty()) {
+            reclaimer->push(ReclaimTask{std::move(detached), true});
+        }
+    }
+
+    /* remove all pairs by replacing the root with an empty leaf. a tree that
+     * has the heap file to itself and no shadow paging gives its pages back
+     * by truncating the file if the page cache supports it, so they are not
+     * visited at all. otherwise the old pages are collected and recycled in
+     * the background. stops background defragmentation and must not run
+     * concurrently with defragment() */
+    void clear()
+    {
+        check_writable();
+        stop_defragmenter();
+
+        std::lock_guard<std::mutex> guard(structure_mutex);
+        bool can_truncate = !shadow_paging && meta_pids[0] == META_PAGE_ID;
+        if (can_truncate) {
+            /* recycling left over from erase_range() must not hand out page
+             * IDs past the truncation */
+            reclaimer->drain();
+        }
+
+        auto latch = structure_latch();
+        auto epoch = epochs.enter();
+
+        /* lock every loaded node so that no operation is left inside the old
+         * tree, then mark them all obsolete */
+        std::vector<NodeType*> locked;
+        while (true) {
+            auto* node = root.get();
+            if (node && lock_subtree(node, locked) && node == root.get()) {
+                break;
+            }
+            for (auto* n : locked) {
+                n->write_unlock();
+            }
+            locked.clear();
+        }
+        for (auto* n : locked) {
+            n->write_unlock_obsolete();
+        }
+
+        bool truncated =
+            can_truncate && page_cache->truncate(META_PAGE_ID + 1);
+        {
+            std::lock_guard<std::mutex> alloc_guard(alloc_mutex);
+            if (truncated) {
+                free_pages.clear();
+                free_chain.clear();
+                meta_free_list_current = false;
+            }
+            /* all nodes modified since the last commit belong to the old
+             * tree */
+            dirty_nodes.clear();
+        }
+
+        std::unique_ptr<NodeType> new_root = create_node<LeafNodeType>(nullptr);
+        write_node(new_root.get());
+        auto old_root = std::exchange(root, std::move(new_root));
+        num_pairs.store(0);
+        write_metadata();
+
+        std::vector<DetachedSubtree> detached;
+        detached.push_back(DetachedSubtree{old_root->get_pid(),
+                                           std::move(old_root), 0});
+
+        if (truncated) {
+            /* only the memory is left to free */
+            reclaimer->retire(std::move(detached));
+        } else {
+            reclaimer->push(ReclaimTask{std::move(detached), false});
+        }
+    }
+
+    /* apply all operations in the batch as one unit. operations are sorted by
+     * key, puts are applied leaf by leaf so that each affected leaf is written
+     * once, erases visit every leaf that holds the key, and the metadata is
+     * written once per batch. point lookups and single leaf reads never observe
+     * a partially applied batch, they wait for it on batch_mutex. iterators
+     * are not batch-atomic: an iterator reads one leaf at a time and can see
+     * a batch that was applied between two of its leaves, use a snapshot for
+     * a consistent scan.
+     *
+     * in shadow paging mode the batch ends with a commit(), so after a crash
+     * either all of it or none of it is in the heap file. without shadow
+     * paging batches are not crash-atomic: each leaf is written in place and
+     * a crash can leave part of the batch on disk */
+    void write(const WriteBatch<K, V>& batch)
+    {
+        check_writable();
+        if (batch.empty()) return;
+
+        apply_batch(batch);
+        if (shadow_paging) commit();
+    }
+
+    /* fold a run of pairs sorted by key into the tree. the run is walked
+     * against the leaf level: each affected leaf is rewritten once with all
+     * the pairs that fall into it, and a leaf that overflows is split into
+     * leaves filled to fill_factor. readers run concurrently and see the run
+     * appear leaf by leaf. returns the number of pairs merged. throws
+     * std::invalid_argument at the first pair that is smaller than the one
+     * before it, the pairs before it are merged */
+    template <typename It>
+    size_t merge(It first, It last, double fill_factor = 0.7)
+    {
+        check_writable();
+        size_t target = std::min<size_t>(
+            N - 1, std::max<size_t>(1, (size_t)(fill_factor * (N - 1))));
+        /* pairs are taken from the run in batches outside of any lock */
+        size_t batch = 64 * N;
+
+        CaptureLatch capture;
+        auto epoch = enter_writer(capture, false);
+        auto latch = writer_latch();
+        std::deque<std::pair<K, V>> pending;
+        std::vector<WriteOp> capture_ops;
+        std::optional<K> prev;
+        bool sorted = true;
+        size_t merged = 0;
+
+        while (true) {
+            while (sorted && pending.size() < batch && first != last) {
+                if (prev && kcmp(first->first, *prev)) {
+                    sorted = false;
+                    break;
+                }
+                prev = first->first;
+                pending.emplace_back(first->first, first->second);
+                if (capture) {
+                    capture_ops.push_back(
+                        WriteOp{OpType::PUT, first->first, first->second});
+                }
+                ++first;
+            }
+            if (pending.empty()) break;
+
+            if (!capture_ops.empty()) {
+                /* puts commute, they can be captured before they are
+                 * applied */
+                std::lock_guard<std::mutex> capture_guard(capture_mutex);
+                captured_ops.insert(captured_ops.end(), capture_ops.begin(),
+                                    capture_ops.end());
+                capture_ops.clear();
+            }
+
+            size_t count = merge_into_leaf(pending, target);
+            if (count == 0) {
+                /* no room next to the leaf, let the regular insert path
+                 * split the parent */
+                insert_pair(pending.front().first, pending.front().second);
+                pending.pop_front();
+                count = 1;
+            }
+
+            num_pairs += count;
+            merged += count;
+        }
+
+        write_metadata();
+        if (!sorted) {
+            throw std::invalid_argument("merge: run is not sorted");
+        }
+        return merged;
+    }
+
+    /* build the tree bottom-up from pairs sorted by key. the tree must be
+     * empty and nothing else may run on it meanwhile. nodes are written in
+     * key order to extents of fresh pages and only the rightmost node of
+     * each level is kept in memory, so the input can be much larger than
+     * memory. nodes are filled to fill_factor. returns the number of pairs
+     * loaded */
+    template <typename It>
+    size_t bulk_load(It first, It last, double fill_factor = 1.0)
+    {
+        return BulkBuilder<BTree>::load(this, first, last, fill_factor);
+    }
+
+    /* bulk_load() with the input split into num_threads key ranges (one per
+     * executor worker if 0) that are built in parallel. each range's leaves
+     * and their parents are written to extents of their own, the levels
+     * above are stitched together at the end */
+    template <typename RandomIt>
+    size_t parallel_bulk_load(RandomIt first, RandomIt last,
+                              size_t num_threads = 0, double fill_factor = 1.0)
+    {
+        return BulkBuilder<BTree>::parallel_load(this, first, last,
+                                                 num_threads, fill_factor);
+    }
+
+    /* call visitor(key, value) for the pairs with keys in [lo, hi) with
+     * num_threads-way parallelism (one per executor worker if 0). the range
+     * is split at separator keys of the upper inner levels into partitions
+     * that cover subtrees of about the same size. at most num_threads
+     * partitions run at a time as tasks on the executor. they are scanned
+     * leaf by leaf with the page cache reading ahead the leaves that follow.
+     * without ordered, visitor is called concurrently from the tasks. with
+     * ordered, the calling thread calls it in key order and at most
+     * num_threads partitions are scanned or buffered ahead of it. like the
+     * iterator, the scan is not atomic with respect to concurrent writes.
+     * returns the number of pairs visited */
+    template <typename F>
+    size_t parallel_scan(const K& lo, const K& hi, size_t num_threads,
+                         F&& visitor, bool ordered = false)
+    {
+        if (!kcmp(lo, hi)) return 0;
+        return scan_partitions(lo, hi, num_threads, visitor, ordered);
+    }
+
+    /* parallel_scan() over the whole tree */
+    template <typename F>
+    size_t parallel_scan(size_t num_threads, F&& visitor, bool ordered = false)
+    {
+        return scan_partitions(std::nullopt, std::nullopt, num_threads,
+                               visitor, ordered);
+    }
+
+    /* replace the contents of the tree with pairs sorted by key while the
+     * tree keeps serving reads and writes. the new tree is built bottom-up
+     * next to the old one as in bulk_load(). writes made meanwhile go to the
+     * old tree and are also captured, then replayed on the new tree before
+     * its root is swapped in. capturing starts before the input is read, so
+     * every write made after rebuild() was called ends up on top of the
+     * input. writers are only held off while the last captured writes are
+     * replayed. the old tree is reclaimed in the background. stops background
+     * defragmentation and must not run concurrently with defragment(), bulk
+     * loads or another rebuild(). returns the number of pairs in the new
+     * tree */
+    template <typename It>
+    size_t rebuild(It first, It last, double fill_factor = 1.0)
+    {
+        return run_rebuild(
+            [&](BulkBuilder<BTree>& builder) {
+                size_t count = 0;
+                for (; first != last; ++first) {
+                    builder.add_pair(first->first, first->second);
+                    count++;
+                }
+                return count;
+            },
+            fill_factor);
+    }
+
+    /* rebuild the tree from its own contents, e.g. to repack it after many
+     * erases. the input is a snapshot that is committed after capturing has
+     * started, so each write is either in the snapshot or replayed. needs
+     * shadow paging */
+    size_t rebuild(double fill_factor = 1.0)
+    {
+        check_writable();
+        if (!shadow_paging) {
+            throw std::runtime_error("rebuild() from a snapshot needs shadow "
+                                     "paging");
+        }
+
+        return run_rebuild(
+            [&](BulkBuilder<BTree>& builder) {
+                auto snap = rebuild_snapshot();
+                size_t count = 0;
+                for (auto it = snap.begin(); it != snap.end(); ++it) {
+                    builder.add_pair(it->first, it->second);
+                    count++;
+                }
+                return count;
+            },
+            fill_factor);
+    }
+
+    /* make all changes since the last commit durable and visible to a
+     * subsequent open. in shadow paging mode the modified nodes and their
+     * ancestors are relocated to fresh pages, then the older of the two meta
+     * pages is overwritten to point to the new root. pages released by the
+     * relocation are recycled after the meta page is written. in the default
+     * mode every change is already written in place and this only writes the
+     * metadata */
+    void commit()
+    {
+        if (read_only) return;
+
+        if (!shadow_paging) {
+            write_metadata(true);
+            page_cache->flush_all_pages();
+            page_cache->sync();
+            return;
+        }
+
+        std::unique_lock<std::shared_mutex> latch(commit_latch);
+        commit_locked();
+    }
+
+    /* commit() in shadow paging mode. the caller holds the commit latch
+     * exclusively */
+    void commit_locked()
+    {
+        if (dirty_nodes.empty() && meta_epoch > 0) return;
+
+        /* ancestors of modified nodes must be relocated as well because their
+         * child page IDs change */
+        std::unordered_set<NodeType*> nodes;
+        for (auto* node : dirty_nodes) {
+            for (auto* p = node; p && nodes.insert(p).second;
+                 p = p->get_parent())
+                ;
+        }
+
+        for (auto* node : nodes) {
+            bool need_restart = true;
+            while (need_restart) {
+                node->write_lock_or_restart(need_restart);
+            }
+        }
+
+        for (auto* node : nodes) {
+            auto pid = node->get_pid();
+            if (fresh_pages.find(pid) == fresh_pages.end()) {
+                /* still referenced by the last committed tree */
+                pending_free.push_back(pid);
+                node->set_pid(alloc_shadow_page());
+            }
+        }
+
+        for (auto* node : nodes) {
+            if (!node->is_leaf()) {
+                auto* inner = static_cast<InnerNodeType*>(node);
+                for (size_t i = 0; i <= inner->get_size(); i++) {
+                    if (inner->child_cache[i]) {
+                        inner->child_pages[i] = inner->child_cache[i]->get_pid();
+                    }
+                }
+            }
+            write_node_page(node);
+        }
+
+        /* the new nodes must be durable before the meta page points to them */
+        page_cache->flush_all_pages();
+        page_cache->sync();
+
+        meta_epoch++;
+        write_meta_slot(meta_epoch & 1, true);
+        page_cache->flush_all_pages();
+        page_cache->sync();
+
+        committed_root_pid = root->get_pid();
+        committed_pairs = num_pairs.load();
+
+        /* readers of older snapshots may still read the pages until
+         * free_page_delay more commits are done, snapshots until they are
+         * released */
+        delayed_free.emplace_back(meta_epoch, std::move(pending_free));
+        pending_free.clear();
+
+        uint64_t oldest_snapshot = std::numeric_limits<uint64_t>::max();
+        {
+            std::lock_guard<std::mutex> guard(snapshot_mutex);
+            if (!snapshot_epochs.empty()) {
+                oldest_snapshot = *snapshot_epochs.begin();
+            }
+        }
+        while (!delayed_free.empty() &&
+               delayed_free.front().first + free_page_delay <= meta_epoch &&
+               delayed_free.front().first <= oldest_snapshot) {
+            auto& pids = delayed_free.front().second;
+            free_pages.insert(free_pages.end(), pids.begin(), pids.end());
+            delayed_free.pop_front();
+        }
+        fresh_pages.clear();
+        dirty_nodes.clear();
+
+        for (auto* node : nodes) {
+            node->write_unlock();
+        }
     }
 
     void print(std::ostream& os) const
@@ -148,6 +903,8 @@ public:
         return os;
     }
 
+    /* returns nullptr if the page does not exist or holds no node. throws
+     * CorruptPageException if the page fails its checksum */
     std::unique_ptr<BaseNode<K, V, KeyComparator, KeyEq>>
     read_node(BaseNode<K, V, KeyComparator, KeyEq>* parent, PageID pid)
     {
@@ -171,19 +928,91 @@ public:
                 std::make_unique<LeafNode<N, K, V, KeySerializer, KeyComparator,
                                           KeyEq, ValueSerializer>>(this, parent,
                                                                    pid);
+        } else {
+            /* not a node, e.g. a page dropped by clear() that a stale reader
+             * still points to */
+            page_cache->unpin_page(page, false, lock);
+            return nullptr;
         }
 
         node->deserialize(&buf[sizeof(uint32_t)],
                           page->get_size() - sizeof(uint32_t));
 
         page_cache->unpin_page(page, false, lock);
+        if (read_only) num_loaded_nodes++;
         return node;
     }
 
+    /* read-only trees: drop the nodes below the root once more than
+     * max_cached_nodes were read. operations still inside them hold an
+     * epoch, and the nodes read again hold the same snapshot */
+    void trim_loaded_nodes()
+    {
+        if (!read_only || max_cached_nodes == 0 ||
+            num_loaded_nodes.load() <= max_cached_nodes) {
+            return;
+        }
+
+        auto* node = root.get();
+        if (!node || node->is_leaf()) return;
+
+        /* another thread is loading a child of the root or trimming */
+        bool need_restart = false;
+        node->write_lock_or_restart(need_restart);
+        if (need_restart) return;
+
+        auto* inner = static_cast<InnerNodeType*>(node);
+        auto holder = std::make_shared<std::vector<std::unique_ptr<NodeType>>>();
+        for (size_t i = 0; i <= inner->get_size(); i++) {
+            if (inner->child_cache[i]) {
+                holder->push_back(std::move(inner->child_cache[i]));
+            }
+        }
+        num_loaded_nodes.store(1);
+        node->write_unlock();
+
+        epochs.retire([holder] { holder->clear(); });
+    }
+
+    /* node serializers do not check the buffer size. with the fixed-size
+     * copy serializers the largest node is known up front, refuse fanouts
+     * whose nodes do not fit a page */
+    void check_node_size()
+    {
+        if (!std::is_same<KeySerializer, CopySerializer<K>>::value ||
+            !std::is_same<ValueSerializer, CopySerializer<V>>::value) {
+            return;
+        }
+
+        size_t child_bytes = compact_child_pages ? sizeof(uint32_t) * (N + 1)
+                                                 : sizeof(PageID) * N;
+        /* | tag | size | keys | child pages or values | */
+        size_t inner_bytes =
+            2 * sizeof(uint32_t) + sizeof(K) * (N - 1) + child_bytes;
+        size_t leaf_bytes =
+            2 * sizeof(uint32_t) + (sizeof(K) + sizeof(V)) * (N - 1);
+
+        if (std::max(inner_bytes, leaf_bytes) > meta_page_size) {
+            throw std::invalid_argument("tree nodes do not fit in a page");
+        }
+    }
+
     void write_node(const BaseNode<K, V, KeyComparator, KeyEq>* node)
+    {
+        if (shadow_paging) {
+            /* written to a fresh page by the next commit */
+            std::lock_guard<std::mutex> guard(alloc_mutex);
+            dirty_nodes.insert(const_cast<NodeType*>(node));
+            return;
+        }
+
+        write_node_page(node);
+    }
+
+    void write_node_page(const BaseNode<K, V, KeyComparator, KeyEq>* node)
     {
         boost::upgrade_lock<Page> lock;
-        auto page = page_cache->fetch_page(node->get_pid(), lock);
+        auto page = page_cache->fetch_page_for_overwrite(node->get_pid(), lock);
 
         {
             boost::upgrade_to_unique_lock<Page> ulock(lock);
@@ -246,31 +1075,13 @@ public:
             : tree(tree), kcmp(kcmp), next_key(std::nullopt)
         {
             ended = false;
-            auto first_node = tree->read_node(
-                nullptr, BTree<N, K, V, KeySerializer, KeyComparator, KeyEq,
-                               ValueSerializer>::FIRST_NODE_PAGE_ID);
-
-            if (!first_node) {
-                ended = true;
-                return;
-            }
-
-            auto leaf =
-                static_cast<LeafNode<N, K, V, KeySerializer, KeyComparator,
-                                     KeyEq, ValueSerializer>*>(
-                    first_node.get());
-            key_buf.clear();
-            value_buf.clear();
-            std::copy(leaf->keys.begin(), leaf->keys.begin() + leaf->get_size(),
-                      std::back_inserter(key_buf));
-            std::copy(leaf->values.begin(),
-                      leaf->values.begin() + leaf->get_size(),
-                      std::back_inserter(value_buf));
+            tree->collect_first_values(&next_key, key_buf, value_buf);
 
             idx = 0;
             if (key_buf.empty()) {
-                ended = true;
-            } else {
+                get_next_batch();
+            }
+            if (!ended) {
                 kvp = std::make_pair(key_buf[idx], value_buf[idx]);
             }
         }
@@ -284,8 +1095,9 @@ public:
             idx = std::lower_bound(key_buf.begin(), key_buf.end(), key, kcmp) -
                   key_buf.begin();
             if (idx == key_buf.size()) {
-                ended = true;
-            } else {
+                get_next_batch();
+            }
+            if (!ended) {
                 kvp = std::make_pair(key_buf[idx], value_buf[idx]);
             }
         }
@@ -303,19 +1115,20 @@ public:
 
         void get_next_batch()
         {
-            if (!next_key) {
-                ended = true;
-                return;
-            }
+            do {
+                if (!next_key) {
+                    ended = true;
+                    return;
+                }
 
-            K key = *next_key;
-            next_key = std::nullopt;
-            tree->collect_values(key, &next_key, key_buf, value_buf);
-            idx = std::lower_bound(key_buf.begin(), key_buf.end(), key, kcmp) -
-                  key_buf.begin();
-            if (idx == key_buf.size()) {
-                ended = true;
-            }
+                K key = *next_key;
+                next_key = std::nullopt;
+                tree->collect_values(key, &next_key, key_buf, value_buf);
+                idx = std::lower_bound(key_buf.begin(), key_buf.end(), key,
+                                       kcmp) -
+                      key_buf.begin();
+                /* leaves emptied by erases are skipped */
+            } while (idx == key_buf.size());
         }
     };
 
@@ -351,55 +1164,1835 @@ public:
     iterator begin(const K& key) { return iterator(this, key); }
     Sentinel end() const { return Sentinel{}; }
 
+    /* take a snapshot of the last commit, see TreeSnapshot. commit() first
+     * to include the latest writes */
+    Snapshot snapshot()
+    {
+        if (!shadow_paging) {
+            throw std::runtime_error("snapshots need shadow paging");
+        }
+
+        /* commit() releases pages under the exclusive latch */
+        std::shared_lock<std::shared_mutex> latch(commit_latch);
+        return Snapshot(std::make_shared<SnapshotState<BTree>>(
+            this, meta_epoch, committed_root_pid, committed_pairs));
+    }
+
 private:
+    /* meta pages of a tree that has the file to itself */
     static const PageID META_PAGE_ID = 1;
-    static const PageID FIRST_NODE_PAGE_ID = META_PAGE_ID + 1;
     static const uint32_t META_PAGE_MAGIC = 0x00C0FFEE;
+    static const uint32_t META_PAGE_MAGIC_V2 = 0x01C0FFEE;
+    static const uint32_t META_PAGE_MAGIC_V3 = 0x02C0FFEE;
+    static const uint32_t META_FLAG_SHADOW = 1;
+    static const uint32_t META_FLAG_COMPACT_CHILDREN = 2;
+    /* the first free page ID of the record heads a chain of free list pages */
+    static const uint32_t META_FLAG_FREE_CHAIN = 4;
+    /* the pair count still includes the pairs of unlinked subtrees, it is
+     * recounted on open */
+    static const uint32_t META_FLAG_COUNT_PENDING = 8;
+    /* the free list ends with the pages still held back by free_page_delay,
+     * see write_meta_slot() */
+    static const uint32_t META_FLAG_DELAYED_FREE = 16;
+    static const uint32_t FREE_CHAIN_MAGIC = 0x03C0FFEE;
+    /* the free page delay is kept in the upper half of the flags */
+    static const uint32_t META_FREE_DELAY_SHIFT = 16;
+    Catalog::MetaPages meta_pids;
     static const uint32_t INNER_TAG = 1;
     static const uint32_t LEAF_TAG = 2;
 
-    AbstractPageCache* page_cache;
-    std::unique_ptr<BaseNode<K, V, KeyComparator, KeyEq>> root;
-    std::atomic<size_t> num_pairs;
+    AbstractPageCache* page_cache;
+    std::unique_ptr<BaseNode<K, V, KeyComparator, KeyEq>> root;
+    std::atomic<size_t> num_pairs;
+    KeyComparator kcmp;
+
+    /* seqlock that keeps readers from observing a half-applied write batch */
+    std::mutex batch_mutex;
+    std::atomic<uint64_t> batch_version;
+
+    bool shadow_paging;
+    bool compact_child_pages;
+    bool read_only;
+    uint32_t free_page_delay;
+    size_t max_cached_nodes;
+    std::atomic<size_t> num_loaded_nodes;
+    bool closed;
+
+    Executor* executor;
+    /* the helpers are held by pointer since their members need the complete
+     * tree type */
+    std::unique_ptr<Defragmenter<BTree>> defragmenter;
+    uint64_t meta_epoch;
+    /* the root and size as of the last commit, for snapshots */
+    PageID committed_root_pid;
+    size_t committed_pairs;
+    /* the usable size of a meta page, read once on open */
+    size_t meta_page_size;
+    /* the meta page holds a full record written by this tree and no page on
+     * its free list has been handed out since, so that writes after a single
+     * change only need to update the root and the pair count */
+    std::atomic<bool> meta_free_list_current;
+    /* epochs of the live snapshots */
+    std::mutex snapshot_mutex;
+    std::multiset<uint64_t> snapshot_epochs;
+    std::shared_mutex commit_latch;
+    std::mutex alloc_mutex; /* guards the free list and the sets below */
+    std::vector<PageID> free_pages;
+    /* pages allocated since the last commit */
+    std::unordered_set<PageID> fresh_pages;
+    /* pages that become free once the next commit is durable */
+    std::vector<PageID> pending_free;
+    /* pages freed by a commit (with its epoch) that wait for the free page
+     * delay */
+    std::deque<std::pair<uint64_t, std::vector<PageID>>> delayed_free;
+    /* nodes modified since the last commit */
+    std::unordered_set<NodeType*> dirty_nodes;
+    /* the free list pages of the last record written, kept until the next
+     * record replaces it */
+    std::vector<PageID> free_chain;
+
+    /* nodes unlinked from the tree are freed once no reader can be inside
+     * them. their pages are collected and recycled by the reclaimer */
+    EpochManager epochs;
+    std::mutex structure_mutex; /* serializes erase_range() and clear() */
+    std::unique_ptr<Reclaimer<BTree>> reclaimer;
+    /* queued erase_range() subtrees whose pairs are not subtracted from
+     * num_pairs yet */
+    std::atomic<size_t> uncounted_tasks;
+
+    using WriteOp = typename WriteBatch<K, V>::Op;
+    using OpType = typename WriteBatch<K, V>::OpType;
+
+    /* writes made during rebuild() are applied to the old tree and captured
+     * for the new one. puts commute, so capturing writers that only put
+     * share capture_latch and take capture_mutex just to append. writers
+     * that erase hold capture_latch exclusively while they write, so that
+     * the captured order of an erase and the puts of the same key is the
+     * order they were applied in */
+    static const int REBUILD_IDLE = 0;
+    static const int REBUILD_CAPTURING = 1;
+    static const int REBUILD_SWAPPING = 2;
+    static const size_t REBUILD_SWAP_OPS = 1024;
+    std::atomic<int> rebuild_state;
+    std::mutex rebuild_mutex;
+    std::condition_variable rebuild_cv;
+    std::shared_mutex capture_latch;
+    std::mutex capture_mutex; /* guards captured_ops */
+    std::vector<WriteOp> captured_ops;
+
+    struct CaptureLatch {
+        std::shared_lock<std::shared_mutex> shared;
+        std::unique_lock<std::shared_mutex> exclusive;
+
+        explicit operator bool() const
+        {
+            return shared.owns_lock() || exclusive.owns_lock();
+        }
+    };
+
+    /* insert a pair without updating the pair count or the metadata */
+    void insert_pair(const K& key, const V& value)
+    {
+        insert_pair(key, value, root);
+    }
+
+    /* insert into the tree below tree_root, which is either the root or the
+     * root of a tree that is being built */
+    void insert_pair(const K& key, const V& value,
+                     std::unique_ptr<NodeType>& tree_root)
+    {
+        auto epoch = epochs.enter();
+
+        while (true) {
+            try {
+                K split_key;
+                auto old_root = tree_root.get();
+                if (!old_root)
+                    continue; /* old_root may be nullptr when another thread is
+                                 updating the root node pointer */
+
+                auto root_sibling = old_root->insert(key, value, split_key, 0);
+
+                if (root_sibling) {
+                    auto new_root =
+                        create_node<InnerNode<N, K, V, KeySerializer,
+                                              KeyComparator, KeyEq>>(nullptr);
+
+                    tree_root->set_parent(new_root.get());
+                    root_sibling->set_parent(new_root.get());
+
+                    new_root->set_size(1);
+                    new_root->keys[0] = split_key;
+                    new_root->child_pages[0] = tree_root->get_pid();
+                    new_root->child_pages[1] = root_sibling->get_pid();
+                    new_root->child_cache[0] = std::move(tree_root);
+                    new_root->child_cache[1] = std::move(root_sibling);
+
+                    tree_root = std::move(new_root);
+                    write_node(tree_root.get());
+                    if (&tree_root == &root) write_metadata();
+
+                    /* release the lock on the old root */
+                    old_root->write_unlock();
+                    continue;
+                }
+
+                break;
+            } catch (OLCRestart&) {
+                continue;
+            }
+        }
+    }
+
+    /* optimistic descent to the leaf that covers key (the leftmost leaf if key
+     * is null). returns the leaf with its version in version, and its parent
+     * with the parent's version. upper is set to the separator bounding the
+     * leaf from above (nullopt for the rightmost leaf). throws OLCRestart */
+    LeafNodeType* find_leaf(const K* key, uint64_t& version, NodeType*& parent,
+                            uint64_t& parent_version, std::optional<K>& upper)
+    {
+        return find_leaf(key, version, parent, parent_version, upper, root);
+    }
+
+    LeafNodeType* find_leaf(const K* key, uint64_t& version, NodeType*& parent,
+                            uint64_t& parent_version, std::optional<K>& upper,
+                            const std::unique_ptr<NodeType>& tree_root)
+    {
+        NodeType* node = tree_root.get();
+        if (!node) throw OLCRestart();
+
+        bool need_restart;
+        parent = nullptr;
+        parent_version = 0;
+        upper = std::nullopt;
+
+        version = node->read_lock_or_restart(need_restart);
+        if (need_restart) throw OLCRestart();
+
+        while (!node->is_leaf()) {
+            auto* inner = static_cast<InnerNodeType*>(node);
+            if (parent && parent->read_unlock_or_restart(parent_version))
+                throw OLCRestart();
+
+            size_t child_idx = 0;
+            if (key) {
+                child_idx =
+                    std::upper_bound(inner->keys.begin(),
+                                     inner->keys.begin() + inner->get_size(),
+                                     *key, kcmp) -
+                    inner->keys.begin();
+            }
+            if (child_idx < inner->get_size()) {
+                upper = inner->keys[child_idx];
+            }
+
+            auto* child = inner->get_child(child_idx, false, version);
+            if (!child || inner->read_unlock_or_restart(version))
+                throw OLCRestart();
+
+            parent = node;
+            parent_version = version;
+            node = child;
+            version = node->read_lock_or_restart(need_restart);
+            if (need_restart) throw OLCRestart();
+        }
+
+        return static_cast<LeafNodeType*>(node);
+    }
+
+    /* descend to the leaf that covers key and call fn(leaf, upper) with the leaf
+     * write-locked. fn returns true if it modified the leaf, in which case the
+     * leaf is written back before it is unlocked */
+    template <typename F> void update_leaf(const K& key, F&& fn)
+    {
+        update_leaf(key, std::forward<F>(fn), root);
+    }
+
+    template <typename F>
+    void update_leaf(const K& key, F&& fn,
+                     const std::unique_ptr<NodeType>& tree_root)
+    {
+        auto epoch = epochs.enter();
+
+        while (true) {
+            try {
+                NodeType* parent;
+                uint64_t version, parent_version;
+                std::optional<K> upper;
+                bool need_restart;
+
+                auto* leaf = find_leaf(&key, version, parent, parent_version,
+                                       upper, tree_root);
+                leaf->upgrade_to_write_lock_or_restart(version, need_restart);
+                if (need_restart) throw OLCRestart();
+                if (parent && parent->read_unlock_or_restart(parent_version)) {
+                    leaf->write_unlock();
+                    throw OLCRestart();
+                }
+
+                if (fn(leaf, upper)) {
+                    write_node(leaf);
+                }
+                leaf->write_unlock();
+                return;
+            } catch (OLCRestart&) {
+                continue;
+            }
+        }
+    }
+
+    /* remove all pairs with key below tree_root. a split can leave copies of
+     * the separator in the leaf to its left, so every leaf whose fences
+     * include key is visited, not only the one that covers it. returns the
+     * number of pairs removed */
+    size_t erase_pairs(const K& key, const std::unique_ptr<NodeType>& tree_root)
+    {
+        auto epoch = epochs.enter();
+        size_t count = 0;
+
+        while (true) {
+            try {
+                NodeType* node = tree_root.get();
+                if (!node) throw OLCRestart();
+                erase_pairs(node, key, count);
+                return count;
+            } catch (OLCRestart&) {
+                /* pairs erased before the restart stay erased */
+                continue;
+            }
+        }
+    }
+
+    void erase_pairs(NodeType* node, const K& key, size_t& count)
+    {
+        bool need_restart;
+        uint64_t version = node->read_lock_or_restart(need_restart);
+        if (need_restart) throw OLCRestart();
+
+        if (node->is_leaf()) {
+            node->upgrade_to_write_lock_or_restart(version, need_restart);
+            if (need_restart) throw OLCRestart();
+            auto* leaf = static_cast<LeafNodeType*>(node);
+            size_t erased = leaf->erase_entries(key);
+            if (erased > 0) write_node(leaf);
+            leaf->write_unlock();
+            count += erased;
+            return;
+        }
+
+        auto* inner = static_cast<InnerNodeType*>(node);
+        auto begin = inner->keys.begin();
+        auto end = begin + inner->get_size();
+        size_t first = std::lower_bound(begin, end, key, kcmp) - begin;
+        size_t last = std::upper_bound(begin, end, key, kcmp) - begin;
+        if (inner->read_unlock_or_restart(version)) throw OLCRestart();
+
+        for (size_t i = first; i <= last; i++) {
+            auto* child = inner->get_child(i, false, version);
+            if (!child || inner->read_unlock_or_restart(version))
+                throw OLCRestart();
+            erase_pairs(child, key, count);
+            /* a split below may have moved pairs to a sibling */
+            if (inner->read_unlock_or_restart(version)) throw OLCRestart();
+        }
+    }
+
+    /* write() without the commit: apply the batch under batch_mutex with the
+     * batch version odd meanwhile */
+    void apply_batch(const WriteBatch<K, V>& batch)
+    {
+        using Op = typename WriteBatch<K, V>::Op;
+
+        std::vector<const Op*> ops;
+        ops.reserve(batch.size());
+        for (auto&& op : batch.get_ops()) {
+            ops.push_back(&op);
+        }
+        /* stable sort keeps operations on the same key in submission order */
+        std::stable_sort(ops.begin(), ops.end(),
+                         [this](const Op* a, const Op* b) {
+                             return kcmp(a->key, b->key);
+                         });
+
+        bool has_erase = std::any_of(ops.begin(), ops.end(), [](const Op* op) {
+            return op->type == WriteBatch<K, V>::OpType::ERASE;
+        });
+        CaptureLatch capture;
+        auto epoch = enter_writer(capture, has_erase);
+        auto latch = writer_latch();
+        std::lock_guard<std::mutex> guard(batch_mutex);
+        batch_version.fetch_add(1);
+
+        size_t pos = 0;
+        while (pos < ops.size()) {
+            if (ops[pos]->type == WriteBatch<K, V>::OpType::ERASE) {
+                num_pairs -= erase_pairs(ops[pos]->key, root);
+                pos++;
+                continue;
+            }
+
+            size_t applied = 0;
+            int64_t delta = 0;
+
+            update_leaf(ops[pos]->key, [&](LeafNodeType* leaf,
+                                           const std::optional<K>& upper) {
+                applied = 0;
+                delta = 0;
+                for (size_t i = pos; i < ops.size(); i++) {
+                    const Op* op = ops[i];
+                    /* the rest of the batch belongs to the following leaves */
+                    if (upper && !kcmp(op->key, *upper)) break;
+                    if (op->type == WriteBatch<K, V>::OpType::ERASE) break;
+                    if (leaf->is_full()) break;
+
+                    leaf->insert_entry(op->key, op->value);
+                    delta++;
+                    applied++;
+                }
+                return delta != 0;
+            });
+
+            if (applied == 0) {
+                /* the leaf is full, let the regular insert path split it */
+                insert_pair(ops[pos]->key, ops[pos]->value);
+                delta = 1;
+                applied = 1;
+            }
+
+            num_pairs += delta;
+            pos += applied;
+        }
+
+        write_metadata();
+        batch_version.fetch_add(1);
+
+        if (capture) {
+            std::lock_guard<std::mutex> capture_guard(capture_mutex);
+            for (auto* op : ops) {
+                captured_ops.push_back(*op);
+            }
+        }
+    }
+
+    /* the batch version that a read validates against. readers that arrive
+     * while a write batch is applied wait for it on batch_mutex */
+    uint64_t read_batch_version()
+    {
+        uint64_t bv = batch_version.load();
+        while (bv & 1) {
+            { std::lock_guard<std::mutex> wait(batch_mutex); }
+            bv = batch_version.load();
+        }
+        return bv;
+    }
+
+    /* writers enter an epoch before they look at the rebuild state so that
+     * rebuild() can wait for those that missed a change of the state. writers
+     * wait while the roots are swapped, and hold the capture latch while the
+     * rebuild captures writes. writes that erase take it exclusively */
+    EpochManager::Guard enter_writer(CaptureLatch& capture, bool erases)
+    {
+        while (true) {
+            {
+                auto epoch = epochs.enter();
+                int state = rebuild_state.load();
+                if (state == REBUILD_IDLE) return epoch;
+                if (state == REBUILD_CAPTURING) {
+                    if (erases) {
+                        capture.exclusive =
+                            std::unique_lock<std::shared_mutex>(capture_latch);
+                    } else {
+                        capture.shared =
+                            std::shared_lock<std::shared_mutex>(capture_latch);
+                    }
+                    return epoch;
+                }
+            }
+
+            std::unique_lock<std::mutex> lock(rebuild_mutex);
+            rebuild_cv.wait(lock, [this] {
+                return rebuild_state.load() != REBUILD_SWAPPING;
+            });
+        }
+    }
+
+    /* append a write that was applied to the tree. the caller holds the
+     * capture latch */
+    void capture_op(const WriteOp& op)
+    {
+        std::lock_guard<std::mutex> guard(capture_mutex);
+        captured_ops.push_back(op);
+    }
+
+    void finish_rebuild(int state)
+    {
+        {
+            std::lock_guard<std::mutex> lock(rebuild_mutex);
+            rebuild_state.store(state);
+        }
+        rebuild_cv.notify_all();
+    }
+
+    /* rebuild() with the input added to a bulk builder by
+     * build_input(builder), which returns the number of pairs. it is called
+     * once the writes are captured */
+    template <typename F>
+    size_t run_rebuild(F&& build_input, double fill_factor)
+    {
+        check_writable();
+        stop_defragmenter();
+
+        std::lock_guard<std::mutex> guard(structure_mutex);
+        rebuild_state.store(REBUILD_CAPTURING);
+        /* writers that did not see the state change are done after this */
+        epochs.synchronize();
+
+        std::unique_ptr<NodeType> new_root;
+        size_t count = 0;
+        try {
+            BulkBuilder<BTree> builder(
+                this, BulkBuilder<BTree>::fill_target(fill_factor));
+            count = build_input(builder);
+            new_root = builder.finish();
+
+            /* catch up with the writes made during the build, until few
+             * enough are left to replay them with the writers held off */
+            {
+                auto latch = writer_latch();
+                write_node(new_root.get());
+            }
+            while (true) {
+                auto latch = writer_latch();
+                if (replay_captured(new_root, count) < REBUILD_SWAP_OPS) break;
+            }
+        } catch (...) {
+            finish_rebuild(REBUILD_IDLE);
+            /* writers that still capture are done after this */
+            epochs.synchronize();
+            {
+                std::lock_guard<std::mutex> capture_guard(capture_mutex);
+                captured_ops.clear();
+            }
+            /* the partial tree is dropped, its pages are leaked */
+            throw;
+        }
+
+        finish_rebuild(REBUILD_SWAPPING);
+        epochs.synchronize();
+
+        {
+            auto latch = structure_latch();
+            replay_captured(new_root, count);
+
+            if (shadow_paging) {
+                std::lock_guard<std::mutex> alloc_guard(alloc_mutex);
+                /* only the nodes of the new tree are left to commit */
+                for (auto it = dirty_nodes.begin(); it != dirty_nodes.end();) {
+                    auto* top = *it;
+                    while (top->get_parent()) {
+                        top = top->get_parent();
+                    }
+                    it = top == new_root.get() ? std::next(it)
+                                               : dirty_nodes.erase(it);
+                }
+            }
+
+            auto old_root = std::exchange(root, std::move(new_root));
+            num_pairs.store(count);
+            write_metadata();
+
+            std::vector<DetachedSubtree> detached;
+            detached.push_back(DetachedSubtree{old_root->get_pid(),
+                                               std::move(old_root), 0});
+            reclaimer->push(ReclaimTask{std::move(detached), false});
+        }
+
+        finish_rebuild(REBUILD_IDLE);
+        return count;
+    }
+
+    /* commit and take a snapshot of the commit without letting a writer in
+     * between. the writes captured so far are part of it and are dropped */
+    Snapshot rebuild_snapshot()
+    {
+        std::unique_lock<std::shared_mutex> latch(commit_latch);
+        commit_locked();
+        {
+            std::lock_guard<std::mutex> guard(capture_mutex);
+            captured_ops.clear();
+        }
+        return Snapshot(std::make_shared<SnapshotState<BTree>>(
+            this, meta_epoch, committed_root_pid, committed_pairs));
+    }
+
+    /* apply the writes captured so far to the tree being rebuilt and keep its
+     * pair count. the caller holds the commit latch. returns the number of
+     * writes applied */
+    size_t replay_captured(std::unique_ptr<NodeType>& tree_root, size_t& count)
+    {
+        std::vector<WriteOp> ops;
+        {
+            std::lock_guard<std::mutex> guard(capture_mutex);
+            ops.swap(captured_ops);
+        }
+
+        for (auto&& op : ops) {
+            if (op.type == OpType::PUT) {
+                insert_pair(op.key, op.value, tree_root);
+                count++;
+            } else {
+                count -= erase_pairs(op.key, tree_root);
+            }
+        }
+        return ops.size();
+    }
+
+    /* merge the pairs at the front of pending that fall into the leaf that
+     * covers the first of them, splitting the leaf into leaves of target
+     * pairs if they do not fit. the leaf and its parent are write-locked for
+     * the rewrite. returns the number of pairs taken from pending, 0 if the
+     * leaf is full and its parent has no room for new leaves */
+    size_t merge_into_leaf(std::deque<std::pair<K, V>>& pending, size_t target)
+    {
+        auto epoch = epochs.enter();
+
+        while (true) {
+            try {
+                NodeType* parent;
+                uint64_t version, parent_version;
+                std::optional<K> upper;
+                bool need_restart;
+
+                auto* leaf = find_leaf(&pending.front().first, version, parent,
+                                       parent_version, upper);
+                leaf->upgrade_to_write_lock_or_restart(version, need_restart);
+                if (need_restart) throw OLCRestart();
+                if (parent) {
+                    parent->upgrade_to_write_lock_or_restart(parent_version,
+                                                             need_restart);
+                    if (need_restart) {
+                        leaf->write_unlock();
+                        throw OLCRestart();
+                    }
+                }
+
+                auto* inner = static_cast<InnerNodeType*>(parent);
+                size_t leaf_size = leaf->get_size();
+                size_t free_slots = inner ? N - 1 - inner->get_size() : 0;
+                size_t capacity = std::max<size_t>(N - 1, (free_slots + 1) * target);
+                size_t count = 0;
+                while (count < pending.size() && leaf_size + count < capacity &&
+                       (!upper || kcmp(pending[count].first, *upper))) {
+                    count++;
+                }
+
+                /* long runs of equal keys can need more leaves than the
+                 * parent has room for, take fewer pairs then */
+                while (count > 0 &&
+                       !rewrite_leaf(leaf, inner, free_slots, pending, count,
+                                     target)) {
+                    count /= 2;
+                }
+                pending.erase(pending.begin(), pending.begin() + count);
+
+                if (parent) parent->write_unlock();
+                leaf->write_unlock();
+                return count;
+            } catch (OLCRestart&) {
+                continue;
+            }
+        }
+    }
+
+    /* merge the first count pairs of pending into the write-locked leaf. if
+     * they do not fit, the leaf keeps the first target pairs and new leaves
+     * for the rest are added to the write-locked parent. returns false
+     * without changing anything if that needs more than free_slots new
+     * leaves */
+    bool rewrite_leaf(LeafNodeType* leaf, InnerNodeType* parent,
+                      size_t free_slots,
+                      const std::deque<std::pair<K, V>>& pending, size_t count,
+                      size_t target)
+    {
+        /* pairs from the run go after existing pairs with the same key, as
+         * with insert() */
+        size_t leaf_size = leaf->get_size();
+        std::vector<K> keys;
+        std::vector<V> values;
+        keys.reserve(leaf_size + count);
+        values.reserve(leaf_size + count);
+        for (size_t i = 0, j = 0; i < leaf_size || j < count;) {
+            if (j == count ||
+                (i < leaf_size && !kcmp(pending[j].first, leaf->keys[i]))) {
+                keys.push_back(leaf->keys[i]);
+                values.push_back(leaf->values[i]);
+                i++;
+            } else {
+                keys.push_back(pending[j].first);
+                values.push_back(pending[j].second);
+                j++;
+            }
+        }
+
+        size_t total = keys.size();
+        std::vector<size_t> bounds{0};
+        if (total <= N - 1) {
+            bounds.push_back(total);
+        } else {
+            while (bounds.back() < total) {
+                size_t begin = bounds.back();
+                size_t end = std::min(total, begin + target);
+                /* keep equal keys in one leaf where they fit. a run of equal
+                 * keys longer than a leaf is cut into full leaves, like
+                 * insert() splits it */
+                while (end < total && end - begin < N - 1 &&
+                       !kcmp(keys[end - 1], keys[end])) {
+                    end++;
+                }
+                size_t full = end;
+                while (end < total && end - 1 > begin &&
+                       !kcmp(keys[end - 1], keys[end])) {
+                    end--;
+                }
+                if (end < total && !kcmp(keys[end - 1], keys[end])) {
+                    end = full;
+                }
+                bounds.push_back(end);
+            }
+        }
+        size_t num_new = bounds.size() - 2;
+        if (num_new > free_slots) return false;
+
+        auto fill = [&](LeafNodeType* node, size_t begin, size_t end) {
+            std::copy(keys.begin() + begin, keys.begin() + end,
+                      node->keys.begin());
+            std::copy(values.begin() + begin, values.begin() + end,
+                      node->values.begin());
+            node->set_size(end - begin);
+        };
+
+        fill(leaf, bounds[0], bounds[1]);
+        if (num_new == 0) {
+            write_node(leaf);
+            return true;
+        }
+
+        size_t idx = 0;
+        while (parent->child_cache[idx].get() != leaf) {
+            idx++;
+        }
+
+        size_t size = parent->get_size();
+        std::move_backward(parent->keys.begin() + idx,
+                           parent->keys.begin() + size,
+                           parent->keys.begin() + size + num_new);
+        for (size_t i = size; i > idx; i--) {
+            parent->child_pages[i + num_new] = parent->child_pages[i];
+            parent->child_cache[i + num_new] =
+                std::move(parent->child_cache[i]);
+        }
+
+        /* the new leaves must be in place before the parent points to them */
+        write_node(leaf);
+        for (size_t j = 0; j < num_new; j++) {
+            auto node = create_node<LeafNodeType>(parent);
+            fill(node.get(), bounds[j + 1], bounds[j + 2]);
+            write_node(node.get());
+
+            parent->keys[idx + j] = keys[bounds[j + 1]];
+            parent->child_pages[idx + 1 + j] = node->get_pid();
+            parent->child_cache[idx + 1 + j] = std::move(node);
+        }
+        parent->set_size(size + num_new);
+        write_node(parent);
+        return true;
+    }
+
+    /* erase the pairs in [lo, hi) below node, which covers
+     * [node_lo, node_hi]. the parent of node is write-locked by the caller.
+     * children that lie entirely in the range are unlinked into detached,
+     * the others are descended into. returns the height of node, 0 if no
+     * leaf was reached below it. throws OLCRestart */
+    size_t erase_subrange(NodeType* node, bool is_root,
+                        const std::optional<K>& node_lo,
+                        const std::optional<K>& node_hi, const K& lo,
+                        const K& hi, std::vector<DetachedSubtree>& detached,
+                        size_t& erased)
+    {
+        bool need_restart;
+        node->write_lock_or_restart(need_restart);
+        if (need_restart) throw OLCRestart();
+        if (is_root && node != root.get()) {
+            node->write_unlock();
+            throw OLCRestart();
+        }
+
+        if (node->is_leaf()) {
+            auto* leaf = static_cast<LeafNodeType*>(node);
+            size_t count = leaf->erase_range(lo, hi);
+            if (count > 0) {
+                write_node(leaf);
+                erased += count;
+            }
+            leaf->write_unlock();
+            return 1;
+        }
+
+        auto* inner = static_cast<InnerNodeType*>(node);
+        size_t child_height = 0;
+        try {
+            size_t first_detached = detached.size();
+            detach_children(inner, node_lo, node_hi, lo, hi, detached);
+            size_t end_detached = detached.size();
+
+            size_t size = inner->get_size();
+            auto keys_end = inner->keys.begin() + size;
+            /* duplicates of lo may also sit left of a separator equal to
+             * lo */
+            size_t first = std::lower_bound(inner->keys.begin(), keys_end, lo,
+                                            kcmp) -
+                           inner->keys.begin();
+            size_t last = std::lower_bound(inner->keys.begin(), keys_end, hi,
+                                           kcmp) -
+                          inner->keys.begin();
+
+            for (size_t i = first; i <= last; i++) {
+                if (!inner->child_cache[i]) {
+                    if (inner->child_pages[i] == Page::INVALID_PAGE_ID) continue;
+                    inner->child_cache[i] =
+                        read_node(inner, inner->child_pages[i]);
+                    if (!inner->child_cache[i]) continue;
+                }
+
+                std::optional<K> child_lo =
+                    i == 0 ? node_lo : std::optional<K>(inner->keys[i - 1]);
+                std::optional<K> child_hi =
+                    i == size ? node_hi : std::optional<K>(inner->keys[i]);
+                size_t height =
+                    erase_subrange(inner->child_cache[i].get(), false, child_lo,
+                                   child_hi, lo, hi, detached, erased);
+                if (height) child_height = height;
+            }
+
+            /* all children of a node are at the same height */
+            for (size_t k = first_detached; k < end_detached; k++) {
+                detached[k].height = child_height;
+            }
+        } catch (OLCRestart&) {
+            inner->write_unlock();
+            throw;
+        }
+
+        inner->write_unlock();
+        return child_height ? child_height + 1 : 0;
+    }
+
+    /* unlink the children of a write-locked inner node that lie entirely in
+     * [lo, hi). at least one child is kept. throws OLCRestart */
+    void detach_children(InnerNodeType* inner, const std::optional<K>& node_lo,
+                         const std::optional<K>& node_hi, const K& lo,
+                         const K& hi, std::vector<DetachedSubtree>& detached)
+    {
+        /* child i holds keys in [keys[i - 1], keys[i]], duplicates of a
+         * separator can sit on both sides of it. a child is covered if its
+         * upper bound is below hi, the covered children are contiguous */
+        size_t size = inner->get_size();
+        size_t first = size + 1, last = 0;
+        for (size_t i = 0; i <= size; i++) {
+            const K* child_lo = i == 0 ? (node_lo ? &*node_lo : nullptr)
+                                       : &inner->keys[i - 1];
+            const K* child_hi = i == size ? (node_hi ? &*node_hi : nullptr)
+                                          : &inner->keys[i];
+            if (child_lo && child_hi && !kcmp(*child_lo, lo) &&
+                kcmp(*child_hi, hi)) {
+                if (first > size) first = i;
+                last = i;
+            }
+        }
+        if (first > size || (first == 0 && last == size)) return;
+
+        std::vector<NodeType*> locked;
+        for (size_t i = first; i <= last; i++) {
+            auto* child = inner->child_cache[i].get();
+            if (child && !lock_subtree(child, locked)) {
+                for (auto* n : locked) {
+                    n->write_unlock();
+                }
+                throw OLCRestart();
+            }
+        }
+
+        if (shadow_paging) {
+            std::lock_guard<std::mutex> guard(alloc_mutex);
+            for (auto* n : locked) {
+                dirty_nodes.erase(n);
+            }
+        }
+        for (auto* n : locked) {
+            n->write_unlock_obsolete();
+        }
+
+        size_t count = last - first + 1;
+        for (size_t i = first; i <= last; i++) {
+            detached.push_back(DetachedSubtree{inner->child_pages[i],
+                                               std::move(inner->child_cache[i]),
+                                               0});
+        }
+
+        /* drop the separator on the side of the kept neighbour */
+        size_t key_pos = last < size ? first : first - 1;
+        std::move(inner->keys.begin() + key_pos + count,
+                  inner->keys.begin() + size, inner->keys.begin() + key_pos);
+        for (size_t i = last + 1; i <= size; i++) {
+            inner->child_pages[i - count] = inner->child_pages[i];
+            inner->child_cache[i - count] = std::move(inner->child_cache[i]);
+        }
+        for (size_t i = size + 1 - count; i <= size; i++) {
+            inner->child_pages[i] = Page::INVALID_PAGE_ID;
+            inner->child_cache[i].reset();
+        }
+        inner->set_size(size - count);
+
+        write_node(inner);
+    }
 
-    /* metadata: | magic(4 bytes) | root page id(4 bytes) | */
-    bool read_metadata()
+    /* write-lock the loaded nodes of a subtree, parents first, and append
+     * them to locked. returns false if one of them is busy */
+    bool lock_subtree(NodeType* node, std::vector<NodeType*>& locked)
+    {
+        bool need_restart;
+        node->write_lock_or_restart(need_restart);
+        if (need_restart) return false;
+        locked.push_back(node);
+
+        if (!node->is_leaf()) {
+            auto* inner = static_cast<InnerNodeType*>(node);
+            for (size_t i = 0; i <= inner->get_size(); i++) {
+                auto* child = inner->child_cache[i].get();
+                if (child && !lock_subtree(child, locked)) return false;
+            }
+        }
+        return true;
+    }
+
+    /* call fn(leaf, upper) on the leaf that covers key (the leftmost leaf if key
+     * is null) without locking it. fn may be called several times and must
+     * only copy data out of the leaf */
+    template <typename F> void read_leaf(const K* key, F&& fn)
+    {
+        auto epoch = epochs.enter();
+
+        while (true) {
+            try {
+                uint64_t bv = read_batch_version();
+
+                NodeType* parent;
+                uint64_t version, parent_version;
+                std::optional<K> upper;
+
+                auto* leaf =
+                    find_leaf(key, version, parent, parent_version, upper);
+                if (parent && parent->read_unlock_or_restart(parent_version))
+                    throw OLCRestart();
+
+                fn(leaf, upper);
+
+                if (leaf->read_unlock_or_restart(version)) continue;
+                if (batch_version.load() != bv) continue;
+                return;
+            } catch (OLCRestart&) {
+                continue;
+            }
+        }
+    }
+
+    /* partitions per degree of parallelism, so that workers that finish
+     * early take over the rest of the work */
+    static const size_t SCAN_PARTITIONS_PER_THREAD = 4;
+    /* leaves that a scan asks the page cache to read ahead */
+    static const size_t SCAN_READ_AHEAD = 8;
+
+    template <typename F>
+    size_t scan_partitions(const std::optional<K>& lo,
+                           const std::optional<K>& hi, size_t num_threads,
+                           F& visitor, bool ordered)
+    {
+        if (num_threads == 0) num_threads = executor->get_num_workers();
+
+        std::vector<std::optional<K>> bounds{lo};
+        {
+            auto epoch = epochs.enter();
+            std::vector<K> keys;
+            size_t want = num_threads * SCAN_PARTITIONS_PER_THREAD;
+            collect_separators(lo, hi, want, keys);
+
+            size_t parts = std::min(want, keys.size() + 1);
+            for (size_t p = 1; p < parts; p++) {
+                const K& key = keys[(keys.size() + 1) * p / parts - 1];
+                if (!bounds.back() || kcmp(*bounds.back(), key)) {
+                    bounds.push_back(key);
+                }
+            }
+        }
+        bounds.push_back(hi);
+
+        size_t num_parts = bounds.size() - 1;
+        std::atomic<size_t> count(0);
+        TaskGroup group(*executor);
+
+        if (!ordered) {
+            /* num_threads tasks take the partitions in turn */
+            std::atomic<size_t> next_part(0);
+            for (size_t t = 0; t < std::min(num_threads, num_parts); t++) {
+                group.run([&] {
+                    size_t p;
+                    while ((p = next_part++) < num_parts) {
+                        count += scan_partition(bounds[p], bounds[p + 1], hi,
+                                                visitor);
+                    }
+                });
+            }
+            group.wait();
+            return count.load();
+        }
+
+        /* partition results buffered for the calling thread */
+        struct Partition {
+            std::vector<std::pair<K, V>> pairs;
+            bool done = false;
+        };
+        std::vector<Partition> results(num_parts);
+        std::mutex result_mutex;
+        std::condition_variable result_cv;
+        bool failed = false;
+
+        auto run_partition = [&](size_t p) {
+            group.run([&, p] {
+                std::vector<std::pair<K, V>> pairs;
+                try {
+                    scan_partition(bounds[p], bounds[p + 1], hi,
+                                   [&](const K& key, const V& value) {
+                                       pairs.emplace_back(key, value);
+                                   });
+                } catch (...) {
+                    std::lock_guard<std::mutex> guard(result_mutex);
+                    failed = true;
+                    result_cv.notify_all();
+                    throw;
+                }
+
+                std::lock_guard<std::mutex> guard(result_mutex);
+                results[p].pairs = std::move(pairs);
+                results[p].done = true;
+                result_cv.notify_all();
+            });
+        };
+
+        /* a partition is only started once the one num_threads before it is
+         * consumed, which bounds the pairs buffered ahead of the caller */
+        size_t window = std::min(num_threads, num_parts);
+        for (size_t p = 0; p < window; p++) {
+            run_partition(p);
+        }
+
+        try {
+            for (size_t p = 0; p < num_parts; p++) {
+                /* scan partitions that no worker took yet while waiting */
+                while (true) {
+                    {
+                        std::lock_guard<std::mutex> guard(result_mutex);
+                        if (results[p].done || failed) break;
+                    }
+                    if (!group.run_one()) break;
+                }
+
+                std::vector<std::pair<K, V>> pairs;
+                {
+                    std::unique_lock<std::mutex> lock(result_mutex);
+                    result_cv.wait(lock,
+                                   [&] { return results[p].done || failed; });
+                    if (!results[p].done) break;
+                    pairs.swap(results[p].pairs);
+                }
+                if (p + window < num_parts) run_partition(p + window);
+
+                for (auto&& kv : pairs) {
+                    visitor(kv.first, kv.second);
+                }
+                count += pairs.size();
+            }
+        } catch (...) {
+            group.cancel();
+            throw;
+        }
+
+        /* rethrows the error of a failed partition */
+        group.wait();
+        return count.load();
+    }
+
+    /* separator keys inside (lo, hi) of the highest inner level that has at
+     * least want of them, or of the deepest level whose nodes are all in
+     * memory. the caller is inside an epoch */
+    void collect_separators(const std::optional<K>& lo,
+                            const std::optional<K>& hi, size_t want,
+                            std::vector<K>& keys)
+    {
+        while (true) {
+            try {
+                keys.clear();
+                std::vector<NodeType*> level{root.get()};
+                bool complete = true;
+
+                while (complete && keys.size() < want) {
+                    std::vector<NodeType*> next;
+                    std::vector<K> level_keys;
+                    bool next_complete = true;
+
+                    for (auto* node : level) {
+                        if (!node || node->is_leaf()) break;
+
+                        bool need_restart;
+                        uint64_t version = node->read_lock_or_restart(need_restart);
+                        if (need_restart) throw OLCRestart();
+
+                        /* child i covers [keys[i - 1], keys[i]) */
+                        auto* inner = static_cast<InnerNodeType*>(node);
+                        size_t size = inner->get_size();
+                        for (size_t i = 0; i <= size; i++) {
+                            if (i > 0 && hi && !kcmp(inner->keys[i - 1], *hi))
+                                break;
+                            if (i < size && lo && !kcmp(*lo, inner->keys[i]))
+                                continue;
+
+                            if (i > 0 && (!lo || kcmp(*lo, inner->keys[i - 1]))) {
+                                level_keys.push_back(inner->keys[i - 1]);
+                            }
+                            auto* child = inner->child_cache[i].get();
+                            if (child) {
+                                next.push_back(child);
+                            } else {
+                                next_complete = false;
+                            }
+                        }
+
+                        if (node->read_unlock_or_restart(version))
+                            throw OLCRestart();
+                    }
+
+                    if (level_keys.size() > keys.size()) keys.swap(level_keys);
+                    if (next.empty()) break;
+                    level.swap(next);
+                    complete = next_complete;
+                }
+                return;
+            } catch (OLCRestart&) {
+                continue;
+            }
+        }
+    }
+
+    /* visit the pairs with keys in [from, to) that are also below hi, and
+     * the pairs with keys equal to a to below hi that sit in leaves bounded
+     * by it. the partition that starts at to begins at the leaf after them.
+     * returns the number of pairs visited */
+    template <typename F>
+    size_t scan_partition(const std::optional<K>& from,
+                          const std::optional<K>& to,
+                          const std::optional<K>& hi, F&& visitor)
+    {
+        std::vector<K> keys;
+        std::vector<V> values;
+        std::vector<PageID> ahead, last_ahead;
+        std::optional<K> key = from, next_key;
+        size_t count = 0;
+
+        while (true) {
+            read_leaf_ahead(key ? &*key : nullptr, next_key, keys, values,
+                            ahead);
+
+            /* the window moves by one leaf at a time, only ask for the
+             * leaves that were not in the last one */
+            std::vector<PageID> pids;
+            for (auto pid : ahead) {
+                if (std::find(last_ahead.begin(), last_ahead.end(), pid) ==
+                    last_ahead.end()) {
+                    pids.push_back(pid);
+                }
+            }
+            if (!pids.empty()) page_cache->read_ahead(pids);
+            last_ahead.swap(ahead);
+
+            /* duplicates of a separator may sit on both sides of it */
+            bool own_to = to && next_key && !kcmp(*next_key, *to) &&
+                          !kcmp(*to, *next_key) && (!hi || kcmp(*to, *hi));
+
+            size_t i = 0;
+            if (key) {
+                i = std::lower_bound(keys.begin(), keys.end(), *key, kcmp) -
+                    keys.begin();
+            }
+            for (; i < keys.size(); i++) {
+                if (to && (own_to ? kcmp(*to, keys[i]) : !kcmp(keys[i], *to)))
+                    return count;
+                visitor(keys[i], values[i]);
+                count++;
+            }
+
+            if (!next_key || (to && !kcmp(*next_key, *to))) break;
+            key = next_key;
+        }
+        return count;
+    }
+
+    /* copy the pairs of the leaf that covers key (the leftmost leaf if null)
+     * and collect the page IDs of the siblings that follow it and are not in
+     * memory */
+    void read_leaf_ahead(const K* key, std::optional<K>& next_key,
+                         std::vector<K>& key_list, std::vector<V>& value_list,
+                         std::vector<PageID>& ahead)
+    {
+        auto epoch = epochs.enter();
+
+        while (true) {
+            try {
+                uint64_t bv = read_batch_version();
+
+                NodeType* parent;
+                uint64_t version, parent_version;
+                std::optional<K> upper;
+
+                auto* leaf =
+                    find_leaf(key, version, parent, parent_version, upper);
+
+                ahead.clear();
+                if (parent) {
+                    auto* inner = static_cast<InnerNodeType*>(parent);
+                    size_t size = inner->get_size();
+                    size_t i = 0;
+                    while (i <= size && inner->child_cache[i].get() != leaf) {
+                        i++;
+                    }
+                    for (i++; i <= size && ahead.size() < SCAN_READ_AHEAD; i++) {
+                        if (!inner->child_cache[i]) {
+                            ahead.push_back(inner->child_pages[i]);
+                        }
+                    }
+                    if (parent->read_unlock_or_restart(parent_version))
+                        throw OLCRestart();
+                }
+
+                key_list.assign(leaf->keys.begin(),
+                                leaf->keys.begin() + leaf->get_size());
+                value_list.assign(leaf->values.begin(),
+                                  leaf->values.begin() + leaf->get_size());
+                next_key = upper;
+
+                if (leaf->read_unlock_or_restart(version)) continue;
+                if (batch_version.load() != bv) continue;
+                return;
+            } catch (OLCRestart&) {
+                continue;
+            }
+        }
+    }
+
+    void collect_first_values(std::optional<K>* next_key,
+                              std::vector<K>& key_list,
+                              std::vector<V>& value_list)
+    {
+        read_leaf(nullptr, [&](LeafNodeType* leaf,
+                               const std::optional<K>& upper) {
+            key_list.assign(leaf->keys.begin(),
+                            leaf->keys.begin() + leaf->get_size());
+            value_list.assign(leaf->values.begin(),
+                              leaf->values.begin() + leaf->get_size());
+            *next_key = upper;
+        });
+    }
+
+    /* metadata: | header | free page IDs | where the header holds the magic,
+     * flags, commit epoch, # pairs, root page ID, # free page IDs and a
+     * checksum over the whole record. the magic encodes the format version:
+     * V3 has 64-bit page IDs, V2 is the same record with 32-bit page IDs and
+     * the legacy layout is
+     * | magic(4 bytes) | root page id(4 bytes) | # pairs(4 bytes) |.
+     * older formats are still accepted when reading. trees read from them
+     * keep compact child pointers. with META_FLAG_FREE_CHAIN set, the first
+     * free page ID is the head of a chain of free list pages holding the IDs
+     * that do not fit the meta page. with META_FLAG_DELAYED_FREE set, the
+     * free list ends with groups | epoch | # pages | page IDs | of pages that
+     * are not free before that epoch plus the free page delay, followed by
+     * the number of entries in the groups */
+    struct MetaHeader {
+        uint32_t magic;
+        uint32_t flags;
+        uint64_t epoch;
+        uint64_t num_pairs;
+        PageID root_pid;
+        uint32_t num_free;
+        uint32_t checksum;
+    };
+
+    /* free list page: | header | free page IDs |. epoch is the epoch of the
+     * record that the chain belongs to, checksum covers the header and the
+     * IDs */
+    struct FreeChainHeader {
+        uint32_t magic;
+        uint32_t num_free;
+        uint64_t epoch;
+        PageID next_pid;
+        uint32_t checksum;
+        uint32_t reserved;
+    };
+
+    struct MetaHeaderV2 {
+        uint32_t magic;
+        uint32_t flags;
+        uint64_t epoch;
+        uint64_t num_pairs;
+        uint32_t root_pid;
+        uint32_t num_free;
+        uint32_t checksum;
+    };
+
+    static uint32_t meta_checksum(const uint8_t* buf, size_t len)
+    {
+        /* FNV-1a */
+        uint32_t hash = 0x811C9DC5;
+        for (size_t i = 0; i < len; i++) {
+            hash = (hash ^ buf[i]) * 0x01000193;
+        }
+        return hash;
+    }
+
+    /* check the checksum of a record whose header is of type H and copy its
+     * free list of page IDs of type I */
+    template <typename H, typename I>
+    static bool read_meta_record(const uint8_t* buf, size_t page_size,
+                                 std::vector<PageID>& free_list)
+    {
+        H header;
+        ::memcpy(&header, buf, sizeof(H));
+        if (header.num_free > (page_size - sizeof(H)) / sizeof(I)) {
+            return false;
+        }
+
+        size_t len = sizeof(H) + header.num_free * sizeof(I);
+        std::vector<uint8_t> record(buf, buf + len);
+        reinterpret_cast<H*>(record.data())->checksum = 0;
+        if (meta_checksum(record.data(), len) != header.checksum) {
+            return false;
+        }
+
+        const auto* ids = reinterpret_cast<const I*>(&buf[sizeof(H)]);
+        free_list.assign(ids, ids + header.num_free);
+        return true;
+    }
+
+    /* returns false if the meta page does not exist. valid is set if the page
+     * holds an intact record, a torn meta page exists but is not valid */
+    bool read_meta_slot(PageID pid, MetaHeader& header,
+                        std::vector<PageID>& free_list, bool& valid)
     {
         boost::upgrade_lock<Page> lock;
-        auto page = page_cache->fetch_page(META_PAGE_ID, lock);
+        Page* page;
+        valid = false;
+        try {
+            page = page_cache->fetch_page(pid, lock);
+        } catch (CorruptPageException&) {
+            ::memset(&header, 0, sizeof(MetaHeader));
+            return true;
+        }
         if (!page) return false;
 
         const auto* buf = page->get_buffer(lock);
-        buf += sizeof(uint32_t);
-        PageID root_pid = (PageID) * reinterpret_cast<const uint32_t*>(buf);
-        buf += sizeof(uint32_t);
-        size_t pair_count = *reinterpret_cast<const uint32_t*>(buf);
-        root = read_node(nullptr, root_pid);
-        num_pairs.store(pair_count);
+        ::memcpy(&header, buf, sizeof(MetaHeader));
+        valid = false;
+
+        if (header.magic == META_PAGE_MAGIC) {
+            /* legacy layout */
+            header.flags = META_FLAG_COMPACT_CHILDREN;
+            header.epoch = 0;
+            header.root_pid = (PageID) * reinterpret_cast<const uint32_t*>(
+                                             &buf[sizeof(uint32_t)]);
+            header.num_pairs = *reinterpret_cast<const uint32_t*>(
+                &buf[2 * sizeof(uint32_t)]);
+            free_list.clear();
+            valid = true;
+        } else if (header.magic == META_PAGE_MAGIC_V2) {
+            MetaHeaderV2 v2;
+            ::memcpy(&v2, buf, sizeof(MetaHeaderV2));
+            valid = read_meta_record<MetaHeaderV2, uint32_t>(
+                buf, page->get_size(), free_list);
+
+            header.flags = v2.flags | META_FLAG_COMPACT_CHILDREN;
+            header.epoch = v2.epoch;
+            header.num_pairs = v2.num_pairs;
+            header.root_pid = v2.root_pid;
+        } else if (header.magic == META_PAGE_MAGIC_V3) {
+            valid = read_meta_record<MetaHeader, PageID>(buf, page->get_size(),
+                                                         free_list);
+        }
 
         page_cache->unpin_page(page, false, lock);
+        return true;
+    }
+
+    /* the header of the newer valid meta slot. returns false if there is no
+     * meta page */
+    bool read_meta_header(MetaHeader& header, std::vector<PageID>& free_list,
+                          bool& valid)
+    {
+        if (!read_meta_slot(meta_pids[0], header, free_list, valid)) {
+            return false;
+        }
+
+        /* the second meta page only exists in shadow paging mode. it is also
+         * checked when the first one is torn */
+        if (!valid || (header.flags & META_FLAG_SHADOW)) {
+            MetaHeader alt_header;
+            std::vector<PageID> alt_free_list;
+            bool alt_valid;
+
+            if (read_meta_slot(meta_pids[1], alt_header, alt_free_list,
+                               alt_valid) &&
+                alt_valid && alt_header.magic != META_PAGE_MAGIC &&
+                (alt_header.flags & META_FLAG_SHADOW) &&
+                (!valid || alt_header.epoch > header.epoch)) {
+                header = alt_header;
+                free_list.swap(alt_free_list);
+                valid = true;
+            }
+        }
+
+        return true;
+    }
+
+    bool read_metadata()
+    {
+        MetaHeader header;
+        std::vector<PageID> free_list;
+        bool valid;
+
+        if (!read_meta_header(header, free_list, valid)) {
+            return false;
+        }
+
+        if (!valid) {
+            throw std::runtime_error("bad tree metadata");
+        }
+
+        shadow_paging = (header.flags & META_FLAG_SHADOW) != 0;
+        compact_child_pages = (header.flags & META_FLAG_COMPACT_CHILDREN) != 0;
+        free_page_delay = header.flags >> META_FREE_DELAY_SHIFT;
+        meta_epoch = header.epoch;
+        committed_root_pid = header.root_pid;
+        committed_pairs = header.num_pairs;
+        free_chain.clear();
+        if ((header.flags & META_FLAG_FREE_CHAIN) && !free_list.empty()) {
+            PageID head = free_list.front();
+            free_list.erase(free_list.begin());
+            /* readers never allocate pages */
+            if (!read_only) {
+                read_free_chain(head, header.epoch, free_list, free_chain);
+            }
+        }
+        delayed_free.clear();
+        if ((header.flags & META_FLAG_DELAYED_FREE) && !read_only) {
+            read_delayed_free(free_list);
+        }
+        free_pages.swap(free_list);
+        root = read_node(nullptr, header.root_pid);
+        num_pairs.store(header.num_pairs);
+        if (header.flags & META_FLAG_COUNT_PENDING) {
+            /* the last erase_range() did not finish counting what it
+             * unlinked */
+            std::vector<PageID> pids;
+            size_t pairs = 0;
+            reclaimer->collect_subtree_pages(root.get(), root->get_pid(), 0,
+                                             true, pids, pairs);
+            num_pairs.store(pairs);
+        }
 
         return true;
     }
 
-    void write_metadata()
+    /* move the groups of delayed pages at the end of free_list to
+     * delayed_free, or back to free_list if their delay is over */
+    void read_delayed_free(std::vector<PageID>& free_list)
+    {
+        if (free_list.empty() || free_list.back() >= free_list.size()) {
+            throw std::runtime_error("bad tree metadata");
+        }
+        size_t end = free_list.size() - 1;
+        size_t pos = end - free_list.back();
+
+        std::vector<PageID> released;
+        while (pos < end) {
+            if (end - pos < 2 || free_list[pos + 1] > end - pos - 2) {
+                throw std::runtime_error("bad tree metadata");
+            }
+            uint64_t epoch = free_list[pos];
+            auto first = free_list.begin() + pos + 2;
+            auto last = first + free_list[pos + 1];
+            if (epoch + free_page_delay <= meta_epoch) {
+                released.insert(released.end(), first, last);
+            } else {
+                delayed_free.emplace_back(epoch,
+                                          std::vector<PageID>(first, last));
+            }
+            pos += 2 + free_list[pos + 1];
+        }
+
+        free_list.resize(end - free_list.back());
+        free_list.insert(free_list.end(), released.begin(), released.end());
+    }
+
+    /* append the free page IDs in the chain of free list pages starting at
+     * pid to free_list and the pages of the chain to chain. the walk stops at
+     * the first page that is not part of the record of the given epoch, the
+     * IDs from there on are leaked */
+    void read_free_chain(PageID pid, uint64_t epoch,
+                         std::vector<PageID>& free_list,
+                         std::vector<PageID>& chain)
+    {
+        while (pid != Page::INVALID_PAGE_ID) {
+            boost::upgrade_lock<Page> lock;
+            Page* page;
+            try {
+                page = page_cache->fetch_page(pid, lock);
+            } catch (CorruptPageException&) {
+                return;
+            }
+            if (!page) return;
+
+            const auto* buf = page->get_buffer(lock);
+            FreeChainHeader header;
+            ::memcpy(&header, buf, sizeof(FreeChainHeader));
+            size_t capacity =
+                (page->get_size() - sizeof(FreeChainHeader)) / sizeof(PageID);
+            bool valid = header.magic == FREE_CHAIN_MAGIC &&
+                         header.epoch == epoch && header.num_free <= capacity;
+
+            if (valid) {
+                size_t len =
+                    sizeof(FreeChainHeader) + header.num_free * sizeof(PageID);
+                std::vector<uint8_t> record(buf, buf + len);
+                reinterpret_cast<FreeChainHeader*>(record.data())->checksum = 0;
+                valid = meta_checksum(record.data(), len) == header.checksum;
+            }
+            if (valid) {
+                const auto* ids =
+                    reinterpret_cast<const PageID*>(&buf[sizeof(FreeChainHeader)]);
+                free_list.insert(free_list.end(), ids, ids + header.num_free);
+                chain.push_back(pid);
+                pid = header.next_pid;
+            }
+
+            page_cache->unpin_page(page, false, lock);
+            if (!valid) return;
+        }
+    }
+
+    /* the metadata written after every change leaves free page IDs beyond the
+     * capacity of the meta page out, they only leak if the process stops
+     * without close() or commit(), which write all of them. while no free
+     * page has been handed out since the last full record, only the root and
+     * the pair count of the record are rewritten. pages freed meanwhile are
+     * left out until the next full record */
+    void write_metadata(bool with_chain = false)
+    {
+        /* in shadow paging mode the metadata is only written by commit() */
+        if (shadow_paging) return;
+
+        if (!with_chain && meta_free_list_current && write_meta_counts()) {
+            return;
+        }
+        write_meta_slot(0, with_chain);
+    }
+
+    /* update the root, the pair count and the checksum of the record in the
+     * first meta slot. returns false if the slot does not hold a full
+     * record */
+    bool write_meta_counts()
+    {
+        boost::upgrade_lock<Page> lock;
+        auto page = page_cache->fetch_page_for_overwrite(meta_pids[0], lock);
+        bool written = false;
+
+        {
+            boost::upgrade_to_unique_lock<Page> ulock(lock);
+            auto* buf = page->get_buffer(ulock);
+
+            MetaHeader header;
+            ::memcpy(&header, buf, sizeof(MetaHeader));
+            size_t max_free =
+                (meta_page_size - sizeof(MetaHeader)) / sizeof(PageID);
+            if (header.magic == META_PAGE_MAGIC_V3 &&
+                header.num_free <= max_free) {
+                header.flags = (header.flags & ~META_FLAG_COUNT_PENDING) |
+                               (uncounted_tasks.load() ? META_FLAG_COUNT_PENDING
+                                                       : 0);
+                header.num_pairs = num_pairs.load();
+                header.root_pid = root->get_pid();
+                header.checksum = 0;
+
+                ::memcpy(buf, &header, sizeof(MetaHeader));
+                header.checksum = meta_checksum(
+                    buf, sizeof(MetaHeader) + header.num_free * sizeof(PageID));
+                ::memcpy(buf, &header, sizeof(MetaHeader));
+                written = true;
+            }
+        }
+
+        page_cache->unpin_page(page, written, lock);
+        return written;
+    }
+
+    size_t read_meta_page_size()
+    {
+        boost::upgrade_lock<Page> lock;
+        auto page = page_cache->fetch_page_for_overwrite(meta_pids[0], lock);
+        size_t size = page->get_size();
+        page_cache->unpin_page(page, false, lock);
+        return size;
+    }
+
+    /* write the record to a meta slot. with with_chain set, free page IDs that
+     * do not fit the meta page go to a chain of free list pages taken from
+     * the free list itself, which is durable before the meta page is
+     * written */
+    void write_meta_slot(int slot, bool with_chain)
+    {
+        size_t page_size = meta_page_size;
+        size_t max_free = (page_size - sizeof(MetaHeader)) / sizeof(PageID);
+        size_t chain_capacity =
+            (page_size - sizeof(FreeChainHeader)) / sizeof(PageID);
+
+        std::vector<PageID> free_list;
+        std::vector<PageID> chain;
+        std::vector<PageID> delayed_groups;
+        {
+            std::lock_guard<std::mutex> guard(alloc_mutex);
+            /* only the pages that are free now go to the record */
+            meta_free_list_current = !shadow_paging;
+            /* the chain of the previous record may only be overwritten once
+             * this record is durable */
+            auto& released = shadow_paging ? pending_free : free_pages;
+            released.insert(released.end(), free_chain.begin(),
+                            free_chain.end());
+            free_chain.clear();
+
+            /* a tree reopened from this record can also reuse the pages the
+             * record stops using, unless readers in other processes may
+             * still read them */
+            std::vector<PageID> released_by_commit;
+            if (shadow_paging && free_page_delay == 0) {
+                released_by_commit = pending_free;
+                for (auto&& p : delayed_free) {
+                    released_by_commit.insert(released_by_commit.end(),
+                                              p.second.begin(), p.second.end());
+                }
+            } else if (shadow_paging) {
+                /* otherwise they are kept with the epoch they were released
+                 * in, the pages this record stops using with its own */
+                auto add_group = [&](uint64_t epoch,
+                                     const std::vector<PageID>& pids) {
+                    if (pids.empty()) return;
+                    delayed_groups.push_back(epoch);
+                    delayed_groups.push_back(pids.size());
+                    delayed_groups.insert(delayed_groups.end(), pids.begin(),
+                                          pids.end());
+                };
+                for (auto&& p : delayed_free) {
+                    add_group(p.first, p.second);
+                }
+                add_group(meta_epoch, pending_free);
+                if (!delayed_groups.empty()) {
+                    delayed_groups.push_back(delayed_groups.size());
+                }
+            }
+
+            size_t total = free_pages.size() + released_by_commit.size() +
+                           delayed_groups.size();
+            if (with_chain && total > max_free) {
+                /* the head of the chain takes one slot of the meta page */
+                do {
+                    if (free_pages.empty()) {
+                        boost::upgrade_lock<Page> lock;
+                        auto page = page_cache->new_page(lock);
+                        chain.push_back(page->get_id());
+                        page_cache->unpin_page(page, false, lock);
+                        continue;
+                    }
+                    chain.push_back(free_pages.back());
+                    free_pages.pop_back();
+                    total--;
+                } while (total + 1 > max_free + chain.size() * chain_capacity);
+                free_chain = chain;
+                free_list = free_pages;
+            } else {
+                free_list.assign(free_pages.begin(),
+                                 free_pages.begin() +
+                                     std::min(free_pages.size(), max_free));
+            }
+            free_list.insert(free_list.end(), released_by_commit.begin(),
+                             released_by_commit.end());
+            if (chain.empty() && free_list.size() > max_free) {
+                free_list.resize(max_free);
+            }
+            /* the groups are only written in full */
+            if (!chain.empty() ||
+                free_list.size() + delayed_groups.size() <= max_free) {
+                free_list.insert(free_list.end(), delayed_groups.begin(),
+                                 delayed_groups.end());
+            } else {
+                delayed_groups.clear();
+            }
+        }
+
+        size_t num_inline = free_list.size();
+        if (!chain.empty()) {
+            num_inline = std::min(free_list.size(), max_free - 1);
+            for (size_t i = 0; i < chain.size(); i++) {
+                size_t begin =
+                    std::min(free_list.size(), num_inline + i * chain_capacity);
+                size_t end = std::min(free_list.size(), begin + chain_capacity);
+                write_free_chain_page(
+                    chain[i],
+                    i + 1 < chain.size() ? chain[i + 1] : Page::INVALID_PAGE_ID,
+                    free_list.data() + begin, end - begin);
+            }
+            page_cache->flush_all_pages();
+            page_cache->sync();
+        }
+
+        boost::upgrade_lock<Page> lock;
+        auto page = page_cache->fetch_page_for_overwrite(meta_pids[slot], lock);
+
+        {
+            boost::upgrade_to_unique_lock<Page> ulock(lock);
+            auto* buf = page->get_buffer(ulock);
+
+            MetaHeader header;
+            ::memset(&header, 0, sizeof(header));
+            header.magic = META_PAGE_MAGIC_V3;
+            header.flags = (shadow_paging ? META_FLAG_SHADOW : 0) |
+                           (compact_child_pages ? META_FLAG_COMPACT_CHILDREN : 0) |
+                           (chain.empty() ? 0 : META_FLAG_FREE_CHAIN) |
+                           (delayed_groups.empty() ? 0
+                                                   : META_FLAG_DELAYED_FREE) |
+                           (uncounted_tasks.load() ? META_FLAG_COUNT_PENDING
+                                                   : 0) |
+                           (std::min<uint32_t>(free_page_delay, 0xFFFF)
+                            << META_FREE_DELAY_SHIFT);
+            header.epoch = meta_epoch;
+            header.num_pairs = num_pairs.load();
+            header.root_pid = root->get_pid();
+
+            auto* ids = reinterpret_cast<PageID*>(&buf[sizeof(MetaHeader)]);
+            if (!chain.empty()) {
+                *ids++ = chain.front();
+            }
+            ::memcpy(ids, free_list.data(), num_inline * sizeof(PageID));
+            header.num_free = (uint32_t)(num_inline + (chain.empty() ? 0 : 1));
+
+            ::memcpy(buf, &header, sizeof(MetaHeader));
+            header.checksum = meta_checksum(
+                buf, sizeof(MetaHeader) + header.num_free * sizeof(PageID));
+            ::memcpy(buf, &header, sizeof(MetaHeader));
+        }
+
+        page_cache->unpin_page(page, true, lock);
+    }
+
+    void write_free_chain_page(PageID pid, PageID next_pid, const PageID* ids,
+                               size_t count)
     {
         boost::upgrade_lock<Page> lock;
-        auto page = page_cache->fetch_page(META_PAGE_ID, lock);
+        auto page = page_cache->fetch_page_for_overwrite(pid, lock);
 
         {
             boost::upgrade_to_unique_lock<Page> ulock(lock);
             auto* buf = page->get_buffer(ulock);
 
-            *reinterpret_cast<uint32_t*>(buf) = META_PAGE_MAGIC;
-            buf += sizeof(uint32_t);
-            *reinterpret_cast<uint32_t*>(buf) = (uint32_t)root->get_pid();
-            buf += sizeof(uint32_t);
-            *reinterpret_cast<uint32_t*>(buf) = (uint32_t)num_pairs.load();
+            FreeChainHeader header;
+            ::memset(&header, 0, sizeof(header));
+            header.magic = FREE_CHAIN_MAGIC;
+            header.num_free = (uint32_t)count;
+            header.epoch = meta_epoch;
+            header.next_pid = next_pid;
+            ::memcpy(buf, &header, sizeof(FreeChainHeader));
+            ::memcpy(&buf[sizeof(FreeChainHeader)], ids, count * sizeof(PageID));
+            header.checksum = meta_checksum(
+                buf, sizeof(FreeChainHeader) + count * sizeof(PageID));
+            ::memcpy(buf, &header, sizeof(FreeChainHeader));
         }
 
         page_cache->unpin_page(page, true, lock);
     }
+
+    /* allocate a page for a new node in shadow paging mode. recycled pages are
+     * preferred. the page is not referenced by the committed tree so it can
+     * be written in place until the next commit */
+    PageID alloc_shadow_page()
+    {
+        std::lock_guard<std::mutex> guard(alloc_mutex);
+        PageID pid;
+
+        if (!free_pages.empty()) {
+            pid = free_pages.back();
+            free_pages.pop_back();
+        } else {
+            boost::upgrade_lock<Page> lock;
+            auto page = page_cache->new_page(lock);
+            pid = page->get_id();
+            page_cache->unpin_page(page, false, lock);
+        }
+
+        fresh_pages.insert(pid);
+        return pid;
+    }
+
+    /* drop the pages allocated since the last commit from the cache without
+     * writing them. the last commit does not use them */
+    void discard_fresh_pages()
+    {
+        std::vector<PageID> pids;
+        {
+            std::lock_guard<std::mutex> guard(alloc_mutex);
+            pids.assign(fresh_pages.begin(), fresh_pages.end());
+            fresh_pages.clear();
+        }
+        page_cache->discard(pids);
+    }
+
+    /* a read-only tree never writes, and changing it in memory only would
+     * let it drift away from the heap file */
+    void check_writable() const
+    {
+        if (read_only) {
+            throw std::runtime_error("the tree is read-only");
+        }
+    }
+
+    /* writers hold the commit latch in shared mode in shadow paging mode so
+     * that commit() sees a quiescent tree */
+    std::shared_lock<std::shared_mutex> writer_latch()
+    {
+        if (!shadow_paging) return {};
+        return std::shared_lock<std::shared_mutex>(commit_latch);
+    }
+
+    /* erase_range() and clear() exclude all writers in shadow paging mode so
+     * that no unlinked node is left in the set of nodes to commit. in the
+     * default mode they rely on the node locks */
+    std::unique_lock<std::shared_mutex> structure_latch()
+    {
+        if (!shadow_paging) return {};
+        return std::unique_lock<std::shared_mutex>(commit_latch);
+    }
 };
 
 } // namespace bptree
@@ -7,9 +7,11 @@
 #include <atomic>
 #include <functional>
 #include <iostream>
+#include <limits>
 #include <memory>
 #include <optional>
 #include <ostream>
+#include <stdexcept>
 #include <vector>
 
 namespace bptree {
@@ -20,6 +22,12 @@ template <unsigned int N, typename K, typename V, typename KeySerializer,
           typename KeyComparator, typename KeyEq, typename ValueSerializer>
 class BTree;
 
+/* helpers of BTree that work on its nodes */
+template <typename Tree> class BulkBuilder;
+template <typename Tree> class Defragmenter;
+template <typename Tree> class Reclaimer;
+template <typename Tree> class TreeSnapshot;
+
 template <typename K, typename V, typename KeyComparator, typename KeyEq>
 class BaseNode {
 public:
@@ -28,6 +36,7 @@ public:
         : pid(pid), parent(parent), kcmp(kcmp), keq(keq), size(0),
           version_counter(0b100)
     {}
+    virtual ~BaseNode() {}
 
     PageID get_pid() const { return pid; }
     void set_pid(PageID id) { pid = id; }
@@ -78,6 +87,9 @@ public:
     }
 
     virtual void write_unlock() { version_counter.fetch_add(0b10); }
+    /* unlock a node that was unlinked from the tree. readers and writers that
+     * still reach it restart */
+    virtual void write_unlock_obsolete() { version_counter.fetch_add(0b11); }
     virtual bool read_unlock_or_restart(uint64_t start_version) const
     {
         return (start_version != version_counter.load());
@@ -113,6 +125,14 @@ class InnerNode : public BaseNode<K, V, KeyComparator, KeyEq> {
                           ValueSerializer>;
     friend class BTree<N, K, V, KeySerializer, KeyComparator, KeyEq,
                        ValueSerializer>;
+    friend class BulkBuilder<BTree<N, K, V, KeySerializer, KeyComparator,
+                                   KeyEq, ValueSerializer>>;
+    friend class Defragmenter<BTree<N, K, V, KeySerializer, KeyComparator,
+                                    KeyEq, ValueSerializer>>;
+    friend class Reclaimer<BTree<N, K, V, KeySerializer, KeyComparator, KeyEq,
+                                 ValueSerializer>>;
+    friend class TreeSnapshot<BTree<N, K, V, KeySerializer, KeyComparator,
+                                    KeyEq, ValueSerializer>>;
 
 public:
     InnerNode(BTree<N, K, V, KeySerializer, KeyComparator, KeyEq,
@@ -124,7 +144,7 @@ public:
         : BaseNode<K, V, KeyComparator, KeyEq>(parent, pid), tree(tree),
           key_serializer(kser)
     {
-        for (int i = 0; i < N + 1; i++) {
+        for (int i = 0; i < N; i++) {
             child_pages[i] = Page::INVALID_PAGE_ID;
         }
     }
@@ -147,7 +167,13 @@ public:
             }
 
             if (!child_cache[idx]) {
-                child_cache[idx] = tree->read_node(this, child_pages[idx]);
+                try {
+                    child_cache[idx] = tree->read_node(this, child_pages[idx]);
+                } catch (...) {
+                    /* e.g. a corrupt page, which a restart cannot fix */
+                    this->write_unlock();
+                    throw;
+                }
             }
 
             this->write_unlock();
@@ -170,7 +196,22 @@ public:
             key_serializer.serialize(buf, size, keys.begin(), keys.end());
         buf += nbytes;
         size -= nbytes;
-        ::memcpy(buf, child_pages.begin(), sizeof(PageID) * (N + 1));
+        /* the layout has room for N + 1 child pages but only N are used */
+        if (!tree->has_compact_child_pages()) {
+            ::memcpy(buf, child_pages.begin(), sizeof(PageID) * N);
+            return;
+        }
+
+        /* compact layout: 32-bit page IDs with room for N + 1 of them */
+        auto* compact = reinterpret_cast<uint32_t*>(buf);
+        for (size_t i = 0; i < N; i++) {
+            if (child_pages[i] > std::numeric_limits<uint32_t>::max()) {
+                throw std::runtime_error(
+                    "page ID does not fit a compact child pointer");
+            }
+            compact[i] = (uint32_t)child_pages[i];
+        }
+        compact[N] = (uint32_t)Page::INVALID_PAGE_ID;
     }
     virtual void deserialize(const uint8_t* buf, size_t size)
     {
@@ -181,7 +222,14 @@ public:
             key_serializer.deserialize(keys.begin(), keys.end(), buf, size);
         buf += nbytes;
         size -= nbytes;
-        ::memcpy(child_pages.begin(), buf, sizeof(PageID) * (N + 1));
+        if (tree->has_compact_child_pages()) {
+            const auto* compact = reinterpret_cast<const uint32_t*>(buf);
+            for (size_t i = 0; i < N; i++) {
+                child_pages[i] = compact[i];
+            }
+        } else {
+            ::memcpy(child_pages.begin(), buf, sizeof(PageID) * N);
+        }
         for (auto&& p : child_cache) {
             p.reset();
         }
@@ -359,6 +407,14 @@ class LeafNode : public BaseNode<K, V, KeyComparator, KeyEq> {
                        ValueSerializer>;
     friend class BTree<N, K, V, KeySerializer, KeyComparator, KeyEq,
                        ValueSerializer>::iterator;
+    friend class BulkBuilder<BTree<N, K, V, KeySerializer, KeyComparator,
+                                   KeyEq, ValueSerializer>>;
+    friend class Defragmenter<BTree<N, K, V, KeySerializer, KeyComparator,
+                                    KeyEq, ValueSerializer>>;
+    friend class Reclaimer<BTree<N, K, V, KeySerializer, KeyComparator, KeyEq,
+                                 ValueSerializer>>;
+    friend class TreeSnapshot<BTree<N, K, V, KeySerializer, KeyComparator,
+                                    KeyEq, ValueSerializer>>;
 
 public:
     LeafNode(BTree<N, K, V, KeySerializer, KeyComparator, KeyEq,
@@ -426,7 +482,7 @@ public:
             if (lower == keys.begin() + this->size) return;
 
             auto upper = lower;
-            while (this->keq(key, *upper))
+            while (upper != keys.begin() + this->size && this->keq(key, *upper))
                 upper++;
 
             std::copy(&values[lower - keys.begin()],
@@ -497,6 +553,20 @@ public:
         }
 
         /* we may assume current will not overflow at this point */
+        insert_entry(key, val);
+
+        tree->write_node(this);
+        this->write_unlock();
+
+        return nullptr;
+    }
+
+    bool is_full() const { return this->size == N - 1; }
+
+    /* insert a pair into this leaf. the caller must hold the write lock and
+     * make sure the leaf is not full */
+    void insert_entry(const K& key, const V& val)
+    {
         auto it = std::upper_bound(keys.begin(), keys.begin() + this->size, key,
                                    this->kcmp);
         size_t pos = it - keys.begin();
@@ -508,11 +578,50 @@ public:
         keys[pos] = key;
         values[pos] = val;
         this->size++;
+    }
 
-        tree->write_node(this);
-        this->write_unlock();
+    /* remove all pairs with the given key from this leaf. the caller must hold
+     * the write lock. returns the number of pairs removed */
+    size_t erase_entries(const K& key)
+    {
+        auto lower = std::lower_bound(keys.begin(), keys.begin() + this->size,
+                                      key, this->kcmp);
+        auto upper = std::upper_bound(lower, keys.begin() + this->size, key,
+                                      this->kcmp);
+        size_t first = lower - keys.begin();
+        size_t last = upper - keys.begin();
+        size_t count = last - first;
+
+        if (count == 0) return 0;
+
+        ::memmove(&keys[first], &keys[last], (this->size - last) * sizeof(K));
+        ::memmove(&values[first], &values[last],
+                  (this->size - last) * sizeof(V));
+        this->size -= count;
+
+        return count;
+    }
 
-        return nullptr;
+    /* remove all pairs with keys in [lo, hi). the caller must hold the write
+     * lock. returns the number of pairs removed */
+    size_t erase_range(const K& lo, const K& hi)
+    {
+        auto lower = std::lower_bound(keys.begin(), keys.begin() + this->size,
+                                      lo, this->kcmp);
+        auto upper = std::lower_bound(lower, keys.begin() + this->size, hi,
+                                      this->kcmp);
+        size_t first = lower - keys.begin();
+        size_t last = upper - keys.begin();
+        size_t count = last - first;
+
+        if (count == 0) return 0;
+
+        ::memmove(&keys[first], &keys[last], (this->size - last) * sizeof(K));
+        ::memmove(&values[first], &values[last],
+                  (this->size - last) * sizeof(V));
+        this->size -= count;
+
+        return count;
     }
 
     virtual void print(std::ostream& os, const std::string& padding = "")
@@ -0,0 +1,40 @@
+#ifndef _BPTREE_WRITE_BATCH_H_
+#define _BPTREE_WRITE_BATCH_H_
+
+#include <cstddef>
+#include <vector>
+
+namespace bptree {
+
+/* a group of puts and erases that BTree::write() applies as one unit. operations
+ * on the same key take effect in the order they were added */
+template <typename K, typename V> class WriteBatch {
+public:
+    enum class OpType { PUT, ERASE };
+
+    struct Op {
+        OpType type;
+        K key;
+        V value;
+    };
+
+    void put(const K& key, const V& value)
+    {
+        ops.push_back(Op{OpType::PUT, key, value});
+    }
+
+    void erase(const K& key) { ops.push_back(Op{OpType::ERASE, key, V{}}); }
+
+    void clear() { ops.clear(); }
+    size_t size() const { return ops.size(); }
+    bool empty() const { return ops.empty(); }
+
+    const std::vector<Op>& get_ops() const { return ops; }
+
+private:
+    std::vector<Op> ops;
+};
+
+} // namespace bptree
+
+#endif
@@ -0,0 +1,261 @@
+#include "../include/bptree/catalog.h"
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+namespace bptree {
+
+Catalog::Catalog(AbstractPageCache* page_cache)
+    : page_cache(page_cache), last_page_entries(0), version(2)
+{
+    /* magic and entry count are at the same place in both versions */
+    CatalogHeader header;
+    {
+        boost::upgrade_lock<Page> lock;
+        auto* page = page_cache->fetch_page(CATALOG_PAGE_ID, lock);
+
+        if (!page) {
+            page = page_cache->new_page(lock);
+            if (page->get_id() != CATALOG_PAGE_ID) {
+                page_cache->unpin_page(page, false, lock);
+                throw std::runtime_error(
+                    "catalog must be created in an empty file");
+            }
+
+            ::memset(&header, 0, sizeof(header));
+        } else {
+            ::memcpy(&header, page->get_buffer(lock), sizeof(header));
+        }
+
+        page_cache->unpin_page(page, false, lock);
+    }
+
+    if (header.magic == 0 && header.num_entries == 0) {
+        /* allocated but never written */
+        init_page(CATALOG_PAGE_ID);
+        catalog_pages.push_back(CATALOG_PAGE_ID);
+        return;
+    }
+
+    if (header.magic == CATALOG_MAGIC_V1) {
+        version = 1;
+    } else if (header.magic != CATALOG_MAGIC) {
+        throw std::runtime_error("heap file has no catalog");
+    }
+
+    load();
+}
+
+size_t Catalog::header_size() const
+{
+    return version == 1 ? sizeof(CatalogHeaderV1) : sizeof(CatalogHeader);
+}
+
+size_t Catalog::entry_size() const
+{
+    return version == 1 ? sizeof(CatalogEntryV1) : sizeof(CatalogEntry);
+}
+
+size_t Catalog::entries_per_page() const
+{
+    return (page_cache->get_page_size() - header_size()) / entry_size();
+}
+
+Catalog::CatalogHeader Catalog::read_header(const uint8_t* buf) const
+{
+    CatalogHeader header;
+    if (version == 1) {
+        CatalogHeaderV1 v1;
+        ::memcpy(&v1, buf, sizeof(v1));
+        header = {v1.magic, v1.num_entries, v1.next_pid};
+    } else {
+        ::memcpy(&header, buf, sizeof(header));
+    }
+    return header;
+}
+
+void Catalog::write_header(uint8_t* buf, const CatalogHeader& header) const
+{
+    if (version == 1) {
+        if (header.next_pid > UINT32_MAX) {
+            throw std::runtime_error("page ID too large for the catalog");
+        }
+        CatalogHeaderV1 v1{header.magic, header.num_entries,
+                           static_cast<uint32_t>(header.next_pid)};
+        ::memcpy(buf, &v1, sizeof(v1));
+    } else {
+        ::memcpy(buf, &header, sizeof(header));
+    }
+}
+
+Catalog::CatalogEntry Catalog::read_entry(const uint8_t* buf) const
+{
+    CatalogEntry entry;
+    if (version == 1) {
+        CatalogEntryV1 v1;
+        ::memcpy(&v1, buf, sizeof(v1));
+        ::memcpy(entry.name, v1.name, sizeof(entry.name));
+        entry.meta_pids = {v1.meta_pids[0], v1.meta_pids[1]};
+    } else {
+        ::memcpy(&entry, buf, sizeof(entry));
+    }
+    entry.name[MAX_NAME_LEN] = '\0';
+    return entry;
+}
+
+void Catalog::write_entry(uint8_t* buf, const CatalogEntry& entry) const
+{
+    if (version == 1) {
+        if (entry.meta_pids[0] > UINT32_MAX ||
+            entry.meta_pids[1] > UINT32_MAX) {
+            throw std::runtime_error("page ID too large for the catalog");
+        }
+        CatalogEntryV1 v1;
+        ::memcpy(v1.name, entry.name, sizeof(v1.name));
+        v1.meta_pids = {static_cast<uint32_t>(entry.meta_pids[0]),
+                        static_cast<uint32_t>(entry.meta_pids[1])};
+        ::memcpy(buf, &v1, sizeof(v1));
+    } else {
+        ::memcpy(buf, &entry, sizeof(entry));
+    }
+}
+
+bool Catalog::find(const std::string& name, MetaPages& meta_pids)
+{
+    std::lock_guard<std::mutex> guard(mutex);
+
+    auto it = entries.find(name);
+    if (it == entries.end()) return false;
+
+    meta_pids = it->second;
+    return true;
+}
+
+bool Catalog::add(const std::string& name, const MetaPages& meta_pids)
+{
+    if (name.empty() || name.size() > MAX_NAME_LEN) {
+        throw std::invalid_argument("bad tree name");
+    }
+
+    std::lock_guard<std::mutex> guard(mutex);
+
+    if (entries.find(name) != entries.end()) return false;
+
+    if (last_page_entries == entries_per_page()) {
+        /* chain a new page after the last one */
+        PageID new_pid;
+        {
+            boost::upgrade_lock<Page> lock;
+            auto* page = page_cache->new_page(lock);
+            new_pid = page->get_id();
+            page_cache->unpin_page(page, false, lock);
+        }
+        init_page(new_pid);
+
+        boost::upgrade_lock<Page> lock;
+        auto* page = page_cache->fetch_page(catalog_pages.back(), lock);
+        {
+            boost::upgrade_to_unique_lock<Page> ulock(lock);
+            auto* buf = page->get_buffer(ulock);
+            auto header = read_header(buf);
+            header.next_pid = new_pid;
+            write_header(buf, header);
+        }
+        page_cache->unpin_page(page, true, lock);
+
+        catalog_pages.push_back(new_pid);
+        last_page_entries = 0;
+    }
+
+    CatalogEntry entry;
+    ::memset(&entry, 0, sizeof(entry));
+    ::memcpy(entry.name, name.data(), name.size());
+    entry.meta_pids = meta_pids;
+
+    boost::upgrade_lock<Page> lock;
+    auto* page = page_cache->fetch_page(catalog_pages.back(), lock);
+    if (!page) {
+        throw std::runtime_error("bad catalog page");
+    }
+    {
+        boost::upgrade_to_unique_lock<Page> ulock(lock);
+        auto* buf = page->get_buffer(ulock);
+
+        write_entry(&buf[header_size() + last_page_entries * entry_size()],
+                    entry);
+        auto header = read_header(buf);
+        header.num_entries = last_page_entries + 1;
+        write_header(buf, header);
+    }
+    page_cache->unpin_page(page, true, lock);
+
+    last_page_entries++;
+    entries[name] = meta_pids;
+    return true;
+}
+
+std::vector<std::string> Catalog::list()
+{
+    std::lock_guard<std::mutex> guard(mutex);
+
+    std::vector<std::string> names;
+    for (auto&& p : entries) {
+        names.push_back(p.first);
+    }
+    return names;
+}
+
+void Catalog::load()
+{
+    PageID pid = CATALOG_PAGE_ID;
+
+    while (pid != Page::INVALID_PAGE_ID) {
+        boost::upgrade_lock<Page> lock;
+        auto* page = page_cache->fetch_page(pid, lock);
+        if (!page) {
+            throw std::runtime_error("bad catalog page");
+        }
+
+        const auto* buf = page->get_buffer(lock);
+        auto header = read_header(buf);
+
+        if (header.magic != magic() ||
+            header.num_entries > entries_per_page()) {
+            page_cache->unpin_page(page, false, lock);
+            throw std::runtime_error("bad catalog page");
+        }
+
+        for (size_t i = 0; i < header.num_entries; i++) {
+            auto entry = read_entry(&buf[header_size() + i * entry_size()]);
+            entries[entry.name] = entry.meta_pids;
+        }
+
+        catalog_pages.push_back(pid);
+        last_page_entries = header.num_entries;
+        pid = header.next_pid;
+
+        page_cache->unpin_page(page, false, lock);
+    }
+}
+
+void Catalog::init_page(PageID pid)
+{
+    boost::upgrade_lock<Page> lock;
+    auto* page = page_cache->fetch_page_for_overwrite(pid, lock);
+    if (!page) {
+        throw std::runtime_error("bad catalog page");
+    }
+
+    {
+        boost::upgrade_to_unique_lock<Page> ulock(lock);
+        auto* buf = page->get_buffer(ulock);
+        ::memset(buf, 0, page->get_size());
+
+        write_header(buf, {magic(), 0, Page::INVALID_PAGE_ID});
+    }
+
+    page_cache->unpin_page(page, true, lock);
+}
+
+} // namespace bptree
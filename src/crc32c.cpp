@@ -0,0 +1,85 @@
+#include "../include/bptree/crc32c.h"
+
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+namespace bptree {
+
+namespace {
+
+const uint32_t POLY = 0x82F63B78; /* reversed Castagnoli polynomial */
+
+struct Crc32cTable {
+    uint32_t table[256];
+
+    Crc32cTable()
+    {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for (int j = 0; j < 8; j++) {
+                crc = (crc >> 1) ^ ((crc & 1) ? POLY : 0);
+            }
+            table[i] = crc;
+        }
+    }
+};
+
+uint32_t crc32c_sw(uint32_t crc, const uint8_t* buf, size_t len)
+{
+    static const Crc32cTable t;
+
+    crc = ~crc;
+    while (len--) {
+        crc = t.table[(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) uint32_t crc32c_hw(uint32_t crc,
+                                                     const uint8_t* buf,
+                                                     size_t len)
+{
+    uint64_t crc64 = ~crc;
+
+    while (len >= sizeof(uint64_t)) {
+        uint64_t word;
+        ::memcpy(&word, buf, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        buf += sizeof(uint64_t);
+        len -= sizeof(uint64_t);
+    }
+
+    uint32_t crc32 = (uint32_t)crc64;
+    while (len--) {
+        crc32 = _mm_crc32_u8(crc32, *buf++);
+    }
+    return ~crc32;
+}
+#endif
+
+typedef uint32_t (*Crc32cFunc)(uint32_t, const uint8_t*, size_t);
+
+Crc32cFunc select_crc32c()
+{
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) return crc32c_hw;
+#endif
+    return crc32c_sw;
+}
+
+const Crc32cFunc crc32c_impl = select_crc32c();
+
+} // namespace
+
+uint32_t crc32c(uint32_t crc, const void* buf, size_t len)
+{
+    return crc32c_impl(crc, static_cast<const uint8_t*>(buf), len);
+}
+
+bool crc32c_hardware_supported() { return crc32c_impl != crc32c_sw; }
+
+} // namespace bptree
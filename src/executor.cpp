@@ -0,0 +1,208 @@
+#include "../include/bptree/executor.h"
+
+#include <algorithm>
+
+namespace bptree {
+
+/* the executor and worker index of the calling thread */
+static thread_local Executor* current_executor = nullptr;
+static thread_local size_t current_worker = 0;
+
+Executor::Executor(size_t num_workers) : next_worker(0), stopping(false)
+{
+    if (num_workers == 0) {
+        num_workers = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (auto&& n : num_queued) {
+        n.store(0);
+    }
+
+    for (size_t i = 0; i < num_workers; i++) {
+        workers.push_back(std::make_unique<Worker>());
+    }
+    for (size_t i = 0; i < num_workers; i++) {
+        workers[i]->thread = std::thread([this, i] { worker_loop(i); });
+    }
+}
+
+Executor::~Executor()
+{
+    {
+        std::lock_guard<std::mutex> guard(sleep_mutex);
+        stopping = true;
+    }
+    sleep_cv.notify_all();
+
+    for (auto&& w : workers) {
+        w->thread.join();
+    }
+}
+
+Executor& Executor::get_default()
+{
+    /* never destroyed so that objects destroyed at exit can still use it */
+    static Executor* executor = new Executor();
+    return *executor;
+}
+
+void Executor::submit(std::function<void()> fn, TaskPriority priority)
+{
+    int p = (int)priority;
+    size_t w = current_executor == this ? current_worker
+                                        : next_worker++ % workers.size();
+    {
+        std::lock_guard<std::mutex> guard(workers[w]->mutex);
+        workers[w]->queues[p].push_back(std::move(fn));
+    }
+    num_queued[p]++;
+
+    /* a worker checks for work under the sleep mutex before it sleeps */
+    { std::lock_guard<std::mutex> guard(sleep_mutex); }
+    sleep_cv.notify_one();
+}
+
+bool Executor::take_task(size_t self, std::function<void()>& task)
+{
+    for (int p = 0; p < NUM_PRIORITIES; p++) {
+        if (num_queued[p].load() == 0) continue;
+
+        /* the newest task of our own deque, then the oldest of the others */
+        for (size_t i = 0; i < workers.size(); i++) {
+            auto& worker = *workers[(self + i) % workers.size()];
+            std::lock_guard<std::mutex> guard(worker.mutex);
+            auto& queue = worker.queues[p];
+            if (queue.empty()) continue;
+
+            if (i == 0) {
+                task = std::move(queue.back());
+                queue.pop_back();
+            } else {
+                task = std::move(queue.front());
+                queue.pop_front();
+            }
+            num_queued[p]--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void Executor::worker_loop(size_t self)
+{
+    current_executor = this;
+    current_worker = self;
+
+    while (true) {
+        std::function<void()> task;
+        if (take_task(self, task)) {
+            try {
+                task();
+            } catch (...) {
+            }
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+        sleep_cv.wait(lock, [this] {
+            return stopping || num_queued[0].load() > 0 ||
+                   num_queued[1].load() > 0;
+        });
+        if (stopping && num_queued[0].load() == 0 &&
+            num_queued[1].load() == 0) {
+            break;
+        }
+    }
+}
+
+void Executor::parallel_for(size_t count, const std::function<void(size_t)>& fn,
+                            TaskPriority priority)
+{
+    if (count == 1) {
+        fn(0);
+        return;
+    }
+
+    TaskGroup group(*this, priority);
+    for (size_t i = 0; i < count; i++) {
+        group.run([&fn, i] { fn(i); });
+    }
+    group.wait();
+}
+
+TaskGroup::TaskGroup(Executor& executor, TaskPriority priority)
+    : executor(executor), priority(priority), state(std::make_shared<State>())
+{}
+
+TaskGroup::~TaskGroup()
+{
+    cancel();
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->cv.wait(lock, [this] { return state->running == 0; });
+}
+
+void TaskGroup::run(std::function<void()> fn)
+{
+    {
+        std::lock_guard<std::mutex> guard(state->mutex);
+        state->tasks.push_back(std::move(fn));
+    }
+
+    /* the executor runs whichever task of the group is next, the state
+     * outlives the group */
+    auto s = state;
+    executor.submit([s] { run_next(*s); }, priority);
+}
+
+bool TaskGroup::run_one() { return run_next(*state); }
+
+void TaskGroup::cancel()
+{
+    std::lock_guard<std::mutex> guard(state->mutex);
+    state->tasks.clear();
+}
+
+void TaskGroup::wait()
+{
+    while (run_next(*state))
+        ;
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->cv.wait(lock, [this] { return state->running == 0; });
+
+    if (state->error) {
+        auto error = state->error;
+        state->error = nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+bool TaskGroup::run_next(State& state)
+{
+    std::function<void()> task;
+    {
+        std::lock_guard<std::mutex> guard(state.mutex);
+        if (state.tasks.empty()) return false;
+        task = std::move(state.tasks.front());
+        state.tasks.pop_front();
+        state.running++;
+    }
+
+    std::exception_ptr error;
+    try {
+        task();
+    } catch (...) {
+        error = std::current_exception();
+    }
+
+    std::lock_guard<std::mutex> guard(state.mutex);
+    if (error && !state.error) {
+        state.error = error;
+        state.tasks.clear();
+    }
+    state.running--;
+    state.cv.notify_all();
+    return true;
+}
+
+} // namespace bptree
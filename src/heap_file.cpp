@@ -1,21 +1,52 @@
 #include "../include/bptree/heap_file.h"
+#include "../include/bptree/crc32c.h"
 
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <climits>
 #include <cstdlib>
+#include <cstring>
 #include <fcntl.h>
+#include <limits>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <sstream>
 #include <iostream>
+#include <vector>
 
 namespace bptree {
 
-HeapFile::HeapFile(std::string_view filename, bool create, size_t page_size)
-    : filename(filename), page_size(page_size)
+HeapFile::HeapFile(std::string_view filename, bool create, size_t page_size,
+                   ChecksumMode checksum_mode)
+    : HeapFile(std::vector<std::string>{std::string(filename)}, create,
+               page_size, checksum_mode)
+{}
+
+HeapFile::HeapFile(const std::vector<std::string>& filenames, bool create,
+                   size_t page_size, ChecksumMode checksum_mode,
+                   const StripeOptions& stripe_options, OpenMode mode)
+    : filename(filenames.at(0)), page_size(page_size),
+      checksum_mode(checksum_mode), mode(mode), stripe_files(filenames),
+      stripe_options(stripe_options)
 {
-    fd = -1;
+    if (this->stripe_options.extent_pages == 0) {
+        this->stripe_options.extent_pages = 1;
+    }
 
-    open(create);
+    fd = -1;
+    format_version = FORMAT_VERSION;
+    checkpoint_seq = 0;
+    checkpoint_time = 0;
+    flags = (checksum_mode != ChecksumMode::NONE) ? FLAG_PAGE_CHECKSUMS : 0;
+    write_seq = 0;
+    synced_seq = 0;
+    sync_in_progress = false;
+    num_syncs = 0;
+
+    open(create && mode == OpenMode::READ_WRITE);
 }
 
 HeapFile::~HeapFile()
@@ -25,12 +56,25 @@ HeapFile::~HeapFile()
     }
 }
 
+PageID HeapFile::get_num_pages()
+{
+    std::lock_guard<std::mutex> guard(mutex);
+    if (mode == OpenMode::READ_ONLY) reload_num_pages();
+    return file_size_pages.load();
+}
+
 PageID HeapFile::new_page()
 {
+    check_writable();
     std::lock_guard<std::mutex> guard(mutex);
 
+    if (format_version < 2 &&
+        file_size_pages >= std::numeric_limits<uint32_t>::max()) {
+        throw IOException("heap file is full (version 1 format)");
+    }
+
     PageID new_page = (PageID)file_size_pages;
-    ftruncate(fd, file_size_pages * page_size);
+    ftruncate(stripe_fds[get_stripe(new_page)], stripe_offset(new_page));
 
     file_size_pages++;
     write_header();
@@ -39,58 +83,309 @@ PageID HeapFile::new_page()
 }
 
 
-void HeapFile::read_page(Page* page, boost::upgrade_to_unique_lock<Page>& lock)
+PageID HeapFile::new_pages(size_t count)
+{
+    check_writable();
+    std::lock_guard<std::mutex> guard(mutex);
+
+    if (format_version < 2 &&
+        file_size_pages + count > std::numeric_limits<uint32_t>::max()) {
+        throw IOException("heap file is full (version 1 format)");
+    }
+
+    /* the pages read as zeros until they are written */
+    PageID first = (PageID)file_size_pages;
+    file_size_pages += count;
+    write_header();
+
+    return first;
+}
+
+void HeapFile::truncate(PageID num_pages)
 {
+    check_writable();
     std::lock_guard<std::mutex> guard(mutex);
 
+    if (num_pages >= file_size_pages) return;
+
+    /* each stripe ends where its first page at or after num_pages would be */
+    for (size_t s = 0; s < stripe_fds.size(); s++) {
+        PageID pid = num_pages;
+        while (get_stripe(pid) != s) pid++;
+
+        if (ftruncate(stripe_fds[s], stripe_offset(pid)) < 0) {
+            std::stringstream ss;
+            ss << "truncate failed (errno: " << errno << ")";
+            throw IOException(ss.str().c_str());
+        }
+    }
+
+    file_size_pages = num_pages;
+    write_header();
+}
+
+void HeapFile::read_page(Page* page, boost::upgrade_to_unique_lock<Page>& lock,
+                         bool verify)
+{
     auto pid = page->get_id();
+    check_page_id(pid);
+
+    auto* buf = page->get_frame(lock);
+    page->set_verified(false);
+
+    ssize_t retval = pread64(stripe_fds[get_stripe(pid)], buf, page_size,
+                             stripe_offset(pid));
+    if (retval < 0) {
+        std::stringstream ss;
+        ss << "read failed (errno: " << errno << ")";
+        throw IOException(ss.str().c_str());
+    }
+    if ((size_t)retval < page_size) {
+        /* the page was allocated but never written */
+        ::memset(&buf[retval], 0, page_size - retval);
+    }
+
+    if (!verify || !has_checksums() || checksum_mode == ChecksumMode::NONE) {
+        page->set_verified(true);
+    } else if (checksum_mode == ChecksumMode::EAGER) {
+        check_frame(pid, buf);
+        page->set_verified(true);
+    }
+}
+
+void HeapFile::read_ahead(PageID pid, size_t count)
+{
+    /* pages past the end are simply not read */
+    if (pid == Page::INVALID_PAGE_ID || count == 0) return;
+    ::posix_fadvise(stripe_fds[get_stripe(pid)], stripe_offset(pid),
+                    page_size * count, POSIX_FADV_WILLNEED);
+}
+
+size_t HeapFile::get_stripe(PageID pid) const
+{
+    size_t n = stripe_fds.size();
+    if (n == 1) return 0;
+
+    if (stripe_options.layout == StripeLayout::MODULO) {
+        return pid % n;
+    }
+    return (pid / stripe_options.extent_pages) % n;
+}
+
+PageID HeapFile::next_in_stripe(PageID pid) const
+{
+    size_t n = stripe_fds.size();
+    if (n == 1) return pid + 1;
+
+    if (stripe_options.layout == StripeLayout::MODULO) {
+        return pid + n;
+    }
+
+    size_t extent = stripe_options.extent_pages;
+    if ((pid + 1) % extent != 0) return pid + 1;
+    return pid + 1 + (n - 1) * extent;
+}
+
+off64_t HeapFile::stripe_offset(PageID pid) const
+{
+    size_t n = stripe_fds.size();
+    PageID local;
+
+    if (n == 1) {
+        local = pid;
+    } else if (stripe_options.layout == StripeLayout::MODULO) {
+        local = pid / n;
+    } else {
+        size_t extent = stripe_options.extent_pages;
+        local = (pid / (extent * n)) * extent + pid % extent;
+    }
+
+    return (off64_t)local * page_size;
+}
+
+void HeapFile::check_page_id(PageID pid)
+{
+    std::lock_guard<std::mutex> guard(mutex);
+
     if (pid == Page::INVALID_PAGE_ID) {
         std::stringstream ss;
         ss << "page ID (" << pid << ") is invalid";
         throw IOException(ss.str().c_str());
     }
 
-    // std::cout << "Reading page ID: " << pid << ", Total pages:" << file_size_pages << std::endl;
+    if (pid >= file_size_pages && mode == OpenMode::READ_ONLY) {
+        /* the writer may have appended pages since */
+        reload_num_pages();
+    }
 
     if (pid >= file_size_pages) {
         std::stringstream ss;
-        ss << "page ID (" << pid << ") >= # pages (" << file_size_pages << ")";
+        ss << "page ID (" << pid << ") >= # pages (" << file_size_pages.load()
+           << ")";
         throw IOException(ss.str().c_str());
     }
+}
 
-    auto* buf = page->get_buffer(lock);
+void HeapFile::verify_page(Page* page, boost::upgrade_lock<Page>& lock)
+{
+    if (has_checksums()) {
+        check_frame(page->get_id(), page->get_frame(lock));
+    }
+    page->set_verified(true);
+}
 
-    off64_t retval;
-    if ((retval = lseek64(fd, (off64_t)pid * page_size, SEEK_SET)) != (off64_t)pid * page_size) {
-        std::stringstream ss;
-        ss << "seek failed (return code: " << retval << ", errno: " << errno << ")";
-        throw IOException(ss.str().c_str());
+void HeapFile::check_frame(PageID pid, const uint8_t* frame) const
+{
+    uint32_t header[2];
+    ::memcpy(header, frame, sizeof(header));
+
+    if (header[1] == 0 && header[0] == 0) {
+        /* the page has never been written. it must be all zeros, otherwise the
+         * write that tore it did not reach the header */
+        for (size_t i = PAGE_HEADER_SIZE; i < page_size; i++) {
+            if (frame[i] != 0) {
+                throw CorruptPageException("torn page (unwritten header)");
+            }
+        }
+        return;
     }
 
-    read(fd, buf, page_size);
+    uint32_t crc = crc32c(checksum_seed(pid), &frame[sizeof(uint32_t)],
+                          page_size - sizeof(uint32_t));
+    if (crc != header[0]) {
+        std::stringstream ss;
+        ss << "page ID (" << pid << ") checksum mismatch";
+        throw CorruptPageException(ss.str().c_str());
+    }
 }
 
 void HeapFile::write_page(Page* page, boost::upgrade_lock<Page>& lock)
 {
-    std::lock_guard<std::mutex> guard(mutex);
+    write_pages(&page, &lock, 1);
+}
 
-    auto pid = page->get_id();
-    if (pid == Page::INVALID_PAGE_ID) {
-        throw IOException("page ID is invalid");
+void HeapFile::write_pages(Page* const* pages, boost::upgrade_lock<Page>* locks,
+                           size_t count)
+{
+    if (count == 0) return;
+    check_writable();
+
+    PageID first_pid = pages[0]->get_id();
+    check_page_id(first_pid);
+    check_page_id(pages[count - 1]->get_id());
+    int stripe_fd = stripe_fds[get_stripe(first_pid)];
+
+    /* with checksums every page needs two buffers: the header built on the side
+     * (so that the frame is not modified under a shared lock) and the rest of
+     * the frame */
+    size_t iov_per_page = has_checksums() ? 2 : 1;
+    std::vector<struct iovec> iov(count * iov_per_page);
+    std::vector<uint32_t> headers(has_checksums() ? count * 2 : 0);
+
+    for (size_t i = 0; i < count; i++) {
+        const auto* buf = pages[i]->get_frame(locks[i]);
+        PageID pid = pages[i]->get_id();
+        assert(i == 0 || pid == next_in_stripe(pages[i - 1]->get_id()));
+
+        if (!has_checksums()) {
+            iov[i].iov_base = const_cast<uint8_t*>(buf);
+            iov[i].iov_len = page_size;
+            continue;
+        }
+
+        uint32_t* header = &headers[i * 2];
+        header[1] = PAGE_FLAG_WRITTEN;
+        uint32_t crc =
+            crc32c(checksum_seed(pid), &header[1], sizeof(uint32_t));
+        header[0] = crc32c(crc, &buf[PAGE_HEADER_SIZE],
+                           page_size - PAGE_HEADER_SIZE);
+
+        iov[i * 2].iov_base = header;
+        iov[i * 2].iov_len = PAGE_HEADER_SIZE;
+        iov[i * 2 + 1].iov_base = const_cast<uint8_t*>(&buf[PAGE_HEADER_SIZE]);
+        iov[i * 2 + 1].iov_len = page_size - PAGE_HEADER_SIZE;
     }
 
-    if (pid >= file_size_pages) {
-        throw IOException("page ID >= # pages");
+    off64_t offset = stripe_offset(first_pid);
+    size_t iov_idx = 0;
+
+    while (iov_idx < iov.size()) {
+        int iov_count = (int)std::min(iov.size() - iov_idx, (size_t)IOV_MAX);
+        ssize_t written =
+            pwritev64(stripe_fd, &iov[iov_idx], iov_count, offset);
+
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            throw IOException(
+                ("write failed(error code: " + std::to_string(errno) + ")")
+                    .c_str());
+        }
+
+        /* skip the buffers that were written completely and adjust the first
+         * partially written one */
+        offset += written;
+        while (written > 0 && (size_t)written >= iov[iov_idx].iov_len) {
+            written -= iov[iov_idx].iov_len;
+            iov_idx++;
+        }
+        if (written > 0) {
+            iov[iov_idx].iov_base =
+                static_cast<uint8_t*>(iov[iov_idx].iov_base) + written;
+            iov[iov_idx].iov_len -= written;
+        }
     }
 
-    const auto* buf = page->get_buffer(lock);
+    write_seq++;
+}
+
+void HeapFile::sync()
+{
+    uint64_t target = write_seq.load();
+    std::unique_lock<std::mutex> lock(sync_mutex);
+
+    while (synced_seq < target) {
+        if (sync_in_progress) {
+            /* the sync in flight may not cover our writes, check again once it
+             * is done */
+            sync_cv.wait(lock);
+            continue;
+        }
+
+        sync_in_progress = true;
+        uint64_t seq = write_seq.load();
+        lock.unlock();
+
+        int err = 0;
+        for (int stripe_fd : stripe_fds) {
+            if (::fdatasync(stripe_fd) != 0) err = -1;
+        }
+        num_syncs++;
+
+        lock.lock();
+        sync_in_progress = false;
+        if (err == 0 && seq > synced_seq) {
+            synced_seq = seq;
+        }
+        sync_cv.notify_all();
 
-    off64_t retval;
-    if ((retval = lseek64(fd, (off64_t)pid * page_size, SEEK_SET)) != (off64_t)pid * page_size) {
-         throw IOException(("seek failed(error code: " + std::to_string(errno) + ")").c_str());
+        if (err != 0) {
+            throw IOException(
+                ("fdatasync failed(error code: " + std::to_string(errno) + ")")
+                    .c_str());
+        }
     }
+}
+
+void HeapFile::mark_checkpoint()
+{
+    check_writable();
+    std::lock_guard<std::mutex> guard(mutex);
 
-    write(fd, buf, page_size);
+    checkpoint_seq++;
+    checkpoint_time = std::chrono::duration_cast<std::chrono::milliseconds>(
+                          std::chrono::system_clock::now().time_since_epoch())
+                          .count();
+    write_header();
 }
 
 void HeapFile::open(bool create)
@@ -110,30 +405,53 @@ void HeapFile::open(bool create)
         throw IOException("unable to get heap file status");
     }
 
-    fd = ::open(filename.c_str(), O_RDWR);
-    if (fd < 0) {
+    open_stripes(mode == OpenMode::READ_ONLY ? O_RDONLY : O_RDWR);
+    try {
+        read_header();
+    } catch (IOException& e) {
+        for (int stripe_fd : stripe_fds) {
+            ::close(stripe_fd);
+        }
+        stripe_fds.clear();
         fd = -1;
-        throw IOException("unable to open heap file");
+        throw;
+    }
+}
+
+void HeapFile::open_stripes(int flags)
+{
+    for (auto&& name : stripe_files) {
+        int stripe_fd =
+            ::open(name.c_str(), flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        if (stripe_fd < 0) {
+            for (int opened : stripe_fds) {
+                ::close(opened);
+            }
+            stripe_fds.clear();
+            fd = -1;
+            throw IOException("unable to open heap file");
+        }
+        stripe_fds.push_back(stripe_fd);
     }
 
-    read_header();
+    fd = stripe_fds[0];
 }
 
 void HeapFile::close()
 {
-    write_header();
-    ::close(fd);
+    if (mode == OpenMode::READ_WRITE) {
+        write_header();
+    }
+    for (int stripe_fd : stripe_fds) {
+        ::close(stripe_fd);
+    }
+    stripe_fds.clear();
     fd = -1;
 }
 
 void HeapFile::create()
 {
-    fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_EXCL,
-                S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-    if (fd < 0) {
-        fd = -1;
-        throw IOException("unable to create heap file");
-    }
+    open_stripes(O_RDWR | O_CREAT | O_EXCL);
 
     int err = ftruncate(fd, page_size);
     file_size_pages = 1;
@@ -151,22 +469,115 @@ void HeapFile::read_header()
 
     lseek(fd, 0, SEEK_SET);
     read(fd, &magic, sizeof(magic));
-    if (magic != MAGIC) {
+
+    if (magic == MAGIC_V2) {
+        read(fd, &format_version, sizeof(format_version));
+        if (format_version > FORMAT_VERSION) {
+            throw IOException("bad heap file(unsupported version)");
+        }
+        read(fd, &page_size, sizeof(page_size));
+        uint64_t num_pages;
+        read(fd, &num_pages, sizeof(num_pages));
+        file_size_pages = num_pages;
+    } else if (magic == MAGIC) {
+        uint32_t num_pages;
+        format_version = 1;
+        read(fd, &page_size, sizeof(page_size));
+        read(fd, &num_pages, sizeof(num_pages));
+        file_size_pages = num_pages;
+    } else {
         throw IOException("bad heap file(magic)");
     }
 
-    read(fd, &page_size, sizeof(page_size));
-    read(fd, &file_size_pages, sizeof(file_size_pages));
+    read(fd, &checkpoint_seq, sizeof(checkpoint_seq));
+    read(fd, &checkpoint_time, sizeof(checkpoint_time));
+    read(fd, &flags, sizeof(flags));
+
+    uint32_t num_stripes = 1;
+    if (format_version >= 2) {
+        uint32_t layout;
+        uint64_t extent_pages;
+        read(fd, &num_stripes, sizeof(num_stripes));
+        read(fd, &layout, sizeof(layout));
+        read(fd, &extent_pages, sizeof(extent_pages));
+
+        if (num_stripes == 0) num_stripes = 1; /* written before striping */
+        stripe_options.layout = (StripeLayout)layout;
+        stripe_options.extent_pages = extent_pages ? extent_pages : 1;
+    }
+
+    if (num_stripes != stripe_fds.size()) {
+        throw IOException("bad heap file(stripe count mismatch)");
+    }
 }
 
-void HeapFile::write_header()
+void HeapFile::check_writable() const
 {
-    uint32_t magic = MAGIC;
+    if (mode == OpenMode::READ_ONLY) {
+        throw IOException("heap file is opened read-only");
+    }
+}
+
+void HeapFile::reload_num_pages()
+{
+    /* the page count follows the magic, the format version (V2 only) and the
+     * page size */
+    uint64_t num_pages = 0;
+    if (format_version >= 2) {
+        off_t offset = 2 * sizeof(uint32_t) + sizeof(page_size);
+        if (pread(fd, &num_pages, sizeof(num_pages), offset) !=
+            sizeof(num_pages)) {
+            return;
+        }
+    } else {
+        uint32_t num_pages_v1;
+        off_t offset = sizeof(uint32_t) + sizeof(page_size);
+        if (pread(fd, &num_pages_v1, sizeof(num_pages_v1), offset) !=
+            sizeof(num_pages_v1)) {
+            return;
+        }
+        num_pages = num_pages_v1;
+    }
 
+    /* the count only grows, a stale header read must not shrink it */
+    uint64_t known = file_size_pages.load();
+    while (known < num_pages &&
+           !file_size_pages.compare_exchange_weak(known, num_pages))
+        ;
+}
+
+void HeapFile::write_header()
+{
     lseek(fd, 0, SEEK_SET);
-    write(fd, &magic, sizeof(magic));
-    write(fd, &page_size, sizeof(page_size));
-    write(fd, &file_size_pages, sizeof(file_size_pages));
+
+    if (format_version >= 2) {
+        uint32_t magic = MAGIC_V2;
+        write(fd, &magic, sizeof(magic));
+        write(fd, &format_version, sizeof(format_version));
+        write(fd, &page_size, sizeof(page_size));
+        uint64_t num_pages = file_size_pages.load();
+        write(fd, &num_pages, sizeof(num_pages));
+    } else {
+        uint32_t magic = MAGIC;
+        uint32_t num_pages = (uint32_t)file_size_pages;
+        write(fd, &magic, sizeof(magic));
+        write(fd, &page_size, sizeof(page_size));
+        write(fd, &num_pages, sizeof(num_pages));
+    }
+
+    write(fd, &checkpoint_seq, sizeof(checkpoint_seq));
+    write(fd, &checkpoint_time, sizeof(checkpoint_time));
+    write(fd, &flags, sizeof(flags));
+
+    if (format_version >= 2) {
+        uint32_t num_stripes = stripe_fds.size();
+        uint32_t layout = (uint32_t)stripe_options.layout;
+        uint64_t extent_pages = stripe_options.extent_pages;
+        write(fd, &num_stripes, sizeof(num_stripes));
+        write(fd, &layout, sizeof(layout));
+        write(fd, &extent_pages, sizeof(extent_pages));
+    }
+    write_seq++;
 }
 
 } // namespace bptree
@@ -2,22 +2,126 @@
 
 #include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <exception>
+#include <fstream>
 #include <iostream>
+#include <stdexcept>
+#include <vector>
 
 namespace bptree {
 
 HeapPageCache::HeapPageCache(std::string_view filename, bool create,
-                             size_t max_pages, size_t page_size)
-    : heap_file(std::make_unique<HeapFile>(filename, create, page_size)),
-      max_pages(max_pages)
+                             size_t max_pages, size_t page_size,
+                             ChecksumMode checksum_mode)
+    : HeapPageCache(std::vector<std::string>{std::string(filename)}, create,
+                    max_pages, page_size, checksum_mode)
+{}
+
+HeapPageCache::HeapPageCache(const std::vector<std::string>& filenames,
+                             bool create, size_t max_pages, size_t page_size,
+                             ChecksumMode checksum_mode,
+                             const StripeOptions& stripe_options)
+    : heap_file(std::make_unique<HeapFile>(filenames, create, page_size,
+                                           checksum_mode, stripe_options)),
+      max_pages(max_pages), write_back(false), num_dirty(0),
+      checkpointer_running(false), durability(DurabilityMode::NONE),
+      sync_interval_ms(0), syncer_running(false),
+      max_write_bytes(DEFAULT_MAX_WRITE_BYTES), num_write_calls(0),
+      closed(false), num_prefetched(0), prefetch_active(false),
+      prefetcher_running(false), executor(&Executor::get_default())
 {
+    flush_threads = std::clamp<size_t>(std::thread::hardware_concurrency(), 1,
+                                       DEFAULT_MAX_FLUSH_THREADS);
     this->page_size = page_size;
 }
 
+HeapPageCache::HeapPageCache(std::string_view filename, OpenMode mode,
+                             size_t max_pages, ChecksumMode checksum_mode)
+    : HeapPageCache(std::vector<std::string>{std::string(filename)}, mode,
+                    max_pages, checksum_mode)
+{}
+
+HeapPageCache::HeapPageCache(const std::vector<std::string>& filenames,
+                             OpenMode mode, size_t max_pages,
+                             ChecksumMode checksum_mode)
+    : heap_file(std::make_unique<HeapFile>(filenames, false, 4096,
+                                           checksum_mode, StripeOptions{},
+                                           mode)),
+      max_pages(max_pages), write_back(false), num_dirty(0),
+      checkpointer_running(false), durability(DurabilityMode::NONE),
+      sync_interval_ms(0), syncer_running(false),
+      max_write_bytes(DEFAULT_MAX_WRITE_BYTES), num_write_calls(0),
+      closed(false), num_prefetched(0), prefetch_active(false),
+      prefetcher_running(false), executor(&Executor::get_default())
+{
+    flush_threads = std::clamp<size_t>(std::thread::hardware_concurrency(), 1,
+                                       DEFAULT_MAX_FLUSH_THREADS);
+    this->page_size = heap_file->get_page_size();
+}
+
+HeapPageCache::~HeapPageCache()
+{
+    if (!closed) {
+        close();
+    }
+}
+
+ShutdownStats HeapPageCache::close(bool fast)
+{
+    auto start = std::chrono::steady_clock::now();
+    uint64_t write_calls = num_write_calls.load();
+
+    stop_prefetcher();
+    stop_checkpointer();
+    stop_syncer();
+
+    ShutdownStats stats;
+    stats.pages_written = flush_dirty_pages(false);
+
+    /* a fast close leaves the written pages to the OS unless every flush has
+     * to be durable anyway */
+    if (!fast || durability == DurabilityMode::PER_FLUSH) {
+        sync_if_durable();
+        stats.synced = durability != DurabilityMode::NONE;
+    }
+
+    /* after the data, the list is only a hint */
+    if (!hot_page_path.empty()) {
+        try {
+            dump_hot_pages(hot_page_path);
+        } catch (IOException& e) {
+        }
+    }
+
+    stats.write_calls = num_write_calls.load() - write_calls;
+    stats.duration_ms = std::chrono::duration<double, std::milli>(
+                            std::chrono::steady_clock::now() - start)
+                            .count();
+    closed = true;
+    shutdown_stats = stats;
+
+    return stats;
+}
+
 Page* HeapPageCache::alloc_page(PageID id, boost::upgrade_lock<Page>& lock)
 {
+    if (!free_frames.empty()) {
+        auto* page = free_frames.back();
+        free_frames.pop_back();
+        lock = boost::upgrade_lock(*page);
+        {
+            boost::upgrade_to_unique_lock<Page> ulock(lock);
+            page->set_id(id);
+        }
+        page_map[id] = page;
+
+        return page;
+    }
+
     if (size() < max_pages) {
-        auto page = new Page(id, page_size);
+        auto page = new Page(id, page_size, heap_file->get_page_header_size());
         lock = boost::upgrade_lock(*page);
         pages.emplace_back(page);
         page_map[id] = page;
@@ -37,7 +141,7 @@ Page* HeapPageCache::alloc_page(PageID id, boost::upgrade_lock<Page>& lock)
     lock = boost::upgrade_lock(*page);
 
     if (page->is_dirty()) {
-        flush_page(page, lock);
+        write_page(page, lock);
     }
 
     boost::upgrade_to_unique_lock<Page> ulock(lock);
@@ -54,6 +158,8 @@ Page* HeapPageCache::new_page(boost::upgrade_lock<Page>& lock)
 
     PageID new_id = heap_file->new_page();
     auto page = alloc_page(new_id, lock);
+    if (!page) throw std::runtime_error("page cache is full");
+    page->set_verified(true);
 
     pin_page(page, lock);
 
@@ -61,6 +167,18 @@ Page* HeapPageCache::new_page(boost::upgrade_lock<Page>& lock)
 }
 
 Page* HeapPageCache::fetch_page(PageID id, boost::upgrade_lock<Page>& lock)
+{
+    return fetch_page(id, lock, true);
+}
+
+Page* HeapPageCache::fetch_page_for_overwrite(PageID id,
+                                              boost::upgrade_lock<Page>& lock)
+{
+    return fetch_page(id, lock, false);
+}
+
+Page* HeapPageCache::fetch_page(PageID id, boost::upgrade_lock<Page>& lock,
+                                bool verify)
 {
     bptree::Page* page = nullptr;
     {
@@ -69,27 +187,171 @@ Page* HeapPageCache::fetch_page(PageID id, boost::upgrade_lock<Page>& lock)
         auto it = page_map.find(id);
 
         if (it == page_map.end()) {
-            auto page = alloc_page(id, lock);
+            page = alloc_page(id, lock);
+            if (!page) throw std::runtime_error("page cache is full");
 
             try {
-                boost::upgrade_to_unique_lock<Page> ulock(lock);
-                heap_file->read_page(page, ulock);
+                {
+                    boost::upgrade_to_unique_lock<Page> ulock(lock);
+                    heap_file->read_page(page, ulock, verify);
+                }
                 pin_page(page, lock);
-
-                return page;
-            } catch (IOException e) {
+            } catch (IOException& e) {
+                /* keep the frame for the next miss */
+                page_map.erase(id);
+                page->set_id(Page::INVALID_PAGE_ID);
+                lock = boost::upgrade_lock<Page>();
+                free_frames.push_back(page);
+
+                /* a page that does not exist is not an error, a corrupt one
+                 * is */
+                if (dynamic_cast<CorruptPageException*>(&e)) throw;
                 return nullptr;
             }
+        } else {
+            page = it->second;
+            pin_page(page, lock);
         }
+    }
 
-        page = it->second;
-        pin_page(page, lock);
+    if (!lock.owns_lock() || lock.mutex() != page) {
+        lock = boost::upgrade_lock<Page>(*page);
+    }
+
+    /* lazy checksum verification happens on the first access, outside of the
+     * cache and heap file locks */
+    if (!page->is_verified()) {
+        if (!verify) {
+            page->set_verified(true);
+        } else {
+            try {
+                heap_file->verify_page(page, lock);
+            } catch (CorruptPageException&) {
+                /* the frame stays unverified, later fetches fail as well */
+                unpin_page(page, false, lock);
+                lock = boost::upgrade_lock<Page>();
+                throw;
+            }
+        }
     }
 
-    lock = boost::upgrade_lock<Page>(*page);
     return page;
 }
 
+void HeapPageCache::invalidate(const std::vector<PageID>& pids)
+{
+    std::lock_guard<std::mutex> guard(mutex);
+
+    /* the unpinned pages are the ones on the LRU list */
+    std::vector<PageID> victims;
+    {
+        std::lock_guard<std::mutex> lru_guard(lru_mutex);
+        if (pids.empty()) {
+            victims.assign(lru_list.begin(), lru_list.end());
+        } else {
+            for (auto pid : pids) {
+                if (lru_map.find(pid) != lru_map.end()) victims.push_back(pid);
+            }
+        }
+    }
+
+    for (auto pid : victims) {
+        auto it = page_map.find(pid);
+        if (it == page_map.end()) continue;
+
+        auto* page = it->second;
+        boost::upgrade_lock<Page> lock(*page);
+        if (page->is_dirty()) continue;
+
+        boost::upgrade_to_unique_lock<Page> ulock(lock);
+        lru_erase(pid);
+        page->set_id(Page::INVALID_PAGE_ID);
+        free_frames.push_back(page);
+        page_map.erase(it);
+    }
+}
+
+void HeapPageCache::discard(const std::vector<PageID>& pids)
+{
+    std::lock_guard<std::mutex> guard(mutex);
+
+    for (auto pid : pids) {
+        auto it = page_map.find(pid);
+        if (it == page_map.end()) continue;
+        {
+            std::lock_guard<std::mutex> lru_guard(lru_mutex);
+            if (lru_map.find(pid) == lru_map.end()) continue; /* pinned */
+        }
+
+        /* as in truncate(), flushes that still hold the frame skip it */
+        auto* page = it->second;
+        boost::upgrade_lock<Page> lock(*page);
+        boost::upgrade_to_unique_lock<Page> ulock(lock);
+        if (page->is_dirty()) {
+            page->set_dirty(false);
+            num_dirty--;
+        }
+        lru_erase(pid);
+        page->set_id(Page::INVALID_PAGE_ID);
+        free_frames.push_back(page);
+        page_map.erase(it);
+    }
+}
+
+bool HeapPageCache::truncate(PageID num_pages)
+{
+    std::lock_guard<std::mutex> guard(mutex);
+
+    for (auto it = page_map.begin(); it != page_map.end();) {
+        if (it->first < num_pages) {
+            ++it;
+            continue;
+        }
+
+        /* dirty pages are dropped without being written. flushes that still
+         * hold the frame skip it because its ID changes */
+        auto* page = it->second;
+        boost::upgrade_lock<Page> lock(*page);
+        boost::upgrade_to_unique_lock<Page> ulock(lock);
+        if (page->is_dirty()) {
+            page->set_dirty(false);
+            num_dirty--;
+        }
+        lru_erase(it->first);
+        page->set_id(Page::INVALID_PAGE_ID);
+        free_frames.push_back(page);
+        it = page_map.erase(it);
+    }
+
+    heap_file->truncate(num_pages);
+    return true;
+}
+
+void HeapPageCache::read_ahead(const std::vector<PageID>& pids)
+{
+    std::vector<PageID> missing;
+    {
+        std::lock_guard<std::mutex> guard(mutex);
+        for (auto pid : pids) {
+            if (page_map.find(pid) == page_map.end()) missing.push_back(pid);
+        }
+    }
+    std::sort(missing.begin(), missing.end());
+    missing.erase(std::unique(missing.begin(), missing.end()), missing.end());
+
+    /* one request per run of pages that are adjacent in their file */
+    size_t i = 0;
+    while (i < missing.size()) {
+        size_t j = i + 1;
+        while (j < missing.size() &&
+               missing[j] == heap_file->next_in_stripe(missing[j - 1])) {
+            j++;
+        }
+        heap_file->read_ahead(missing[i], j - i);
+        i = j;
+    }
+}
+
 void HeapPageCache::pin_page(Page* page, boost::upgrade_lock<Page>& lock)
 {
     if (page->pin() == 0) {
@@ -99,31 +361,463 @@ void HeapPageCache::pin_page(Page* page, boost::upgrade_lock<Page>& lock)
 
 void HeapPageCache::unpin_page(Page* page, bool dirty, boost::upgrade_lock<Page>& lock)
 {
-    page->set_dirty(dirty);
+    if (dirty && page->mark_dirty()) {
+        if (++num_dirty > checkpoint_options.max_dirty_pages &&
+            checkpointer_running) {
+            checkpoint_cv.notify_one();
+        }
+    }
 
     int pin_count = page->unpin();
     if (pin_count == 1) {
         lru_insert(page->get_id());
     }
 
-    flush_page(page, lock);
+    /* past twice the dirty page budget writers write their own pages so that
+     * the budget holds even if the checkpointer falls behind */
+    if (!write_back ||
+        (checkpointer_running &&
+         num_dirty.load() > 2 * checkpoint_options.max_dirty_pages)) {
+        bool written = write_page(page, lock);
+
+        if (written && durability == DurabilityMode::PER_FLUSH) {
+            /* the caller keeps its lock, writers of other pages still share
+             * the fdatasync */
+            heap_file->sync();
+        }
+    }
 }
 
 void HeapPageCache::flush_page(Page* page, boost::upgrade_lock<Page>& lock)
+{
+    write_page(page, lock);
+
+    if (durability == DurabilityMode::PER_FLUSH) {
+        heap_file->sync();
+    }
+}
+
+bool HeapPageCache::write_page(Page* page, boost::upgrade_lock<Page>& lock)
 {
     if (page->is_dirty()) {
         heap_file->write_page(page, lock);
 
         page->set_dirty(false);
+        num_dirty--;
+        num_write_calls++;
+        return true;
     }
+
+    return false;
 }
 
 void HeapPageCache::flush_all_pages()
 {
-    for (auto&& p : pages) {
-        auto lock = boost::upgrade_lock<Page>(*p);
-        flush_page(p.get(), lock);
+    flush_dirty_pages(false);
+
+    if (durability == DurabilityMode::PER_FLUSH) {
+        heap_file->sync();
+    }
+}
+
+void HeapPageCache::sync() { heap_file->sync(); }
+
+void HeapPageCache::sync_if_durable()
+{
+    if (durability != DurabilityMode::NONE) {
+        heap_file->sync();
+    }
+}
+
+size_t HeapPageCache::flush_dirty_pages(bool paced)
+{
+    std::vector<std::pair<PageID, Page*>> dirty_pages;
+    {
+        /* page IDs only change under the cache mutex */
+        std::lock_guard<std::mutex> guard(mutex);
+        for (auto&& p : pages) {
+            if (p->is_dirty()) {
+                dirty_pages.emplace_back(p->get_id(), p.get());
+            }
+        }
+    }
+
+    /* in file order: by stripe, then by page ID */
+    std::sort(dirty_pages.begin(), dirty_pages.end(),
+              [this](const auto& a, const auto& b) {
+                  auto sa = heap_file->get_stripe(a.first);
+                  auto sb = heap_file->get_stripe(b.first);
+                  return sa < sb || (sa == sb && a.first < b.first);
+              });
+
+    size_t num_threads = std::min(flush_threads, dirty_pages.size() / 64);
+    if (paced || num_threads <= 1) {
+        return write_dirty_pages(dirty_pages, 0, dirty_pages.size(), paced);
+    }
+
+    /* split the pages into one range per writer at the start of a run as
+     * write_dirty_pages() forms them: where the next page is not contiguous in
+     * its file or the run reaches max_write_bytes. so runs stay intact and a
+     * contiguous set of pages is still written by all writers. with a striped
+     * file the writers mostly work on different files */
+    size_t max_run = std::max<size_t>(1, max_write_bytes / page_size);
+    std::vector<size_t> run_starts;
+    size_t run_length = 0;
+    for (size_t i = 0; i < dirty_pages.size(); i++) {
+        if (i == 0 || run_length == max_run ||
+            dirty_pages[i].first !=
+                heap_file->next_in_stripe(dirty_pages[i - 1].first)) {
+            run_starts.push_back(i);
+            run_length = 0;
+        }
+        run_length++;
+    }
+
+    std::vector<size_t> bounds{0};
+    for (size_t t = 1; t < num_threads; t++) {
+        auto it = std::lower_bound(run_starts.begin(), run_starts.end(),
+                                   dirty_pages.size() * t / num_threads);
+        size_t b = it == run_starts.end() ? dirty_pages.size() : *it;
+        bounds.push_back(std::max(bounds.back(), b));
+    }
+    bounds.push_back(dirty_pages.size());
+
+    std::vector<size_t> counts(num_threads, 0);
+    executor->parallel_for(num_threads, [&](size_t t) {
+        counts[t] =
+            write_dirty_pages(dirty_pages, bounds[t], bounds[t + 1], false);
+    });
+
+    size_t count = 0;
+    for (auto c : counts) {
+        count += c;
+    }
+    return count;
+}
+
+size_t HeapPageCache::write_dirty_pages(
+    const std::vector<std::pair<PageID, Page*>>& dirty_pages, size_t begin,
+    size_t end, bool paced)
+{
+    size_t max_run = std::max<size_t>(1, max_write_bytes / page_size);
+    std::vector<Page*> run;
+    std::vector<boost::upgrade_lock<Page>> locks;
+    run.reserve(max_run);
+    locks.reserve(max_run);
+
+    size_t count = 0, since_pause = 0;
+    size_t i = begin;
+    while (i < end) {
+        /* pages that were evicted or written since the snapshot are skipped.
+         * only writers of the pages in a run wait for the write */
+        auto [pid, page] = dirty_pages[i++];
+        boost::upgrade_lock<Page> lock(*page);
+        if (page->get_id() != pid || !page->is_dirty()) continue;
+
+        run.push_back(page);
+        locks.push_back(std::move(lock));
+
+        /* extend the run with the pages that follow it in the file. blocking on
+         * them while holding a page lock could deadlock with eviction, so a
+         * page that is busy ends the run */
+        while (i < end && run.size() < max_run &&
+               dirty_pages[i].first ==
+                   heap_file->next_in_stripe(dirty_pages[i - 1].first)) {
+            auto* next = dirty_pages[i].second;
+            boost::upgrade_lock<Page> next_lock(*next, boost::try_to_lock);
+            if (!next_lock.owns_lock() || next->get_id() != dirty_pages[i].first ||
+                !next->is_dirty()) {
+                break;
+            }
+
+            run.push_back(next);
+            locks.push_back(std::move(next_lock));
+            i++;
+        }
+
+        heap_file->write_pages(run.data(), locks.data(), run.size());
+        for (auto* p : run) {
+            p->set_dirty(false);
+        }
+        num_dirty -= run.size();
+        count += run.size();
+        since_pause += run.size();
+        num_write_calls++;
+
+        run.clear();
+        locks.clear();
+
+        if (paced && since_pause >= checkpoint_options.batch_pages &&
+            num_dirty.load() <= checkpoint_options.max_dirty_pages) {
+            since_pause = 0;
+            std::this_thread::sleep_for(
+                std::chrono::milliseconds(checkpoint_options.batch_pause_ms));
+        }
+    }
+
+    return count;
+}
+
+void HeapPageCache::checkpoint()
+{
+    flush_dirty_pages(false);
+    /* the pages must be durable before the checkpoint marker */
+    sync_if_durable();
+    heap_file->mark_checkpoint();
+    sync_if_durable();
+}
+
+void HeapPageCache::start_checkpointer(const CheckpointOptions& options)
+{
+    std::lock_guard<std::mutex> guard(checkpoint_mutex);
+    if (checkpointer_running) return;
+
+    checkpoint_options = options;
+    if (checkpoint_options.batch_pages == 0) {
+        checkpoint_options.batch_pages = 1;
+    }
+    checkpointer_running = true;
+    checkpointer = std::thread([this] { checkpointer_loop(); });
+}
+
+void HeapPageCache::stop_checkpointer()
+{
+    {
+        std::lock_guard<std::mutex> guard(checkpoint_mutex);
+        if (!checkpointer_running) return;
+        checkpointer_running = false;
+    }
+
+    checkpoint_cv.notify_all();
+    checkpointer.join();
+}
+
+void HeapPageCache::checkpointer_loop()
+{
+    std::unique_lock<std::mutex> lock(checkpoint_mutex);
+
+    while (checkpointer_running) {
+        checkpoint_cv.wait_for(
+            lock, std::chrono::milliseconds(checkpoint_options.interval_ms),
+            [this] {
+                return !checkpointer_running ||
+                       num_dirty.load() > checkpoint_options.max_dirty_pages;
+            });
+        if (!checkpointer_running) break;
+
+        lock.unlock();
+        if (num_dirty.load() > 0) {
+            flush_dirty_pages(true);
+            sync_if_durable();
+            heap_file->mark_checkpoint();
+            sync_if_durable();
+        }
+        if (!hot_page_path.empty()) {
+            try {
+                dump_hot_pages(hot_page_path);
+            } catch (IOException& e) {
+                /* the list is only a hint, the next checkpoint tries again */
+            }
+        }
+        lock.lock();
+    }
+}
+
+void HeapPageCache::set_durability(DurabilityMode mode,
+                                   uint32_t sync_interval_ms)
+{
+    stop_syncer();
+
+    durability = mode;
+    this->sync_interval_ms = sync_interval_ms;
+
+    if (mode == DurabilityMode::INTERVAL) {
+        std::lock_guard<std::mutex> guard(syncer_mutex);
+        syncer_running = true;
+        syncer = std::thread([this] { syncer_loop(); });
+    }
+}
+
+void HeapPageCache::stop_syncer()
+{
+    {
+        std::lock_guard<std::mutex> guard(syncer_mutex);
+        if (!syncer_running) return;
+        syncer_running = false;
+    }
+
+    syncer_cv.notify_all();
+    syncer.join();
+}
+
+void HeapPageCache::syncer_loop()
+{
+    std::unique_lock<std::mutex> lock(syncer_mutex);
+
+    while (syncer_running) {
+        syncer_cv.wait_for(lock, std::chrono::milliseconds(sync_interval_ms),
+                           [this] { return !syncer_running; });
+        if (!syncer_running) break;
+
+        lock.unlock();
+        heap_file->sync(); /* no-op if nothing was written since the last one */
+        lock.lock();
+    }
+}
+
+size_t HeapPageCache::prefetch_pages(std::vector<PageID> pids)
+{
+    std::sort(pids.begin(), pids.end());
+    pids.erase(std::unique(pids.begin(), pids.end()), pids.end());
+
+    size_t count = 0;
+    for (auto pid : pids) {
+        {
+            /* only fill free frames, prefetching must not evict pages that are
+             * in use */
+            std::lock_guard<std::mutex> guard(mutex);
+            if (page_map.find(pid) != page_map.end()) continue;
+            if (size() >= max_pages && free_frames.empty()) break;
+        }
+
+        boost::upgrade_lock<Page> lock;
+        Page* page;
+        try {
+            page = fetch_page(pid, lock);
+        } catch (CorruptPageException&) {
+            continue; /* reported when the page is actually used */
+        } catch (std::runtime_error&) {
+            break; /* the free frames were taken in the meantime */
+        }
+        if (page) {
+            unpin_page(page, false, lock);
+            count++;
+        }
+    }
+
+    num_prefetched += count;
+    return count;
+}
+
+void HeapPageCache::dump_hot_pages(const std::string& path)
+{
+    std::vector<PageID> pids;
+    {
+        /* pinned pages are not in the LRU list, they go first as the most
+         * recently used ones */
+        std::lock_guard<std::mutex> guard(mutex);
+        std::lock_guard<std::mutex> lru_guard(lru_mutex);
+
+        pids.reserve(page_map.size());
+        for (auto&& [pid, page] : page_map) {
+            if (lru_map.find(pid) == lru_map.end()) {
+                pids.push_back(pid);
+            }
+        }
+        for (auto pid : lru_list) {
+            pids.push_back(pid);
+        }
+    }
+
+    /* write to a temporary file and rename it so that a crash does not leave a
+     * partial list behind */
+    std::string tmp_path = path + ".tmp";
+    std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+    if (!out) {
+        throw IOException("unable to create hot page file");
+    }
+
+    uint32_t magic = HOT_PAGE_MAGIC;
+    uint64_t count = pids.size();
+    out.write(reinterpret_cast<const char*>(&magic), sizeof(magic));
+    out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+    out.write(reinterpret_cast<const char*>(pids.data()),
+              pids.size() * sizeof(PageID));
+    out.close();
+
+    if (!out || ::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        throw IOException("unable to write hot page file");
+    }
+}
+
+bool HeapPageCache::load_hot_pages(const std::string& path, bool background)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return false;
+
+    uint32_t magic = 0;
+    uint64_t count = 0;
+    in.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+    in.read(reinterpret_cast<char*>(&count), sizeof(count));
+    if (!in || magic != HOT_PAGE_MAGIC) return false;
+
+    /* pages beyond the cache capacity would only evict hotter ones */
+    std::vector<PageID> pids(std::min<uint64_t>(count, max_pages));
+    in.read(reinterpret_cast<char*>(pids.data()), pids.size() * sizeof(PageID));
+    pids.resize(in.gcount() / sizeof(PageID));
+
+    stop_prefetcher();
+
+    if (!background) {
+        prefetch_hot_pages(pids);
+        return true;
     }
+
+    {
+        std::lock_guard<std::mutex> guard(prefetch_mutex);
+        prefetch_active = true;
+    }
+    prefetcher_running = true;
+    prefetch_hot_batch(
+        std::make_shared<const std::vector<PageID>>(std::move(pids)), 0);
+    return true;
+}
+
+void HeapPageCache::prefetch_hot_batch(
+    std::shared_ptr<const std::vector<PageID>> pids, size_t begin)
+{
+    /* each batch is a separate task so that foreground work queued meanwhile
+     * runs first */
+    executor->submit(
+        [this, pids, begin] {
+            bool done = !prefetcher_running || begin >= pids->size();
+            if (!done) {
+                size_t end = std::min(pids->size(), begin + PREFETCH_BATCH_PAGES);
+                try {
+                    prefetch_pages(std::vector<PageID>(pids->begin() + begin,
+                                                       pids->begin() + end));
+                    prefetch_hot_batch(pids, end);
+                } catch (std::exception&) {
+                    /* prefetching is best effort */
+                    done = true;
+                }
+            }
+
+            if (done) {
+                std::lock_guard<std::mutex> guard(prefetch_mutex);
+                prefetch_active = false;
+                prefetch_cv.notify_all();
+            }
+        },
+        TaskPriority::MAINTENANCE);
+}
+
+void HeapPageCache::prefetch_hot_pages(const std::vector<PageID>& pids)
+{
+    /* the hottest pages are loaded first. within a batch the pages are read in
+     * page ID order */
+    for (size_t i = 0; i < pids.size(); i += PREFETCH_BATCH_PAGES) {
+        size_t end = std::min(pids.size(), i + PREFETCH_BATCH_PAGES);
+        prefetch_pages(std::vector<PageID>(pids.begin() + i, pids.begin() + end));
+    }
+}
+
+void HeapPageCache::stop_prefetcher()
+{
+    prefetcher_running = false;
+
+    std::unique_lock<std::mutex> lock(prefetch_mutex);
+    prefetch_cv.wait(lock, [this] { return !prefetch_active; });
 }
 
 void HeapPageCache::lru_insert(PageID id)
@@ -0,0 +1,470 @@
+#include "../include/bptree/replication.h"
+#include "../include/bptree/heap_file.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <limits>
+#include <poll.h>
+#include <random>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace bptree {
+
+/* message: | magic | type | flags | page size | stream id | seq | # file
+ * pages | # pages | followed by # pages times | page ID | page data |. the
+ * page data is the part of the page after the storage header
+ * BATCH    - the pages written up to the end of batch seq. with
+ *            FLAG_TRUNCATE the file is first cut to # file pages
+ * COPY     - pages of a full copy
+ * COPY_END - the full copy is complete and covers the batches up to seq. the
+ *            file has # file pages. with FLAG_CONSISTENT no page changed
+ *            while it was taken. otherwise the header is followed by the
+ *            seq of the last batch with writes made during the copy, the
+ *            pages are consistent once it is applied */
+static const uint32_t REPL_MAGIC = 0x5250424C;
+static const uint32_t MSG_BATCH = 1;
+static const uint32_t MSG_COPY = 2;
+static const uint32_t MSG_COPY_END = 3;
+static const uint32_t FLAG_TRUNCATE = 1;
+static const uint32_t FLAG_CONSISTENT = 2;
+
+struct MessageHeader {
+    uint32_t magic;
+    uint32_t type;
+    uint32_t flags;
+    uint32_t page_size;
+    uint64_t stream_id;
+    uint64_t seq;
+    uint64_t num_file_pages;
+    uint64_t num_pages;
+};
+
+static std::string encode_header(uint32_t type, uint32_t flags,
+                                 uint32_t page_size, uint64_t stream_id,
+                                 uint64_t seq, uint64_t num_file_pages,
+                                 uint64_t num_pages)
+{
+    MessageHeader header{REPL_MAGIC, type,           flags,    page_size,
+                         stream_id,  seq,            num_file_pages,
+                         num_pages};
+    std::string msg;
+    msg.reserve(sizeof(header) + num_pages * (sizeof(PageID) + page_size));
+    msg.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    return msg;
+}
+
+static void append_page(std::string& msg, PageID pid, const void* data,
+                        size_t len)
+{
+    msg.append(reinterpret_cast<const char*>(&pid), sizeof(pid));
+    msg.append(static_cast<const char*>(data), len);
+}
+
+static void send_fully(int fd, const void* data, size_t len)
+{
+    auto* p = static_cast<const uint8_t*>(data);
+
+    while (len > 0) {
+        ssize_t n = ::send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == ENOTSOCK) n = ::write(fd, p, len);
+
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw IOException("replication send failed");
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+ReplicationSource::ReplicationSource(AbstractPageCache* page_cache,
+                                     const ReplicationOptions& options)
+    : page_cache(page_cache), options(options),
+      pending_truncate(std::numeric_limits<PageID>::max()), num_changes(0),
+      log_first_seq(1), log_bytes(0), stopping(false)
+{
+    if (this->options.copy_batch_pages == 0) {
+        this->options.copy_batch_pages = 1;
+    }
+
+    /* followers of an earlier source always start with a full copy */
+    std::random_device rd;
+    do {
+        stream_id = ((uint64_t)rd() << 32) | rd();
+    } while (stream_id == 0);
+}
+
+ReplicationSource::~ReplicationSource()
+{
+    {
+        std::lock_guard<std::mutex> guard(log_mutex);
+        stopping = true;
+    }
+    log_cv.notify_all();
+
+    for (auto&& f : followers) {
+        /* wakes up a sender blocked on a socket */
+        ::shutdown(f->fd, SHUT_RDWR);
+        f->thread.join();
+        ::close(f->fd);
+    }
+}
+
+void ReplicationSource::add_follower(int fd, const ReplicationPosition& position)
+{
+    auto follower = std::make_unique<Follower>();
+    follower->fd = fd;
+    follower->next_seq =
+        position.stream_id == stream_id ? position.seq + 1 : 0;
+    follower->done = false;
+
+    auto* f = follower.get();
+    std::lock_guard<std::mutex> guard(log_mutex);
+    reap_followers();
+    followers.push_back(std::move(follower));
+    f->thread = std::thread([this, f] { follower_loop(f); });
+}
+
+size_t ReplicationSource::get_num_followers()
+{
+    std::lock_guard<std::mutex> guard(log_mutex);
+    reap_followers();
+    return followers.size();
+}
+
+void ReplicationSource::reap_followers()
+{
+    auto it = std::remove_if(followers.begin(), followers.end(), [](auto& f) {
+        if (!f->done) return false;
+        /* done is set last, the thread is about to exit */
+        f->thread.join();
+        ::close(f->fd);
+        return true;
+    });
+    followers.erase(it, followers.end());
+}
+
+uint64_t ReplicationSource::get_seq()
+{
+    std::lock_guard<std::mutex> guard(log_mutex);
+    return log_first_seq + log.size() - 1;
+}
+
+bool ReplicationSource::truncate(PageID num_pages)
+{
+    if (!page_cache->truncate(num_pages)) return false;
+
+    std::lock_guard<std::mutex> guard(pending_mutex);
+    pending_pages.erase(pending_pages.lower_bound(num_pages),
+                        pending_pages.end());
+    pending_truncate = std::min(pending_truncate, num_pages);
+    num_changes++;
+    return true;
+}
+
+void ReplicationSource::unpin_page(Page* page, bool dirty,
+                                   boost::upgrade_lock<Page>& lock)
+{
+    /* the wrapped cache may release the lock */
+    if (dirty) {
+        const auto* buf = page->get_buffer(lock);
+        std::lock_guard<std::mutex> guard(pending_mutex);
+        pending_pages[page->get_id()].assign(
+            reinterpret_cast<const char*>(buf), page->get_size());
+        num_changes++;
+    }
+
+    page_cache->unpin_page(page, dirty, lock);
+}
+
+void ReplicationSource::sync()
+{
+    page_cache->sync();
+
+    /* the batches are numbered in the order they are taken */
+    std::lock_guard<std::mutex> guard(pending_mutex);
+    bool truncated = pending_truncate != std::numeric_limits<PageID>::max();
+    if (pending_pages.empty() && !truncated) return;
+
+    size_t page_size = pending_pages.empty()
+                           ? 0
+                           : pending_pages.begin()->second.size();
+    std::shared_ptr<std::string> msg;
+    {
+        std::lock_guard<std::mutex> log_guard(log_mutex);
+        msg = std::make_shared<std::string>(encode_header(
+            MSG_BATCH, truncated ? FLAG_TRUNCATE : 0, page_size, stream_id,
+            log_first_seq + log.size(), truncated ? pending_truncate : 0,
+            pending_pages.size()));
+    }
+    for (auto&& [pid, data] : pending_pages) {
+        append_page(*msg, pid, data.data(), data.size());
+    }
+    pending_pages.clear();
+    pending_truncate = std::numeric_limits<PageID>::max();
+
+    {
+        std::lock_guard<std::mutex> log_guard(log_mutex);
+        log_bytes += msg->size();
+        log.push_back(std::move(msg));
+
+        /* the newest batch is always kept */
+        while (log.size() > 1 && log_bytes > options.max_log_bytes) {
+            log_bytes -= log.front()->size();
+            log.pop_front();
+            log_first_seq++;
+        }
+    }
+    log_cv.notify_all();
+}
+
+void ReplicationSource::follower_loop(Follower* follower)
+{
+    try {
+        while (true) {
+            std::shared_ptr<const std::string> msg;
+            {
+                std::unique_lock<std::mutex> lock(log_mutex);
+                log_cv.wait(lock, [this, follower] {
+                    return stopping || follower->next_seq < log_first_seq ||
+                           follower->next_seq < log_first_seq + log.size();
+                });
+                if (stopping) break;
+
+                /* a position that is no longer in the log needs a full
+                 * copy */
+                if (follower->next_seq >= log_first_seq) {
+                    msg = log[follower->next_seq - log_first_seq];
+                }
+            }
+
+            if (!msg) {
+                follower->next_seq = send_full_copy(follower->fd) + 1;
+                continue;
+            }
+
+            send_fully(follower->fd, msg->data(), msg->size());
+            follower->next_seq++;
+        }
+    } catch (IOException&) {
+        /* the follower is gone */
+    }
+
+    follower->done = true;
+}
+
+uint64_t ReplicationSource::send_full_copy(int fd)
+{
+    /* the writes that are not in a batch up to seq yet go into later
+     * batches, which the follower applies after the copy */
+    uint64_t seq;
+    uint64_t changes;
+    {
+        std::lock_guard<std::mutex> guard(pending_mutex);
+        std::lock_guard<std::mutex> log_guard(log_mutex);
+        seq = log_first_seq + log.size() - 1;
+        changes = num_changes.load();
+    }
+
+    PageID num_pages = page_cache->get_num_pages();
+    size_t page_size = 0;
+    std::string msg;
+    std::vector<std::pair<PageID, std::string>> pages;
+
+    auto send_pages = [&] {
+        if (pages.empty()) return;
+        msg = encode_header(MSG_COPY, 0, page_size, stream_id, seq, num_pages,
+                            pages.size());
+        for (auto&& [pid, data] : pages) {
+            append_page(msg, pid, data.data(), data.size());
+        }
+        send_fully(fd, msg.data(), msg.size());
+        pages.clear();
+    };
+
+    for (PageID pid = 1; pid < num_pages; pid++) {
+        boost::upgrade_lock<Page> lock;
+        Page* page;
+        try {
+            page = page_cache->fetch_page(pid, lock);
+        } catch (CorruptPageException&) {
+            /* e.g. a free page torn by a crash. a page the tree uses fails
+             * on the leader itself when it is read */
+            continue;
+        }
+        if (!page) continue;
+
+        page_size = page->get_size();
+        pages.emplace_back(
+            pid, std::string(reinterpret_cast<const char*>(
+                                 page->get_buffer(lock)),
+                             page_size));
+        page_cache->unpin_page(page, false, lock);
+
+        if (pages.size() >= options.copy_batch_pages) send_pages();
+    }
+    send_pages();
+
+    /* the writes made during the copy are in the batches up to the end of
+     * the log, and in the next batch if some are still pending */
+    uint64_t catch_up_seq;
+    bool changed;
+    {
+        std::lock_guard<std::mutex> guard(pending_mutex);
+        std::lock_guard<std::mutex> log_guard(log_mutex);
+        catch_up_seq = log_first_seq + log.size() - 1;
+        if (!pending_pages.empty() ||
+            pending_truncate != std::numeric_limits<PageID>::max()) {
+            catch_up_seq++;
+        }
+        changed = num_changes.load() != changes;
+    }
+
+    uint32_t flags = changed ? 0 : FLAG_CONSISTENT;
+    msg = encode_header(MSG_COPY_END, flags, page_size, stream_id, seq,
+                        num_pages, 0);
+    if (changed) {
+        msg.append(reinterpret_cast<const char*>(&catch_up_seq),
+                   sizeof(catch_up_seq));
+    }
+    send_fully(fd, msg.data(), msg.size());
+
+    return seq;
+}
+
+ReplicationSink::ReplicationSink(AbstractPageCache* page_cache, int fd,
+                                 const ReplicationPosition& position)
+    : page_cache(page_cache), fd(fd), position(position), applied(position),
+      consistent(true), consistent_seq(0)
+{}
+
+ReplicationSink::~ReplicationSink() { ::close(fd); }
+
+size_t ReplicationSink::apply_available()
+{
+    size_t applied_messages = 0;
+
+    while (applied_messages < MAX_MESSAGES_PER_SYNC) {
+        if (applied_messages > 0) {
+            /* stop at the first message that has not arrived yet */
+            struct pollfd pfd = {fd, POLLIN, 0};
+            if (::poll(&pfd, 1, 0) <= 0) break;
+        }
+
+        if (!apply_message()) break;
+        applied_messages++;
+    }
+
+    if (applied_messages > 0) {
+        page_cache->flush_all_pages();
+        page_cache->sync();
+        position = applied;
+    }
+    return applied_messages;
+}
+
+void ReplicationSink::run()
+{
+    while (apply_available() > 0)
+        ;
+}
+
+bool ReplicationSink::read_fully(void* dst, size_t len)
+{
+    auto* p = static_cast<uint8_t*>(dst);
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t n = ::read(fd, p + done, len - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw IOException("replication receive failed");
+        }
+        if (n == 0) {
+            if (done == 0) return false;
+            throw IOException("truncated replication message");
+        }
+        done += n;
+    }
+    return true;
+}
+
+bool ReplicationSink::apply_message()
+{
+    MessageHeader header;
+    if (!read_fully(&header, sizeof(header))) return false;
+
+    if (header.magic != REPL_MAGIC) {
+        throw IOException("bad replication message");
+    }
+    if (header.type == MSG_BATCH) {
+        if (header.stream_id != applied.stream_id ||
+            header.seq != applied.seq + 1) {
+            throw IOException("replication batch out of order");
+        }
+        if (header.flags & FLAG_TRUNCATE) {
+            page_cache->truncate(header.num_file_pages);
+        }
+    } else if (header.type == MSG_COPY) {
+        consistent = false;
+    } else if (header.type != MSG_COPY_END) {
+        throw IOException("bad replication message");
+    }
+
+    size_t record_size = sizeof(PageID) + header.page_size;
+    buf.resize(record_size);
+    for (uint64_t i = 0; i < header.num_pages; i++) {
+        if (!read_fully(buf.data(), record_size)) {
+            throw IOException("truncated replication message");
+        }
+        PageID pid;
+        ::memcpy(&pid, buf.data(), sizeof(pid));
+        write_page(pid, &buf[sizeof(pid)], header.page_size);
+    }
+
+    if (header.type == MSG_BATCH) {
+        applied.seq = header.seq;
+        if (applied.seq >= consistent_seq) consistent = true;
+    } else if (header.type == MSG_COPY_END) {
+        consistent_seq = 0;
+        if (!(header.flags & FLAG_CONSISTENT) &&
+            !read_fully(&consistent_seq, sizeof(consistent_seq))) {
+            throw IOException("truncated replication message");
+        }
+
+        /* pages past the end of the leader's file are left over from an
+         * earlier state */
+        if (page_cache->get_num_pages() > header.num_file_pages) {
+            page_cache->truncate(header.num_file_pages);
+        }
+        applied.stream_id = header.stream_id;
+        applied.seq = header.seq;
+        consistent = applied.seq >= consistent_seq;
+    }
+    return true;
+}
+
+void ReplicationSink::write_page(PageID pid, const uint8_t* data, size_t len)
+{
+    PageID num_pages = page_cache->get_num_pages();
+    if (pid >= num_pages) {
+        page_cache->new_pages(pid + 1 - num_pages);
+    }
+
+    boost::upgrade_lock<Page> lock;
+    auto* page = page_cache->fetch_page_for_overwrite(pid, lock);
+    if (!page || page->get_size() != len) {
+        if (page) page_cache->unpin_page(page, false, lock);
+        throw IOException("unable to apply replicated page");
+    }
+
+    {
+        boost::upgrade_to_unique_lock<Page> ulock(lock);
+        ::memcpy(page->get_buffer(ulock), data, len);
+    }
+    page_cache->unpin_page(page, true, lock);
+}
+
+} // namespace bptree
@@ -0,0 +1,771 @@
+#include "../include/bptree/shm_page_cache.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <exception>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+namespace bptree {
+
+static const uint32_t SHM_MAGIC = 0x42505349;
+
+/* one bit per process in Frame::pinned_by */
+static const size_t MAX_PROCESSES = 64;
+
+/* the atomics are shared between processes, which needs them lock-free */
+static_assert(std::atomic<int32_t>::is_always_lock_free,
+              "shared memory needs lock-free 32-bit atomics");
+
+struct ShmPageCache::Header {
+    std::atomic<uint32_t> magic;
+    uint32_t page_size;
+    uint64_t num_frames;
+    /* entries in the page table, a power of two */
+    uint64_t table_size;
+    /* guards the fields below, the frames and the page table. robust, so
+     * that a process that dies holding it does not block the others */
+    pthread_mutex_t mutex;
+    uint64_t clock_hand;
+    uint64_t num_used;
+    /* pids of the attached processes, 0 for a free slot. slot 0 is the
+     * writer's */
+    std::atomic<int32_t> pids[MAX_PROCESSES];
+};
+
+enum : uint32_t { FRAME_FREE = 0, FRAME_LOADING, FRAME_READY };
+
+struct ShmPageCache::Frame {
+    PageID pid;
+    uint32_t state;
+    /* slot of the process that fills a LOADING frame */
+    uint32_t owner;
+    /* one bit per slot of the processes that have the frame pinned */
+    uint64_t pinned_by;
+    /* in the page table. a frame replaced by a newer copy of its page stays
+     * readable until it is unpinned */
+    bool mapped;
+    /* holds a page that the writer has not written to the file yet */
+    bool dirty;
+    bool referenced;
+};
+
+class ShmPageCache::SegmentLock {
+public:
+    explicit SegmentLock(Header* header) : mutex(&header->mutex), locked(false)
+    {
+        lock();
+    }
+    ~SegmentLock()
+    {
+        if (locked) unlock();
+    }
+
+    void lock()
+    {
+        int ret = pthread_mutex_lock(mutex);
+        if (ret == EOWNERDEAD) {
+            /* the owner died in a short critical section, reap() releases
+             * what it left pinned or half-loaded */
+            pthread_mutex_consistent(mutex);
+        } else if (ret != 0) {
+            throw IOException("cannot lock shared memory segment");
+        }
+        locked = true;
+    }
+    void unlock()
+    {
+        locked = false;
+        pthread_mutex_unlock(mutex);
+    }
+
+private:
+    pthread_mutex_t* mutex;
+    bool locked;
+};
+
+static size_t align_up(size_t n, size_t align)
+{
+    return (n + align - 1) / align * align;
+}
+
+static size_t hash_pid(PageID pid)
+{
+    return (size_t)((pid * 0x9E3779B97F4A7C15ULL) >> 17);
+}
+
+static bool process_alive(int32_t pid)
+{
+    return pid != 0 && (::kill(pid, 0) == 0 || errno != ESRCH);
+}
+
+static void throw_errno(const char* what)
+{
+    std::stringstream ss;
+    ss << what << " failed (errno: " << errno << ")";
+    throw IOException(ss.str().c_str());
+}
+
+ShmPageCache::ShmPageCache(const std::string& name, std::string_view filename,
+                           bool create, size_t num_frames, size_t page_size)
+    : name(name), writer(true), closed(false), page_size(page_size),
+      num_frames(num_frames),
+      heap_file(std::make_unique<HeapFile>(filename, create, page_size))
+{
+    this->page_size = heap_file->get_page_size();
+    attach(true, num_frames);
+}
+
+ShmPageCache::ShmPageCache(const std::string& name, std::string_view filename,
+                           OpenMode mode, size_t num_frames)
+    : name(name), writer(mode == OpenMode::READ_WRITE), closed(false),
+      page_size(0), num_frames(num_frames),
+      heap_file(std::make_unique<HeapFile>(
+          std::vector<std::string>{std::string(filename)}, false, 4096,
+          ChecksumMode::NONE, StripeOptions{}, mode))
+{
+    page_size = heap_file->get_page_size();
+    attach(writer, num_frames);
+}
+
+ShmPageCache::~ShmPageCache()
+{
+    if (!closed) {
+        close();
+    }
+}
+
+void ShmPageCache::attach(bool create, size_t num_frames)
+{
+    int fd;
+    if (create) {
+        ::shm_unlink(name.c_str());
+        fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0660);
+    } else {
+        fd = ::shm_open(name.c_str(), O_RDWR, 0);
+    }
+    if (fd < 0) throw_errno("shm_open");
+
+    size_t table_size = 1;
+    if (create) {
+        num_frames = std::max<size_t>(1, num_frames);
+        while (table_size < 2 * num_frames) table_size <<= 1;
+    } else {
+        /* the geometry of an existing segment comes from its header */
+        alignas(Header) uint8_t buf[sizeof(Header)];
+        auto* h = (Header*)buf;
+        struct stat st;
+        if (::fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(Header) ||
+            ::pread(fd, buf, sizeof(buf), 0) != (ssize_t)sizeof(buf) ||
+            h->magic.load() != SHM_MAGIC || h->page_size != page_size) {
+            ::close(fd);
+            throw IOException("bad shared memory segment");
+        }
+        num_frames = h->num_frames;
+        table_size = h->table_size;
+    }
+    this->num_frames = num_frames;
+
+    size_t frames_offset = align_up(sizeof(Header), 64);
+    size_t table_offset =
+        align_up(frames_offset + num_frames * sizeof(Frame), 64);
+    size_t data_offset =
+        align_up(table_offset + table_size * sizeof(uint32_t), 4096);
+    segment_size = data_offset + num_frames * page_size;
+
+    if (create && ::ftruncate(fd, segment_size) < 0) {
+        ::close(fd);
+        throw_errno("ftruncate");
+    }
+
+    void* addr = ::mmap(nullptr, segment_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) throw_errno("mmap");
+
+    segment = (uint8_t*)addr;
+    header = (Header*)segment;
+    frames = (Frame*)(segment + frames_offset);
+    table = (uint32_t*)(segment + table_offset);
+    data = segment + data_offset;
+
+    if (create) {
+        /* the segment is zero-filled: all frames are free and the table is
+         * empty. readers check the magic last */
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&header->mutex, &attr);
+        pthread_mutexattr_destroy(&attr);
+
+        header->page_size = page_size;
+        header->num_frames = num_frames;
+        header->table_size = table_size;
+        slot = 0;
+        header->pids[0].store(::getpid());
+        header->magic.store(SHM_MAGIC);
+        return;
+    }
+
+    try {
+        check_writer();
+
+        SegmentLock lock(header);
+        reap();
+        for (slot = 1; slot < MAX_PROCESSES; slot++) {
+            if (header->pids[slot].load() == 0) break;
+        }
+        if (slot == MAX_PROCESSES) {
+            throw IOException("too many processes attached to the segment");
+        }
+        header->pids[slot].store(::getpid());
+    } catch (...) {
+        ::munmap(segment, segment_size);
+        throw;
+    }
+}
+
+void ShmPageCache::close()
+{
+    if (closed) return;
+
+    if (writer) {
+        flush_all_pages();
+        heap_file->sync();
+    }
+
+    {
+        SegmentLock lock(header);
+        uint64_t bit = 1ULL << slot;
+        for (size_t i = 0; i < num_frames; i++) {
+            auto& frame = frames[i];
+            frame.pinned_by &= ~bit;
+            if (frame.state != FRAME_FREE && !frame.mapped &&
+                frame.pinned_by == 0) {
+                release_frame(i);
+            }
+        }
+        header->pids[slot].store(0);
+    }
+
+    ::munmap(segment, segment_size);
+    closed = true;
+}
+
+void ShmPageCache::remove(const std::string& name)
+{
+    ::shm_unlink(name.c_str());
+}
+
+size_t ShmPageCache::lookup(PageID pid) const
+{
+    size_t mask = header->table_size - 1;
+    for (size_t i = hash_pid(pid) & mask;; i = (i + 1) & mask) {
+        uint32_t entry = table[i];
+        if (entry == 0) return NO_FRAME;
+        if (frames[entry - 1].pid == pid) return entry - 1;
+    }
+}
+
+void ShmPageCache::map_frame(size_t frame)
+{
+    /* at most num_frames of the 2 * num_frames entries are used, so there is
+     * always an empty one */
+    size_t mask = header->table_size - 1;
+    size_t i = hash_pid(frames[frame].pid) & mask;
+    while (table[i] != 0) i = (i + 1) & mask;
+
+    table[i] = (uint32_t)(frame + 1);
+    frames[frame].mapped = true;
+    header->num_used++;
+}
+
+void ShmPageCache::unmap_frame(size_t frame)
+{
+    size_t mask = header->table_size - 1;
+    size_t i = hash_pid(frames[frame].pid) & mask;
+    while (table[i] != frame + 1) i = (i + 1) & mask;
+    table[i] = 0;
+
+    /* linear probing: move later entries of the cluster into the hole unless
+     * their home position lies after it */
+    for (size_t j = (i + 1) & mask; table[j] != 0; j = (j + 1) & mask) {
+        size_t home = hash_pid(frames[table[j] - 1].pid) & mask;
+        bool after_hole = (i <= j) ? (home > i && home <= j)
+                                   : (home > i || home <= j);
+        if (!after_hole) {
+            table[i] = table[j];
+            table[j] = 0;
+            i = j;
+        }
+    }
+
+    frames[frame].mapped = false;
+    header->num_used--;
+}
+
+void ShmPageCache::release_frame(size_t frame)
+{
+    auto& f = frames[frame];
+    f.pid = Page::INVALID_PAGE_ID;
+    f.state = FRAME_FREE;
+    f.pinned_by = 0;
+    f.dirty = false;
+    f.referenced = false;
+}
+
+/* returns an unmapped frame for pid, LOADING and pinned by this process. the
+ * writer writes dirty frames back to make room, it holds write_mutex */
+size_t ShmPageCache::grab_frame(PageID pid, SegmentLock& lock)
+{
+    uint64_t bit = 1ULL << slot;
+    bool reaped = false;
+
+    while (true) {
+        size_t victim = NO_FRAME, dirty_frame = NO_FRAME;
+        for (size_t n = 0; n < 2 * num_frames; n++) {
+            size_t i = header->clock_hand;
+            header->clock_hand = (i + 1) % num_frames;
+            auto& frame = frames[i];
+
+            if (frame.state == FRAME_FREE) {
+                victim = i;
+                break;
+            }
+            if (frame.state != FRAME_READY || frame.pinned_by != 0) continue;
+            if (frame.referenced) {
+                frame.referenced = false;
+                continue;
+            }
+            if (frame.dirty) {
+                /* only the writer writes the file */
+                if (writer && dirty_frame == NO_FRAME) dirty_frame = i;
+                continue;
+            }
+
+            if (frame.mapped) unmap_frame(i);
+            victim = i;
+            break;
+        }
+
+        if (victim != NO_FRAME) {
+            auto& frame = frames[victim];
+            frame.pid = pid;
+            frame.state = FRAME_LOADING;
+            frame.owner = (uint32_t)slot;
+            frame.pinned_by = bit;
+            frame.dirty = false;
+            frame.referenced = true;
+            return victim;
+        }
+
+        if (dirty_frame != NO_FRAME) {
+            frames[dirty_frame].pinned_by |= bit;
+            lock.unlock();
+            write_frames(&dirty_frame, 1);
+            lock.lock();
+            continue;
+        }
+
+        if (reaped) {
+            throw std::runtime_error("all shared frames are pinned");
+        }
+        /* frames left pinned by processes that died */
+        reap();
+        reaped = true;
+    }
+}
+
+void ShmPageCache::unpin_frame(size_t frame)
+{
+    SegmentLock lock(header);
+    auto& f = frames[frame];
+    f.pinned_by &= ~(1ULL << slot);
+    if (!f.mapped && f.pinned_by == 0) release_frame(frame);
+}
+
+/* write frames that this process has pinned and whose pages follow each
+ * other in one file. their content does not change while they are pinned */
+void ShmPageCache::write_frames(const size_t* frame_list, size_t count)
+{
+    std::vector<std::unique_ptr<Page>> pages;
+    std::vector<Page*> page_ptrs;
+    std::vector<boost::upgrade_lock<Page>> locks(count);
+    for (size_t i = 0; i < count; i++) {
+        size_t frame = frame_list[i];
+        pages.push_back(std::make_unique<Page>(
+            frames[frame].pid, frame_data(frame), page_size,
+            heap_file->get_page_header_size()));
+        page_ptrs.push_back(pages.back().get());
+        locks[i] = boost::upgrade_lock<Page>(*pages.back());
+    }
+
+    std::exception_ptr error;
+    try {
+        heap_file->write_pages(page_ptrs.data(), locks.data(), count);
+    } catch (...) {
+        error = std::current_exception();
+    }
+
+    SegmentLock lock(header);
+    for (size_t i = 0; i < count; i++) {
+        auto& frame = frames[frame_list[i]];
+        /* a frame replaced in the meantime is clean already */
+        if (!error) frame.dirty = false;
+        frame.pinned_by &= ~(1ULL << slot);
+        if (!frame.mapped && frame.pinned_by == 0) {
+            release_frame(frame_list[i]);
+        }
+    }
+    if (error) std::rethrow_exception(error);
+}
+
+/* release the pins and the loads of the processes that died. the caller
+ * holds the segment lock */
+void ShmPageCache::reap()
+{
+    uint64_t dead = 0;
+    for (size_t s = 0; s < MAX_PROCESSES; s++) {
+        auto pid = header->pids[s].load();
+        if (pid != 0 && !process_alive(pid)) dead |= 1ULL << s;
+    }
+    if (dead == 0) return;
+
+    for (size_t i = 0; i < num_frames; i++) {
+        auto& frame = frames[i];
+        if (frame.state == FRAME_FREE) continue;
+
+        if (frame.state == FRAME_LOADING && ((dead >> frame.owner) & 1)) {
+            if (frame.mapped) unmap_frame(i);
+            release_frame(i);
+            continue;
+        }
+
+        frame.pinned_by &= ~dead;
+        if (!frame.mapped && frame.pinned_by == 0) release_frame(i);
+    }
+
+    for (size_t s = 0; s < MAX_PROCESSES; s++) {
+        if ((dead >> s) & 1) header->pids[s].store(0);
+    }
+}
+
+void ShmPageCache::check_writer() const
+{
+    if (!process_alive(header->pids[0].load())) {
+        throw IOException("the writer of the shared memory segment is gone");
+    }
+}
+
+Page* ShmPageCache::new_page(boost::upgrade_lock<Page>& lock)
+{
+    auto* page = pin_private(new_pages(1), true);
+    lock = boost::upgrade_lock<Page>(*page);
+    return page;
+}
+
+PageID ShmPageCache::new_pages(size_t count)
+{
+    if (!writer) {
+        throw std::runtime_error("shared memory segment is read-only");
+    }
+    return heap_file->new_pages(count);
+}
+
+Page* ShmPageCache::fetch_page(PageID id, boost::upgrade_lock<Page>& lock)
+{
+    if (id == Page::INVALID_PAGE_ID) return nullptr;
+
+    Page* page;
+    if (writer) {
+        if (id >= heap_file->get_num_pages()) return nullptr;
+        page = pin_private(id, false);
+    } else {
+        page = pin_shared(id);
+        if (!page) return nullptr;
+    }
+
+    lock = boost::upgrade_lock<Page>(*page);
+    return page;
+}
+
+void ShmPageCache::read_ahead(const std::vector<PageID>& pids)
+{
+    for (auto pid : pids) {
+        heap_file->read_ahead(pid);
+    }
+}
+
+/* the caller holds mutex */
+Page* ShmPageCache::add_local(PageID id, size_t frame)
+{
+    auto page = std::make_unique<Page>(id, frame_data(frame), page_size,
+                                       heap_file->get_page_header_size());
+    auto* p = page.get();
+    local_pages.emplace(id, LocalPage{std::move(page), 1, frame});
+    return p;
+}
+
+/* readers: pin the frame of the page, loading it from the file if it is not
+ * in the pool */
+Page* ShmPageCache::pin_shared(PageID id)
+{
+    uint64_t bit = 1ULL << slot;
+    bool checked = false;
+    size_t frame = NO_FRAME;
+
+    while (frame == NO_FRAME) {
+        bool loading = false;
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            auto it = local_pages.find(id);
+            if (it != local_pages.end()) {
+                it->second.pin_count++;
+                return it->second.page.get();
+            }
+
+            SegmentLock lock(header);
+            size_t mapped = lookup(id);
+            if (mapped != NO_FRAME && frames[mapped].state == FRAME_READY) {
+                frames[mapped].pinned_by |= bit;
+                frames[mapped].referenced = true;
+                return add_local(id, mapped);
+            }
+
+            if (mapped != NO_FRAME) {
+                /* another thread or process is loading the page */
+                auto owner = header->pids[frames[mapped].owner].load();
+                if (!process_alive(owner)) reap();
+                loading = true;
+            } else if (checked) {
+                frame = grab_frame(id, lock);
+                map_frame(frame);
+            }
+        }
+
+        if (loading) {
+            std::this_thread::yield();
+        } else if (frame == NO_FRAME) {
+            /* only misses look at the writer and the file */
+            check_writer();
+            if (id >= heap_file->get_num_pages()) return nullptr;
+            checked = true;
+        }
+    }
+
+    /* the frame is mapped and LOADING, others wait until it is READY */
+    try {
+        Page page(id, frame_data(frame), page_size,
+                  heap_file->get_page_header_size());
+        boost::upgrade_lock<Page> lock(page);
+        boost::upgrade_to_unique_lock<Page> ulock(lock);
+        heap_file->read_page(&page, ulock);
+    } catch (...) {
+        SegmentLock lock(header);
+        if (frames[frame].mapped) unmap_frame(frame);
+        release_frame(frame);
+        throw;
+    }
+
+    std::lock_guard<std::mutex> guard(mutex);
+    {
+        SegmentLock lock(header);
+        frames[frame].state = FRAME_READY;
+    }
+
+    auto it = local_pages.find(id);
+    if (it == local_pages.end()) return add_local(id, frame);
+
+    /* the writer replaced the page while it was loading and another thread
+     * pinned the new frame */
+    it->second.pin_count++;
+    unpin_frame(frame);
+    return it->second.page.get();
+}
+
+void ShmPageCache::invalidate(const std::vector<PageID>&)
+{
+    if (!writer) check_writer();
+}
+
+void ShmPageCache::discard(const std::vector<PageID>& pids)
+{
+    if (!writer) return;
+
+    std::lock_guard<std::mutex> write_guard(write_mutex);
+    SegmentLock lock(header);
+    for (auto pid : pids) {
+        size_t frame = lookup(pid);
+        if (frame == NO_FRAME) continue;
+
+        unmap_frame(frame);
+        frames[frame].dirty = false;
+        if (frames[frame].pinned_by == 0) release_frame(frame);
+    }
+}
+
+Page* ShmPageCache::pin_private(PageID id, bool fresh)
+{
+    std::lock_guard<std::mutex> guard(mutex);
+
+    auto it = local_pages.find(id);
+    if (it != local_pages.end()) {
+        it->second.pin_count++;
+        return it->second.page.get();
+    }
+
+    auto page = std::make_unique<Page>(id, page_size,
+                                       heap_file->get_page_header_size());
+    if (!fresh) {
+        /* nobody else can see the page yet */
+        boost::upgrade_lock<Page> lock(*page);
+        boost::upgrade_to_unique_lock<Page> ulock(lock);
+
+        bool copied = false;
+        {
+            SegmentLock slock(header);
+            size_t frame = lookup(id);
+            if (frame != NO_FRAME && frames[frame].state == FRAME_READY) {
+                ::memcpy(page->get_frame(ulock), frame_data(frame), page_size);
+                frames[frame].referenced = true;
+                copied = true;
+            }
+        }
+        /* pages are written to the file before their frame is unmapped */
+        if (!copied) heap_file->read_page(page.get(), ulock);
+    }
+
+    auto* p = page.get();
+    local_pages.emplace(id, LocalPage{std::move(page), 1, NO_FRAME});
+    return p;
+}
+
+void ShmPageCache::publish(Page* page, boost::upgrade_lock<Page>& lock)
+{
+    if (!writer) {
+        throw std::runtime_error("shared memory segment is read-only");
+    }
+
+    /* holders of the upgrade lock are exclusive, so there is one publisher
+     * per page at a time. the copy goes to a frame nobody else sees until it
+     * replaces the current one */
+    auto id = page->get_id();
+    std::lock_guard<std::mutex> write_guard(write_mutex);
+    SegmentLock slock(header);
+    size_t frame = grab_frame(id, slock);
+
+    slock.unlock();
+    ::memcpy(frame_data(frame), page->get_frame(lock), page_size);
+    slock.lock();
+
+    size_t old = lookup(id);
+    if (old != NO_FRAME) {
+        unmap_frame(old);
+        frames[old].dirty = false;
+        if (frames[old].pinned_by == 0) release_frame(old);
+    }
+
+    auto& f = frames[frame];
+    f.state = FRAME_READY;
+    f.dirty = true;
+    f.pinned_by &= ~(1ULL << slot);
+    map_frame(frame);
+    page->set_dirty(false);
+}
+
+void ShmPageCache::pin_page(Page* page, boost::upgrade_lock<Page>&)
+{
+    std::lock_guard<std::mutex> guard(mutex);
+    local_pages.at(page->get_id()).pin_count++;
+}
+
+void ShmPageCache::unpin_page(Page* page, bool dirty,
+                              boost::upgrade_lock<Page>& lock)
+{
+    if (dirty || page->is_dirty()) {
+        publish(page, lock);
+    }
+
+    std::lock_guard<std::mutex> guard(mutex);
+    auto it = local_pages.find(page->get_id());
+    if (--it->second.pin_count > 0) return;
+
+    /* the last pin is gone and the page is dropped, so the caller's lock
+     * must not outlive it */
+    if (lock.owns_lock() && lock.mutex() == page) lock.unlock();
+    size_t frame = it->second.frame;
+    local_pages.erase(it);
+    if (frame != NO_FRAME) unpin_frame(frame);
+}
+
+void ShmPageCache::flush_page(Page* page, boost::upgrade_lock<Page>& lock)
+{
+    if (page->is_dirty()) {
+        publish(page, lock);
+    }
+}
+
+void ShmPageCache::flush_all_pages()
+{
+    if (!writer) return;
+
+    std::lock_guard<std::mutex> write_guard(write_mutex);
+    std::vector<size_t> dirty;
+    {
+        SegmentLock lock(header);
+        uint64_t bit = 1ULL << slot;
+        for (size_t i = 0; i < num_frames; i++) {
+            if (frames[i].mapped && frames[i].dirty) {
+                frames[i].pinned_by |= bit;
+                dirty.push_back(i);
+            }
+        }
+    }
+
+    /* runs of pages that follow each other in one file go out in one write */
+    std::sort(dirty.begin(), dirty.end(), [this](size_t a, size_t b) {
+        return frames[a].pid < frames[b].pid;
+    });
+
+    size_t begin = 0;
+    try {
+        while (begin < dirty.size()) {
+            size_t end = begin + 1;
+            while (end < dirty.size() &&
+                   frames[dirty[end]].pid ==
+                       heap_file->next_in_stripe(frames[dirty[end - 1]].pid)) {
+                end++;
+            }
+            size_t run = begin;
+            begin = end;
+            write_frames(&dirty[run], end - run);
+        }
+    } catch (...) {
+        for (; begin < dirty.size(); begin++) {
+            unpin_frame(dirty[begin]);
+        }
+        throw;
+    }
+}
+
+void ShmPageCache::sync()
+{
+    if (writer) heap_file->sync();
+}
+
+size_t ShmPageCache::size() const
+{
+    SegmentLock lock(header);
+    return header->num_used;
+}
+
+} // namespace bptree
@@ -0,0 +1,79 @@
+#include "../include/bptree/heap_page_cache.h"
+#include "../include/bptree/tree.h"
+#include "test_util.h"
+
+#include <gtest/gtest.h>
+
+#include <stdexcept>
+#include <utility>
+
+using namespace bptree;
+
+using Tree = BTree<8, int, int>;
+
+TEST(BulkLoadTest, ParallelBuildMatchesInput)
+{
+    std::string path = fresh_file("bulk_parallel.heap");
+    const int n = 100000;
+
+    std::vector<std::pair<int, int>> pairs;
+    for (int i = 0; i < n; i++) {
+        pairs.emplace_back(i, 2 * i);
+    }
+
+    {
+        HeapPageCache page_cache(path, true);
+        Tree tree(&page_cache);
+        EXPECT_EQ(tree.parallel_bulk_load(pairs.begin(), pairs.end(), 4), n);
+        EXPECT_EQ(tree.size(), n);
+
+        /* the built tree takes regular inserts */
+        tree.insert(n, 2 * n);
+    }
+
+    HeapPageCache page_cache(path, false);
+    Tree tree(&page_cache);
+    EXPECT_EQ(tree.size(), n + 1);
+    int expected = 0;
+    for (auto&& [key, value] : tree) {
+        ASSERT_EQ(key, expected);
+        ASSERT_EQ(value, 2 * expected);
+        expected++;
+    }
+    EXPECT_EQ(expected, n + 1);
+}
+
+TEST(BulkLoadTest, ParallelBuildKeepsEqualKeysTogether)
+{
+    HeapPageCache page_cache(fresh_file("bulk_dups.heap"), true);
+    Tree tree(&page_cache);
+
+    /* long runs of equal keys around every range boundary */
+    std::vector<std::pair<int, int>> pairs;
+    for (int k = 0; k < 1000; k++) {
+        for (int j = 0; j < 100; j++) {
+            pairs.emplace_back(k, j);
+        }
+    }
+    EXPECT_EQ(tree.parallel_bulk_load(pairs.begin(), pairs.end(), 3),
+              pairs.size());
+
+    EXPECT_EQ(tree.size(), pairs.size());
+
+    /* erase() finds every pair of a key, in whichever leaves they are */
+    for (int k = 0; k < 1000; k++) {
+        ASSERT_EQ(tree.erase(k), 100) << k;
+    }
+    EXPECT_EQ(tree.size(), 0);
+}
+
+TEST(BulkLoadTest, RequiresEmptyTree)
+{
+    HeapPageCache page_cache(fresh_file("bulk_nonempty.heap"), true);
+    Tree tree(&page_cache);
+    tree.insert(1, 1);
+
+    std::vector<std::pair<int, int>> pairs{{2, 2}, {3, 3}};
+    EXPECT_THROW(tree.parallel_bulk_load(pairs.begin(), pairs.end(), 2),
+                 std::runtime_error);
+}
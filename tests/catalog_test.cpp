@@ -0,0 +1,79 @@
+#include "../include/bptree/catalog.h"
+#include "../include/bptree/heap_page_cache.h"
+#include "../include/bptree/tree.h"
+#include "test_util.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+using namespace bptree;
+
+TEST(CatalogTest, TreesShareOneFile)
+{
+    std::string path = fresh_file("catalog.heap");
+
+    {
+        HeapPageCache page_cache(path, true);
+        Catalog catalog(&page_cache);
+        BTree<8, int, int> ints(&page_cache, &catalog, "ints");
+        BTree<16, int, long> longs(&page_cache, &catalog, "longs");
+
+        for (int i = 0; i < 1000; i++) {
+            ints.insert(i, 2 * i);
+            longs.insert(i, -i);
+        }
+    }
+
+    HeapPageCache page_cache(path, false);
+    Catalog catalog(&page_cache);
+    EXPECT_EQ(catalog.list(), (std::vector<std::string>{"ints", "longs"}));
+
+    BTree<8, int, int> ints(&page_cache, &catalog, "ints");
+    BTree<16, int, long> longs(&page_cache, &catalog, "longs");
+    EXPECT_EQ(ints.size(), 1000);
+    EXPECT_EQ(longs.size(), 1000);
+
+    std::vector<int> values;
+    ints.get_value(500, values);
+    EXPECT_EQ(values, std::vector<int>{1000});
+    std::vector<long> longs_values;
+    longs.get_value(500, longs_values);
+    EXPECT_EQ(longs_values, std::vector<long>{-500});
+}
+
+TEST(CatalogTest, ChainsPagesWhenFull)
+{
+    std::string path = fresh_file("catalog_chain.heap");
+    const int num_trees = 100; /* more than one catalog page holds */
+
+    {
+        HeapPageCache page_cache(path, true);
+        Catalog catalog(&page_cache);
+        for (int i = 0; i < num_trees; i++) {
+            BTree<8, int, int> tree(&page_cache, &catalog,
+                                    "tree" + std::to_string(i));
+            tree.insert(i, i);
+        }
+        EXPECT_FALSE(catalog.add("tree0", {1, 2}));
+    }
+
+    HeapPageCache page_cache(path, false);
+    Catalog catalog(&page_cache);
+    EXPECT_EQ(catalog.list().size(), num_trees);
+
+    BTree<8, int, int> tree(&page_cache, &catalog, "tree42");
+    std::vector<int> values;
+    tree.get_value(42, values);
+    EXPECT_EQ(values, std::vector<int>{42});
+}
+
+TEST(CatalogTest, RejectsBadNames)
+{
+    HeapPageCache page_cache(fresh_file("catalog_names.heap"), true);
+    Catalog catalog(&page_cache);
+    EXPECT_THROW(catalog.add("", {1, 2}), std::invalid_argument);
+    EXPECT_THROW(catalog.add(std::string(Catalog::MAX_NAME_LEN + 1, 'x'),
+                             {1, 2}),
+                 std::invalid_argument);
+}
@@ -0,0 +1,67 @@
+#include "../include/bptree/heap_page_cache.h"
+#include "../include/bptree/tree.h"
+#include "test_util.h"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <thread>
+
+using namespace bptree;
+
+TEST(CheckpointTest, WritesDirtyPagesAndRecordsSequence)
+{
+    std::string path = fresh_file("checkpoint.heap");
+    uint64_t seq;
+
+    {
+        HeapPageCache page_cache(path, true);
+        page_cache.set_write_back(true);
+        BTree<8, int, int> tree(&page_cache);
+        for (int i = 0; i < 2000; i++) {
+            tree.insert(i, i);
+        }
+        EXPECT_GT(page_cache.get_num_dirty(), 0);
+
+        uint64_t before = page_cache.get_checkpoint_seq();
+        page_cache.checkpoint();
+        EXPECT_EQ(page_cache.get_num_dirty(), 0);
+        seq = page_cache.get_checkpoint_seq();
+        EXPECT_GT(seq, before);
+    }
+
+    HeapPageCache page_cache(path, false);
+    EXPECT_GE(page_cache.get_checkpoint_seq(), seq);
+    BTree<8, int, int> tree(&page_cache);
+    EXPECT_EQ(tree.size(), 2000);
+    std::vector<int> values;
+    tree.get_value(1234, values);
+    EXPECT_EQ(values, std::vector<int>{1234});
+}
+
+TEST(CheckpointTest, BackgroundCheckpointsBoundDirtyPages)
+{
+    HeapPageCache page_cache(fresh_file("checkpoint_bg.heap"), true);
+    page_cache.set_write_back(true);
+
+    CheckpointOptions options;
+    options.max_dirty_pages = 64;
+    options.interval_ms = 10;
+    page_cache.start_checkpointer(options);
+
+    BTree<8, int, int> tree(&page_cache);
+    size_t max_dirty = 0;
+    for (int i = 0; i < 20000; i++) {
+        tree.insert(i, i);
+        max_dirty = std::max(max_dirty, page_cache.get_num_dirty());
+    }
+    /* writers write their own pages when twice the budget is dirty */
+    EXPECT_LE(max_dirty, 2 * options.max_dirty_pages + 8);
+
+    for (int i = 0; i < 200 && page_cache.get_num_dirty() > 0; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    EXPECT_EQ(page_cache.get_num_dirty(), 0);
+    EXPECT_GT(page_cache.get_checkpoint_seq(), 0);
+    page_cache.stop_checkpointer();
+}
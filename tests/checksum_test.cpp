@@ -0,0 +1,115 @@
+#include "../include/bptree/heap_page_cache.h"
+#include "../include/bptree/tree.h"
+#include "test_util.h"
+
+#include <gtest/gtest.h>
+
+#include <fcntl.h>
+
+using namespace bptree;
+
+namespace {
+
+using Tree = BTree<8, int, int>;
+
+const size_t PAGE_SIZE = 4096;
+
+/* flip a byte in the middle of a page, as a torn write would leave it */
+void corrupt_page(const std::string& path, PageID pid)
+{
+    int fd = ::open(path.c_str(), O_RDWR);
+    ASSERT_GE(fd, 0);
+    off_t offset = (off_t)(pid * PAGE_SIZE + PAGE_SIZE / 2);
+    uint8_t byte;
+    ASSERT_EQ(::pread(fd, &byte, 1, offset), 1);
+    byte ^= 0xFF;
+    ASSERT_EQ(::pwrite(fd, &byte, 1, offset), 1);
+    ::close(fd);
+}
+
+void create_tree(const std::string& path, ChecksumMode mode, int num_keys)
+{
+    HeapPageCache page_cache(path, true, 4096, PAGE_SIZE, mode);
+    Tree tree(&page_cache);
+    for (int i = 0; i < num_keys; i++) {
+        tree.insert(i, i);
+    }
+}
+
+size_t scan(const std::string& path, ChecksumMode mode)
+{
+    HeapPageCache page_cache(path, false, 4096, PAGE_SIZE, mode);
+    Tree tree(&page_cache);
+    size_t count = 0;
+    for (auto it = tree.begin(); it != tree.end(); ++it) {
+        count++;
+    }
+    return count;
+}
+
+} // namespace
+
+TEST(ChecksumTest, IntactFileReadsBack)
+{
+    std::string path = fresh_file("checksum.heap");
+    create_tree(path, ChecksumMode::EAGER, 2000);
+    EXPECT_EQ(scan(path, ChecksumMode::EAGER), 2000);
+    EXPECT_EQ(scan(path, ChecksumMode::LAZY), 2000);
+}
+
+TEST(ChecksumTest, CorruptNodeThrows)
+{
+    for (auto mode : {ChecksumMode::EAGER, ChecksumMode::LAZY}) {
+        std::string path = fresh_file("checksum_node.heap");
+        create_tree(path, mode, 2000);
+        corrupt_page(path, 10);
+
+        EXPECT_THROW(scan(path, mode), CorruptPageException);
+        /* without verification the damage goes unnoticed */
+        EXPECT_NO_THROW(scan(path, ChecksumMode::NONE));
+    }
+}
+
+TEST(ChecksumTest, CorruptMetaPageIsNotRecreated)
+{
+    std::string path = fresh_file("checksum_meta.heap");
+    create_tree(path, ChecksumMode::EAGER, 100);
+    corrupt_page(path, 1);
+
+    {
+        HeapPageCache page_cache(path, false, 4096, PAGE_SIZE,
+                                 ChecksumMode::EAGER);
+        EXPECT_THROW(Tree tree(&page_cache), std::runtime_error);
+    }
+
+    /* the tree was left alone */
+    EXPECT_GT(file_size(path), (off_t)(10 * PAGE_SIZE));
+}
+
+TEST(ChecksumTest, TornMetaSlotFallsBackToPreviousCommit)
+{
+    std::string path = fresh_file("checksum_shadow.heap");
+    BTreeOptions options;
+    options.shadow_paging = true;
+
+    {
+        HeapPageCache page_cache(path, true, 4096, PAGE_SIZE,
+                                 ChecksumMode::EAGER);
+        Tree tree(&page_cache, options);
+        for (int i = 0; i < 500; i++) {
+            tree.insert(i, i);
+        }
+        tree.commit();
+        for (int i = 500; i < 1000; i++) {
+            tree.insert(i, i);
+        }
+        tree.commit();
+    }
+
+    /* the last commit (epoch 3) went to the second meta page */
+    corrupt_page(path, 2);
+
+    HeapPageCache page_cache(path, false, 4096, PAGE_SIZE, ChecksumMode::EAGER);
+    Tree tree(&page_cache, options);
+    EXPECT_EQ(tree.size(), 500);
+}
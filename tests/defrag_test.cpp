@@ -0,0 +1,63 @@
+#include "../include/bptree/heap_page_cache.h"
+#include "../include/bptree/tree.h"
+#include "test_util.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <random>
+
+using namespace bptree;
+
+static void fill_shuffled(BTree<8, int, int>& tree, int n)
+{
+    std::vector<int> keys(n);
+    for (int i = 0; i < n; i++) keys[i] = i;
+    std::shuffle(keys.begin(), keys.end(), std::mt19937(42));
+    for (auto key : keys) {
+        tree.insert(key, key);
+    }
+}
+
+static void check_contents(BTree<8, int, int>& tree, int n)
+{
+    EXPECT_EQ(tree.size(), n);
+    int expected = 0;
+    for (auto&& [key, value] : tree) {
+        ASSERT_EQ(key, expected);
+        ASSERT_EQ(value, expected);
+        expected++;
+    }
+    EXPECT_EQ(expected, n);
+}
+
+TEST(DefragTest, PlacesLeavesInKeyOrder)
+{
+    HeapPageCache page_cache(fresh_file("defrag.heap"), true);
+    BTree<8, int, int> tree(&page_cache);
+    fill_shuffled(tree, 20000);
+    EXPECT_GT(tree.fragmentation(), 0.5);
+
+    EXPECT_GT(tree.defragment(), 0);
+    EXPECT_LT(tree.fragmentation(), 0.01);
+    check_contents(tree, 20000);
+
+    /* nothing left to do */
+    EXPECT_EQ(tree.defragment(), 0);
+}
+
+TEST(DefragTest, FollowsStripes)
+{
+    std::vector<std::string> files = {fresh_file("defrag_striped.0"),
+                                      fresh_file("defrag_striped.1")};
+    HeapPageCache page_cache(files, true);
+    BTree<8, int, int> tree(&page_cache);
+    fill_shuffled(tree, 20000);
+
+    EXPECT_GT(tree.defragment(), 0);
+    /* leaves follow each other within a file, an extent switches files
+     * once */
+    EXPECT_LT(tree.fragmentation(), 0.02);
+    check_contents(tree, 20000);
+    EXPECT_EQ(tree.defragment(), 0);
+}
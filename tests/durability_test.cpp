@@ -0,0 +1,86 @@
+#include "../include/bptree/heap_page_cache.h"
+#include "../include/bptree/tree.h"
+#include "test_util.h"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+using namespace bptree;
+
+namespace {
+
+/* write a new page through the cache. returns whether the caller still
+ * holds the page lock after the unpin */
+bool write_page(HeapPageCache& page_cache)
+{
+    boost::upgrade_lock<Page> lock;
+    auto* page = page_cache.new_page(lock);
+    {
+        boost::upgrade_to_unique_lock<Page> ulock(lock);
+        ::memset(page->get_buffer(ulock), 0xAB, page->get_size());
+    }
+    page_cache.unpin_page(page, true, lock);
+    return lock.owns_lock();
+}
+
+} // namespace
+
+TEST(DurabilityTest, PerFlushSyncsOnUnpinAndKeepsLock)
+{
+    HeapPageCache page_cache(fresh_file("durability_flush.heap"), true);
+    page_cache.set_durability(DurabilityMode::PER_FLUSH);
+
+    uint64_t syncs = page_cache.get_num_syncs();
+    EXPECT_TRUE(write_page(page_cache));
+    EXPECT_GT(page_cache.get_num_syncs(), syncs);
+}
+
+TEST(DurabilityTest, OnCheckpointSyncsOnlyOnBarriers)
+{
+    HeapPageCache page_cache(fresh_file("durability_ckpt.heap"), true);
+    page_cache.set_durability(DurabilityMode::ON_CHECKPOINT);
+
+    uint64_t syncs = page_cache.get_num_syncs();
+    for (int i = 0; i < 10; i++) {
+        write_page(page_cache);
+    }
+    EXPECT_EQ(page_cache.get_num_syncs(), syncs);
+
+    page_cache.sync();
+    EXPECT_GT(page_cache.get_num_syncs(), syncs);
+}
+
+TEST(DurabilityTest, NoneStillSyncsCommits)
+{
+    HeapPageCache page_cache(fresh_file("durability_none.heap"), true);
+    BTreeOptions options;
+    options.shadow_paging = true;
+    BTree<8, int, int> tree(&page_cache, options);
+
+    uint64_t syncs = page_cache.get_num_syncs();
+    for (int i = 0; i < 10; i++) {
+        write_page(page_cache);
+    }
+    page_cache.checkpoint();
+    EXPECT_EQ(page_cache.get_num_syncs(), syncs);
+
+    tree.insert(1, 1);
+    tree.commit();
+    EXPECT_GT(page_cache.get_num_syncs(), syncs);
+}
+
+TEST(DurabilityTest, IntervalSyncsInBackground)
+{
+    HeapPageCache page_cache(fresh_file("durability_interval.heap"), true);
+    page_cache.set_durability(DurabilityMode::INTERVAL, 5);
+
+    uint64_t syncs = page_cache.get_num_syncs();
+    write_page(page_cache);
+    for (int i = 0; i < 200 && page_cache.get_num_syncs() == syncs; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    EXPECT_GT(page_cache.get_num_syncs(), syncs);
+}
@@ -0,0 +1,161 @@
+#include "../include/bptree/epoch.h"
+#include "../include/bptree/heap_page_cache.h"
+#include "../include/bptree/tree.h"
+#include "test_util.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+using namespace bptree;
+
+static void wait_for_size(BTree<8, int, int>& tree, size_t size)
+{
+    for (int i = 0; i < 1000 && tree.size() != size; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+}
+
+/* counts the pages fetched for reading */
+class CountingPageCache : public AbstractPageCache {
+public:
+    explicit CountingPageCache(AbstractPageCache* page_cache)
+        : page_cache(page_cache), num_fetches(0)
+    {}
+
+    virtual Page* new_page(boost::upgrade_lock<Page>& lock)
+    {
+        return page_cache->new_page(lock);
+    }
+    virtual Page* fetch_page(PageID id, boost::upgrade_lock<Page>& lock)
+    {
+        num_fetches++;
+        return page_cache->fetch_page(id, lock);
+    }
+    virtual Page* fetch_page_for_overwrite(PageID id,
+                                           boost::upgrade_lock<Page>& lock)
+    {
+        return page_cache->fetch_page_for_overwrite(id, lock);
+    }
+    virtual void pin_page(Page* page, boost::upgrade_lock<Page>& lock)
+    {
+        page_cache->pin_page(page, lock);
+    }
+    virtual void unpin_page(Page* page, bool dirty,
+                            boost::upgrade_lock<Page>& lock)
+    {
+        page_cache->unpin_page(page, dirty, lock);
+    }
+    virtual void flush_page(Page* page, boost::upgrade_lock<Page>& lock)
+    {
+        page_cache->flush_page(page, lock);
+    }
+    virtual void flush_all_pages() { page_cache->flush_all_pages(); }
+    virtual void sync() { page_cache->sync(); }
+    virtual size_t size() const { return page_cache->size(); }
+    virtual size_t get_page_size() const { return page_cache->get_page_size(); }
+    virtual PageID get_num_pages() const
+    {
+        return page_cache->get_num_pages();
+    }
+
+    size_t get_num_fetches() const { return num_fetches.load(); }
+
+private:
+    AbstractPageCache* page_cache;
+    std::atomic<size_t> num_fetches;
+};
+
+TEST(EraseRangeTest, KeepsDuplicatesOfTheUpperBound)
+{
+    std::string path = fresh_file("erase_range.heap");
+    const int dups = 10;
+
+    {
+        HeapPageCache page_cache(path, true);
+        BTree<8, int, int> tree(&page_cache);
+        for (int k = 0; k < 1000; k++) {
+            for (int j = 0; j < dups; j++) {
+                tree.insert(k, j);
+            }
+        }
+
+        tree.erase_range(100, 500);
+        wait_for_size(tree, 600 * dups);
+        EXPECT_EQ(tree.size(), 600 * dups);
+
+        /* duplicates of a separator can sit in the leaves on both sides of
+         * it, erase() visits all of them */
+        EXPECT_EQ(tree.erase(99), dups);
+        EXPECT_EQ(tree.erase(500), dups);
+        EXPECT_EQ(tree.erase(100), 0);
+        EXPECT_EQ(tree.erase(499), 0);
+    }
+
+    HeapPageCache page_cache(path, false);
+    BTree<8, int, int> tree(&page_cache);
+    EXPECT_EQ(tree.size(), 598 * dups);
+    EXPECT_EQ(tree.erase(501), dups);
+    EXPECT_EQ(tree.erase(250), 0);
+}
+
+TEST(EraseRangeTest, EpochsWaitForAFreeSlot)
+{
+    /* more threads than the epoch manager has slots */
+    EpochManager epochs;
+    std::atomic<int> done(0);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 300; i++) {
+        threads.emplace_back([&] {
+            auto guard = epochs.enter();
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+            done++;
+        });
+    }
+    for (auto&& t : threads) {
+        t.join();
+    }
+    EXPECT_EQ(done.load(), 300);
+}
+
+TEST(EraseRangeTest, ClearDoesNotReadLeaves)
+{
+    BTreeOptions options;
+    options.shadow_paging = true;
+    std::string path = fresh_file("erase_range_clear.heap");
+    const int num_keys = 20000;
+
+    {
+        HeapPageCache page_cache(path, true);
+        BTree<8, int, int> tree(&page_cache, options);
+        for (int i = 0; i < num_keys; i++) {
+            tree.insert(i, i);
+        }
+    }
+
+    /* only the root is loaded after the reopen. sequential inserts leave
+     * about 5000 half full leaves below about 1250 inner nodes. the
+     * reclaimer reads the inner nodes, the leaf page IDs are in them */
+    {
+        HeapPageCache heap_cache(path, false);
+        CountingPageCache page_cache(&heap_cache);
+        BTree<8, int, int> tree(&page_cache, options);
+        size_t fetches = page_cache.get_num_fetches();
+        tree.clear();
+        tree.close();
+        EXPECT_LT(page_cache.get_num_fetches() - fetches, num_keys / 8);
+    }
+
+    /* the collected pages are reused */
+    off_t before = file_size(path);
+    HeapPageCache page_cache(path, false);
+    BTree<8, int, int> tree(&page_cache, options);
+    EXPECT_EQ(tree.size(), 0);
+    for (int i = 0; i < num_keys; i++) {
+        tree.insert(i, i);
+    }
+    tree.commit();
+    EXPECT_LE(file_size(path), before + before / 20);
+}
@@ -0,0 +1,108 @@
+#include "../include/bptree/external_sort.h"
+#include "../include/bptree/heap_page_cache.h"
+#include "../include/bptree/tree.h"
+#include "test_util.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <fstream>
+#include <random>
+
+using namespace bptree;
+
+static std::string write_input(const std::string& name,
+                               const std::vector<int>& keys)
+{
+    std::string path = fresh_file(name);
+    std::ofstream out(path);
+    for (auto key : keys) {
+        out << key << " " << -key << "\n";
+    }
+    return path;
+}
+
+static void check_loaded(BTree<8, int, int>& tree, int n)
+{
+    EXPECT_EQ(tree.size(), n);
+    int expected = 0;
+    for (auto&& [key, value] : tree) {
+        ASSERT_EQ(key, expected);
+        ASSERT_EQ(value, -expected);
+        expected++;
+    }
+    EXPECT_EQ(expected, n);
+}
+
+TEST(ExternalSortTest, LoadsUnsortedFile)
+{
+    const int n = 50000;
+    std::vector<int> keys(n);
+    for (int i = 0; i < n; i++) keys[i] = i;
+    std::shuffle(keys.begin(), keys.end(), std::mt19937(1));
+    auto path = write_input("external_sort.txt", keys);
+
+    ExternalSortOptions options;
+    options.memory_budget = 4 * 1024 * sizeof(std::pair<int, int>);
+    options.threads = 4;
+    options.temp_dir = "./tmp";
+    ExternalSorter<int, int> sorter(options);
+    EXPECT_EQ(sorter.add_text_file(path), n);
+    EXPECT_GT(sorter.get_num_spilled_runs(), 0);
+
+    HeapPageCache page_cache(fresh_file("external_sort.heap"), true);
+    BTree<8, int, int> tree(&page_cache);
+    sorter.load_into(tree);
+    check_loaded(tree, n);
+}
+
+TEST(ExternalSortTest, SpillsSmallFilesPastTheBudget)
+{
+    /* every file fits in memory, all of them together do not */
+    ExternalSortOptions options;
+    options.memory_budget = 4 * 1024 * sizeof(std::pair<int, int>);
+    options.threads = 4;
+    options.temp_dir = "./tmp";
+    ExternalSorter<int, int> sorter(options);
+
+    const int num_files = 20, per_file = 500;
+    std::mt19937 rng(2);
+    for (int f = 0; f < num_files; f++) {
+        std::vector<int> keys;
+        for (int i = 0; i < per_file; i++) keys.push_back(i * num_files + f);
+        std::shuffle(keys.begin(), keys.end(), rng);
+        auto path =
+            write_input("external_sort_" + std::to_string(f) + ".txt", keys);
+        EXPECT_EQ(sorter.add_text_file(path), per_file);
+    }
+    EXPECT_GT(sorter.get_num_spilled_runs(), 0);
+
+    HeapPageCache page_cache(fresh_file("external_sort_small.heap"), true);
+    BTree<8, int, int> tree(&page_cache);
+    sorter.load_into(tree);
+    check_loaded(tree, num_files * per_file);
+}
+
+TEST(ExternalSortTest, MergesInPassesPastTheFanIn)
+{
+    const int n = 50000;
+    std::vector<int> keys(n);
+    for (int i = 0; i < n; i++) keys[i] = i;
+    std::shuffle(keys.begin(), keys.end(), std::mt19937(3));
+    auto path = write_input("external_sort_passes.txt", keys);
+
+    ExternalSortOptions options;
+    options.memory_budget = 4 * 1024 * sizeof(std::pair<int, int>);
+    options.threads = 4;
+    options.temp_dir = "./tmp";
+    options.max_merge_runs = 4;
+    ExternalSorter<int, int> sorter(options);
+    EXPECT_EQ(sorter.add_text_file(path), n);
+    EXPECT_GT(sorter.get_num_spilled_runs(), 16);
+
+    HeapPageCache page_cache(fresh_file("external_sort_passes.heap"), true);
+    BTree<8, int, int> tree(&page_cache);
+    sorter.load_into(tree);
+    EXPECT_GE(sorter.get_num_merge_passes(), 2);
+    check_loaded(tree, n);
+}
@@ -0,0 +1,95 @@
+#include "../include/bptree/catalog.h"
+#include "../include/bptree/heap_page_cache.h"
+#include "../include/bptree/tree.h"
+#include "test_util.h"
+
+#include <gtest/gtest.h>
+
+#include <cstring>
+
+using namespace bptree;
+
+/* rewrite the single catalog page in the 32-bit page ID layout */
+static void downgrade_catalog(const std::string& path)
+{
+    HeapPageCache page_cache(path, false);
+    boost::upgrade_lock<Page> lock;
+    auto* page = page_cache.fetch_page(1, lock);
+    ASSERT_NE(page, nullptr);
+    {
+        boost::upgrade_to_unique_lock<Page> ulock(lock);
+        auto* buf = page->get_buffer(ulock);
+
+        uint32_t num_entries;
+        ::memcpy(&num_entries, &buf[4], sizeof(num_entries));
+        std::vector<uint8_t> v1(page->get_size(), 0);
+        uint32_t header[3] = {0x0CA7A106, num_entries, 0};
+        ::memcpy(v1.data(), header, sizeof(header));
+
+        for (size_t i = 0; i < num_entries; i++) {
+            const uint8_t* entry = &buf[16 + i * 72];
+            uint8_t* out = &v1[12 + i * 64];
+            ::memcpy(out, entry, 56);
+            for (size_t j = 0; j < 2; j++) {
+                uint64_t pid;
+                ::memcpy(&pid, &entry[56 + 8 * j], sizeof(pid));
+                uint32_t pid32 = (uint32_t)pid;
+                ::memcpy(&out[56 + 4 * j], &pid32, sizeof(pid32));
+            }
+        }
+        ::memcpy(buf, v1.data(), v1.size());
+    }
+    page_cache.unpin_page(page, true, lock);
+}
+
+TEST(FormatTest, ReadsVersion1Catalog)
+{
+    std::string path = fresh_file("format_catalog.heap");
+
+    {
+        HeapPageCache page_cache(path, true);
+        Catalog catalog(&page_cache);
+        BTree<8, int, int> tree(&page_cache, &catalog, "old");
+        for (int i = 0; i < 100; i++) {
+            tree.insert(i, i);
+        }
+    }
+    downgrade_catalog(path);
+
+    {
+        HeapPageCache page_cache(path, false);
+        Catalog catalog(&page_cache);
+        BTree<8, int, int> old_tree(&page_cache, &catalog, "old");
+        EXPECT_EQ(old_tree.size(), 100);
+
+        /* entries added to a version 1 catalog keep its layout */
+        BTree<8, int, int> new_tree(&page_cache, &catalog, "new");
+        new_tree.insert(1, 1);
+    }
+
+    HeapPageCache page_cache(path, false);
+    Catalog catalog(&page_cache);
+    EXPECT_EQ(catalog.list(), (std::vector<std::string>{"new", "old"}));
+    BTree<8, int, int> tree(&page_cache, &catalog, "new");
+    EXPECT_EQ(tree.size(), 1);
+}
+
+TEST(FormatTest, RejectsNodesLargerThanAPage)
+{
+    using WideTree = BTree<300, int64_t, int64_t>;
+    {
+        HeapPageCache page_cache(fresh_file("format_wide.heap"), true);
+        EXPECT_THROW(WideTree tree(&page_cache), std::invalid_argument);
+    }
+
+    /* compact child pointers make the same inner nodes fit */
+    using CompactTree = BTree<300, int64_t, int>;
+    HeapPageCache page_cache(fresh_file("format_compact.heap"), true);
+    BTreeOptions options;
+    options.compact_child_pages = true;
+    CompactTree tree(&page_cache, options);
+    for (int i = 0; i < 1000; i++) {
+        tree.insert(i, i);
+    }
+    EXPECT_EQ(tree.size(), 1000);
+}
@@ -0,0 +1,85 @@
+#include "../include/bptree/heap_page_cache.h"
+#include "../include/bptree/tree.h"
+#include "test_util.h"
+
+#include <gtest/gtest.h>
+
+#include <stdexcept>
+
+using namespace bptree;
+
+TEST(HotPagesTest, PrefetchesDumpedPagesOnReopen)
+{
+    std::string path = fresh_file("hot_pages.heap");
+    std::string hot_path = fresh_file("hot_pages.list");
+
+    {
+        HeapPageCache page_cache(path, true);
+        BTree<8, int, int> tree(&page_cache);
+        for (int i = 0; i < 2000; i++) {
+            tree.insert(i, i);
+        }
+        page_cache.dump_hot_pages(hot_path);
+    }
+
+    HeapPageCache page_cache(path, false);
+    EXPECT_TRUE(page_cache.load_hot_pages(hot_path, false));
+    EXPECT_GT(page_cache.get_num_prefetched(), 0);
+
+    BTree<8, int, int> tree(&page_cache);
+    EXPECT_EQ(tree.size(), 2000);
+    std::vector<int> values;
+    tree.get_value(1999, values);
+    EXPECT_EQ(values, std::vector<int>{1999});
+}
+
+TEST(HotPagesTest, FailedDumpOnCloseKeepsData)
+{
+    std::string path = fresh_file("hot_pages_close.heap");
+
+    {
+        HeapPageCache page_cache(path, true);
+        page_cache.set_write_back(true);
+        /* the directory of the list does not exist */
+        page_cache.set_hot_page_file("./tmp/no_such_dir/hot_pages.list");
+        BTree<8, int, int> tree(&page_cache);
+        for (int i = 0; i < 2000; i++) {
+            tree.insert(i, i);
+        }
+        tree.close();
+        EXPECT_NO_THROW(page_cache.close());
+        EXPECT_GT(page_cache.get_shutdown_stats().pages_written, 0);
+    }
+
+    HeapPageCache page_cache(path, false);
+    BTree<8, int, int> tree(&page_cache);
+    EXPECT_EQ(tree.size(), 2000);
+}
+
+TEST(HotPagesTest, MissingListIsNotAnError)
+{
+    HeapPageCache page_cache(fresh_file("hot_pages_missing.heap"), true);
+    EXPECT_FALSE(
+        page_cache.load_hot_pages(fresh_file("hot_pages_missing.list"), false));
+    EXPECT_EQ(page_cache.get_num_prefetched(), 0);
+}
+
+TEST(HotPagesTest, FullCacheThrows)
+{
+    HeapPageCache page_cache(fresh_file("hot_pages_full.heap"), true, 2);
+
+    boost::upgrade_lock<Page> lock1, lock2, lock3;
+    auto* page1 = page_cache.new_page(lock1);
+    auto* page2 = page_cache.new_page(lock2);
+    EXPECT_THROW(page_cache.new_page(lock3), std::runtime_error);
+
+    /* prefetching stops at the full cache instead of failing */
+    EXPECT_EQ(page_cache.prefetch_pages({page2->get_id() + 1}), 0);
+
+    page_cache.unpin_page(page2, false, lock2);
+    lock2.unlock();
+    auto* page3 = page_cache.new_page(lock3);
+    EXPECT_NE(page3, nullptr);
+    page_cache.unpin_page(page3, false, lock3);
+    page_cache.unpin_page(page1, false, lock1);
+}
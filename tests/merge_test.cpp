@@ -0,0 +1,90 @@
+#include "../include/bptree/heap_page_cache.h"
+#include "../include/bptree/tree.h"
+#include "test_util.h"
+
+#include <gtest/gtest.h>
+
+#include <stdexcept>
+#include <utility>
+
+using namespace bptree;
+
+using Tree = BTree<8, int, int>;
+
+TEST(MergeTest, FoldsSortedRunIntoTree)
+{
+    HeapPageCache page_cache(fresh_file("merge.heap"), true);
+    Tree tree(&page_cache);
+    for (int i = 0; i < 10000; i += 2) {
+        tree.insert(i, i);
+    }
+
+    std::vector<std::pair<int, int>> run;
+    for (int i = 1; i < 10000; i += 2) {
+        run.emplace_back(i, i);
+    }
+    EXPECT_EQ(tree.merge(run.begin(), run.end()), 5000);
+    EXPECT_EQ(tree.size(), 10000);
+
+    int expected = 0;
+    for (auto&& [key, value] : tree) {
+        ASSERT_EQ(key, expected);
+        ASSERT_EQ(value, expected);
+        expected++;
+    }
+    EXPECT_EQ(expected, 10000);
+}
+
+TEST(MergeTest, RejectsUnsortedRun)
+{
+    HeapPageCache page_cache(fresh_file("merge_unsorted.heap"), true);
+    Tree tree(&page_cache);
+
+    std::vector<std::pair<int, int>> run;
+    for (int i = 0; i < 1000; i++) {
+        run.emplace_back(i, i);
+    }
+    run.emplace_back(500, 500);
+    run.emplace_back(2000, 2000);
+
+    EXPECT_THROW(tree.merge(run.begin(), run.end()), std::invalid_argument);
+    /* the pairs before the out of order one are merged */
+    EXPECT_EQ(tree.size(), 1000);
+    std::vector<int> values;
+    tree.get_value(999, values);
+    EXPECT_EQ(values, std::vector<int>{999});
+    values.clear();
+    tree.get_value(2000, values);
+    EXPECT_TRUE(values.empty());
+}
+
+TEST(MergeTest, PacksLongRunsOfEqualKeys)
+{
+    HeapPageCache merge_cache(fresh_file("merge_equal.heap"), true);
+    HeapPageCache insert_cache(fresh_file("merge_equal_insert.heap"), true);
+    Tree merged(&merge_cache);
+    Tree inserted(&insert_cache);
+    for (int i = 0; i < 200; i++) {
+        merged.insert(i, i);
+        inserted.insert(i, i);
+    }
+    PageID merge_before = merge_cache.get_num_pages();
+    PageID insert_before = insert_cache.get_num_pages();
+
+    /* many more copies of one key than fit in a leaf */
+    std::vector<std::pair<int, int>> run(60, std::make_pair(100, -1));
+    EXPECT_EQ(merged.merge(run.begin(), run.end()), 60);
+    for (auto&& [key, value] : run) {
+        inserted.insert(key, value);
+    }
+
+    EXPECT_LE(merge_cache.get_num_pages() - merge_before,
+              insert_cache.get_num_pages() - insert_before);
+    EXPECT_EQ(merged.size(), 260);
+    int prev = -1;
+    for (auto&& [key, value] : merged) {
+        ASSERT_LE(prev, key);
+        prev = key;
+    }
+    EXPECT_EQ(prev, 199);
+}
@@ -0,0 +1,101 @@
+#include "../include/bptree/heap_page_cache.h"
+#include "../include/bptree/tree.h"
+#include "test_util.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace bptree;
+
+using Tree = BTree<8, int, int>;
+
+static const int NUM_KEYS = 20000;
+/* few enough that the copies of a key span at most two leaves */
+static const int NUM_DUPS = 3;
+
+static void insert_dups(Tree& tree)
+{
+    for (int i = 0; i < NUM_KEYS; i++) {
+        for (int j = 0; j < NUM_DUPS; j++) {
+            tree.insert(i, j);
+        }
+    }
+}
+
+TEST(ParallelScanTest, VisitsEqualKeysOnBothSidesOfPartitions)
+{
+    HeapPageCache page_cache(fresh_file("scan_dups.heap"), true);
+    Tree tree(&page_cache);
+    insert_dups(tree);
+
+    std::mutex mutex;
+    std::vector<int> seen(NUM_KEYS);
+    size_t count = tree.parallel_scan(4, [&](const int& key, const int&) {
+        std::lock_guard<std::mutex> guard(mutex);
+        seen[key]++;
+    });
+    EXPECT_EQ(count, NUM_KEYS * NUM_DUPS);
+    for (int i = 0; i < NUM_KEYS; i++) {
+        ASSERT_EQ(seen[i], NUM_DUPS) << "key " << i;
+    }
+}
+
+TEST(ParallelScanTest, RangeExcludesUpperBound)
+{
+    HeapPageCache page_cache(fresh_file("scan_range.heap"), true);
+    Tree tree(&page_cache);
+    insert_dups(tree);
+
+    std::atomic<size_t> outside(0);
+    size_t count =
+        tree.parallel_scan(1000, 15000, 4, [&](const int& key, const int&) {
+            if (key < 1000 || key >= 15000) outside++;
+        });
+    EXPECT_EQ(count, 14000 * NUM_DUPS);
+    EXPECT_EQ(outside.load(), 0);
+}
+
+TEST(ParallelScanTest, OrderedScanIsSorted)
+{
+    HeapPageCache page_cache(fresh_file("scan_ordered.heap"), true);
+    Tree tree(&page_cache);
+    insert_dups(tree);
+
+    std::vector<int> keys;
+    size_t count = tree.parallel_scan(
+        4, [&](const int& key, const int&) { keys.push_back(key); }, true);
+    EXPECT_EQ(count, NUM_KEYS * NUM_DUPS);
+    ASSERT_EQ(keys.size(), NUM_KEYS * NUM_DUPS);
+    for (size_t i = 0; i < keys.size(); i++) {
+        ASSERT_EQ(keys[i], i / NUM_DUPS);
+    }
+}
+
+TEST(ParallelScanTest, RunsAtMostNumThreadsPartitions)
+{
+    Executor executor(8);
+    BTreeOptions options;
+    options.executor = &executor;
+    HeapPageCache page_cache(fresh_file("scan_threads.heap"), true);
+    Tree tree(&page_cache, options);
+    for (int i = 0; i < 4000; i++) {
+        tree.insert(i, i);
+    }
+
+    std::atomic<int> active(0), max_active(0);
+    size_t count = tree.parallel_scan(2, [&](const int&, const int&) {
+        int now = ++active;
+        int seen = max_active.load();
+        while (now > seen && !max_active.compare_exchange_weak(seen, now))
+            ;
+        std::this_thread::sleep_for(std::chrono::microseconds(20));
+        active--;
+    });
+    EXPECT_EQ(count, 4000);
+    EXPECT_LE(max_active.load(), 2);
+}
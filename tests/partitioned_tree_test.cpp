@@ -0,0 +1,116 @@
+#include "../include/bptree/partitioned_tree.h"
+#include "test_util.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+using namespace bptree;
+
+using Tree = PartitionedBTree<8, int, int>;
+
+static const int NUM_KEYS = 10000;
+
+static PartitionOptions shadow_options()
+{
+    PartitionOptions options;
+    options.num_shards = 2;
+    options.max_pages = 1024;
+    options.tree_options.shadow_paging = true;
+    options.min_rebalance_pairs = 100;
+    options.rebalance_check_writes = 0;
+    return options;
+}
+
+static std::string fresh_tree(const std::string& name)
+{
+    std::string path = fresh_file(name);
+    for (auto suffix : {".0", ".1", ".shards", ".shards.tmp"}) {
+        ::unlink((path + suffix).c_str());
+    }
+    return path;
+}
+
+TEST(PartitionedTreeTest, MovedPairsSurviveCrashAfterRebalance)
+{
+    auto options = shadow_options();
+    std::string path = fresh_tree("partitioned_crash");
+
+    {
+        Tree tree(path, true, options);
+        for (int i = 0; i < NUM_KEYS; i++) {
+            tree.insert(i, i);
+        }
+        tree.commit();
+        ASSERT_TRUE(tree.rebalance());
+
+        /* like a crash right after the rebalance: no shard commits again */
+        for (size_t i = 0; i < tree.get_num_shards(); i++) {
+            tree.get_shard(i).close(true);
+        }
+    }
+
+    Tree tree(path, false, options);
+    for (int i = 0; i < NUM_KEYS; i++) {
+        std::vector<int> values;
+        tree.get_value(i, values);
+        ASSERT_EQ(values, std::vector<int>{i}) << "key " << i;
+    }
+    EXPECT_EQ(::access((path + ".shards.tmp").c_str(), F_OK), -1);
+}
+
+TEST(PartitionedTreeTest, ReopensWithLayout)
+{
+    auto options = shadow_options();
+    std::string path = fresh_tree("partitioned_reopen");
+
+    {
+        Tree tree(path, true, options);
+        std::vector<int> sample;
+        for (int i = 0; i < NUM_KEYS; i += 100) {
+            sample.push_back(i);
+        }
+        tree.set_split_points(sample);
+        for (int i = 0; i < NUM_KEYS; i++) {
+            tree.insert(i, i);
+        }
+        EXPECT_GT(tree.get_shard(0).size(), 0);
+        EXPECT_GT(tree.get_shard(1).size(), 0);
+    }
+
+    Tree tree(path, false, options);
+    EXPECT_EQ(tree.size(), NUM_KEYS);
+    int expected = 0;
+    for (auto it = tree.begin(); it != tree.end(); ++it) {
+        ASSERT_EQ(it->first, expected);
+        expected++;
+    }
+    EXPECT_EQ(expected, NUM_KEYS);
+}
+
+TEST(PartitionedTreeTest, RebalanceDropsCopiesOfInterruptedMoves)
+{
+    auto options = shadow_options();
+    options.rebalance_ratio = 1.2;
+    std::string path = fresh_tree("partitioned_stale");
+
+    Tree tree(path, true, options);
+    tree.set_split_points({0, NUM_KEYS / 2});
+    for (int i = 0; i < 3 * NUM_KEYS; i++) {
+        tree.insert(i, i);
+    }
+
+    /* copies left in the lower shard by a move down that crashed before its
+     * layout was written */
+    for (int i = NUM_KEYS / 2; i < NUM_KEYS; i++) {
+        tree.get_shard(0).insert(i, i);
+    }
+
+    ASSERT_TRUE(tree.rebalance());
+    for (int i = 0; i < 3 * NUM_KEYS; i++) {
+        std::vector<int> values;
+        tree.get_value(i, values);
+        ASSERT_EQ(values, std::vector<int>{i}) << "key " << i;
+    }
+}
@@ -0,0 +1,44 @@
+#include "../include/bptree/heap_page_cache.h"
+#include "../include/bptree/tree.h"
+#include "test_util.h"
+
+#include <gtest/gtest.h>
+
+using namespace bptree;
+
+TEST(PreloadTest, LoadsAllInnerNodesOnOpen)
+{
+    std::string path = fresh_file("preload.heap");
+
+    size_t num_inner;
+    {
+        HeapPageCache page_cache(path, true);
+        BTree<8, int, int> tree(&page_cache);
+        for (int i = 0; i < 20000; i++) {
+            tree.insert(i, i);
+        }
+    }
+
+    {
+        /* a lazy open loads nothing until the tree is used */
+        HeapPageCache page_cache(path, false);
+        BTree<8, int, int> tree(&page_cache);
+        num_inner = tree.preload_inner_nodes(2);
+        EXPECT_GT(num_inner, 8);
+        EXPECT_EQ(tree.preload_inner_nodes(2), 0);
+    }
+
+    HeapPageCache page_cache(path, false);
+    BTreeOptions options;
+    options.preload_inner = true;
+    options.preload_threads = 2;
+    BTree<8, int, int> tree(&page_cache, options);
+    EXPECT_EQ(tree.preload_inner_nodes(), 0);
+
+    EXPECT_EQ(tree.size(), 20000);
+    for (int i = 0; i < 20000; i += 997) {
+        std::vector<int> values;
+        tree.get_value(i, values);
+        EXPECT_EQ(values, std::vector<int>{i});
+    }
+}
@@ -0,0 +1,142 @@
+#include "../include/bptree/heap_page_cache.h"
+#include "../include/bptree/tree.h"
+#include "test_util.h"
+
+#include <gtest/gtest.h>
+
+#include <vector>
+
+using namespace bptree;
+
+using Tree = BTree<8, int, int>;
+
+static const int NUM_KEYS = 2000;
+
+static BTreeOptions delayed_options()
+{
+    BTreeOptions options;
+    options.shadow_paging = true;
+    options.free_page_delay = 2;
+    return options;
+}
+
+/* rewrite every value, which releases all pages of the last commit */
+static void rewrite(Tree& tree, int round)
+{
+    for (int i = 0; i < NUM_KEYS; i++) {
+        tree.erase(i);
+        tree.insert(i, round);
+    }
+    tree.commit();
+}
+
+TEST(ReaderTest, DelayedPagesAreReusedAfterReopen)
+{
+    std::string path = fresh_file("reader_delayed.heap");
+    auto options = delayed_options();
+
+    {
+        HeapPageCache page_cache(path, true);
+        Tree tree(&page_cache, options);
+        for (int i = 0; i < NUM_KEYS; i++) {
+            tree.insert(i, 0);
+        }
+        tree.commit();
+    }
+
+    /* each session leaves the pages of its last commits held back. they must
+     * be freed by a later session instead of leaking */
+    std::vector<off_t> sizes;
+    for (int round = 1; round <= 8; round++) {
+        {
+            HeapPageCache page_cache(path, false);
+            Tree tree(&page_cache, options);
+            rewrite(tree, round);
+        }
+        sizes.push_back(file_size(path));
+    }
+    /* the first sessions grow the file until the delay is covered, after
+     * that four sessions together take less than one of them did */
+    EXPECT_LT(sizes[7] - sizes[3], sizes[1] - sizes[0]);
+
+    HeapPageCache page_cache(path, false);
+    Tree tree(&page_cache, options);
+    EXPECT_EQ(tree.size(), NUM_KEYS);
+    for (auto&& p : tree) {
+        ASSERT_EQ(p.second, 8);
+    }
+}
+
+TEST(ReaderTest, ReaderFollowsWriterCommits)
+{
+    std::string path = fresh_file("reader_follow.heap");
+    auto options = delayed_options();
+
+    HeapPageCache writer_cache(path, true);
+    Tree writer(&writer_cache, options);
+    writer.insert(0, 0);
+    writer.commit();
+
+    HeapPageCache reader_cache(path, OpenMode::READ_ONLY);
+    BTreeOptions reader_options;
+    reader_options.read_only = true;
+    Tree reader(&reader_cache, reader_options);
+    EXPECT_EQ(reader.size(), 1);
+
+    /* the writer appends pages that the reader has not seen yet */
+    for (int i = 1; i < NUM_KEYS; i++) {
+        writer.insert(i, i);
+    }
+    writer.commit();
+    writer_cache.flush_all_pages();
+
+    reader.refresh();
+    EXPECT_TRUE(reader.validate_snapshot());
+    EXPECT_EQ(reader.size(), NUM_KEYS);
+    int expected = 0;
+    for (auto&& p : reader) {
+        ASSERT_EQ(p.first, expected);
+        expected++;
+    }
+    EXPECT_EQ(expected, NUM_KEYS);
+}
+
+TEST(ReaderTest, ReadOnlyTreeRejectsWrites)
+{
+    std::string path = fresh_file("reader_writes.heap");
+
+    {
+        HeapPageCache page_cache(path, true);
+        Tree tree(&page_cache, delayed_options());
+        for (int i = 0; i < 3; i++) {
+            tree.insert(i, i);
+        }
+        tree.commit();
+    }
+
+    HeapPageCache page_cache(path, OpenMode::READ_ONLY);
+    BTreeOptions options;
+    options.read_only = true;
+    Tree tree(&page_cache, options);
+
+    WriteBatch<int, int> batch;
+    batch.put(100, 1);
+    std::vector<std::pair<int, int>> run{{100, 1}};
+
+    EXPECT_THROW(tree.insert(100, 1), std::runtime_error);
+    EXPECT_THROW(tree.erase(0), std::runtime_error);
+    EXPECT_THROW(tree.write(batch), std::runtime_error);
+    EXPECT_THROW(tree.merge(run.begin(), run.end()), std::runtime_error);
+    EXPECT_THROW(tree.erase_range(0, 3), std::runtime_error);
+    EXPECT_THROW(tree.clear(), std::runtime_error);
+    EXPECT_THROW(tree.bulk_load(run.begin(), run.end()), std::runtime_error);
+    EXPECT_THROW(tree.rebuild(run.begin(), run.end()), std::runtime_error);
+    EXPECT_THROW(tree.defragment(), std::runtime_error);
+
+    EXPECT_EQ(tree.size(), 3);
+    std::vector<int> values;
+    tree.get_value(100, values);
+    EXPECT_TRUE(values.empty());
+    tree.get_value(0, values);
+    EXPECT_EQ(values, std::vector<int>{0});
+}
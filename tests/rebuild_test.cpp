@@ -0,0 +1,128 @@
+#include "../include/bptree/heap_page_cache.h"
+#include "../include/bptree/tree.h"
+#include "test_util.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using namespace bptree;
+
+static const int NUM_KEYS = 20000;
+
+/* walks a vector of pairs and signals once rebuild() reads its input */
+struct SignalingIterator {
+    const std::pair<int, int>* p;
+    std::atomic<bool>* reading;
+
+    const std::pair<int, int>* operator->() const
+    {
+        reading->store(true);
+        return p;
+    }
+    SignalingIterator& operator++()
+    {
+        ++p;
+        return *this;
+    }
+    bool operator!=(const SignalingIterator& other) const
+    {
+        return p != other.p;
+    }
+};
+
+TEST(RebuildTest, KeepsWritesMadeDuringRebuild)
+{
+    HeapPageCache page_cache(fresh_file("rebuild.heap"), true);
+    BTree<8, int, int> tree(&page_cache);
+    std::vector<std::pair<int, int>> input;
+    for (int i = 0; i < NUM_KEYS; i++) {
+        tree.insert(i, i);
+        input.emplace_back(i, i);
+    }
+
+    /* once the input is read, one writer adds keys above the initial ones and
+     * the other erases the odd initial keys */
+    std::atomic<bool> reading(false);
+    std::thread inserter([&] {
+        while (!reading.load())
+            ;
+        for (int i = NUM_KEYS; i < 2 * NUM_KEYS; i++) {
+            tree.insert(i, i);
+        }
+    });
+    std::thread eraser([&] {
+        while (!reading.load())
+            ;
+        for (int i = 1; i < NUM_KEYS; i += 2) {
+            tree.erase(i);
+        }
+    });
+    tree.rebuild(SignalingIterator{input.data(), &reading},
+                 SignalingIterator{input.data() + input.size(), &reading});
+    inserter.join();
+    eraser.join();
+
+    EXPECT_EQ(tree.size(), NUM_KEYS + NUM_KEYS / 2);
+    int expected = 0;
+    for (auto&& p : tree) {
+        ASSERT_EQ(p.first, expected);
+        ASSERT_EQ(p.second, expected);
+        expected += expected < NUM_KEYS ? 2 : 1;
+    }
+    EXPECT_EQ(expected, 2 * NUM_KEYS);
+}
+
+TEST(RebuildTest, RebuildsFromOwnSnapshot)
+{
+    BTreeOptions options;
+    options.shadow_paging = true;
+    HeapPageCache page_cache(fresh_file("rebuild_snapshot.heap"), true);
+    BTree<8, int, int> tree(&page_cache, options);
+    for (int i = 0; i < NUM_KEYS; i++) {
+        tree.insert(i, i);
+    }
+    tree.commit();
+
+    /* one writer adds keys above the initial ones, the other erases the odd
+     * initial keys */
+    std::atomic<bool> started(false);
+    std::thread inserter([&] {
+        for (int i = NUM_KEYS; i < 2 * NUM_KEYS; i++) {
+            tree.insert(i, i);
+            started.store(true);
+        }
+    });
+    std::thread eraser([&] {
+        for (int i = 1; i < NUM_KEYS; i += 2) {
+            tree.erase(i);
+        }
+    });
+    while (!started.load())
+        ;
+    tree.rebuild();
+    inserter.join();
+    eraser.join();
+
+    EXPECT_EQ(tree.size(), NUM_KEYS + NUM_KEYS / 2);
+    int expected = 0;
+    for (auto&& p : tree) {
+        ASSERT_EQ(p.first, expected);
+        ASSERT_EQ(p.second, expected);
+        expected += expected < NUM_KEYS ? 2 : 1;
+    }
+    EXPECT_EQ(expected, 2 * NUM_KEYS);
+}
+
+TEST(RebuildTest, NeedsShadowPaging)
+{
+    HeapPageCache page_cache(fresh_file("rebuild_plain.heap"), true);
+    BTree<8, int, int> tree(&page_cache);
+    tree.insert(1, 1);
+    EXPECT_THROW(tree.rebuild(), std::runtime_error);
+    EXPECT_EQ(tree.size(), 1);
+}
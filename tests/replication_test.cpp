@@ -0,0 +1,120 @@
+#include "../include/bptree/heap_page_cache.h"
+#include "../include/bptree/replication.h"
+#include "../include/bptree/tree.h"
+#include "test_util.h"
+
+#include <gtest/gtest.h>
+
+#include <fcntl.h>
+#include <memory>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace bptree;
+
+using Tree = BTree<8, int, int>;
+
+static const int COMMIT_KEYS = 10;
+
+/* insert the keys of num_commits commits, starting at key */
+static void write_commits(Tree& tree, int& key, int num_commits)
+{
+    for (int c = 0; c < num_commits; c++) {
+        for (int i = 0; i < COMMIT_KEYS; i++, key++) {
+            tree.insert(key, key);
+        }
+        tree.commit();
+    }
+}
+
+/* the follower's tree holds the keys of a whole number of commits */
+static void check_commit_prefix(Tree& tree)
+{
+    int expected = 0;
+    for (auto&& p : tree) {
+        ASSERT_EQ(p.first, expected);
+        expected++;
+    }
+    EXPECT_EQ(expected % COMMIT_KEYS, 0);
+    EXPECT_EQ(tree.size(), expected);
+}
+
+TEST(ReplicationTest, CopyRacingWithWritersIsConsistentOnlyAfterCatchUp)
+{
+    BTreeOptions options;
+    options.shadow_paging = true;
+    HeapPageCache leader_cache(fresh_file("repl_leader.heap"), true);
+    ReplicationOptions repl_options;
+    repl_options.copy_batch_pages = 1;
+    ReplicationSource source(&leader_cache, repl_options);
+    Tree leader(&source, options);
+
+    int key = 0;
+    write_commits(leader, key, 200);
+
+    int fds[2];
+    ASSERT_EQ(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    source.add_follower(fds[0]);
+
+    /* the copy has started once its first page arrives. it stalls while
+     * nobody reads the socket, so the commits below happen during the copy
+     * and end up in many batches after it */
+    struct pollfd pfd = {fds[1], POLLIN, 0};
+    ASSERT_EQ(::poll(&pfd, 1, 10000), 1);
+    write_commits(leader, key, 200);
+    /* the copy ends after these commits, they must all be applied before the
+     * follower is consistent */
+    uint64_t catch_up_seq = source.get_seq();
+
+    HeapPageCache follower_cache(fresh_file("repl_follower.heap"), true);
+    ReplicationSink sink(&follower_cache, fds[1]);
+    std::unique_ptr<Tree> follower;
+    BTreeOptions reader_options;
+    reader_options.read_only = true;
+
+    while (sink.get_position().seq < source.get_seq()) {
+        ASSERT_GT(sink.apply_available(), 0);
+        if (!sink.is_consistent()) continue;
+        ASSERT_GE(sink.get_position().seq, catch_up_seq);
+
+        if (!follower) {
+            follower = std::make_unique<Tree>(&follower_cache, reader_options);
+        } else {
+            follower->refresh();
+        }
+        check_commit_prefix(*follower);
+    }
+
+    ASSERT_TRUE(sink.is_consistent());
+    ASSERT_TRUE(follower);
+    EXPECT_EQ(follower->size(), leader.size());
+}
+
+TEST(ReplicationTest, DisconnectedFollowersAreReleased)
+{
+    HeapPageCache leader_cache(fresh_file("repl_reconnect.heap"), true);
+    ReplicationSource source(&leader_cache);
+    Tree leader(&source);
+    leader.insert(0, 0);
+    leader.commit();
+
+    /* each follower disconnects before its full copy is sent */
+    std::vector<int> sent_fds;
+    for (int i = 0; i < 4; i++) {
+        int fds[2];
+        ASSERT_EQ(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+        ::close(fds[1]);
+        source.add_follower(fds[0]);
+        sent_fds.push_back(fds[0]);
+    }
+
+    for (int i = 0; i < 1000 && source.get_num_followers() > 0; i++) {
+        ::usleep(10000);
+    }
+    EXPECT_EQ(source.get_num_followers(), 0);
+    for (int fd : sent_fds) {
+        EXPECT_EQ(::fcntl(fd, F_GETFD), -1);
+    }
+}
@@ -0,0 +1,209 @@
+#include "../include/bptree/heap_page_cache.h"
+#include "../include/bptree/tree.h"
+#include "test_util.h"
+
+#include <gtest/gtest.h>
+
+#include <fstream>
+
+using namespace bptree;
+
+static const int NUM_KEYS = 20000;
+
+TEST(ShadowPagingTest, ReopensAtLastCommit)
+{
+    BTreeOptions options;
+    options.shadow_paging = true;
+    std::string path = fresh_file("shadow_reopen.heap");
+
+    {
+        HeapPageCache page_cache(path, true);
+        BTree<8, int, int> tree(&page_cache, options);
+        for (int i = 0; i < 1000; i++) {
+            tree.insert(i, i);
+        }
+        tree.commit();
+        for (int i = 1000; i < 2000; i++) {
+            tree.insert(i, i);
+        }
+        tree.erase(10);
+        /* like a crash: the changes since the commit are dropped, even
+         * though their pages may have been written */
+        page_cache.flush_all_pages();
+        tree.close(true);
+    }
+
+    HeapPageCache page_cache(path, false);
+    BTree<8, int, int> tree(&page_cache, options);
+    EXPECT_TRUE(tree.is_shadow_paging());
+    EXPECT_EQ(tree.size(), 1000);
+    std::vector<int> values;
+    tree.get_value(10, values);
+    EXPECT_EQ(values, std::vector<int>{10});
+    tree.get_value(1500, values);
+    EXPECT_TRUE(values.empty());
+
+    int expected = 0;
+    for (auto&& p : tree) {
+        EXPECT_EQ(p.first, expected++);
+    }
+    EXPECT_EQ(expected, 1000);
+}
+
+TEST(ShadowPagingTest, PersistsFreePagesBeyondMetaPageInPlace)
+{
+    std::string path = fresh_file("free_list.heap");
+
+    {
+        HeapPageCache page_cache(path, true);
+        BTree<8, int, int> tree(&page_cache);
+        for (int i = 0; i < NUM_KEYS; i++) {
+            tree.insert(i, i);
+        }
+        tree.erase_range(0, NUM_KEYS);
+        /* the reclaimer recycles the pages before close() returns */
+        tree.close();
+    }
+
+    off_t before = file_size(path);
+    {
+        HeapPageCache page_cache(path, false);
+        BTree<8, int, int> tree(&page_cache);
+        for (int i = 0; i < NUM_KEYS; i++) {
+            tree.insert(i, i);
+        }
+        EXPECT_EQ(tree.size(), NUM_KEYS);
+    }
+
+    /* the tree needs thousands of pages, far more than a meta page lists */
+    EXPECT_GT(before, 2000 * 4096);
+    EXPECT_LE(file_size(path), before + before / 20);
+}
+
+TEST(ShadowPagingTest, PersistsFreePagesBeyondMetaPage)
+{
+    BTreeOptions options;
+    options.shadow_paging = true;
+    std::string path = fresh_file("free_list_shadow.heap");
+
+    {
+        HeapPageCache page_cache(path, true);
+        BTree<8, int, int> tree(&page_cache, options);
+        for (int i = 0; i < NUM_KEYS; i++) {
+            tree.insert(i, i);
+        }
+        tree.commit();
+        for (int i = 0; i < NUM_KEYS; i += 2) {
+            tree.erase(i);
+        }
+        /* the pages of the first commit are released by the final commit
+         * of the destructor */
+    }
+
+    off_t before = file_size(path);
+    {
+        HeapPageCache page_cache(path, false);
+        BTree<8, int, int> tree(&page_cache, options);
+        for (int i = 1; i < NUM_KEYS; i += 2) {
+            tree.erase(i);
+        }
+    }
+
+    /* the tree needs thousands of pages, far more than a meta page lists */
+    EXPECT_GT(before, 2000 * 4096);
+    EXPECT_LE(file_size(path), before + before / 20);
+
+    HeapPageCache page_cache(path, false);
+    BTree<8, int, int> tree(&page_cache, options);
+    EXPECT_EQ(tree.size(), 0);
+}
+
+TEST(ShadowPagingTest, InPlaceMetadataKeepsUsedPagesOffFreeList)
+{
+    std::string path = fresh_file("free_list_counts.heap");
+    std::string image = fresh_file("free_list_counts.image");
+
+    {
+        HeapPageCache page_cache(path, true);
+        BTree<8, int, int> tree(&page_cache);
+        for (int i = 0; i < NUM_KEYS; i++) {
+            tree.insert(i, i);
+        }
+        tree.erase_range(0, NUM_KEYS);
+        tree.close();
+    }
+
+    {
+        /* single inserts rewrite only the counts of the record, those that
+         * take pages from the free list rewrite all of it */
+        HeapPageCache page_cache(path, false);
+        BTree<8, int, int> tree(&page_cache);
+        for (int i = 0; i < NUM_KEYS / 2; i++) {
+            tree.insert(i, i);
+        }
+
+        /* like a crash: the heap file as it is before close() */
+        page_cache.flush_all_pages();
+        std::ifstream in(path, std::ios::binary);
+        std::ofstream out(image, std::ios::binary);
+        out << in.rdbuf();
+    }
+
+    HeapPageCache page_cache(image, false);
+    BTree<8, int, int> tree(&page_cache);
+    EXPECT_EQ(tree.size(), NUM_KEYS / 2);
+    /* pages taken from the free list must not be handed out again */
+    for (int i = NUM_KEYS / 2; i < NUM_KEYS; i++) {
+        tree.insert(i, i);
+    }
+
+    int expected = 0;
+    for (auto&& p : tree) {
+        ASSERT_EQ(p.first, expected);
+        ASSERT_EQ(p.second, expected);
+        expected++;
+    }
+    EXPECT_EQ(expected, NUM_KEYS);
+}
+
+TEST(ShadowPagingTest, MetaSlotsAreNotPinned)
+{
+    BTreeOptions options;
+    options.shadow_paging = true;
+    /* two frames: the meta slots must not keep any of them */
+    HeapPageCache page_cache(fresh_file("shadow_pins.heap"), true, 2);
+    BTree<8, int, int> tree(&page_cache, options);
+    for (int i = 0; i < 100; i++) {
+        tree.insert(i, i);
+    }
+    tree.commit();
+    EXPECT_EQ(tree.size(), 100);
+}
+
+TEST(ShadowPagingTest, FastCloseDiscardsUncommittedPages)
+{
+    BTreeOptions options;
+    options.shadow_paging = true;
+    std::string path = fresh_file("shadow_fast_close.heap");
+
+    {
+        HeapPageCache page_cache(path, true);
+        page_cache.set_write_back(true);
+        BTree<8, int, int> tree(&page_cache, options);
+        std::vector<std::pair<int, int>> pairs;
+        for (int i = 0; i < NUM_KEYS; i++) {
+            pairs.emplace_back(i, i);
+        }
+        tree.bulk_load(pairs.begin(), pairs.end());
+        EXPECT_GT(page_cache.get_num_dirty(), 0);
+
+        /* the bulk load was never committed */
+        tree.close(true);
+        EXPECT_EQ(page_cache.close(true).pages_written, 0);
+    }
+
+    HeapPageCache page_cache(path, false);
+    BTree<8, int, int> tree(&page_cache, options);
+    EXPECT_EQ(tree.size(), 0);
+    EXPECT_EQ(tree.begin(), tree.end());
+}
@@ -0,0 +1,272 @@
+#include "../include/bptree/heap_page_cache.h"
+#include "../include/bptree/shm_page_cache.h"
+#include "../include/bptree/tree.h"
+#include "test_util.h"
+
+#include <gtest/gtest.h>
+
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace bptree;
+
+using Tree = BTree<8, int, int>;
+
+static const char* SEGMENT = "/bptree_shm_test";
+
+static BTreeOptions reader_options()
+{
+    BTreeOptions options;
+    options.read_only = true;
+    return options;
+}
+
+TEST(ShmPageCacheTest, ReaderSeesCommitsAfterRefresh)
+{
+    auto path = fresh_file("shm_refresh.heap");
+    BTreeOptions options;
+    options.shadow_paging = true;
+    /* keeps the pages of the reader's snapshot through the next commit */
+    options.free_page_delay = 2;
+    ShmPageCache writer_cache(SEGMENT, path, true, 64);
+    Tree writer(&writer_cache, options);
+    for (int i = 0; i < 1000; i++) {
+        writer.insert(i, i);
+    }
+    writer.commit();
+
+    ShmPageCache reader_cache(SEGMENT, path, OpenMode::READ_ONLY);
+    EXPECT_FALSE(reader_cache.is_writer());
+    EXPECT_EQ(reader_cache.get_num_frames(), 64);
+    Tree reader(&reader_cache, reader_options());
+    EXPECT_EQ(reader.size(), 1000);
+
+    std::vector<int> values;
+    reader.get_value(500, values);
+    EXPECT_EQ(values, std::vector<int>{500});
+
+    for (int i = 1000; i < 2000; i++) {
+        writer.insert(i, i);
+    }
+    writer.commit();
+
+    /* the reader stays on its snapshot until it refreshes */
+    reader.get_value(1500, values);
+    EXPECT_TRUE(values.empty());
+    EXPECT_TRUE(reader.validate_snapshot());
+
+    reader.refresh();
+    EXPECT_EQ(reader.size(), 2000);
+    int expected = 0;
+    for (auto&& p : reader) {
+        ASSERT_EQ(p.first, expected);
+        expected++;
+    }
+    EXPECT_EQ(expected, 2000);
+
+    reader.close();
+    reader_cache.close();
+    writer.close();
+    writer_cache.close();
+    ShmPageCache::remove(SEGMENT);
+}
+
+TEST(ShmPageCacheTest, TreeOutgrowsThePoolAndOutlivesTheSegment)
+{
+    const int num_keys = 5000;
+    auto path = fresh_file("shm_persist.heap");
+    BTreeOptions options;
+    options.shadow_paging = true;
+    {
+        ShmPageCache page_cache(SEGMENT, path, true, 32);
+        Tree tree(&page_cache, options);
+        for (int i = 0; i < num_keys; i++) {
+            tree.insert(i, i);
+        }
+        tree.commit();
+        EXPECT_LE(page_cache.size(), 32);
+        EXPECT_GT(page_cache.get_num_pages(), 32);
+        tree.close();
+    }
+    ShmPageCache::remove(SEGMENT);
+
+    /* the heap file holds the tree, with or without a segment */
+    {
+        HeapPageCache page_cache(path, false);
+        Tree tree(&page_cache, options);
+        EXPECT_EQ(tree.size(), num_keys);
+    }
+
+    ShmPageCache writer_cache(SEGMENT, path, OpenMode::READ_WRITE, 32);
+    Tree writer(&writer_cache, options);
+    EXPECT_EQ(writer.size(), num_keys);
+
+    ShmPageCache reader_cache(SEGMENT, path, OpenMode::READ_ONLY);
+    Tree reader(&reader_cache, reader_options());
+    int expected = 0;
+    for (auto&& p : reader) {
+        ASSERT_EQ(p.first, expected);
+        ASSERT_EQ(p.second, expected);
+        expected++;
+    }
+    EXPECT_EQ(expected, num_keys);
+
+    reader.close();
+    reader_cache.close();
+    writer.close();
+    writer_cache.close();
+    ShmPageCache::remove(SEGMENT);
+}
+
+TEST(ShmPageCacheTest, ReadersPinFramesInPlace)
+{
+    auto path = fresh_file("shm_pin.heap");
+    ShmPageCache writer_cache(SEGMENT, path, true, 16);
+    boost::upgrade_lock<Page> lock;
+    auto* page = writer_cache.new_page(lock);
+    auto pid = page->get_id();
+    {
+        boost::upgrade_to_unique_lock<Page> ulock(lock);
+        page->get_buffer(ulock)[0] = 42;
+    }
+    writer_cache.unpin_page(page, true, lock);
+
+    ShmPageCache reader_cache(SEGMENT, path, OpenMode::READ_ONLY);
+    boost::upgrade_lock<Page> reader_lock;
+    auto* shared = reader_cache.fetch_page(pid, reader_lock);
+    ASSERT_NE(shared, nullptr);
+    const uint8_t* before = shared->get_buffer(reader_lock);
+    EXPECT_EQ(before[0], 42);
+
+    /* the writer publishes a new version into another frame, the pinned one
+     * does not change */
+    page = writer_cache.fetch_page(pid, lock);
+    {
+        boost::upgrade_to_unique_lock<Page> ulock(lock);
+        page->get_buffer(ulock)[0] = 43;
+    }
+    writer_cache.unpin_page(page, true, lock);
+    EXPECT_EQ(before[0], 42);
+    reader_cache.unpin_page(shared, false, reader_lock);
+
+    shared = reader_cache.fetch_page(pid, reader_lock);
+    EXPECT_EQ(shared->get_buffer(reader_lock)[0], 43);
+    reader_cache.unpin_page(shared, false, reader_lock);
+
+    reader_cache.close();
+    writer_cache.close();
+    ShmPageCache::remove(SEGMENT);
+}
+
+TEST(ShmPageCacheTest, PinsOfADeadReaderAreReleased)
+{
+    const int num_keys = 2000;
+    const size_t num_frames = 16;
+    auto path = fresh_file("shm_dead.heap");
+    BTreeOptions options;
+    options.shadow_paging = true;
+    ShmPageCache writer_cache(SEGMENT, path, true, num_frames);
+    Tree writer(&writer_cache, options);
+    for (int i = 0; i < num_keys; i++) {
+        writer.insert(i, i);
+    }
+    writer.commit();
+
+    /* a reader that pins every frame and dies without unpinning */
+    pid_t child = ::fork();
+    if (child == 0) {
+        try {
+            ShmPageCache cache(SEGMENT, path, OpenMode::READ_ONLY);
+            size_t pinned = 0;
+            for (PageID pid = 1; pinned < num_frames; pid++) {
+                boost::upgrade_lock<Page> lock;
+                if (cache.fetch_page(pid, lock)) pinned++;
+                lock.release();
+            }
+            /* without closing the cache */
+            ::_exit(0);
+        } catch (...) {
+            ::_exit(1);
+        }
+    }
+    int status;
+    ASSERT_EQ(::waitpid(child, &status, 0), child);
+    ASSERT_TRUE(WIFEXITED(status));
+    ASSERT_EQ(WEXITSTATUS(status), 0);
+
+    ShmPageCache reader_cache(SEGMENT, path, OpenMode::READ_ONLY);
+    Tree reader(&reader_cache, reader_options());
+    int expected = 0;
+    for (auto&& p : reader) {
+        ASSERT_EQ(p.first, expected);
+        expected++;
+    }
+    EXPECT_EQ(expected, num_keys);
+
+    reader.close();
+    reader_cache.close();
+    writer.close();
+    writer_cache.close();
+    ShmPageCache::remove(SEGMENT);
+}
+
+TEST(ShmPageCacheTest, ReaderThrowsOnceTheWriterIsGone)
+{
+    auto path = fresh_file("shm_gone.heap");
+    BTreeOptions options;
+    options.shadow_paging = true;
+    ShmPageCache writer_cache(SEGMENT, path, true, 64);
+    Tree writer(&writer_cache, options);
+    writer.insert(1, 1);
+    writer.commit();
+
+    ShmPageCache reader_cache(SEGMENT, path, OpenMode::READ_ONLY);
+    Tree reader(&reader_cache, reader_options());
+    EXPECT_EQ(reader.size(), 1);
+
+    writer.close();
+    writer_cache.close();
+    EXPECT_THROW(reader.refresh(), IOException);
+    EXPECT_THROW(ShmPageCache(SEGMENT, path, OpenMode::READ_ONLY),
+                 IOException);
+
+    reader_cache.close();
+    ShmPageCache::remove(SEGMENT);
+}
+
+TEST(ShmPageCacheTest, ReaderBoundsItsLoadedNodes)
+{
+    const int num_keys = 5000;
+    auto path = fresh_file("shm_trim.heap");
+    BTreeOptions options;
+    options.shadow_paging = true;
+    ShmPageCache writer_cache(SEGMENT, path, true, 64);
+    Tree writer(&writer_cache, options);
+    for (int i = 0; i < num_keys; i++) {
+        writer.insert(i, i);
+    }
+    writer.commit();
+
+    ShmPageCache reader_cache(SEGMENT, path, OpenMode::READ_ONLY);
+    auto bounded = reader_options();
+    bounded.max_cached_nodes = 8;
+    Tree reader(&reader_cache, bounded);
+    std::vector<int> values;
+    for (int i = 0; i < num_keys; i += 7) {
+        reader.get_value(i, values);
+        ASSERT_EQ(values, std::vector<int>{i});
+    }
+    int expected = 0;
+    for (auto&& p : reader) {
+        ASSERT_EQ(p.first, expected);
+        expected++;
+    }
+    EXPECT_EQ(expected, num_keys);
+
+    reader.close();
+    reader_cache.close();
+    writer.close();
+    writer_cache.close();
+    ShmPageCache::remove(SEGMENT);
+}
@@ -0,0 +1,63 @@
+#include "../include/bptree/heap_page_cache.h"
+#include "../include/bptree/tree.h"
+#include "test_util.h"
+
+#include <gtest/gtest.h>
+
+#include <stdexcept>
+#include <vector>
+
+using namespace bptree;
+
+using Tree = BTree<8, int, int>;
+
+static const int NUM_KEYS = 5000;
+
+TEST(SnapshotTest, KeepsCommitWhileTreeChanges)
+{
+    BTreeOptions options;
+    options.shadow_paging = true;
+    HeapPageCache page_cache(fresh_file("snapshot.heap"), true);
+    Tree tree(&page_cache, options);
+    for (int i = 0; i < NUM_KEYS; i++) {
+        tree.insert(i, i);
+    }
+    tree.commit();
+
+    auto snap = tree.snapshot();
+    EXPECT_EQ(snap.get_epoch(), tree.get_epoch());
+
+    /* later commits free the pages of the snapshot's tree, which must not be
+     * reused while it is alive */
+    for (int round = 1; round <= 3; round++) {
+        for (int i = 0; i < NUM_KEYS; i += 2) {
+            tree.erase(i);
+            tree.insert(i, -round);
+        }
+        tree.insert(NUM_KEYS + round, 0);
+        tree.commit();
+    }
+
+    EXPECT_EQ(snap.size(), NUM_KEYS);
+    int expected = 0;
+    for (auto it = snap.begin(); it != snap.end(); ++it) {
+        ASSERT_EQ(it->first, expected);
+        ASSERT_EQ(it->second, expected);
+        expected++;
+    }
+    EXPECT_EQ(expected, NUM_KEYS);
+
+    std::vector<int> values;
+    snap.get_value(10, values);
+    EXPECT_EQ(values, std::vector<int>{10});
+    tree.get_value(10, values);
+    EXPECT_EQ(values, std::vector<int>{-3});
+    EXPECT_EQ(tree.size(), NUM_KEYS + 3);
+}
+
+TEST(SnapshotTest, NeedsShadowPaging)
+{
+    HeapPageCache page_cache(fresh_file("snapshot_plain.heap"), true);
+    Tree tree(&page_cache);
+    EXPECT_THROW(tree.snapshot(), std::runtime_error);
+}
@@ -0,0 +1,59 @@
+#include "../include/bptree/heap_page_cache.h"
+#include "../include/bptree/tree.h"
+#include "test_util.h"
+
+#include <gtest/gtest.h>
+
+#include <sys/stat.h>
+
+using namespace bptree;
+
+static void check_striped_tree(const std::string& name, StripeLayout layout)
+{
+    std::vector<std::string> files;
+    for (int i = 0; i < 3; i++) {
+        files.push_back(fresh_file(name + "." + std::to_string(i)));
+    }
+
+    StripeOptions stripe_options;
+    stripe_options.layout = layout;
+    stripe_options.extent_pages = 16;
+
+    {
+        HeapPageCache page_cache(files, true, 256, 4096,
+                                 ChecksumMode::EAGER, stripe_options);
+        BTree<8, int, int> tree(&page_cache);
+        for (int i = 0; i < 20000; i++) {
+            tree.insert(i, i);
+        }
+    }
+
+    /* every file got a share of the pages */
+    for (auto&& file : files) {
+        struct stat st;
+        ASSERT_EQ(::stat(file.c_str(), &st), 0);
+        EXPECT_GT(st.st_size, 16 * 4096);
+    }
+
+    /* the layout is taken from the header */
+    HeapPageCache page_cache(files, false, 256, 4096, ChecksumMode::EAGER);
+    BTree<8, int, int> tree(&page_cache);
+    EXPECT_EQ(tree.size(), 20000);
+    int expected = 0;
+    for (auto&& [key, value] : tree) {
+        ASSERT_EQ(key, expected);
+        ASSERT_EQ(value, expected);
+        expected++;
+    }
+    EXPECT_EQ(expected, 20000);
+}
+
+TEST(StripingTest, ModuloLayout)
+{
+    check_striped_tree("striping_modulo.heap", StripeLayout::MODULO);
+}
+
+TEST(StripingTest, ExtentLayout)
+{
+    check_striped_tree("striping_extent.heap", StripeLayout::EXTENT);
+}
@@ -0,0 +1,26 @@
+#ifndef _BPTREE_TEST_UTIL_H_
+#define _BPTREE_TEST_UTIL_H_
+
+#include <string>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* path of a heap file under ./tmp that does not exist yet */
+inline std::string fresh_file(const std::string& name)
+{
+    ::mkdir("./tmp", 0755);
+    std::string path = "./tmp/" + name;
+    ::unlink(path.c_str());
+    return path;
+}
+
+/* size of a file in bytes, 0 if it does not exist */
+inline off_t file_size(const std::string& path)
+{
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0) return 0;
+    return st.st_size;
+}
+
+#endif
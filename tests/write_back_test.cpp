@@ -0,0 +1,130 @@
+#include "../include/bptree/heap_page_cache.h"
+#include "test_util.h"
+
+#include <gtest/gtest.h>
+
+#include <cstring>
+
+using namespace bptree;
+
+namespace {
+
+const size_t NUM_PAGES = 100;
+
+/* dirty num_pages new pages, page i filled with byte i */
+std::vector<PageID> fill_pages(HeapPageCache& page_cache,
+                               size_t num_pages = NUM_PAGES)
+{
+    std::vector<PageID> pids;
+    for (size_t i = 0; i < num_pages; i++) {
+        boost::upgrade_lock<Page> lock;
+        auto* page = page_cache.new_page(lock);
+        {
+            boost::upgrade_to_unique_lock<Page> ulock(lock);
+            ::memset(page->get_buffer(ulock), (int)i, page->get_size());
+        }
+        pids.push_back(page->get_id());
+        page_cache.unpin_page(page, true, lock);
+    }
+    return pids;
+}
+
+void check_pages(const std::string& path, const std::vector<PageID>& pids)
+{
+    HeapPageCache page_cache(path, false);
+    for (size_t i = 0; i < pids.size(); i++) {
+        boost::upgrade_lock<Page> lock;
+        auto* page = page_cache.fetch_page(pids[i], lock);
+        ASSERT_NE(page, nullptr);
+        const auto* buf = page->get_buffer(lock);
+        EXPECT_EQ(buf[0], (uint8_t)i);
+        EXPECT_EQ(buf[page->get_size() - 1], (uint8_t)i);
+        page_cache.unpin_page(page, false, lock);
+    }
+}
+
+} // namespace
+
+TEST(WriteBackTest, ContiguousPagesAreCoalesced)
+{
+    std::string path = fresh_file("write_back.heap");
+    std::vector<PageID> pids;
+
+    {
+        HeapPageCache page_cache(path, true);
+        page_cache.set_write_back(true);
+        page_cache.set_flush_threads(1);
+        page_cache.set_max_write_bytes(16 * 4096);
+
+        pids = fill_pages(page_cache);
+        EXPECT_EQ(page_cache.get_num_dirty(), NUM_PAGES);
+
+        uint64_t calls = page_cache.get_num_write_calls();
+        page_cache.flush_all_pages();
+        EXPECT_EQ(page_cache.get_num_dirty(), 0);
+        /* 16 pages per write */
+        EXPECT_LE(page_cache.get_num_write_calls() - calls,
+                  (NUM_PAGES + 15) / 16 + 1);
+    }
+
+    check_pages(path, pids);
+}
+
+TEST(WriteBackTest, WriteThroughWritesEachPage)
+{
+    std::string path = fresh_file("write_through.heap");
+    std::vector<PageID> pids;
+
+    {
+        HeapPageCache page_cache(path, true);
+        uint64_t calls = page_cache.get_num_write_calls();
+        pids = fill_pages(page_cache);
+        EXPECT_EQ(page_cache.get_num_dirty(), 0);
+        EXPECT_GE(page_cache.get_num_write_calls() - calls, NUM_PAGES);
+    }
+
+    check_pages(path, pids);
+}
+
+TEST(WriteBackTest, ParallelFlushKeepsRunsIntact)
+{
+    std::string path = fresh_file("write_back_parallel.heap");
+    std::vector<PageID> pids;
+    const size_t num_pages = 1000;
+
+    {
+        HeapPageCache page_cache(path, true, 2 * num_pages);
+        page_cache.set_write_back(true);
+        page_cache.set_flush_threads(4);
+        page_cache.set_max_write_bytes(16 * 4096);
+
+        /* a single contiguous stretch of dirty pages */
+        pids = fill_pages(page_cache, num_pages);
+        uint64_t calls = page_cache.get_num_write_calls();
+        page_cache.flush_all_pages();
+        EXPECT_EQ(page_cache.get_num_dirty(), 0);
+        /* the writers split the pages between runs, never inside one */
+        EXPECT_EQ(page_cache.get_num_write_calls() - calls,
+                  (num_pages + 15) / 16);
+    }
+
+    check_pages(path, pids);
+}
+
+TEST(WriteBackTest, FastCloseWritesWithoutSync)
+{
+    std::string path = fresh_file("write_back_close.heap");
+    std::vector<PageID> pids;
+
+    {
+        HeapPageCache page_cache(path, true);
+        page_cache.set_write_back(true);
+        pids = fill_pages(page_cache);
+
+        const auto& stats = page_cache.close(true);
+        EXPECT_EQ(stats.pages_written, NUM_PAGES);
+        EXPECT_FALSE(stats.synced);
+    }
+
+    check_pages(path, pids);
+}
@@ -0,0 +1,137 @@
+#include "../include/bptree/heap_page_cache.h"
+#include "../include/bptree/tree.h"
+#include "test_util.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <thread>
+
+using namespace bptree;
+
+TEST(WriteBatchTest, AppliesOperationsInOrder)
+{
+    HeapPageCache page_cache(fresh_file("write_batch.heap"), true);
+    BTree<8, int, int> tree(&page_cache);
+
+    WriteBatch<int, int> batch;
+    for (int i = 0; i < 100; i++) {
+        batch.put(i, i * 10);
+    }
+    batch.erase(5);
+    batch.put(5, 55);
+    batch.erase(7);
+    tree.write(batch);
+
+    EXPECT_EQ(tree.size(), 99);
+    std::vector<int> values;
+    tree.get_value(5, values);
+    EXPECT_EQ(values, std::vector<int>{55});
+    tree.get_value(7, values);
+    EXPECT_TRUE(values.empty());
+    tree.get_value(42, values);
+    EXPECT_EQ(values, std::vector<int>{420});
+}
+
+TEST(WriteBatchTest, EraseRemovesDuplicatesAcrossLeaves)
+{
+    HeapPageCache page_cache(fresh_file("write_batch_dup.heap"), true);
+    BTree<8, int, int> tree(&page_cache);
+
+    /* enough copies of one key to fill several leaves */
+    for (int i = 0; i < 40; i++) {
+        tree.insert(i, i);
+    }
+    for (int i = 0; i < 50; i++) {
+        tree.insert(20, 1000 + i);
+    }
+
+    WriteBatch<int, int> batch;
+    batch.erase(20);
+    tree.write(batch);
+
+    EXPECT_EQ(tree.size(), 39);
+    size_t count = 0;
+    for (auto it = tree.begin(0); it != tree.end(); it++) {
+        EXPECT_NE(it->first, 20);
+        count++;
+    }
+    EXPECT_EQ(count, 39);
+
+    for (int i = 0; i < 30; i++) {
+        tree.insert(10, i);
+    }
+    EXPECT_EQ(tree.erase(10), 31);
+    EXPECT_EQ(tree.size(), 38);
+}
+
+TEST(WriteBatchTest, LookupsSeeWholeBatches)
+{
+    HeapPageCache page_cache(fresh_file("write_batch_atomic.heap"), true);
+    BTree<8, int, int> tree(&page_cache);
+    for (int i = 0; i < 32; i++) {
+        tree.insert(i, 0);
+    }
+
+    std::atomic<bool> stop(false);
+    std::thread writer([&] {
+        for (int round = 1; round <= 200; round++) {
+            /* replace every pair, a lookup between the erase and the put of
+             * a key would find nothing */
+            WriteBatch<int, int> batch;
+            for (int i = 0; i < 32; i++) {
+                batch.erase(i);
+                batch.put(i, round);
+            }
+            tree.write(batch);
+        }
+        stop = true;
+    });
+
+    int last = 0;
+    while (!stop) {
+        std::vector<int> values;
+        tree.get_value(17, values);
+        EXPECT_EQ(values.size(), 1);
+        if (values.size() != 1) break;
+        EXPECT_GE(values[0], last);
+        last = values[0];
+    }
+    writer.join();
+
+    std::vector<int> values;
+    tree.get_value(31, values);
+    EXPECT_EQ(values, std::vector<int>{200});
+    EXPECT_EQ(tree.size(), 32);
+}
+
+TEST(WriteBatchTest, ShadowPagingBatchesSurviveCrash)
+{
+    std::string path = fresh_file("write_batch_crash.heap");
+    BTreeOptions options;
+    options.shadow_paging = true;
+
+    {
+        HeapPageCache page_cache(path, true);
+        BTree<8, int, int> tree(&page_cache, options);
+        WriteBatch<int, int> batch;
+        for (int i = 0; i < 100; i++) {
+            batch.put(i, i);
+        }
+        tree.write(batch);
+        tree.insert(1000, 0);
+
+        /* like a crash: the insert after the batch is never committed */
+        tree.close(true);
+    }
+
+    HeapPageCache page_cache(path, false);
+    BTree<8, int, int> tree(&page_cache, options);
+    EXPECT_EQ(tree.size(), 100);
+    int expected = 0;
+    for (auto&& p : tree) {
+        ASSERT_EQ(p.first, expected);
+        expected++;
+    }
+    EXPECT_EQ(expected, 100);
+}